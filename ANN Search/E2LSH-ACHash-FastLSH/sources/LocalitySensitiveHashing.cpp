@@ -34,10 +34,15 @@
 #include <algorithm>
 #include <ctime>
 #include <vector>
+#include "fwht.h"
 
-bool is_power_of_two(int n){
-    return (n > 0) && ((n & (n-1)) == 0);
-}
+// Number of points whose Hadamard transforms are computed together when
+// building the DS (ACHash).
+#define HADAMARD_BATCH 256
+
+// Scratch buffer for the zero padded Hadamard transform of a query.
+static double *queryHadamard = NULL;
+static IntT queryHadamardSize = 0;
 
 void printRNNParameters(FILE *output, RNNParametersT parameters){
   ASSERT(output != NULL);
@@ -359,8 +364,6 @@ PRNearNeighborStructT initLSH(RNNParametersT algParameters, Int32T nPointsEstima
 void preparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point);
 
 void preparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point, int subdim);
-void first_hadamard_transform(double* work, int N, double* output); 
-void second_hadamard_transform(double* work, int N, double* output); 
 void FpreparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, double* point, int subdim);
 
 
@@ -409,6 +412,7 @@ PRNearNeighborStructT initLSH_WithDataSet(RNNParametersT algParameters, Int32T n
       }
     }
   }
+
   end = clock();
   std::cout<<"time of computing hash value is "<<(double)(end-start) / CLOCKS_PER_SEC <<"(s)"<<std::endl;
   //DPRINTF("Allocated memory(modelHT and precomputedHashesOfULSHs just a.): %lld\n", totalAllocatedMemory);
@@ -495,26 +499,26 @@ PRNearNeighborStructT FinitLSH_WithDataSet(RNNParametersT algParameters, Int32T
   clock_t start, end;
   start = clock();
 
+  //*********************************
+  //  ACHash: the points are transformed HADAMARD_BATCH at a time, each
+  //  zero padded to a power of two.
+  //*********************************
+  IntT hadamardSize = fwht::paddedSize(nnStruct->dimension);
+  double *hadamardRows = NULL;
+  FAILIF(NULL == (hadamardRows = (double*)MALLOC(HADAMARD_BATCH * hadamardSize * sizeof(double))));
   
   for(IntT i = 0; i < nPoints; i++){
 
-    //*********************************
-    //  ACHash
-    //*********************************
-    if(is_power_of_two(nnStruct->dimension)){
-      double firstHT[nnStruct->dimension];
-      double *temp = dataSet[i]->coordinates;
-      first_hadamard_transform(temp, nnStruct->dimension, firstHT);
-      FpreparePointAdding(nnStruct, modelHT, firstHT, subdim);
-    }else{
-      int dimension = pow(2, ceil(log2(nnStruct->dimension)));
-      double firstHT[dimension];
-      double temp[dimension] = {0}; 
-      for (IntT d = 0; d < nnStruct->dimension; ++d){temp[d] = dataSet[i]->coordinates[d];}
-      first_hadamard_transform(temp, dimension, firstHT);
-      FpreparePointAdding(nnStruct, modelHT, firstHT, subdim);
+    double *firstHT = hadamardRows + (i % HADAMARD_BATCH) * hadamardSize;
+    if (i % HADAMARD_BATCH == 0) {
+      IntT nRows = MIN(HADAMARD_BATCH, nPoints - i);
+      for(IntT r = 0; r < nRows; r++){
+        fwht::pad(dataSet[i + r]->coordinates, nnStruct->dimension, hadamardRows + r * hadamardSize, hadamardSize);
+      }
+      fwht::transformRows(hadamardRows, nRows, hadamardSize, hadamardSize);
     }
-    
+    FpreparePointAdding(nnStruct, modelHT, firstHT, subdim);
+
 
     for(IntT l = 0; l < nnStruct->nHFTuples; l++){
       for(IntT h = 0; h < N_PRECOMPUTED_HASHES_NEEDED; h++){
@@ -522,6 +526,7 @@ PRNearNeighborStructT FinitLSH_WithDataSet(RNNParametersT algParameters, Int32T
       }
     }
   }
+  FREE(hadamardRows);
 
   end = clock();
   std::cout<<"time of computing hash value is "<<(double)(end-start) / CLOCKS_PER_SEC <<"(s)"<<std::endl;
@@ -840,75 +845,6 @@ inline void computeULSH(PRNearNeighborStructT nnStruct, IntT gNumber, RealT *poi
 
 
 
-void first_hadamard_transform(double* work, int N, double* output) 
-{
-	int i, j, k, stage, L, J, M;
-	double *tmp;
-	for (i = 0; i < N-1; i += 2)
-	{
-		work[i] = (work[i] + work[i+1]);
-		work[i+1] = (work[i] - 2*work[i+1]);
-	}
-	L = 1;
-	for (stage = 2; stage <= ceil(log2(N)); ++stage)
-	{
-		M = (int) pow((float)2, L);
-		J = 0;
-		k = 0;
-
-		while (k < N-1)
-		{
-			for (j = J; j < J+M-1; j = j+2)
-			{
-				output[k] = work[j] + work[j+M];
-				output[k+1] = work[j] - work[j+M];
-				output[k+2] = work[j+1] - work[j+M+1];
-				output[k+3] = work[j+1] + work[j+M+1];
-				k += 4;
-			}
-			J += 2*M;
-		}
-		tmp = work;
-		work = output;
-		output = tmp;
-		L += 1;
-	}
-}
-
-void second_hadamard_transform(double* work, int N, double* output) 
-{
-	int i, j, k, stage, L, J, M;
-	double *tmp;
-	for (i = 0; i < N-1; i += 2)
-	{
-		work[i] = (work[i] + work[i+1]);
-		work[i+1] = (work[i] - 2*work[i+1]);
-	}
-	L = 1;
-	for (stage = 2; stage <= ceil(log2(N)); ++stage)
-	{
-		M = (int) pow((float)2, L);
-		J = 0;
-		k = 0;
-
-		while (k < N-1)
-		{
-			for (j = J; j < J+M-1; j = j+2)
-			{
-				output[k] = work[j] + work[j+M];
-				output[k+1] = work[j] - work[j+M];
-				output[k+2] = work[j+1] - work[j+M+1];
-				output[k+3] = work[j+1] + work[j+M+1];
-				k += 4;
-			}
-			J += 2*M;
-		}
-		tmp = work;
-		work = output;
-		output = tmp;
-		L += 1;
-	}
-}
 
 inline void preparePointAdding(PRNearNeighborStructT nnStruct, PUHashStructureT uhash, PPointT point){
   ASSERT(nnStruct != NULL);
@@ -1136,19 +1072,15 @@ Int32T FgetNearNeighborsFromPRNearNeighborStruct(PRNearNeighborStructT nnStruct,
   //*******************
   // ACHash
   //*******************
-  if(is_power_of_two(nnStruct->dimension)){
-    double firHT[nnStruct->dimension];
-    double *tmp = query->coordinates; 
-    first_hadamard_transform(tmp, nnStruct->dimension, firHT);
-    FpreparePointAdding(nnStruct, nnStruct->hashedBuckets[0], firHT, subdim);
-  }else{
-    int dimension = pow(2, ceil(log2(nnStruct->dimension)));
-    double firHT[dimension];
-    double tmp[dimension] = {0}; 
-    for (IntT d = 0; d < nnStruct->dimension; ++d){tmp[d] = query->coordinates[d];}
-    first_hadamard_transform(tmp, dimension, firHT);
-    FpreparePointAdding(nnStruct, nnStruct->hashedBuckets[0], firHT, subdim);
-  }
+  IntT hadamardSize = fwht::paddedSize(nnStruct->dimension);
+  if (hadamardSize > queryHadamardSize) {
+    FREE(queryHadamard);
+    FAILIF(NULL == (queryHadamard = (double*)MALLOC(hadamardSize * sizeof(double))));
+    queryHadamardSize = hadamardSize;
+  }
+  fwht::pad(query->coordinates, nnStruct->dimension, queryHadamard, hadamardSize);
+  fwht::transform(queryHadamard, hadamardSize);
+  FpreparePointAdding(nnStruct, nnStruct->hashedBuckets[0], queryHadamard, subdim);
   Uns32T precomputedHashesOfULSHs[nnStruct->nHFTuples][N_PRECOMPUTED_HASHES_NEEDED];
   for(IntT i = 0; i < nnStruct->nHFTuples; i++){
     for(IntT j = 0; j < N_PRECOMPUTED_HASHES_NEEDED; j++){
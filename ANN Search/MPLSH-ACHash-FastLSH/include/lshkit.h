@@ -132,6 +132,9 @@
  *  - The file format used by the tool programs: matrix.h
  *  - (Semi-)Automatic parameter tuning for Multi-Probe LSH and run benchmarks: mplsh-tune.cpp
  *  - Building a Multi-Probe LSH index: mplsh.h
+ *  - Inserting into a Multi-Probe LSH index while it is queried: concurrent.h
+ *  - Splitting a Multi-Probe LSH index into shards, possibly served by other processes: sharded.h
+ *  - Serving a Multi-Probe LSH index over a Unix socket, with latency percentiles: mplsh-serve.cpp
  *  - Using LSH to construct sketches: sketch.h
  *  - Using LSH to construct random histograms to match sets of features: histogram.h
  *  - The supported LSH classes: lsh.h
@@ -142,6 +145,7 @@
  * - scan.cpp
  * - lsh-run.cpp
  * - mplsh-run.cpp
+ * - mplsh-serve.cpp
  * - fitdata.cpp
  * - mplsh-predict.cpp
  * - mplsh-tune.cpp
@@ -184,14 +188,21 @@
 #include <lshkit/lsh.h>
 #include <lshkit/lsh-index.h>
 #include <lshkit/sketch.h>
+#include <lshkit/sketch-filter.h>
 #include <lshkit/histogram.h>
 #include <lshkit/metric.h>
 #include <lshkit/kernel.h>
 #include <lshkit/mplsh.h>
+#include <lshkit/concurrent.h>
+#include <lshkit/remote.h>
+#include <lshkit/sharded.h>
+#include <lshkit/latency.h>
 #include <lshkit/apost.h>
 #include <lshkit/forest.h>
 #include <lshkit/topk.h>
 #include <lshkit/matrix.h>
+#include <lshkit/quantized.h>
+#include <lshkit/pq.h>
 #include <lshkit/eval.h>
 #include <lshkit/spectral-hash.h>
 
@@ -205,6 +205,27 @@ public:
     APostModel () {
     };
 
+    /// Scratch memory of genProbeSequence.
+    /**
+      * A scratch kept across the queries of a thread saves the allocations
+      * of the probe heap; it is used by one call at a time.
+      */
+    struct Scratch {
+        struct Component {
+            unsigned m;
+            const std::vector<PrH> *prh;
+        };
+        struct Entry {
+            float pr;
+            unsigned last;
+            std::size_t off;
+        };
+        std::vector<Component> components;
+        std::vector<unsigned> range;
+        std::vector<unsigned> pool;
+        std::vector<Entry> heap;
+    };
+
     template<class Archive>
     void serialize(Archive & ar, const unsigned int version)
     {
@@ -222,6 +243,10 @@ public:
 
     void genProbeSequence (const APostLsh &lsh, const float *query,
             float recall, unsigned T, std::vector<unsigned> *probe) const;
+
+    void genProbeSequence (const APostLsh &lsh, const float *query,
+            float recall, unsigned T, std::vector<unsigned> *probe,
+            Scratch *scratch) const;
 };
 
 
@@ -239,6 +264,20 @@ public:
     typedef typename Super::Domain Domain;
     typedef KEY Key;
 
+    /// Scratch memory of the queries.
+    /**
+      * Holds the probe sequence and the scratch of its generation, so that a
+      * thread passing the same context to its queries does not allocate.  A
+      * context is used by one query at a time; the queries given no context
+      * use one private to the calling thread.
+      */
+    class QueryContext
+    {
+        friend class APostLshIndex;
+        std::vector<unsigned> seq_;
+        APostModel::Scratch scratch_;
+    };
+
 private:
 
     std::vector<APostModel> model;
@@ -249,22 +288,32 @@ private:
       * @param scanner 
       */
     template <typename SCANNER>
-    void query_helper (Domain obj, float recall, unsigned T, SCANNER &scanner) const
+    void query_helper (Domain obj, float recall, unsigned T, SCANNER &scanner,
+            QueryContext &ctx) const
     {
-        std::vector<unsigned> seq;
+        std::vector<unsigned> &seq = ctx.seq_;
         BOOST_VERIFY(recall <= 1.0);
         recall = 1.0 - exp(1.0/Super::lshs_.size() * log(1.0 - recall));
         for (unsigned i = 0; i < Super::lshs_.size(); ++i) {
-            model[i].genProbeSequence(Super::lshs_[i], obj, recall, T, &seq);
+            model[i].genProbeSequence(Super::lshs_[i], obj, recall, T, &seq,
+                    &ctx.scratch_);
             BOOST_FOREACH(unsigned j, seq) {
-                typename Super::Bin const &bin = Super::tables_[i][j];
-                BOOST_FOREACH(Key key, bin) {
-                    scanner(key);
-                }
+                Super::visitBin(i, j, [this, &scanner](typename Super::BinRange keys) {
+                    BOOST_FOREACH(Key key, keys) {
+                        if (Super::removed(key)) continue;
+                        scanner(key);
+                    }
+                });
             }
         }
     }
 
+    static QueryContext &threadContext ()
+    {
+        static thread_local QueryContext ctx;
+        return ctx;
+    }
+
 public:
 
     /// Constructor.
@@ -309,6 +358,22 @@ public:
         BOOST_VERIFY(ar);
     }
 
+    /// Save the index as an image, which can be mapped by map().
+    void saveImage (std::ostream &os)
+    {
+        Super::writeImage(os, [this](std::ostream &ms) {
+            ms & model;
+        });
+    }
+
+    /// Map an index image saved by saveImage, see LshIndex::map.
+    void map (const std::string &path, bool verify = false)
+    {
+        Super::mapImage(path, [this](std::istream &ms) {
+            ms & model;
+        }, verify);
+    }
+
     /// Query for K-NNs.
     /**
       * @param obj the query object.
@@ -317,7 +382,14 @@ public:
     template <typename SCANNER>
     void query (Domain obj, unsigned T, SCANNER &scanner) const
     {
-        query_helper(obj, 1.0, T, scanner);
+        query_helper(obj, 1.0, T, scanner, threadContext());
+    }
+
+    /// Query for K-NNs with the given context.
+    template <typename SCANNER>
+    void query (Domain obj, unsigned T, SCANNER &scanner, QueryContext &ctx) const
+    {
+        query_helper(obj, 1.0, T, scanner, ctx);
     }
 
     /// Query for K-NNs, try to achieve the given recall by adaptive probing.
@@ -330,7 +402,17 @@ public:
     template <typename SCANNER>
     void query_recall (Domain obj, float recall, SCANNER &scanner) const
     {
-        query_helper(obj, recall, std::numeric_limits<unsigned>::max(), scanner);
+        query_helper(obj, recall, std::numeric_limits<unsigned>::max(), scanner,
+                threadContext());
+    }
+
+    /// Adaptive query with the given context.
+    template <typename SCANNER>
+    void query_recall (Domain obj, float recall, SCANNER &scanner,
+            QueryContext &ctx) const
+    {
+        query_helper(obj, recall, std::numeric_limits<unsigned>::max(), scanner,
+                ctx);
     }
 };
 
@@ -33,6 +33,7 @@
 #include <boost/assert.hpp>
 #include <boost/foreach.hpp>
 #include <boost/random.hpp>
+#include <lshkit/archive.h>
 
 /// Enable concept checking.
 /** Concept checking requires boost > 1.35.
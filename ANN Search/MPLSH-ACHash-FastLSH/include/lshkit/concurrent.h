@@ -0,0 +1,322 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_CONCURRENT__
+#define __LSHKIT_CONCURRENT__
+
+/**
+ * \file concurrent.h
+ * \brief Inserting into a MultiProbeLshIndex while it is queried.
+ *
+ * The queries of a MultiProbeLshIndex are const and can run in parallel,
+ * but insert, update and remove modify the bins being scanned.
+ * ConcurrentIndex keeps the index as read-copy-update snapshots instead:
+ *
+ * - the published snapshot is a frozen index which is never modified, so
+ *   any number of threads query it without locks;
+ * - the writers hash their points and queue them, which only holds a
+ *   mutex of the writers for the time of a copy;
+ * - publish() copies the snapshot, adds the queued keys with
+ *   LshIndex::append and swaps the new snapshot in atomically.  The
+ *   queries running on the old snapshot finish on it, and it is released
+ *   with its last query.
+ *
+ * The copy shares the frozen tables and the chunks of the overflow (see
+ * LshIndex::frozen) with the snapshot, and only copies the bitmaps of the
+ * removed and updated keys.  The queued keys go to the overflow as a new
+ * chunk, so a publish takes time in the number of changes, not in the
+ * size of the index.  Once in a while the overflow is full and the
+ * publish flushes it into new tables, which takes time linear in the
+ * size of the index and twice its memory for that time.  The changes are
+ * published in batches: explicitly, or every interval by a background
+ * thread started with start().  The queued changes are invisible to the
+ * queries until then.
+ *
+ * \code
+ * ConcurrentIndex<MultiProbeLshIndex<unsigned> > live;
+ * live.reset(index);                  // a built std::shared_ptr<Index>
+ * live.start(1000);                   // publish every second
+ *
+ * // any thread
+ * live.insert(key, value);            // accessor(key) must return value
+ * live.remove(other);
+ *
+ * // any other thread
+ * live.query(query, T, scanner);
+ * \endcode
+ *
+ * The accessor of the scanners has to cover the inserted keys; a
+ * Matrix<>::Accessor has to be made on a matrix with room for them.  A
+ * sketch filter cannot be used with new keys, as it only covers the keys
+ * it was reset with.
+ */
+
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+#include <lshkit/mplsh.h>
+
+namespace lshkit {
+
+/// A MultiProbeLshIndex which can be modified while it is queried.
+/**
+  * @param INDEX MultiProbeLshIndex<KEY>.
+  */
+template <typename INDEX>
+class ConcurrentIndex
+{
+public:
+    typedef INDEX Index;
+    typedef typename INDEX::Key Key;
+    /// A published index, which is never modified.
+    typedef std::shared_ptr<const INDEX> Snapshot;
+
+private:
+    Snapshot current_;                  // accessed with std::atomic_load/store
+
+    // The queued changes.  A queued key removed before it is published
+    // stays queued, and is removed after it is added.
+    std::mutex queueMutex_;
+    std::vector<Key> keys_;
+    std::vector<unsigned> bins_;        // L per key
+    std::vector<uint8_t> updates_;
+    std::unordered_set<Key> removals_;
+
+    std::mutex publishMutex_;           // one publish at a time
+
+    std::thread publisher_;
+    std::mutex stopMutex_;
+    std::condition_variable stopped_;
+    bool stop_;
+
+    template <typename T>
+    void enqueue (const Key *keys, const T *const *values, unsigned n, bool update)
+    {
+        Snapshot index = snapshot();
+        BOOST_VERIFY(index);
+        unsigned L = index->getL();
+        std::vector<unsigned> bins(std::size_t(n) * L);
+        if (n != 0) index->hash(values, n, &bins[0]);
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        for (unsigned j = 0; j < n; ++j) {
+            // The key was not removed from the snapshot yet, so its old
+            // entries are still there.
+            bool cancelled = removals_.erase(keys[j]) != 0;
+            keys_.push_back(keys[j]);
+            updates_.push_back(update || cancelled);
+        }
+        bins_.insert(bins_.end(), bins.begin(), bins.end());
+    }
+
+public:
+    ConcurrentIndex (): stop_(false) {}
+
+    ~ConcurrentIndex ()
+    {
+        stop();
+    }
+
+    /// Publish an index.
+    /**
+      * The index is frozen and is not to be modified afterwards.  The
+      * queued changes are dropped.
+      */
+    void reset (const std::shared_ptr<INDEX> &index)
+    {
+        std::lock_guard<std::mutex> publishing(publishMutex_);
+        index->freeze();
+        {
+            std::lock_guard<std::mutex> lock(queueMutex_);
+            keys_.clear();
+            bins_.clear();
+            updates_.clear();
+            removals_.clear();
+        }
+        std::atomic_store(&current_, Snapshot(index));
+    }
+
+    /// The published index.
+    /**
+      * A thread running many queries can take the snapshot once and query
+      * it directly, which saves the atomic access of each query.
+      */
+    Snapshot snapshot () const
+    {
+        return std::atomic_load(&current_);
+    }
+
+    /// Queue a block of items to insert.
+    /**
+      * The items are hashed by the calling thread.  Inserting a removed
+      * key is the same as updating it.
+      */
+    template <typename T>
+    void insert (const Key *keys, const T *const *values, unsigned n)
+    {
+        enqueue(keys, values, n, false);
+    }
+
+    /// Queue an item to insert.
+    template <typename T>
+    void insert (Key key, const T *value)
+    {
+        enqueue(&key, &value, 1, false);
+    }
+
+    /// Queue a block of updates, see MultiProbeLshIndex::update.
+    template <typename T>
+    void update (const Key *keys, const T *const *values, unsigned n)
+    {
+        enqueue(keys, values, n, true);
+    }
+
+    /// Queue an update.
+    template <typename T>
+    void update (Key key, const T *value)
+    {
+        enqueue(&key, &value, 1, true);
+    }
+
+    /// Queue the removal of a key.
+    void remove (Key key)
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        removals_.insert(key);
+    }
+
+    /// Number of queued changes.
+    unsigned queued ()
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        return keys_.size() + removals_.size();
+    }
+
+    /// Publish the queued changes.
+    /**
+      * @param threads number of threads rebuilding the tables when the
+      * overflow is flushed, 0 for all the cores.
+      */
+    void publish (unsigned threads = 0)
+    {
+        std::lock_guard<std::mutex> publishing(publishMutex_);
+        std::vector<Key> keys;
+        std::vector<unsigned> bins;
+        std::vector<uint8_t> updates;
+        std::unordered_set<Key> removals;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex_);
+            keys.swap(keys_);
+            bins.swap(bins_);
+            updates.swap(updates_);
+            removals.swap(removals_);
+        }
+        if (keys.empty() && removals.empty()) return;
+        std::shared_ptr<INDEX> next = std::make_shared<INDEX>(*snapshot());
+        if (!keys.empty()) {
+            next->append(&keys[0], &bins[0], keys.size(), &updates[0], threads);
+        }
+        for (typename std::unordered_set<Key>::const_iterator it = removals.begin(); it != removals.end(); ++it) {
+            next->remove(*it);
+        }
+        std::atomic_store(&current_, Snapshot(next));
+    }
+
+    /// Publish a compacted copy of the index.
+    /**
+      * The removed keys and the stale entries of the published index are
+      * dropped.  The queued changes stay queued.
+      */
+    void compact (unsigned threads = 0)
+    {
+        std::lock_guard<std::mutex> publishing(publishMutex_);
+        Snapshot index = snapshot();
+        if (!index->pending()) return;
+        std::shared_ptr<INDEX> next = std::make_shared<INDEX>(*index);
+        next->compact(threads);
+        std::atomic_store(&current_, Snapshot(next));
+    }
+
+    /// Publish the queued changes every interval milliseconds.
+    /**
+      * @param threads number of threads of each publish.
+      *
+      * A background thread publishes until stop() is called.
+      */
+    void start (unsigned interval, unsigned threads = 1)
+    {
+        stop();
+        stop_ = false;
+        publisher_ = std::thread([this, interval, threads]() {
+            std::unique_lock<std::mutex> lock(stopMutex_);
+            while (!stopped_.wait_for(lock, std::chrono::milliseconds(interval), [this] { return stop_; })) {
+                lock.unlock();
+                publish(threads);
+                lock.lock();
+            }
+        });
+    }
+
+    /// Stop the background publishing.  The queued changes stay queued.
+    void stop ()
+    {
+        if (!publisher_.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(stopMutex_);
+            stop_ = true;
+        }
+        stopped_.notify_all();
+        publisher_.join();
+    }
+
+    /// Query the published index, see MultiProbeLshIndex::query.
+    template <typename SCANNER, typename POINT>
+    void query (const POINT *obj, unsigned T, SCANNER &scanner) const
+    {
+        snapshot()->query(obj, T, scanner);
+    }
+
+    /// Adaptive query of the published index.
+    template <typename SCANNER, typename POINT>
+    void query_recall (const POINT *obj, float recall, SCANNER &scanner) const
+    {
+        snapshot()->query_recall(obj, recall, scanner);
+    }
+
+    /// Query a batch of points in parallel, all on the same snapshot.
+    template <typename SCANNER, typename POINT>
+    std::vector<Topk<Key> > query_batch (const POINT *const *queries, unsigned Q, unsigned T, const SCANNER &scanner, unsigned threads = 0, std::vector<unsigned> *cnt = 0) const
+    {
+        return snapshot()->query_batch(queries, Q, T, scanner, threads, cnt);
+    }
+
+    /// Adaptive query of a batch of points, all on the same snapshot.
+    template <typename SCANNER, typename POINT>
+    std::vector<Topk<Key> > query_recall_batch (const POINT *const *queries, unsigned Q, float recall, const SCANNER &scanner, unsigned threads = 0, std::vector<unsigned> *cnt = 0) const
+    {
+        return snapshot()->query_recall_batch(queries, Q, recall, scanner, threads, cnt);
+    }
+};
+
+}
+
+#endif
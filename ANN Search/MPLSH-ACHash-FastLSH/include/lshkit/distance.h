@@ -0,0 +1,97 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_DISTANCE__
+#define __LSHKIT_DISTANCE__
+
+/**
+ * \file distance.h
+ * \brief SIMD distance kernels on float and byte vectors.
+ *
+ * The kernels of squared L2, L1, L-infinity and inner product have scalar,
+ * SSE2, AVX2 and AVX-512 variants, and the best one supported by the CPU is
+ * picked once, as for the projection kernels (see simd.h).  metric::l1,
+ * metric::l2, metric::l2sqr, metric::max and kernel::dot use them for float,
+ * and so does TopkScanner with metric::l2sqr.
+ *
+ * Squared L2 on bytes (e.g. the bvecs of SIFT1B) is computed on integers:
+ * the differences are widened to 16 bits and squared and summed in pairs
+ * into 32-bit lanes (pmaddwd, or vpdpwssd on CPUs with AVX-512 VNNI), so the
+ * sum is exact.  metric::l2sqr<uint8_t> and its TopkScanner use it.
+ *
+ * The bounded variants stop early: the partial distance is compared with
+ * bound every DISTANCE_BLOCK dimensions, and returned as soon as it is
+ * larger.  A result larger than bound is therefore only a lower bound of
+ * the distance, which is all a K-NN scan needs to reject a candidate.
+ *
+ * \code
+ * const DistanceKernels &k = distanceKernels();
+ * float d = k.l2sqr(a, b, dim);
+ * float e = k.l2sqrBounded(a, b, dim, topk.threshold());
+ * \endcode
+ */
+
+#include <stdint.h>
+#include <lshkit/simd.h>
+
+namespace lshkit {
+
+/// Number of dimensions between two checks of a bounded kernel.
+static const unsigned DISTANCE_BLOCK = 32;
+
+typedef float (*DistanceKernel) (const float *a, const float *b, unsigned dim);
+typedef float (*BoundedDistanceKernel) (const float *a, const float *b, unsigned dim, float bound);
+
+/// The distance kernels of one instruction set.
+struct DistanceKernels
+{
+    DistanceKernel l2sqr;       // sum (a[i] - b[i])^2
+    DistanceKernel l1;          // sum |a[i] - b[i]|
+    DistanceKernel max;         // max |a[i] - b[i]|
+    DistanceKernel dot;         // sum a[i] * b[i]
+    BoundedDistanceKernel l2sqrBounded;
+    BoundedDistanceKernel l1Bounded;
+};
+
+/// The kernels of the given instruction set, which the CPU must support.
+const DistanceKernels &distanceKernels (SimdLevel level);
+
+/// The kernels of simdLevel().
+static inline const DistanceKernels &distanceKernels ()
+{
+    static const DistanceKernels &kernels = distanceKernels(simdLevel());
+    return kernels;
+}
+
+/// Bounded squared L2 kernel on bytes, as BoundedDistanceKernel.
+typedef float (*ByteDistanceKernel) (const uint8_t *a, const uint8_t *b, unsigned dim, float bound);
+
+/// The byte L2sqr kernel of the given instruction set.
+ByteDistanceKernel l2sqrByteKernel (SimdLevel level);
+
+/// The byte L2sqr kernel of simdLevel().
+static inline ByteDistanceKernel l2sqrByteKernel ()
+{
+    static const ByteDistanceKernel kernel = l2sqrByteKernel(simdLevel());
+    return kernel;
+}
+
+}
+
+#endif
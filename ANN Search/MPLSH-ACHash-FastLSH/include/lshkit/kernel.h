@@ -28,6 +28,7 @@
 // This file implements some common kernel functions.
 
 #include <functional>
+#include <lshkit/distance.h>
 
 namespace lshkit { namespace kernel {
 
@@ -49,6 +50,11 @@ public:
     }
 };
 
+template <>
+inline float dot<float>::operator () (const float *first1, const float *first2) const
+{
+    return distanceKernels().dot(first1, first2, dim_);
+}
 
 }}
 
@@ -0,0 +1,142 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_LATENCY__
+#define __LSHKIT_LATENCY__
+
+/**
+ * \file latency.h
+ * \brief Histogram of latencies, for percentiles such as p99 and p999.
+ */
+
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include <stdint.h>
+
+namespace lshkit {
+
+/// Histogram of non-negative integer values, e.g. latencies in microseconds.
+/**
+  * The values below 2^SUB_BITS have a bucket each; above, a power of two
+  * is split into 2^SUB_BITS buckets, so a percentile is off by less than
+  * 1/2^SUB_BITS = 3% of its value.  The histogram takes 15KB whatever
+  * the range of the values, and recording a value costs a few
+  * instructions.  It is not thread safe.
+  */
+class LatencyHistogram
+{
+public:
+    static const unsigned SUB_BITS = 5;
+    static const unsigned BUCKETS = (64 - SUB_BITS + 1) << SUB_BITS;
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t total_;
+    uint64_t sum_;
+    uint64_t max_;
+
+public:
+    LatencyHistogram (): counts_(BUCKETS, 0), total_(0), sum_(0), max_(0) {}
+
+    /// The bucket of v.
+    static unsigned bucket (uint64_t v)
+    {
+        if (v < (uint64_t(1) << SUB_BITS)) return v;
+        unsigned e = 63 - __builtin_clzll(v);
+        return ((e - SUB_BITS + 1) << SUB_BITS) + unsigned((v >> (e - SUB_BITS)) & ((1u << SUB_BITS) - 1));
+    }
+
+    /// The smallest value of bucket b.
+    static uint64_t lower (unsigned b)
+    {
+        if (b < (1u << SUB_BITS)) return b;
+        unsigned e = (b >> SUB_BITS) + SUB_BITS - 1;
+        return (uint64_t(1) << e) + (uint64_t(b & ((1u << SUB_BITS) - 1)) << (e - SUB_BITS));
+    }
+
+    /// The largest value of bucket b.
+    static uint64_t upper (unsigned b)
+    {
+        return b + 1 < BUCKETS ? lower(b + 1) - 1 : ~uint64_t(0);
+    }
+
+    /// Record a value.
+    void record (uint64_t v, uint64_t n = 1)
+    {
+        counts_[bucket(v)] += n;
+        total_ += n;
+        sum_ += v * n;
+        max_ = std::max(max_, v);
+    }
+
+    /// Add the values of another histogram.
+    void merge (const LatencyHistogram &h)
+    {
+        for (unsigned b = 0; b < BUCKETS; ++b) counts_[b] += h.counts_[b];
+        total_ += h.total_;
+        sum_ += h.sum_;
+        max_ = std::max(max_, h.max_);
+    }
+
+    void reset ()
+    {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        total_ = sum_ = max_ = 0;
+    }
+
+    /// Number of values.
+    uint64_t count () const { return total_; }
+
+    uint64_t max () const { return max_; }
+
+    double mean () const { return total_ ? double(sum_) / total_ : 0; }
+
+    /// The value which p of the values do not exceed, p in [0, 1].
+    /**
+      * The largest value of its bucket is returned, but not more than the
+      * largest value recorded.  0 when the histogram is empty.
+      */
+    uint64_t percentile (double p) const
+    {
+        if (total_ == 0) return 0;
+        uint64_t rank = uint64_t(p * total_);
+        if (rank < 1) rank = 1;
+        if (rank > total_) rank = total_;
+        uint64_t seen = 0;
+        for (unsigned b = 0; b < BUCKETS; ++b) {
+            seen += counts_[b];
+            if (seen >= rank) return std::min(upper(b), max_);
+        }
+        return max_;
+    }
+
+    /// Write the non-empty buckets, a line "lower upper count" each.
+    void dump (std::ostream &os) const
+    {
+        for (unsigned b = 0; b < BUCKETS; ++b) {
+            if (counts_[b] == 0) continue;
+            os << lower(b) << ' ' << upper(b) << ' ' << counts_[b] << '\n';
+        }
+    }
+};
+
+}
+
+#endif
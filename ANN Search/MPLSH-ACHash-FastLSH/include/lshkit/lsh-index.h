@@ -27,9 +27,23 @@
 
 #include <stdexcept>
 #include <algorithm>
+#include <utility>
+#include <memory>
+#include <future>
+#include <unordered_map>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <lshkit/common.h>
 #include <lshkit/topk.h>
 #include <lshkit/archive.h>
+#include <lshkit/parallel.h>
 
 
 //改
@@ -41,6 +55,53 @@
 
 namespace lshkit {
 
+/// The index image format.
+/**
+  * An index image is a file that can be mapped into memory and queried in
+  * place (see LshIndex::map).  It is made of sections starting at multiples
+  * of IMAGE_ALIGN bytes:
+  *
+  *  - the header, IndexImageHeader, followed by L IndexImageTable;
+  *  - the metadata: the LSH functions followed by whatever the index class
+  *    adds, written with the routines of archive.h;
+  *  - for each table, the H + 1 offsets and then the keys of the frozen
+  *    layout.
+  *
+  * The version is increased whenever the layout changes.  Like archive.h,
+  * the format is architecture dependent.
+  */
+static const char IMAGE_MAGIC[8] = {'L', 'S', 'H', 'K', 'I', 'M', 'G', 0};
+static const unsigned IMAGE_VERSION = 1;
+static const uint64_t IMAGE_ALIGN = 4096;
+
+struct IndexImageHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t keySize;       // sizeof(Key)
+    uint32_t L;
+    uint32_t reserved;
+    uint64_t metaOffset;
+    uint64_t metaSize;
+};
+
+struct IndexImageTable
+{
+    uint64_t bins;          // H
+    uint64_t size;          // # keys
+    uint64_t offsets;       // file offset of the H + 1 offsets
+    uint64_t keys;          // file offset of the keys
+};
+
+/// Whether the file at path is an index image.
+static inline bool isIndexImage (const std::string &path)
+{
+    std::ifstream is(path.c_str(), std::ios::binary);
+    char magic[sizeof(IMAGE_MAGIC)];
+    if (!is.read(magic, sizeof(magic))) return false;
+    return std::memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
 /// Flat LSH index.
 /** Flat LSH index is implemented as L hash tables using mutually independent
   * LSH functions.  Given a query point q, the points in the bins to which q is
@@ -59,15 +120,645 @@ public:
     typedef typename LSH::Domain Domain;
     typedef KEY Key;
 
+public:
+    /// The keys in a bin, as the range [first, second).
+    typedef std::pair<const Key *, const Key *> BinRange;
+
 protected:
     typedef std::vector<Key> Bin;
 
+    /// A hash table in the frozen layout.
+    /**
+      * The keys of bin h are keys[offsets[h]], ..., keys[offsets[h + 1] - 1].
+      * This takes 4 bytes per bin plus the keys, against 24 bytes per bin
+      * and one heap block per non-empty bin for std::vector<Bin>.
+      *
+      * A frozen table is never modified, so the arrays are shared by the
+      * copies of the table.  They are either owned by storage or live in a
+      * mapped index image.
+      */
+    struct FrozenTable
+    {
+        const unsigned *offsets;
+        const Key *keys;
+        std::shared_ptr<const void> storage;
+
+        FrozenTable (): offsets(0), keys(0) {}
+    };
+
+    /// Heap storage of a frozen table.
+    struct FrozenArrays
+    {
+        std::vector<unsigned> offsets;
+        std::vector<Key> keys;
+    };
+
+    /// Point table to the arrays of storage.
+    static void attach (FrozenTable *table, const std::shared_ptr<FrozenArrays> &storage)
+    {
+        table->offsets = storage->offsets.data();
+        table->keys = storage->keys.data();
+        table->storage = storage;
+    }
+
+    /// Keys added to a frozen index, see append.
+    /**
+      * The entries of table i are [i * size, (i + 1) * size) of bins and
+      * keys, sorted by bin; the keys of a bin are in the order they were
+      * added.  A chunk is never modified, so it is shared by the copies of
+      * the index.
+      */
+    struct Overflow
+    {
+        unsigned size;
+        std::vector<unsigned> bins;
+        std::vector<Key> keys;
+    };
+
     std::vector<LSH> lshs_;
-    std::vector<std::vector<Bin> > tables_;
+    std::vector<std::vector<Bin> > tables_;     // empty when frozen
+    std::vector<FrozenTable> frozenTables_;     // empty when not frozen
+    bool frozen_;
+    // The overflow of a frozen index, oldest chunk first.  Each chunk is
+    // more than twice as large as the next one.
+    std::vector<std::shared_ptr<const Overflow> > overflow_;
+    unsigned overflowSize_;                     // # keys in overflow_
+
+    // Bit k of removed_ is set when key k is removed but still in the
+    // tables.  An updated key has its new bins in moved_ and its bit set
+    // in updated_; its entries in the other bins are stale.  Both are
+    // cleared by compaction.
+    std::vector<uint64_t> removed_;
+    std::vector<uint64_t> updated_;
+    std::unordered_map<Key, std::vector<unsigned> > moved_;
+    unsigned tombstones_;
+
+    /// The keys added while compaction passes are running, see install.
+    struct Journal
+    {
+        std::vector<Key> keys;
+        std::vector<unsigned> bins;     // L per key
+        std::vector<uint8_t> updates;   // whether the key was updated
+        unsigned passes;                // # passes started
+        unsigned installed;             // the last pass installed
+
+        Journal (): passes(0), installed(0) {}
+    };
+
+    // The journal lives as long as the passes referring to it.  A copy of
+    // the index has none, so the passes of the original are not
+    // installed on it.
+    struct JournalRef
+    {
+        std::weak_ptr<Journal> ptr;
+
+        JournalRef () {}
+        JournalRef (const JournalRef &) {}
+        JournalRef &operator = (const JournalRef &)
+        {
+            ptr.reset();
+            return *this;
+        }
+    };
+    JournalRef journal_;
+
+    static bool testBit (const std::vector<uint64_t> &bits, Key key)
+    {
+        std::size_t w = std::size_t(key) / 64;
+        return w < bits.size() && (bits[w] >> (key % 64) & 1);
+    }
+
+    static void setBit (std::vector<uint64_t> *bits, Key key)
+    {
+        std::size_t w = std::size_t(key) / 64;
+        if (w >= bits->size()) bits->resize(w + 1, 0);
+        (*bits)[w] |= uint64_t(1) << (key % 64);
+    }
+
+    static void clearBit (std::vector<uint64_t> *bits, Key key)
+    {
+        std::size_t w = std::size_t(key) / 64;
+        if (w < bits->size()) (*bits)[w] &= ~(uint64_t(1) << (key % 64));
+    }
+
+    /// Forget the removed and updated keys and the overflow, when the
+    /// tables are replaced.
+    void resetTombstones ()
+    {
+        overflow_.clear();
+        overflowSize_ = 0;
+        removed_.clear();
+        updated_.clear();
+        moved_.clear();
+        tombstones_ = 0;
+        journal_.ptr.reset();
+    }
+
+    /// Record that key is added to bin bins[i] of table i.
+    /**
+      * With update, or when the key was removed, the key is live again and
+      * its entries in other bins become stale.  The key is journaled while
+      * a compaction pass is running.
+      */
+    void track (Key key, const unsigned *bins, bool update)
+    {
+        if (tombstones_ != 0 && testBit(removed_, key)) {
+            clearBit(&removed_, key);
+            --tombstones_;
+            update = true;
+        }
+        if (update) {
+            setBit(&updated_, key);
+            moved_[key].assign(bins, bins + lshs_.size());
+        }
+        if (journal_.ptr.expired()) return;
+        std::shared_ptr<Journal> journal = journal_.ptr.lock();
+        if (!journal) return;
+        journal->keys.push_back(key);
+        journal->bins.insert(journal->bins.end(), bins, bins + lshs_.size());
+        journal->updates.push_back(update);
+    }
+
+    /// Sort a batch of keys of known bins into an overflow chunk.
+    std::shared_ptr<const Overflow> makeOverflow (const Key *keys, const unsigned *bins, unsigned n) const
+    {
+        unsigned L = lshs_.size();
+        std::shared_ptr<Overflow> o = std::make_shared<Overflow>();
+        o->size = n;
+        o->bins.resize(std::size_t(L) * n);
+        o->keys.resize(std::size_t(L) * n);
+        std::vector<unsigned> order(n);
+        for (unsigned i = 0; i < L; ++i) {
+            for (unsigned j = 0; j < n; ++j) order[j] = j;
+            std::stable_sort(order.begin(), order.end(), [bins, L, i](unsigned a, unsigned b) {
+                return bins[std::size_t(a) * L + i] < bins[std::size_t(b) * L + i];
+            });
+            std::size_t off = std::size_t(i) * n;
+            for (unsigned j = 0; j < n; ++j) {
+                o->bins[off + j] = bins[std::size_t(order[j]) * L + i];
+                o->keys[off + j] = keys[order[j]];
+            }
+        }
+        return o;
+    }
+
+    /// Merge two overflow chunks, a being the older one.
+    std::shared_ptr<const Overflow> mergeOverflow (const Overflow &a, const Overflow &b) const
+    {
+        unsigned L = lshs_.size();
+        std::shared_ptr<Overflow> o = std::make_shared<Overflow>();
+        o->size = a.size + b.size;
+        o->bins.resize(std::size_t(L) * o->size);
+        o->keys.resize(std::size_t(L) * o->size);
+        for (unsigned i = 0; i < L; ++i) {
+            std::size_t p = std::size_t(i) * a.size, pe = p + a.size;
+            std::size_t q = std::size_t(i) * b.size, qe = q + b.size;
+            std::size_t k = std::size_t(i) * o->size;
+            for (; p < pe || q < qe; ++k) {
+                if (q == qe || (p < pe && a.bins[p] <= b.bins[q])) {
+                    o->bins[k] = a.bins[p];
+                    o->keys[k] = a.keys[p++];
+                }
+                else {
+                    o->bins[k] = b.bins[q];
+                    o->keys[k] = b.keys[q++];
+                }
+            }
+        }
+        return o;
+    }
+
+    /// Add a chunk to the overflow.
+    /**
+      * Like the digits of a binary counter, the newest chunks are merged
+      * while the one before is not more than twice as large, so there are
+      * at most log2(overflowSize_) + 1 chunks, and a key is merged
+      * O(log(overflowSize_)) times before it is flushed.
+      */
+    void pushOverflow (const std::shared_ptr<const Overflow> &o)
+    {
+        overflow_.push_back(o);
+        overflowSize_ += o->size;
+        while (overflow_.size() >= 2) {
+            const Overflow &a = *overflow_[overflow_.size() - 2];
+            const Overflow &b = *overflow_.back();
+            if (a.size > 2 * b.size) break;
+            std::shared_ptr<const Overflow> merged = mergeOverflow(a, b);
+            overflow_.pop_back();
+            overflow_.back() = merged;
+        }
+    }
+
+    /// Merge the overflow into the frozen tables.
+    /**
+      * The tables are rebuilt in parallel, each by a linear merge of its
+      * bins with the overflow, whose keys follow the old ones in each bin.
+      */
+    void flush (unsigned threads)
+    {
+        if (overflow_.empty()) return;
+        while (overflow_.size() > 1) {
+            std::shared_ptr<const Overflow> merged = mergeOverflow(*overflow_[overflow_.size() - 2], *overflow_.back());
+            overflow_.pop_back();
+            overflow_.back() = merged;
+        }
+        const Overflow &o = *overflow_[0];
+        unsigned L = lshs_.size();
+        if (threads > L) threads = std::max(L, 1u);
+        std::vector<FrozenTable> frozen(L);
+        parallelRun(threads, [&](unsigned t) {
+            unsigned end = partBegin(L, threads, t + 1);
+            for (unsigned i = partBegin(L, threads, t); i < end; ++i) {
+                std::shared_ptr<FrozenArrays> storage = std::make_shared<FrozenArrays>();
+                FrozenArrays &table = *storage;
+                unsigned H = lshs_[i].getRange();
+                table.offsets.resize(H + 1);
+                table.keys.resize(frozenTables_[i].offsets[H] + o.size);
+                const unsigned *bins = &o.bins[std::size_t(i) * o.size];
+                const Key *keys = &o.keys[std::size_t(i) * o.size];
+                unsigned p = 0, off = 0;
+                for (unsigned h = 0; h < H; ++h) {
+                    table.offsets[h] = off;
+                    BinRange old = bin(i, h);
+                    std::copy(old.first, old.second, table.keys.begin() + off);
+                    off += old.second - old.first;
+                    for (; p < o.size && bins[p] == h; ++p) {
+                        table.keys[off++] = keys[p];
+                    }
+                }
+                table.offsets[H] = off;
+                attach(&frozen[i], storage);
+            }
+        });
+        frozenTables_.swap(frozen);
+        overflow_.clear();
+        overflowSize_ = 0;
+    }
+
+    /// Number of keys in the tables, but the overflow.
+    unsigned indexed () const
+    {
+        if (lshs_.empty()) return 0;
+        if (frozen_) return frozenTables_[0].offsets[lshs_[0].getRange()];
+        unsigned n = 0;
+        BOOST_FOREACH(const Bin &b, tables_[0]) n += b.size();
+        return n;
+    }
+
+    /// Add the n keys of known bins, see append.  They are already tracked.
+    void extend (const Key *keys, const unsigned *bins, unsigned n, unsigned threads)
+    {
+        unsigned L = lshs_.size();
+        if (!frozen_) {
+            for (unsigned j = 0; j < n; ++j) {
+                for (unsigned i = 0; i < L; ++i) {
+                    tables_[i][bins[std::size_t(j) * L + i]].push_back(keys[j]);
+                }
+            }
+            return;
+        }
+        uint64_t total = uint64_t(overflowSize_) + n;
+        if (total <= OVERFLOW_MIN || total * OVERFLOW_RATIO <= indexed()) {
+            pushOverflow(makeOverflow(keys, bins, n));
+            return;
+        }
+        if (threads == 0) threads = defaultThreads();
+        std::vector<unsigned> buckets(std::size_t(L) * n);
+        for (unsigned j = 0; j < n; ++j) {
+            for (unsigned i = 0; i < L; ++i) {
+                buckets[std::size_t(i) * n + j] = bins[std::size_t(j) * L + i];
+            }
+        }
+        fill(&buckets[0], n, threads, keys);
+    }
+
+    /// Call f(range) for the ranges of keys of bin h of table i.
+    /**
+      * These are bin(i, h) and then the keys of the bin in the overflow
+      * chunks, oldest first, so the keys are in the order they were added.
+      */
+    template <typename F>
+    void visitBin (unsigned i, unsigned h, F f) const
+    {
+        f(bin(i, h));
+        for (std::size_t c = 0; c < overflow_.size(); ++c) {
+            const Overflow &o = *overflow_[c];
+            const unsigned *bins = &o.bins[std::size_t(i) * o.size];
+            std::pair<const unsigned *, const unsigned *> r = std::equal_range(bins, bins + o.size, h);
+            if (r.first == r.second) continue;
+            const Key *keys = &o.keys[r.first - &o.bins[0]];
+            f(BinRange(keys, keys + (r.second - r.first)));
+        }
+    }
+
+    /// Copy the keys of [first, last) which are not removed to out.
+    /**
+      * out may be first.  Returns the number of keys copied.
+      */
+    unsigned live (const Key *first, const Key *last, Key *out) const
+    {
+        unsigned m = 0;
+        for (; first < last; ++first) {
+            Key key = *first;
+            out[m] = key;
+            m += !testBit(removed_, key);
+        }
+        return m;
+    }
+
+    /// Number of keys in bin h of table i.
+    unsigned binSize (unsigned i, unsigned h) const
+    {
+        if (frozen_) {
+            const unsigned *offsets = frozenTables_[i].offsets;
+            return offsets[h + 1] - offsets[h];
+        }
+        return tables_[i][h].size();
+    }
+
+    static uint64_t alignImage (uint64_t off)
+    {
+        return (off + IMAGE_ALIGN - 1) / IMAGE_ALIGN * IMAGE_ALIGN;
+    }
+
+    /// Write the index as an image.
+    /**
+      * meta(os) writes the metadata of the derived class after the LSH
+      * functions.  The index is compacted or frozen first.
+      */
+    template <typename META>
+    void writeImage (std::ostream &os, META meta)
+    {
+        if (pending()) compact();
+        else freeze();
+        unsigned L = lshs_.size();
+        std::ostringstream ms(std::ios::binary);
+        for (unsigned i = 0; i < L; ++i) {
+            lshs_[i].serialize(ms, 0);
+        }
+        meta(ms);
+        std::string m = ms.str();
+
+        IndexImageHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+        header.version = IMAGE_VERSION;
+        header.keySize = sizeof(Key);
+        header.L = L;
+        header.metaOffset = alignImage(sizeof(header) + L * sizeof(IndexImageTable));
+        header.metaSize = m.size();
+
+        std::vector<IndexImageTable> dir(L);
+        uint64_t off = alignImage(header.metaOffset + header.metaSize);
+        for (unsigned i = 0; i < L; ++i) {
+            dir[i].bins = lshs_[i].getRange();
+            dir[i].size = frozenTables_[i].offsets[dir[i].bins];
+            dir[i].offsets = off;
+            off = alignImage(off + (dir[i].bins + 1) * sizeof(unsigned));
+            dir[i].keys = off;
+            off = alignImage(off + dir[i].size * sizeof(Key));
+        }
+
+        uint64_t pos = 0;
+        writeImageSection(os, &pos, 0, (const char *)&header, sizeof(header));
+        writeImageSection(os, &pos, pos, (const char *)dir.data(), L * sizeof(IndexImageTable));
+        writeImageSection(os, &pos, header.metaOffset, m.data(), m.size());
+        for (unsigned i = 0; i < L; ++i) {
+            const FrozenTable &table = frozenTables_[i];
+            writeImageSection(os, &pos, dir[i].offsets, (const char *)table.offsets, (dir[i].bins + 1) * sizeof(unsigned));
+            writeImageSection(os, &pos, dir[i].keys, (const char *)table.keys, dir[i].size * sizeof(Key));
+        }
+    }
+
+    /// Write size bytes at file offset off >= *pos, padding with zeros.
+    static void writeImageSection (std::ostream &os, uint64_t *pos, uint64_t off, const char *data, uint64_t size)
+    {
+        static const char zeros[IMAGE_ALIGN] = {0};
+        BOOST_VERIFY(off >= *pos);
+        os.write(zeros, off - *pos);
+        os.write(data, size);
+        *pos = off + size;
+    }
+
+    /// Map an index image written by writeImage.
+    /**
+      * meta(is) reads the metadata of the derived class.  The tables are
+      * used in place; the mapping is released when no table refers to it.
+      * The sections are checked to lie in the file, and the offsets of each
+      * table to start at 0 and end with its number of keys.  With verify,
+      * all the offsets are also checked not to decrease, which reads the
+      * L (H + 1) offsets but not the keys.  A bad image throws
+      * std::runtime_error.
+      */
+    template <typename META>
+    void mapImage (const std::string &path, META meta, bool verify)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("cannot open " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("cannot stat " + path);
+        }
+        uint64_t size = st.st_size;
+        void *addr = MAP_FAILED;
+        if (size >= sizeof(IndexImageHeader)) {
+            addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (addr == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+        // The bins are visited in random order, read ahead is useless.
+        madvise(addr, size, MADV_RANDOM);
+        std::shared_ptr<const void> region(addr, [size](const void *p) {
+            munmap(const_cast<void *>(p), size);
+        });
+        const char *base = (const char *)addr;
+
+        const IndexImageHeader &header = *(const IndexImageHeader *)base;
+        if (std::memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+            throw std::runtime_error(path + " is not an index image");
+        }
+        if (header.version != IMAGE_VERSION) {
+            throw std::runtime_error(path + ": unsupported index image version");
+        }
+        if (header.keySize != sizeof(Key)) {
+            throw std::runtime_error(path + ": wrong key type");
+        }
+        unsigned L = header.L;
+        const IndexImageTable *dir = (const IndexImageTable *)(base + sizeof(header));
+        if (!imageSection(size, sizeof(header), L, sizeof(IndexImageTable))
+                || !imageSection(size, header.metaOffset, header.metaSize, 1)) {
+            throw std::runtime_error(path + " is truncated");
+        }
+
+        std::istringstream ms(std::string(base + header.metaOffset, header.metaSize), std::ios::binary);
+        lshs_.resize(L);
+        for (unsigned i = 0; i < L; ++i) {
+            lshs_[i].serialize(ms, 0);
+        }
+        meta(ms);
+
+        tables_.clear();
+        tables_.resize(L);
+        frozenTables_.clear();
+        frozenTables_.resize(L);
+        frozen_ = true;
+        resetTombstones();
+        for (unsigned i = 0; i < L; ++i) {
+            if (dir[i].bins != lshs_[i].getRange()) {
+                throw std::runtime_error(path + ": hash table does not match its LSH");
+            }
+            if (!imageSection(size, dir[i].offsets, dir[i].bins + 1, sizeof(unsigned))
+                    || !imageSection(size, dir[i].keys, dir[i].size, sizeof(Key))) {
+                throw std::runtime_error(path + " is truncated");
+            }
+            if (dir[i].offsets % sizeof(unsigned) != 0 || dir[i].keys % sizeof(Key) != 0) {
+                throw std::runtime_error(path + ": misaligned hash table");
+            }
+            const unsigned *offsets = (const unsigned *)(base + dir[i].offsets);
+            if (offsets[0] != 0 || offsets[dir[i].bins] != dir[i].size
+                    || (verify && !monotonic(offsets, dir[i].bins))) {
+                throw std::runtime_error(path + ": corrupted hash table");
+            }
+            FrozenTable &table = frozenTables_[i];
+            table.offsets = offsets;
+            table.keys = (const Key *)(base + dir[i].keys);
+            table.storage = region;
+        }
+    }
+
+    /// Whether n items of the given size at offset off fit in an image of
+    /// size bytes.
+    static bool imageSection (uint64_t size, uint64_t off, uint64_t n, uint64_t item)
+    {
+        return off <= size && n <= (size - off) / item;
+    }
+
+    /// Whether the H + 1 offsets of a table never decrease.
+    static bool monotonic (const unsigned *offsets, uint64_t H)
+    {
+        for (uint64_t h = 0; h < H; ++h) {
+            if (offsets[h] > offsets[h + 1]) return false;
+        }
+        return true;
+    }
+
+    /// Add key j to bin buckets[i * N + j] of table i, for j in [0, N).
+    /**
+      * Each table is rebuilt in the frozen layout with a parallel counting
+      * sort in two passes.  The bins are split into one range per thread:
+      * the threads first move the keys of their part of [0, N) to the
+      * range of their bins, then each thread counts the keys of its range
+      * in each of its bins, and once the offsets are known, copies the
+      * keys already in its bins and writes the new ones after them.  This
+      * takes H + 2N integers of temporary memory, whatever the number of
+      * threads.  The new keys of a bin follow the old ones in increasing
+      * order.  With N = 0, this just freezes the index.  If keys is given,
+      * keys[j] is added instead of j.  The overflow is flushed first.
+      */
+    void fill (const unsigned *buckets, unsigned N, unsigned threads, const Key *keys = 0)
+    {
+        flush(threads);
+        std::vector<FrozenTable> frozen(tables_.size());
+        std::vector<unsigned> total(threads + 1);
+        // parts[t * threads + r]: # keys of part t in bin range r, later
+        // where part t moves its next key of range r to.
+        std::vector<unsigned> parts(std::size_t(threads) * threads);
+        std::vector<unsigned> begin(threads + 1);
+        std::vector<unsigned> ranged(N);    // the new keys by bin range
+        std::vector<Key> rangedKeys(N);
+        std::vector<unsigned> counts;
+        for (unsigned i = 0; i < frozen.size(); ++i) {
+            std::shared_ptr<FrozenArrays> storage = std::make_shared<FrozenArrays>();
+            FrozenArrays &table = *storage;
+            unsigned H = lshs_[i].getRange();
+            unsigned width = (H + threads - 1) / threads;
+            const unsigned *bucket = buckets + std::size_t(i) * N;
+            parallelRun(threads, [&](unsigned t) {
+                unsigned *count = &parts[std::size_t(t) * threads];
+                std::fill(count, count + threads, 0);
+                unsigned end = partBegin(N, threads, t + 1);
+                for (unsigned j = partBegin(N, threads, t); j < end; ++j) {
+                    ++count[bucket[j] / width];
+                }
+            });
+            unsigned off = 0;
+            for (unsigned r = 0; r < threads; ++r) {
+                begin[r] = off;
+                for (unsigned t = 0; t < threads; ++t) {
+                    unsigned &c = parts[std::size_t(t) * threads + r];
+                    unsigned n = c;
+                    c = off;
+                    off += n;
+                }
+            }
+            begin[threads] = off;
+            parallelRun(threads, [&](unsigned t) {
+                unsigned *next = &parts[std::size_t(t) * threads];
+                unsigned end = partBegin(N, threads, t + 1);
+                for (unsigned j = partBegin(N, threads, t); j < end; ++j) {
+                    unsigned k = next[bucket[j] / width]++;
+                    ranged[k] = bucket[j];
+                    rangedKeys[k] = keys ? keys[j] : Key(j);
+                }
+            });
+            // counts[h]: # new keys in bin h, later where the next one goes.
+            // total[r + 1]: # keys in the bins of range r.
+            counts.assign(H, 0);
+            parallelRun(threads, [&](unsigned r) {
+                for (unsigned k = begin[r]; k < begin[r + 1]; ++k) {
+                    ++counts[ranged[k]];
+                }
+                unsigned sum = 0;
+                unsigned end = std::min(H, (r + 1) * width);
+                for (unsigned h = std::min(H, r * width); h < end; ++h) {
+                    sum += binSize(i, h) + counts[h];
+                }
+                total[r + 1] = sum;
+            });
+            for (unsigned r = 0; r < threads; ++r) {
+                total[r + 1] += total[r];
+            }
+            table.offsets.resize(H + 1);
+            table.offsets[H] = total[threads];
+            table.keys.resize(total[threads]);
+            parallelRun(threads, [&](unsigned r) {
+                unsigned off = total[r];
+                unsigned end = std::min(H, (r + 1) * width);
+                for (unsigned h = std::min(H, r * width); h < end; ++h) {
+                    table.offsets[h] = off;
+                    BinRange old = bin(i, h);
+                    std::copy(old.first, old.second, table.keys.begin() + off);
+                    off += old.second - old.first;
+                    unsigned n = counts[h];
+                    counts[h] = off;
+                    off += n;
+                }
+                for (unsigned k = begin[r]; k < begin[r + 1]; ++k) {
+                    table.keys[counts[ranged[k]]++] = rangedKeys[k];
+                }
+            });
+            attach(&frozen[i], storage);
+            // The old table is no longer needed.
+            if (frozen_) {
+                frozenTables_[i] = FrozenTable();
+            }
+            else {
+                std::vector<Bin>().swap(tables_[i]);
+            }
+        }
+        frozenTables_.swap(frozen);
+        frozen_ = true;
+    }
 
 public:
+    /// The overflow is flushed when it holds more than OVERFLOW_MIN keys
+    /// and more than 1 / OVERFLOW_RATIO of the keys in the tables.
+    static const unsigned OVERFLOW_MIN = 4096;
+    static const unsigned OVERFLOW_RATIO = 8;
+
     /// Constructor.
-    LshIndex() {
+    LshIndex(): frozen_(false), overflowSize_(0), tombstones_(0) {
     }
 
     /// Initialize the hash tables.
@@ -76,6 +767,7 @@ public:
       * @param engine random number generator.
       * @param L number of hash table maintained.
       *
+      * The tables start empty in the frozen layout.
       */
     template <typename Engine>
     void init (const Parameter &param, Engine &engine, unsigned L)
@@ -84,6 +776,9 @@ public:
         BOOST_VERIFY(tables_.size() == 0);
         lshs_.resize(L);
         tables_.resize(L);
+        frozenTables_.resize(L);
+        frozen_ = true;
+        resetTombstones();
 
         engine.seed(std::random_device()());
 
@@ -92,54 +787,77 @@ public:
             if (lshs_[i].getRange() == 0) {
                 throw std::logic_error("LSH with unlimited range should not be used to construct an LSH index.  Use lshkit::Tail<> to wrapp the LSH.");
             }
-            tables_[i].resize(lshs_[i].getRange());
+            std::shared_ptr<FrozenArrays> storage = std::make_shared<FrozenArrays>();
+            storage->offsets.resize(lshs_[i].getRange() + 1, 0);
+            attach(&frozenTables_[i], storage);
         }
     }
 
     /// Constructor
-    /** Load the LSH index from a stream. */
+    /** Load the LSH index from a stream.  The loaded index is frozen. */
     void load (std::istream &ar)
     {
         unsigned L;
         ar & L;
         lshs_.resize(L);
+        tables_.clear();
         tables_.resize(L);
+        frozenTables_.clear();
+        frozenTables_.resize(L);
+        frozen_ = true;
+        resetTombstones();
         for (unsigned i = 0; i < L; ++i) {
             lshs_[i].serialize(ar, 0);
             unsigned l;
             ar & l;
-            std::vector<Bin> &table = tables_[i];
-            table.resize(l);
+            std::shared_ptr<FrozenArrays> storage = std::make_shared<FrozenArrays>();
+            FrozenArrays &table = *storage;
+            table.offsets.resize(l + 1);
+            // The bins are saved in increasing order, so the offsets of
+            // the bins before idx are known when bin idx is read.
+            unsigned next = 0;
             for (;;) {
                 unsigned idx, ll;
                 ar & idx;
                 ar & ll;
                 if (ll == 0) break;
-                table[idx].resize(ll);
-                ar.read((char *)&table[idx][0], ll * sizeof(Key));
+                BOOST_VERIFY(next <= idx && idx < l);
+                for (; next <= idx; ++next) table.offsets[next] = table.keys.size();
+                unsigned off = table.keys.size();
+                table.keys.resize(off + ll);
+                ar.read((char *)&table.keys[off], ll * sizeof(Key));
             }
+            for (; next <= l; ++next) table.offsets[next] = table.keys.size();
+            table.keys.shrink_to_fit();
+            attach(&frozenTables_[i], storage);
         }
     }
 
     /// Save the LSH index to a stream.
+    /**
+      * The index is compacted first if keys were removed or updated, and
+      * its overflow is flushed.
+      */
     void save (std::ostream &ar)
     {
+        if (pending()) compact();
+        else flush(defaultThreads());
         unsigned L;
         L = lshs_.size();
         ar & L;
         for (unsigned i = 0; i < L; ++i) {
             lshs_[i].serialize(ar, 0);
-            std::vector<Bin> &table = tables_[i];
-            unsigned l = table.size();
+            unsigned l = lshs_[i].getRange();
             ar & l;
             unsigned idx, ll;
             for (unsigned j = 0; j < l; ++j) {
-                if (table[j].empty()) continue;
+                BinRange keys = bin(i, j);
+                if (keys.first == keys.second) continue;
                 idx = j;
-                ll = table[j].size();
+                ll = keys.second - keys.first;
                 ar & idx;
                 ar & ll;
-                ar.write((char *)&table[j][0], ll * sizeof(Key));
+                ar.write((const char *)keys.first, ll * sizeof(Key));
             }
             idx = ll = 0;
             ar & idx;
@@ -147,20 +865,413 @@ public:
         }
     }
 
+    /// Save the index as an image, which can be mapped by map().
+    void saveImage (std::ostream &os)
+    {
+        writeImage(os, [](std::ostream &) {});
+    }
+
+    /// Map an index image saved by saveImage.
+    /**
+      * The tables are queried directly from the file, so this reads
+      * neither the keys nor the offsets of the bins, and the processes
+      * mapping the same image share its memory.  With verify all the
+      * offsets are checked, see mapImage; an image that is not trusted
+      * should be mapped that way.  The items inserted afterwards are kept
+      * in memory in the overflow.
+      */
+    void map (const std::string &path, bool verify = false)
+    {
+        mapImage(path, [](std::istream &) {}, verify);
+    }
+
+    /// Number of hash tables.
+    unsigned getL () const
+    {
+        return lshs_.size();
+    }
+
+    /// Whether the tables are in the frozen layout.
+    /**
+      * The index is frozen after init, load and build.  A frozen index is
+      * compact and fast to scan.  The items inserted into it go to a small
+      * overflow beside the tables, which the queries scan as well and
+      * which is flushed into the tables when it grows past OVERFLOW_MIN
+      * keys and 1 / OVERFLOW_RATIO of the index.  An insert thus costs
+      * amortized O(L log n) and the flushes O(H L / n) per key, instead
+      * of a copy of the whole index to thaw it.
+      */
+    bool frozen () const
+    {
+        return frozen_;
+    }
+
+    /// Convert the tables to the frozen layout and flush the overflow.
+    /**
+      * @param threads number of threads, 0 for all the cores.
+      */
+    void freeze (unsigned threads = 0)
+    {
+        if (frozen_ && overflow_.empty()) return;
+        if (threads == 0) threads = defaultThreads();
+        if (frozen_) flush(threads);
+        else fill(0, 0, threads);
+    }
+
+    /// Number of keys in the overflow of a frozen index.
+    unsigned overflow () const
+    {
+        return overflowSize_;
+    }
+
+    /// Convert the tables back to one vector per bin.
+    /**
+      * The items inserted into a thawed index are added to their bins
+      * directly.
+      */
+    void thaw ()
+    {
+        if (!frozen_) return;
+        flush(defaultThreads());
+        for (unsigned i = 0; i < lshs_.size(); ++i) {
+            unsigned H = lshs_[i].getRange();
+            std::vector<Bin> &table = tables_[i];
+            table.resize(H);
+            for (unsigned h = 0; h < H; ++h) {
+                BinRange keys = bin(i, h);
+                table[h].assign(keys.first, keys.second);
+            }
+        }
+        frozenTables_.clear();
+        frozen_ = false;
+    }
+
+    /// The keys in bin h of table i, but those in the overflow.
+    /** See visitBin for all of them. */
+    BinRange bin (unsigned i, unsigned h) const
+    {
+        if (frozen_) {
+            const FrozenTable &table = frozenTables_[i];
+            return BinRange(table.keys + table.offsets[h], table.keys + table.offsets[h + 1]);
+        }
+        const Bin &b = tables_[i][h];
+        return BinRange(b.data(), b.data() + b.size());
+    }
+
     /// Insert an item to the index.
     /**
       * @param key the key to the item.
       * @param value the value of the key.
       *
       * The inserted object is not explicitly given, but is obtained by
-      * accessor(key).
+      * accessor(key).  The key goes to the overflow of a frozen index.
+      * Inserting a removed key is the same as updating it.
       */
     void insert (Key key, Domain value)
     {
+        add(key, value, false);
+    }
+
+    /// Insert a batch of keys of known bins in the frozen layout.
+    /**
+      * @param keys n keys.
+      * @param bins bins[j * L + i] is the bin of keys[j] in table i, as
+      * computed by MultiProbeLshIndex::hash.
+      * @param update if not 0, update[j] tells whether keys[j] is updated.
+      * @param threads number of threads of a flush, 0 for all the cores.
+      *
+      * The keys of a frozen index go to its overflow as one chunk, which
+      * takes O(n log n) per table.  When the overflow gets too large (see
+      * frozen), it is flushed and the tables are rebuilt by fill(), which
+      * takes time linear in the size of the index.  The keys of a thawed
+      * index are added to their bins.
+      */
+    void append (const Key *keys, const unsigned *bins, unsigned n, const uint8_t *update = 0, unsigned threads = 0)
+    {
+        if (n == 0) return;
+        unsigned L = lshs_.size();
+        for (unsigned j = 0; j < n; ++j) {
+            track(keys[j], bins + std::size_t(j) * L, update && update[j]);
+        }
+        extend(keys, bins, n, threads);
+    }
+
+    /// Change the value of a key.
+    /**
+      * The key is inserted with its new value.  Its entries in the bins of
+      * the old value are stale: they are still candidates of the queries
+      * hashed to them, which read the new value through the accessor, and
+      * they are dropped by the next compaction.  accessor(key) must return
+      * the new value before the next query.
+      */
+    void update (Key key, Domain value)
+    {
+        add(key, value, true);
+    }
+
+    /// Remove a key from the index.
+    /**
+      * The key is marked with a tombstone, and the queries skip it from
+      * now on.  It stays in the tables until the next compaction.
+      */
+    void remove (Key key)
+    {
+        if (testBit(removed_, key)) return;
+        setBit(&removed_, key);
+        ++tombstones_;
+    }
+
+    /// Whether key was removed.
+    bool removed (Key key) const
+    {
+        return tombstones_ != 0 && testBit(removed_, key);
+    }
+
+    /// Number of removed keys still in the tables.
+    unsigned tombstones () const
+    {
+        return tombstones_;
+    }
+
+    /// Number of updated keys with stale entries in the tables.
+    unsigned stale () const
+    {
+        return moved_.size();
+    }
+
+    /// Whether a compaction would change the tables.
+    bool pending () const
+    {
+        return tombstones_ != 0 || !moved_.empty();
+    }
+
+    /// A compaction pass.
+    /**
+      * A pass holds a snapshot of the frozen tables and of the removed and
+      * updated keys.  run() writes new frozen tables without the removed
+      * keys and the stale entries, reading only the snapshot, so it can
+      * run in a background thread while the index is queried and even
+      * modified.  The new tables are then put in place by install().  The
+      * keys added to the index while a pass exists are journaled, to be
+      * added again to the new tables.
+      */
+    class Compaction
+    {
+        friend class LshIndex;
+        std::vector<FrozenTable> tables_;
+        std::vector<unsigned> bins_;            // H of each table
+        std::vector<uint64_t> removed_;
+        std::vector<uint64_t> updated_;
+        std::unordered_map<Key, std::vector<unsigned> > moved_;
+        std::shared_ptr<Journal> journal_;
+        std::size_t start_;                     // # keys journaled before
+        unsigned serial_;                       // journal_->passes then
+        bool done_;
+
+        void compactTable (unsigned i)
+        {
+            const FrozenTable &old = tables_[i];
+            unsigned H = bins_[i];
+            std::shared_ptr<FrozenArrays> storage = std::make_shared<FrozenArrays>();
+            FrozenArrays &table = *storage;
+            table.offsets.resize(H + 1);
+            table.keys.reserve(old.offsets[H]);
+            for (unsigned h = 0; h < H; ++h) {
+                unsigned begin = table.keys.size();
+                table.offsets[h] = begin;
+                for (unsigned j = old.offsets[h]; j < old.offsets[h + 1]; ++j) {
+                    Key key = old.keys[j];
+                    if (testBit(removed_, key)) continue;
+                    if (testBit(updated_, key)) {
+                        // Keep one entry, in the new bin only.
+                        if (moved_.find(key)->second[i] != h) continue;
+                        if (std::find(table.keys.begin() + begin, table.keys.end(), key) != table.keys.end()) continue;
+                    }
+                    table.keys.push_back(key);
+                }
+            }
+            table.offsets[H] = table.keys.size();
+            attach(&tables_[i], storage);
+        }
+
+    public:
+        Compaction (): start_(0), serial_(0), done_(false) {}
+
+        /// Compact the tables of the snapshot.
+        /**
+          * @param threads number of threads, 0 for all the cores.
+          */
+        void run (unsigned threads = 0)
+        {
+            if (done_) return;
+            if (threads == 0) threads = defaultThreads();
+            unsigned L = tables_.size();
+            if (threads > L) threads = std::max(L, 1u);
+            parallelRun(threads, [&](unsigned t) {
+                unsigned end = partBegin(L, threads, t + 1);
+                for (unsigned i = partBegin(L, threads, t); i < end; ++i) {
+                    compactTable(i);
+                }
+            });
+            done_ = true;
+        }
+
+        /// Whether run() has finished.
+        bool done () const
+        {
+            return done_;
+        }
+    };
+
+    /// Start a compaction pass.
+    /**
+      * @param threads number of threads to freeze the index, 0 for all the
+      * cores.
+      *
+      * A thawed index is frozen and the overflow flushed first, so that
+      * the snapshot only copies the removed and updated keys and shares
+      * the frozen tables.
+      */
+    Compaction compaction (unsigned threads = 0)
+    {
+        freeze(threads);
+        Compaction c;
+        c.tables_ = frozenTables_;
+        c.bins_.resize(lshs_.size());
         for (unsigned i = 0; i < lshs_.size(); ++i) {
-            unsigned index = lshs_[i](value);
-            tables_[i][index].push_back(key);
+            c.bins_[i] = lshs_[i].getRange();
+        }
+        c.removed_ = removed_;
+        c.updated_ = updated_;
+        c.moved_ = moved_;
+        c.journal_ = journal_.ptr.lock();
+        if (!c.journal_) {
+            c.journal_ = std::make_shared<Journal>();
+            journal_.ptr = c.journal_;
+        }
+        c.start_ = c.journal_->keys.size();
+        c.serial_ = ++c.journal_->passes;
+        return c;
+    }
+
+    /// Put the tables of a finished compaction pass in place.
+    /**
+      * The keys added since the snapshot are added again to the new
+      * tables, through the overflow (see frozen), and those removed or
+      * updated since keep their tombstones or stale entries.  This takes
+      * time linear in the number of bins and in the number of keys added
+      * since the snapshot.  Nothing is done if a pass started later was
+      * installed first, as its tables are more compact, or if the index
+      * was copied, initialized, loaded or mapped since the snapshot.
+      *
+      * @return whether the tables were replaced.
+      */
+    bool install (Compaction &c)
+    {
+        BOOST_VERIFY(c.done_);
+        if (!c.journal_ || c.journal_ != journal_.ptr.lock()) return false;
+        Journal &journal = *c.journal_;
+        if (c.serial_ < journal.installed) return false;
+        journal.installed = c.serial_;
+        unsigned L = lshs_.size();
+        std::size_t n = journal.keys.size() - c.start_;
+        const Key *keys = n ? &journal.keys[c.start_] : 0;
+        const unsigned *bins = n ? &journal.bins[c.start_ * L] : 0;
+        const uint8_t *updates = n ? &journal.updates[c.start_] : 0;
+        // The keys removed before the snapshot are gone, unless they
+        // were added again and removed since.
+        std::vector<uint64_t> added;
+        for (std::size_t j = 0; j < n; ++j) {
+            setBit(&added, keys[j]);
+        }
+        for (std::size_t w = 0; w < c.removed_.size() && w < removed_.size(); ++w) {
+            uint64_t gone = removed_[w] & c.removed_[w];
+            if (w < added.size()) gone &= ~added[w];
+            tombstones_ -= __builtin_popcountll(gone);
+            removed_[w] &= ~gone;
         }
+        // The stale entries of the keys updated before the snapshot are
+        // gone; those updated since have their old entries in the new
+        // tables.
+        std::vector<uint64_t> updated;
+        std::unordered_map<Key, std::vector<unsigned> > moved;
+        for (std::size_t j = 0; j < n; ++j) {
+            if (!updates[j]) continue;
+            setBit(&updated, keys[j]);
+            moved[keys[j]].assign(bins + j * L, bins + (j + 1) * L);
+        }
+        updated_.swap(updated);
+        moved_.swap(moved);
+        for (unsigned i = 0; i < tables_.size(); ++i) {
+            std::vector<Bin>().swap(tables_[i]);
+        }
+        frozenTables_.swap(c.tables_);
+        frozen_ = true;
+        overflow_.clear();
+        overflowSize_ = 0;
+        c.tables_.clear();
+        c.done_ = false;
+        std::shared_ptr<Journal> mine;
+        mine.swap(c.journal_);
+        if (n != 0) extend(keys, bins, n, 0);
+        return true;
+    }
+
+    /// Compact the tables now.
+    void compact (unsigned threads = 0)
+    {
+        Compaction c = compaction(threads);
+        c.run(threads);
+        install(c);
+    }
+
+    /// Compact the tables in a background thread.
+    /**
+      * @param threads number of threads of the pass.
+      *
+      * \code
+      * std::future<Index::Compaction> pass = index.compactAsync();
+      * // ... queries ...
+      * Index::Compaction c = pass.get();
+      * index.install(c);
+      * \endcode
+      */
+    std::future<Compaction> compactAsync (unsigned threads = 1)
+    {
+        Compaction c = compaction();
+        return std::async(std::launch::async, [threads](Compaction c) {
+            c.run(threads);
+            return c;
+        }, std::move(c));
+    }
+
+    /// Insert the items [0, N) in bulk.
+    /**
+      * @param accessor accessor(key) returns the value of key.  It is called
+      * from several threads at the same time.
+      * @param N number of items, the keys being 0, ..., N - 1.
+      * @param threads number of threads, 0 for all the cores.
+      *
+      * The hash values of all the items are computed in parallel first, and
+      * then the tables are filled by fill().  This takes N x L unsigned
+      * integers of temporary memory.  The index is frozen afterwards.
+      */
+    template <typename ACCESSOR>
+    void build (ACCESSOR &accessor, unsigned N, unsigned threads = 0)
+    {
+        if (threads == 0) threads = defaultThreads();
+        unsigned L = lshs_.size();
+        std::vector<unsigned> buckets(std::size_t(L) * N);
+        parallelRun(threads, [&](unsigned t) {
+            unsigned end = partBegin(N, threads, t + 1);
+            for (unsigned j = partBegin(N, threads, t); j < end; ++j) {
+                Domain value = accessor(j);
+                for (unsigned i = 0; i < L; ++i) {
+                    buckets[std::size_t(i) * N + j] = lshs_[i](value);
+                }
+            }
+        });
+        fill(&buckets[0], N, threads);
     }
 
     /// Query for K-NNs.
@@ -174,12 +1285,59 @@ public:
     template <typename SCANNER>
     void query (Domain obj, SCANNER &scanner) const
     {
-        for (unsigned i = 0; i < lshs_.size(); ++i) {
-            unsigned index = lshs_[i](obj);
-            BOOST_FOREACH(Key key, tables_[i][index]) {
-                scanner(key);
+        query(obj, scanner, threadContext());
+    }
+
+    /// Scratch memory of the queries.
+    /**
+      * Holds the bins of the query, which are all hashed before the first
+      * one is scanned so that their offsets are fetched together.  A context
+      * is used by one query at a time; the queries given no context use one
+      * private to the calling thread.
+      */
+    class QueryContext
+    {
+        friend class LshIndex;
+        std::vector<unsigned> bins_;
+    };
+
+    /// Query for K-NNs with the given context.
+    template <typename SCANNER>
+    void query (Domain obj, SCANNER &scanner, QueryContext &ctx) const
+    {
+        unsigned L = lshs_.size();
+        ctx.bins_.resize(L);
+        for (unsigned i = 0; i < L; ++i) {
+            ctx.bins_[i] = lshs_[i](obj);
+            if (frozen_) {
+                __builtin_prefetch(frozenTables_[i].offsets + ctx.bins_[i], 0, 0);
             }
         }
+        for (unsigned i = 0; i < L; ++i) {
+            visitBin(i, ctx.bins_[i], [this, &scanner](BinRange keys) {
+                BOOST_FOREACH(Key key, keys) {
+                    if (removed(key)) continue;
+                    scanner(key);
+                }
+            });
+        }
+    }
+
+private:
+    static QueryContext &threadContext ()
+    {
+        static thread_local QueryContext ctx;
+        return ctx;
+    }
+
+    void add (Key key, Domain value, bool update)
+    {
+        std::vector<unsigned> bins(lshs_.size());
+        for (unsigned i = 0; i < lshs_.size(); ++i) {
+            bins[i] = lshs_[i](value);
+        }
+        track(key, &bins[0], update);
+        extend(&key, &bins[0], 1, 0);
     }
 };
 
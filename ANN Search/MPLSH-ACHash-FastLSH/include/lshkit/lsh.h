@@ -74,6 +74,75 @@ public:
     }
 };
 
+/// b + a . x over the N sampled dimensions dims, fully unrolled.
+/**
+ * The terms are added in the same order as the loop in sampledDot, so the
+ * results are the same.
+ */
+template <unsigned N>
+struct SampledDot
+{
+    static float apply (float ret, const float *a, const unsigned *dims, unsigned, const float *x)
+    {
+        return SampledDot<N - 1>::apply(ret + a[0] * x[dims[0]], a + 1, dims + 1, 0, x);
+    }
+};
+
+template <>
+struct SampledDot<0>
+{
+    static float apply (float ret, const float *, const unsigned *, unsigned, const float *)
+    {
+        return ret;
+    }
+};
+
+/// b + a . x over the n sampled dimensions dims.
+static inline float sampledDot (float ret, const float *a, const unsigned *dims, unsigned n, const float *x)
+{
+    for (unsigned i = 0; i < n; ++i) {
+        ret += a[i] * x[dims[i]];
+    }
+    return ret;
+}
+
+/// b + a . x over the first n dimensions (dims is not used).
+static inline float denseDot (float ret, const float *a, const unsigned *, unsigned n, const float *x)
+{
+    for (unsigned i = 0; i < n; ++i) {
+        ret += a[i] * x[i];
+    }
+    return ret;
+}
+
+typedef float (*SampledDotFunc) (float, const float *, const unsigned *, unsigned, const float *);
+
+/// The unrolled kernel for n sampled dimensions if there's one, or sampledDot.
+static inline SampledDotFunc selectSampledDot (unsigned n)
+{
+    switch (n) {
+        case 16: return &SampledDot<16>::apply;
+        case 30: return &SampledDot<30>::apply;
+        case 32: return &SampledDot<32>::apply;
+        case 64: return &SampledDot<64>::apply;
+        case 128: return &SampledDot<128>::apply;
+        default: return &sampledDot;
+    }
+}
+
+/// Variants of StableDistLsh.
+enum LshFamily {
+    /// All the dimensions are used.
+    FAMILY_MPLSH = 0,
+    /// A random sample of the dimensions is used.
+    FAMILY_FASTLSH = 1,
+    /// A random sample of the Hadamard transform of the point is used.
+    FAMILY_ACHASH = 2
+};
+
+template <typename DIST, unsigned SUBDIM = 0>
+class StableDistLsh;
+
 /// Stable distribution based LSH.
 /**
  * This LSH is defined on the D-dimensional vector space.  For a vector X, the
@@ -90,6 +159,8 @@ public:
  *      struct Parameter {
  *          unsigned dim;
  *          float W;
+ *          unsigned family;    // LshFamily, FAMILY_FASTLSH by default.
+ *          unsigned subdim;    // # dimensions sampled, 0 for the default.
  *      };
  * \endcode
  * The range of this LSH is 0.
@@ -101,6 +172,19 @@ public:
  * \endcode
  * Cauchy distribution is 1-stable and Gaussian distribution is 2-stable.  These
  * two LSHes can be used to approximate L1 and L2 distances respectively.
+ *
+ * The family decides which dimensions are used:
+ *   - FAMILY_MPLSH: all the D dimensions, as above.
+ *   - FAMILY_FASTLSH: a random sample of subdim dimensions (FASTLSH_SUBDIM by
+ *     default).
+ *   - FAMILY_ACHASH: a random sample of subdim (D/4 by default) dimensions,
+ *     with a ~ DIST(0, log(D/0.01)/D).  The function is to be applied to the
+ *     Hadamard transform of the point (see fwht.h), which MultiProbeLshIndex
+ *     does internally.
+ *
+ * subdim is known at runtime only, so the matching unrolled SampledDot kernel
+ * is selected whenever the function is reset or loaded.  StableDistLsh<DIST,
+ * SUBDIM> with SUBDIM > 0 fixes the number of samples at compile time.
  * 
  * For more information on stable distribution based LSH, see the following reference.
  *
@@ -110,7 +194,7 @@ public:
  *     08-11, 2004, Brooklyn, New York, USA.
 */
 template <typename DIST>
-class StableDistLsh
+class StableDistLsh<DIST, 0>
 {
     std::vector<float> a_;
     float b_;
@@ -118,8 +202,17 @@ class StableDistLsh
     unsigned dim_;
     std::vector<unsigned> dimension;
     unsigned subdim;
-    float delta = 0.01;
+    unsigned family_;
+    SampledDotFunc dot_;
+
+    void selectDot ()
+    {
+        dot_ = family_ == FAMILY_MPLSH ? &denseDot : selectSampledDot(subdim);
+    }
 public:
+    /// Number of dimensions sampled by FastLSH (the same as in E2LSH and ACE).
+    static const unsigned FASTLSH_SUBDIM = 30;
+
     /**
      * Parameter to StableDistLsh.
      */
@@ -129,6 +222,10 @@ public:
         unsigned dim;   
         /// Window size.
         float W;
+        /// LshFamily.
+        unsigned family = FAMILY_FASTLSH;
+        /// Number of dimensions sampled, 0 for the default of the family.
+        unsigned subdim = 0;
     };
 
     typedef const float *Domain;
@@ -143,38 +240,39 @@ public:
         a_.resize(param.dim);
         W_ = param.W;
         dim_ = param.dim;
+        family_ = param.family;
+
+        float sigma = 1.0;
+        switch (family_) {
+            case FAMILY_MPLSH:
+                subdim = dim_;
+                break;
+            case FAMILY_FASTLSH:
+                subdim = param.subdim ? param.subdim : FASTLSH_SUBDIM;
+                break;
+            case FAMILY_ACHASH:
+                subdim = param.subdim ? param.subdim : unsigned(std::ceil(0.25 * dim_));
+                sigma = std::log(dim_ / 0.01) / dim_;
+                break;
+            default:
+                throw std::logic_error("UNKNOWN LSH FAMILY");
+        }
+        subdim = min(dim_, subdim);
 
-        //******* generate hash function for MPLSH and FastLSH
-
-        boost::variate_generator<RNG &, DIST> gen(rng, DIST());
+        boost::variate_generator<RNG &, DIST> gen(rng, DIST(0, sigma));
 
         for (unsigned i = 0; i < dim_; ++i) a_[i] = gen();
         rng.seed(std::random_device()());
         b_ = boost::variate_generator<RNG &, Uniform>(rng, Uniform(0,W_))();
 
-        //***** used to select dimensions for FastLSH
-
-	    dimension.resize(param.dim);
+        dimension.resize(param.dim);
         for(size_t k=0;k<dim_;k++){
             dimension.at(k)=k;
         }
-        std::random_shuffle(dimension.begin(),dimension.end());
-
-        //********* generate hash function for ACHash
-
-        // subdim = ceil(0.25 * dim_);
-        // float sigma = log(dim_ / delta) / dim_;
-
-        // boost::variate_generator<RNG &, DIST> gen(rng, DIST(0, sigma));
-
-        // for (unsigned i = 0; i < dim_; ++i) a_[i] = gen(); 
-        // rng.seed(std::random_device()());
-        // b_ = boost::variate_generator<RNG &, Uniform>(rng, Uniform(0,W_))();
-	    // dimension.resize(param.dim);
-        // for(size_t k=0;k<dim_;k++){
-        //     dimension.at(k)=k;
-        // }
-        // std::random_shuffle(dimension.begin(),dimension.end());
+        if (family_ != FAMILY_MPLSH) {
+            std::random_shuffle(dimension.begin(),dimension.end());
+        }
+        selectDot();
     }
 
     template <typename RNG>
@@ -189,38 +287,84 @@ public:
         return 0;
     }
 
-  unsigned operator () (Domain obj) const
+    /// Window size.
+    float getW () const
     {
-        float ret = b_;
+        return W_;
+    }
 
-        //******* MPLSH 
-        // for (unsigned i = 0; i < dim_; ++i)
-        // {
-        //     ret += a_[i] * obj[i];
-        // }
+    /// Offset b.
+    float getB () const
+    {
+        return b_;
+    }
 
-        //******* FastLSH and ACHash
-        for (unsigned i = 0; i < subdim; ++i){
-            ret += a_[i] * obj[dimension[i]];
-        }
-        return unsigned(int(std::floor(ret / W_)));
+    /// LshFamily.
+    unsigned getFamily () const
+    {
+        return family_;
     }
 
+    /// Dimension of the domain.
+    unsigned getDim () const
+    {
+        return dim_;
+    }
 
-    unsigned operator () (Domain obj, float *delta) const
+    /// Number of dimensions sampled.
+    unsigned getSubDim () const
     {
-        float ret = b_;
+        return subdim;
+    }
+
+    /// The getSubDim() dimensions sampled.
+    const unsigned *getSample () const
+    {
+        return &dimension[0];
+    }
 
-        //******* MPLSH 
-        // for (unsigned i = 0; i < dim_; ++i)
-        // {
-        //     ret += a_[i] * obj[i];
-        // }
+    /// Coefficients of the sampled dimensions, in the order of getSample().
+    const float *getA () const
+    {
+        return &a_[0];
+    }
 
-        //******* FastLSH and ACHash
-        for (unsigned i = 0; i < subdim; ++i){
-            ret += a_[i] * obj[dimension[i]];
+    /// Sample the n dimensions dims instead of the randomly chosen ones.
+    /**
+      * The coefficients already drawn are kept.  This is used to make
+      * several functions share the same sample.
+      */
+    void setSample (const unsigned *dims, unsigned n)
+    {
+        BOOST_VERIFY(n <= dim_);
+        std::copy(dims, dims + n, dimension.begin());
+        subdim = n;
+        selectDot();
+    }
+
+    /// Write the coefficients as a dense vector of dim values.
+    /**
+      * The dimensions not sampled get zero coefficients, so that
+      * h(X) = floor((b + row . X) / W).  This is the form used by
+      * ProjectionBlock.
+      */
+    void expand (float *row) const
+    {
+        std::fill(row, row + dim_, 0.0F);
+        for (unsigned i = 0; i < subdim; ++i) {
+            row[dimension[i]] = a_[i];
         }
+    }
+
+    unsigned operator () (Domain obj) const
+    {
+        float ret = dot_(b_, &a_[0], &dimension[0], subdim, obj);
+        return unsigned(int(std::floor(ret / W_)));
+    }
+
+    unsigned operator () (Domain obj, float *delta) const
+    {
+        float ret = dot_(b_, &a_[0], &dimension[0], subdim, obj);
         ret /= W_;
 
         float flr =  std::floor(ret);
@@ -235,15 +379,144 @@ public:
         ar & b_;
         ar & W_;
         ar & dim_;
+        ar & dimension;
+        ar & subdim;
+        ar & family_;
         assert(a_.size() == dim_);
+        selectDot();
     }
 
 };
 
+/// Stable distribution based LSH sampling SUBDIM dimensions.
+/**
+ * The same as StableDistLsh<DIST>, but the number of sampled dimensions is a
+ * compile time constant, so the coefficients are kept in fixed size arrays
+ * and the hash is computed by the unrolled SampledDot<SUBDIM>.  The
+ * dimension of the domain should be at least SUBDIM.
+ */
+template <typename DIST, unsigned SUBDIM>
+class StableDistLsh
+{
+    float a_[SUBDIM];
+    unsigned dimension[SUBDIM];
+    float b_;
+    float W_;
+    unsigned dim_;
+public:
+    struct Parameter
+    {
+        /// Dimension of domain.
+        unsigned dim;   
+        /// Window size.
+        float W;
+    };
+
+    typedef const float *Domain;
+
+    StableDistLsh ()
+    {
+    }
+
+    template <typename RNG>
+    void reset(const Parameter &param, RNG &rng)
+    {
+        if (param.dim < SUBDIM) throw std::logic_error("DIMENSION SMALLER THAN SUBDIM");
+        W_ = param.W;
+        dim_ = param.dim;
+
+        boost::variate_generator<RNG &, DIST> gen(rng, DIST());
+
+        for (unsigned i = 0; i < SUBDIM; ++i) a_[i] = gen();
+        rng.seed(std::random_device()());
+        b_ = boost::variate_generator<RNG &, Uniform>(rng, Uniform(0,W_))();
+
+        std::vector<unsigned> perm(dim_);
+        for (unsigned k = 0; k < dim_; ++k) {
+            perm[k] = k;
+        }
+        std::random_shuffle(perm.begin(), perm.end());
+        std::copy(perm.begin(), perm.begin() + SUBDIM, dimension);
+    }
+
+    template <typename RNG>
+    StableDistLsh(const Parameter &param, RNG &rng)
+    {
+        reset(param, rng);
+    }
+
+    unsigned getRange () const
+    {
+        return 0;
+    }
+
+    float getW () const
+    {
+        return W_;
+    }
+
+    float getB () const
+    {
+        return b_;
+    }
+
+    unsigned getSubDim () const
+    {
+        return SUBDIM;
+    }
+
+    const unsigned *getSample () const
+    {
+        return dimension;
+    }
+
+    const float *getA () const
+    {
+        return a_;
+    }
+
+    void expand (float *row) const
+    {
+        std::fill(row, row + dim_, 0.0F);
+        for (unsigned i = 0; i < SUBDIM; ++i) {
+            row[dimension[i]] = a_[i];
+        }
+    }
+
+    unsigned operator () (Domain obj) const
+    {
+        float ret = SampledDot<SUBDIM>::apply(b_, a_, dimension, SUBDIM, obj);
+        return unsigned(int(std::floor(ret / W_)));
+    }
+
+    unsigned operator () (Domain obj, float *delta) const
+    {
+        float ret = SampledDot<SUBDIM>::apply(b_, a_, dimension, SUBDIM, obj);
+        ret /= W_;
+        float flr =  std::floor(ret);
+        *delta = ret - flr;
+        return unsigned(int(flr));
+    }
+
+    template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+        ar & b_;
+        ar & W_;
+        ar & dim_;
+        for (unsigned i = 0; i < SUBDIM; ++i) {
+            ar & a_[i];
+            ar & dimension[i];
+        }
+    }
+};
+
 /// LSH for L1 distance.
 typedef StableDistLsh<Cauchy> CauchyLsh;
 /// LSH for L2 distance.
 typedef StableDistLsh<Gaussian> GaussianLsh;
+/// FastLSH for L2 distance, with the default number of sampled dimensions.
+typedef StableDistLsh<Gaussian, GaussianLsh::FASTLSH_SUBDIM> FastGaussianLsh;
 
 /// Random hyperplane based LSH for cosine similarity.
 /**
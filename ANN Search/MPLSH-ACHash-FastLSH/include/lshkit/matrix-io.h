@@ -28,14 +28,17 @@
 #include<iostream>
 #include <lshkit/common.h>
 #include <cassert>
+#include <cstring>
 #include <fstream>
-
-#ifdef MATRIX_MMAP
+#include <stdexcept>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+
+#ifdef MATRIX_MMAP
 #include <errno.h>
 #endif
 
@@ -44,7 +47,7 @@ using namespace std;
 namespace lshkit{
 
 template <typename T>
-void Matrix<T>::peek (const std::string &path, int *elem_size, int *size, int *dim)
+void Matrix<T>::peek (const std::string &path, int *elem_size, std::size_t *size, std::size_t *dim)
 {
     unsigned header[3]; /* entry size, row, col */
     assert(sizeof header == 3*4);
@@ -80,13 +83,13 @@ void Matrix<T>::loadFvecs (std::istream &is)
 {
     
     uint32_t dim_;
-    unsigned N_;
+    size_t N_;
     is.read((char *) &dim_, sizeof(uint32_t));
     is.seekg(0,std::ios::end);
     std::ios::pos_type ss = is.tellg();
     size_t fsize = (size_t) ss;
     dim = dim_;
-    N_ = (unsigned)(fsize / (dim + 1) / sizeof(uint32_t));
+    N_ = fsize / (dim + 1) / sizeof(uint32_t);
     reset(dim_, N_);
     is.clear();
 	is.seekg(0, ios::beg);
@@ -108,22 +111,21 @@ void Matrix<T>::loadFvecsTwo (std::istream &is,std::istream &is2)
     
        //is
     uint32_t dim_;
-    unsigned N_;
+    size_t N_;
     is.read((char *) &dim_, sizeof(uint32_t));
     is.seekg(0,std::ios::end);
     std::ios::pos_type ss = is.tellg();
     size_t fsize = (size_t) ss;
     dim = dim_;
-    N_ = (unsigned)(fsize / (dim + 1) / sizeof(uint32_t));
-    printf("%d\n", N_);
+    N_ = fsize / (dim + 1) / sizeof(uint32_t);
     uint32_t dim2_;
-    unsigned N2_;
+    size_t N2_;
     is2.read((char *) &dim2_, sizeof(uint32_t));
     is2.seekg(0,std::ios::end);
     std::ios::pos_type ss2 = is2.tellg();
     size_t fsize2 = (size_t) ss2;
     dim = dim2_;
-    N2_ = (unsigned)(fsize2 / (dim + 1) / sizeof(uint32_t));
+    N2_ = fsize2 / (dim + 1) / sizeof(uint32_t);
     reset(dim_, N_+N2_);
     is2.clear();
 	is2.seekg(0, ios::beg);
@@ -160,8 +162,15 @@ void Matrix<T>::save (std::ostream &os)
     header[2] = dim;
     os.write((char *)header, sizeof header);
     BOOST_VERIFY(os);
-    size_t sz = sizeof(T) * dim * N;
-    os.write((char *)dims, sz);
+    if (stride == dim) {
+        size_t sz = sizeof(T) * dim * N;
+        os.write((char *)dims, sz);
+    }
+    else {
+        for (size_t i = 0; i < N; ++i) {
+            os.write((const char *)operator[](i), sizeof(T) * dim);
+        }
+    }
     BOOST_VERIFY(os);
 
 }
@@ -196,24 +205,78 @@ void Matrix<T>::save (const std::string &path)
     save(os);
 }
 
+template <class T>
+void Matrix<T>::mapVecs (const std::string &path, bool populate)
+{
+    static_assert(sizeof(uint32_t) % sizeof(T) == 0, "the dimension prefix has to be a whole number of elements");
+    release();
+    dim = N = stride = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("cannot stat " + path);
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return;
+    }
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (populate) flags |= MAP_POPULATE;
+#endif
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+    const char *base = (const char *)addr;
+
+    uint32_t first = 0, last = 0;
+    size_t rowBytes = 0;
+    if (size >= sizeof(first)) {
+        std::memcpy(&first, base, sizeof(first));
+        rowBytes = sizeof(first) + sizeof(T) * size_t(first);
+    }
+    if (first != 0 && size % rowBytes == 0) {
+        std::memcpy(&last, base + size - rowBytes, sizeof(last));
+    }
+    if (first == 0 || last != first) {
+        munmap(addr, size);
+        throw std::runtime_error(path + " is not a vecs file of this type");
+    }
+    mapped = size;
+    dims = (T *)(base + sizeof(first));
+    dim = first;
+    stride = rowBytes / sizeof(T);
+    N = size / rowBytes;
+}
+
+template <class T>
+void Matrix<T>::unmapVecs ()
+{
+    munmap((char *)dims - sizeof(uint32_t), mapped);
+}
+
 #ifdef MATRIX_MMAP
 template <class T>
 void Matrix<T>::map (const std::string &path) {
 
-    if (dims != NULL) delete[] dims;
+    release();
 
-    int size = 0;
+    unsigned header[3]; /* entry size, row, col */
 
     fd = open(path.c_str(), O_RDONLY);
     BOOST_VERIFY(fd >= 0);
 
-    if (read(fd, &size, 4) != sizeof(size)) BOOST_VERIFY(0);
-    if (read(fd, &N, 4) != sizeof(N)) BOOST_VERIFY(0);
-    if (read(fd, &dim, 4) != sizeof(dim)) BOOST_VERIFY(0);
+    if (read(fd, header, sizeof header) != sizeof header) BOOST_VERIFY(0);
 
-    BOOST_VERIFY(size == sizeof(T));
+    BOOST_VERIFY(header[0] == sizeof(T));
+    N = header[1];
+    dim = stride = header[2];
 
-    size_t sz = sizeof(T) * size_t(dim) * size_t(N);
+    // The header is mapped too.
+    size_t sz = 3 * 4 + sizeof(T) * dim * N;
     
     char *start = (char *)mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
     if (start == MAP_FAILED) { BOOST_VERIFY(0); }
@@ -224,7 +287,7 @@ void Matrix<T>::map (const std::string &path) {
 template <class T>
 void Matrix<T>::unmap () {
     char *start = (char *)dims - 3 * 4;
-    if (munmap(start, sizeof(T) * size_t(dim) * size_t(N)) != 0) BOOST_VERIFY(0);
+    if (munmap(start, 3 * 4 + sizeof(T) * dim * N) != 0) BOOST_VERIFY(0);
     close(fd);
 
     dims = 0;
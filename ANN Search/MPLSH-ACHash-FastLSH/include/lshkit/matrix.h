@@ -19,8 +19,13 @@
     along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cstddef>
+#include <algorithm>
 #include <fstream>
 #include <boost/dynamic_bitset.hpp>
+#include <boost/assert.hpp>
+#include <lshkit/visited.h>
+#include <lshkit/memory.h>
 
 /**
  * \file matrix.h
@@ -41,6 +46,17 @@
  * size is SIZE * DIM * 4 bytes.
  *
  * Such binary files can be accessed using lshkit::Matrix<float>.
+ *
+ * Sizes and offsets are size_t, so a matrix can hold more than 2^31
+ * values.  The buffer comes from allocLarge, so a large dataset sits on
+ * huge pages and can be interleaved over the NUMA nodes (see memory.h).
+ *
+ * The fvecs, ivecs and bvecs files of the TEXMEX benchmarks prefix each
+ * vector with its 32-bit dimension.  Matrix::loadFvecs copies such a file
+ * into memory; Matrix::mapVecs maps it instead, and the rows are read in
+ * place with a stride of dim + 4 / sizeof(T) elements.  Mapping costs
+ * nothing however large the file is, the pages are read on demand and
+ * processes serving the same file share them.
  */
 
 namespace lshkit {
@@ -53,9 +69,22 @@ namespace lshkit {
 template <class T>
 class Matrix
 {
-    int dim, N;
+    std::size_t dim, N;
+    std::size_t stride; // elements from a row to the next
+    std::size_t bytes;  // of the buffer, 0 when it is not owned
+    std::size_t mapped; // bytes mapped by mapVecs
     T *dims;
 
+    void release ()
+    {
+        if (bytes != 0) freeLarge(dims, bytes);
+        if (mapped != 0) unmapVecs();
+        bytes = mapped = 0;
+        dims = NULL;
+    }
+
+    void unmapVecs ();
+
     void load (const char *);
     void save (const char *);
 
@@ -68,43 +97,57 @@ public:
      * @param dim Dimension of each feature vector.
      * @param N Number of feature vectors.
      */
-    void reset (int _dim, int _N)
+    void reset (std::size_t _dim, std::size_t _N)
     {
-        dim = _dim;
+        release();
+        dim = stride = _dim;
         N = _N;
-        if (dims != NULL) delete[] dims;
-        dims = new T[dim * N];
+        bytes = sizeof(T) * dim * N;
+        dims = static_cast<T *>(allocLarge(bytes));
     }
 
     /// Release memory.
     void free (void) {
         dim = N = 0;
-        if (dims != NULL) delete[] dims;
-        dims = NULL;
+        release();
     }
     
     /// Default constructor.
     /** Allocates an empty matrix.  Should invoke reset or load before using it.*/
-    Matrix () :dim(0), N(0), dims(NULL) {}
+    Matrix () :dim(0), N(0), stride(0), bytes(0), mapped(0), dims(NULL) {}
 
     /// Constructor, same as Matrix() followed immediately by reset().
-    Matrix (int _dim, int _N) : dims(NULL) { reset(_dim, _N); }
+    Matrix (std::size_t _dim, std::size_t _N) : bytes(0), mapped(0), dims(NULL) { reset(_dim, _N); }
+
+    /// Copy constructor.  The copy owns its rows, even of a mapped matrix.
+    Matrix (const Matrix &m): dim(0), N(0), stride(0), bytes(0), mapped(0), dims(NULL) { *this = m; }
+
+    /// Copy the rows of another matrix.
+    Matrix &operator = (const Matrix &m)
+    {
+        if (this == &m) return *this;
+        reset(m.dim, m.N);
+        for (std::size_t i = 0; i < N; ++i) {
+            std::copy(m[i], m[i] + dim, (*this)[i]);
+        }
+        return *this;
+    }
 
     /// Destructor.
-    ~Matrix () { if (dims != NULL) delete[] dims; }
+    ~Matrix () { release(); }
 
     /// Access the ith vector.
-    const T *operator [] (int i) const {
-        return dims + i * dim;
+    const T *operator [] (std::size_t i) const {
+        return dims + i * stride;
     }
 
     /// Access the ith vector.
-    T *operator [] (int i) {
-        return dims + i * dim;
+    T *operator [] (std::size_t i) {
+        return dims + i * stride;
     }
 
-    int getDim () const {return dim; }
-    int getSize () const {return N; }
+    std::size_t getDim () const {return dim; }
+    std::size_t getSize () const {return N; }
 
 
     /// Peek into a file to determine the size and dimension of the dataset.
@@ -116,7 +159,7 @@ public:
      *
      *  This function doesn't read the whole matrix into memory, so it is fast.
      */
-    static void peek (const std::string &path, int *elem_size, int *size, int *dim);
+    static void peek (const std::string &path, int *elem_size, std::size_t *size, std::size_t *dim);
 
     void load (const std::string &path);
     //new load-fvecs
@@ -132,38 +175,66 @@ public:
     void loadFvecsTwo(std::istream &is,std::istream &is2);
     void save (std::ostream &os);
 
+    /// Map an fvecs (T = float), ivecs (int) or bvecs (unsigned char) file.
+    /**
+     *  @param populate read the whole file now instead of on demand.
+     *
+     *  The mapping is private: the rows can be modified, the file is not.
+     *  Only the dimensions of the first and the last rows are checked.
+     *  Throws std::runtime_error if the file cannot be mapped or is not a
+     *  vecs file of T.
+     */
+    void mapVecs (const std::string &path, bool populate = false);
+
 #ifdef MATRIX_MMAP
     void map (const std::string &path);
     void unmap ();
 #endif
 
     /// Construct from a file.
-    Matrix (const std::string &path): dims(NULL) { loadFvecs(path); }
+    Matrix (const std::string &path): dim(0), N(0), stride(0), bytes(0), mapped(0), dims(NULL) { loadFvecs(path); }
 /// Construct from two file.
-    Matrix (const std::string &path,const std::string &path2): dims(NULL) { loadFvecsTwo(path,path2); }
+    Matrix (const std::string &path,const std::string &path2): dim(0), N(0), stride(0), bytes(0), mapped(0), dims(NULL) { loadFvecsTwo(path,path2); }
 
     /// An accessor class to be used with LSH index.
+    /**
+      * The marks are kept in a VisitedSet, so reset() takes constant time
+      * instead of clearing a flag per row.  The accessor does not own the
+      * set: by default reset() takes the set of the calling thread (see
+      * VisitedSet::local), so copies of the accessor, one per thread as
+      * in query_batch, cost a few words and share the memory of their
+      * thread.  A set can also be given to the constructor.  mark()
+      * asserts that no other query has reset the set since reset().
+      */
     class Accessor
     {
         const Matrix &matrix_;
-
-        boost::dynamic_bitset<> flags_;
+        VisitedSet *flags_;
+        bool local_;        // flags_ is the set of the thread
+        unsigned long query_id_;    // flags_->query() at reset()
     public:
         typedef unsigned Key;
-        typedef const float *Value;
+        typedef const T *Value;
 
         Accessor(const Matrix &matrix)
-            : matrix_(matrix), flags_(matrix.getSize()) {}
+            : matrix_(matrix), flags_(&VisitedSet::local(matrix.getSize())), local_(true), query_id_(flags_->query()) {}
+
+        /// Keep the marks in flags, which has room for the rows of matrix.
+        Accessor(const Matrix &matrix, VisitedSet &flags)
+            : matrix_(matrix), flags_(&flags), local_(false), query_id_(flags.query()) {
+            BOOST_VERIFY(flags.size() >= matrix.getSize());
+        }
 
         void reset () {
-            flags_.reset();
+            if (local_) flags_ = &VisitedSet::local(matrix_.getSize());
+            flags_->reset();
+            query_id_ = flags_->query();
         }
         bool mark (unsigned key) {
-            if (flags_[key]) return false;
-            flags_.set(key);
-            return true;
+            BOOST_ASSERT(flags_->query() == query_id_);
+            return flags_->mark(key);
         }
-        const float *operator () (unsigned key) {
+        const T *operator () (unsigned key) {
             return matrix_[key];
         }
     };
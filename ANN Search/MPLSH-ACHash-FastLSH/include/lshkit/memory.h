@@ -0,0 +1,104 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_MEMORY__
+#define __LSHKIT_MEMORY__
+
+/**
+ * \file memory.h
+ * \brief Allocation of large buffers on huge pages and NUMA nodes.
+ *
+ * A dataset of 100M 128-dimensional vectors takes 50GB.  Scanning the
+ * candidates of a query reads rows all over that buffer, so with 4KB pages
+ * nearly every row costs a TLB miss, and on a multi-socket machine the rows
+ * all live on the node that happened to load them.  allocLarge maps the
+ * buffers of 2MB or more directly, aligned to huge pages, and places them
+ * following the memory policy:
+ *
+ * - huge pages: "none", "thp" for transparent huge pages (the default,
+ *   requested with madvise), or "explicit" for the pages reserved in
+ *   /proc/sys/vm/nr_hugepages, falling back to transparent huge pages when
+ *   there are not enough of them;
+ * - NUMA: "default" for the placement of the kernel (first touch),
+ *   "interleave" to spread the pages over all the nodes, or "bind:N" to
+ *   put them on node N.
+ *
+ * The policy is read from the environment variables LSHKIT_HUGEPAGES and
+ * LSHKIT_NUMA, and can be changed with setMemoryPolicy.  It applies to the
+ * buffers allocated afterwards.  Smaller buffers come from the heap.
+ */
+
+#include <cstddef>
+#include <string>
+
+namespace lshkit {
+
+/// Use of huge pages.
+enum HugePages {
+    HUGEPAGES_NONE = 0,
+    HUGEPAGES_TRANSPARENT = 1,
+    HUGEPAGES_EXPLICIT = 2
+};
+
+/// Placement of the pages on the NUMA nodes.
+enum NumaPolicy {
+    NUMA_DEFAULT = 0,
+    NUMA_INTERLEAVE = 1,
+    NUMA_BIND = 2
+};
+
+/// Policy of allocLarge.
+struct MemoryPolicy
+{
+    HugePages hugePages;
+    NumaPolicy numa;
+    unsigned node;      ///< The node of NUMA_BIND.
+
+    MemoryPolicy (): hugePages(HUGEPAGES_TRANSPARENT), numa(NUMA_DEFAULT), node(0) {}
+};
+
+/// Parse "none", "thp" or "explicit", throw std::runtime_error otherwise.
+HugePages parseHugePages (const std::string &);
+
+/// Parse "default", "interleave" or "bind:N" into policy.
+void parseNuma (const std::string &, MemoryPolicy *policy);
+
+/// The current policy.
+MemoryPolicy memoryPolicy ();
+
+/// Set the policy of the following allocations.
+void setMemoryPolicy (const MemoryPolicy &);
+
+/// Buffers from this size on are mapped with the policy, 2MB.
+static const std::size_t LARGE_PAGE_SIZE = std::size_t(1) << 21;
+
+/// Allocate bytes, aligned to 64 bytes at least.
+/**
+  * Throws std::bad_alloc when out of memory, and std::runtime_error when
+  * the pages cannot be bound to the node of the policy.  The memory is not
+  * initialized and has to be released with freeLarge(p, bytes).
+  */
+void *allocLarge (std::size_t bytes);
+
+/// Release a buffer of allocLarge.
+void freeLarge (void *p, std::size_t bytes);
+
+}
+
+#endif
@@ -28,6 +28,10 @@
 // This file implements some common distance functions.
 
 #include <functional>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <lshkit/distance.h>
 
 namespace lshkit { namespace metric {
 
@@ -108,15 +112,48 @@ public:
     max (unsigned dim) : dim_(dim) {}
     float operator () (const T *first1, const T *first2) const
     {
-        double r = std::numeric_limits<T>::min();
+        double r = 0;
         for (unsigned i = 0; i < dim_; ++i)
         {
-            r += max(r, std::fabs(first1[i] - first2[i]));
+            r = std::max<double>(r, std::fabs(first1[i] - first2[i]));
         }
-        return (float)std::sqrt(r);
+        return (float)r;
     }
 };
 
+// The float distances use the SIMD kernels of distance.h.
+
+template <>
+inline float l1<float>::operator () (const float *first1, const float *first2) const
+{
+    return distanceKernels().l1(first1, first2, dim_);
+}
+
+template <>
+inline float l2<float>::operator () (const float *first1, const float *first2) const
+{
+    return std::sqrt(distanceKernels().l2sqr(first1, first2, dim_));
+}
+
+template <>
+inline float l2sqr<float>::operator () (const float *first1, const float *first2) const
+{
+    return distanceKernels().l2sqr(first1, first2, dim_);
+}
+
+template <>
+inline float max<float>::operator () (const float *first1, const float *first2) const
+{
+    return distanceKernels().max(first1, first2, dim_);
+}
+
+// Bytes are compared in integers, see l2sqrByteKernel.
+template <>
+inline float l2sqr<uint8_t>::operator () (const uint8_t *first1, const uint8_t *first2) const
+{
+    return l2sqrByteKernel()(first1, first2, dim_, std::numeric_limits<float>::max());
+}
+
 /// (Basic) hamming distance
 /** Take the hamming distance between two values of type T as bit-vectors.
  *  Normally you should use hamming instead of basic_hamming.
@@ -212,10 +212,26 @@ public:
     
     float lookup (float dist, int T) const
     {
-        unsigned d;
-        if (dist < min_) return 1.0;
-        if (!(dist < max_)) return 0.0;
-        d = std::floor((log(dist) - lmin_) * step_ / (lmax_ - lmin_) + 0.5);
+        return lookupColumn(column(dist), T);
+    }
+
+    /// The column of dist in the table, -1 below it and step above it.
+    /**
+      * It takes a logarithm, so a caller looking up the same distances
+      * for increasing T keeps their columns and uses lookupColumn.
+      */
+    int column (float dist) const
+    {
+        if (dist < min_) return -1;
+        if (!(dist < max_)) return step_;
+        unsigned d = std::floor((log(dist) - lmin_) * step_ / (lmax_ - lmin_) + 0.5);
+        return std::min(d, step_ - 1);
+    }
+
+    float lookupColumn (int d, int T) const
+    {
+        if (d < 0) return 1.0;
+        if (d >= int(step_)) return 0.0;
         return table_[T-1][d];
     }
 
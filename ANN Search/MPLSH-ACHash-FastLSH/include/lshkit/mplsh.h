@@ -73,6 +73,8 @@
   * param.H = H; // See H in the program parameters.  You can just use the default value.
   * param.M = M;
   * param.dim = DIMENSION_OF_THE_DATA
+  * param.family = FAMILY_FASTLSH; // or FAMILY_MPLSH, FAMILY_ACHASH.
+  * param.shared = 0; // 1 to make the M functions of a table sample the same dimensions.
   * DefaultRng rng; // random number generator.
   * 
   * index.init(param, rng, L);
@@ -80,6 +82,13 @@
   * for (each possible key, value pair) {
   *     index.insert(key, value);
   * }
+  *
+  * // Or better, insert the items in blocks so they can be hashed together.
+  * index.insert(keys, values, n);
+  *
+  * // Or, for keys 0 ... N - 1 with value accessor(key), build the index in
+  * // parallel on all the cores.
+  * index.build(accessor, N);
   * 
   * // You can now save the index for future use.
   * ofstream os(index_file.c_str(), std::ios::binary);
@@ -92,6 +101,24 @@
   * ifstream is(index_file.c_str(), std::ios::binary);
   * index.load(is);
   * \endcode
+  *
+  * index.saveImage(os) saves the index in a format which can be mapped into
+  * memory with index.map(index_file) instead.  The hash tables are then
+  * queried directly from the file, and mapping reads neither their keys
+  * nor their offsets.
+  *
+  * The points can also be vectors of bytes, such as the bvecs of SIFT1B:
+  * insert, build and the queries take const uint8_t * as well.  The bytes
+  * are converted to floats for hashing a batch at a time, so the data stays
+  * at one byte per value.  Scan them with metric::l2sqr<uint8_t>:
+  *
+  * \code
+  * Matrix<uint8_t> data;
+  * data.mapVecs("bigann_base.bvecs");
+  * Matrix<uint8_t>::Accessor accessor(data);
+  * index.build(accessor, data.getSize());
+  * TopkScanner<Matrix<uint8_t>::Accessor, metric::l2sqr<uint8_t> > scanner(accessor, metric::l2sqr<uint8_t>(dim), K);
+  * \endcode
   * 
   * \section mplsh-4 4. Query the MPLSH. 
   * 
@@ -100,15 +127,51 @@
   * float *query;
   * ...
   * index.query(query, T, scanner);   cnt is the number of points actually scanned.
-  * 
+  *
+  * // A thread can keep the scratch memory of its queries in a context.
+  * Index::QueryContext ctx;
+  * index.query(query, T, scanner, ctx);
+  *
+  * // Or, for Q queries, query them in parallel on all the cores.  Each
+  * // thread uses its own copy of scanner.
+  * std::vector<Topk<unsigned> > topks = index.query_batch(queries, Q, T, scanner);
+  *
+  * \endcode
+  *
+  * \section mplsh-5 5. Remove and update items.
+  *
+  * Removed keys get a tombstone which the queries honor, and updated keys
+  * leave stale entries in their old bins.  A compaction rewrites the tables
+  * without them; it can run in the background while the index is queried,
+  * and the items inserted meanwhile are added to the new tables when they
+  * are installed.
+  *
+  * \code
+  * index.remove(key);
+  * index.update(key, value);       // after accessor(key) returns value
+  *
+  * std::future<Index::Compaction> pass = index.compactAsync();
+  * ...
+  * Index::Compaction c = pass.get();
+  * index.install(c);               // or just index.compact()
   * \endcode
   *
+  * These modify the index, and cannot run at the same time as the queries.
+  * ConcurrentIndex (see concurrent.h) queues them and publishes them as
+  * snapshots of the index instead, so the index can be modified while it
+  * is queried.
+  *
   * See the source file lshkit/tools/mplsh-run.cpp for a full example of using MPLSH.
   *
   * For adaptive probing, I hard coded the sensitive range of KNN distance to
   * [0.0001W, 100W] and logarithmically quantized the range to 200 levels.
   * If you find that your KNN distances fall outside this range, or want more refined
   * quantization, you'll have to modify the code in lshkit::MultiProbeLshIndex::init().
+  * The probes of an adaptive query are generated as it goes (see
+  * MultiProbeLsh::ProbeGenerator), so its cost follows the number of probes
+  * it actually uses.  index.setQueryDirected(true) generates the probes
+  * from the scores of each query, as in the query-directed probing of the
+  * Multi-Probe LSH paper, instead of the template sequence.
   *
   * \section ref Reference
   *
@@ -134,6 +197,10 @@
 #include <lshkit/lsh-index.h>
 #include <lshkit/mplsh-model.h>
 #include <lshkit/topk.h>
+#include <lshkit/projection.h>
+#include <lshkit/sketch-filter.h>
+#include <fwht.h>
+#include <atomic>
 
 namespace lshkit
 {
@@ -203,9 +270,26 @@ public:
 extern ProbeSequenceTemplates __probeSequenceTemplates;
 
 /// Multi-Probe LSH class.
-class MultiProbeLsh: public RepeatHash<GaussianLsh> 
+class MultiProbeLsh: public RepeatHash<GaussianLsh>
 {
     unsigned H_;
+
+    // Sort the scores of the query.  Set up[i] to the change of the hash
+    // value when the i-th component of the order is shifted in its
+    // direction, and return the hash value of the query before the modulo.
+    unsigned sortScores (const unsigned *base, const float *delta, ProbeSequence &scores, unsigned *up) const;
+
+    // The bucket of the template probe p.
+    unsigned perturb (unsigned hash, const unsigned *up, const Probe &p) const
+    {
+        for (unsigned long long m = p.mask; m != 0; m &= m - 1) {
+            unsigned i = __builtin_ctzll(m);
+            if (p.shift & leftshift(i)) hash += up[i];
+            else hash -= up[i];
+        }
+        return hash % H_;
+    }
+
 public:
     typedef RepeatHash<GaussianLsh> Super;
     typedef Super::Domain Domain;
@@ -218,11 +302,19 @@ public:
      *   unsigned repeat; // the same as M in the paper
      *   unsigned dim;
      *   float W;
+     *   unsigned family; // MPLSH, FastLSH or ACHash, see StableDistLsh.
+     *   unsigned subdim;
      * \endcode
      */
     struct Parameter : public Super::Parameter {
 
         unsigned range;
+        /// If not 0, the M functions share the dimensions sampled.
+        /**
+          * The sampled coordinates of a point are then gathered once per
+          * table instead of once per function.
+          */
+        unsigned shared = 0;
 
         template<class Archive>
         void serialize(Archive & ar, const unsigned int version)
@@ -231,6 +323,9 @@ public:
             ar & repeat;
             ar & dim;
             ar & W;
+            ar & shared;
+            ar & family;
+            ar & subdim;
         }
     };
 
@@ -241,13 +336,17 @@ public:
     {
         H_ = param.range;
         Super::reset(param, rng);
+        if (param.shared) {
+            for (unsigned i = 1; i < lsh_.size(); ++i) {
+                lsh_[i].setSample(lsh_[0].getSample(), lsh_[0].getSubDim());
+            }
+        }
     }
 
     template <typename RNG>
     MultiProbeLsh(const Parameter &param, RNG &rng)
     {
-        H_ = param.range;
-        Super::reset(param, rng);
+        reset(param, rng);
     }
 
     unsigned getRange () const
@@ -267,7 +366,161 @@ public:
         ar & H_;
     }
 
+    /// Generate the probe sequence of a point.
+    /**
+      * The point is transformed first for FAMILY_ACHASH, so the probes
+      * are those of MultiProbeLshIndex.
+      */
     void genProbeSequence (Domain obj, std::vector<unsigned> &seq, unsigned T) const;
+
+    /// Generate the probe sequence from precomputed hash values.
+    /**
+      * @param base the values of the M component functions.
+      * @param delta the rounded off parts of the M component functions.
+      *
+      * base and delta are usually produced by ProjectionBlock::apply.
+      */
+    void genProbeSequence (const unsigned *base, const float *delta, std::vector<unsigned> &seq, unsigned T) const;
+
+    /// The same, with scores as scratch memory.
+    void genProbeSequence (const unsigned *base, const float *delta, std::vector<unsigned> &seq, unsigned T, ProbeSequence &scores) const;
+
+    /// Generates the probe sequence of a query one probe at a time.
+    /**
+      * reset() sorts the scores of the query, and each probe then costs a
+      * few operations per component it shifts, so a query which stops
+      * early does not pay for the probes it does not use.
+      *
+      * By default the probes are those of genProbeSequence, in the same
+      * order: the expected scores of the template sequence are mapped to
+      * the components in the order of their scores.  With directed, the
+      * perturbation sets are generated from the scores of the query
+      * instead, in increasing sum of the squared distances of the shifted
+      * components to their boundaries, with the heap of the query-directed
+      * probing of the Multi-Probe LSH paper.  This takes a few heap
+      * operations per probe and finds the buckets likely to hold the
+      * neighbors with fewer probes.
+      *
+      * \code
+      * MultiProbeLsh::ProbeGenerator gen;
+      * gen.reset(lsh, base, delta, scores);
+      * while (!gen.done() && ...) scan(gen.next());
+      * \endcode
+      */
+    class ProbeGenerator
+    {
+        // A set of shifted components of the sorted order, of the
+        // query-directed sequence.  last is the last one in the order;
+        // once and twice are the masks of the components shifted once,
+        // and in both directions, which makes the set invalid.
+        struct Shifts
+        {
+            float score;
+            unsigned hash;
+            unsigned last;
+            unsigned long long once;
+            unsigned long long twice;
+            bool operator < (const Shifts &s) const { return s.score < score; }
+        };
+
+        const MultiProbeLsh *lsh_;
+        const ProbeSequence *tmpl_;     // 0 for the query-directed sequence
+        unsigned hash_;
+        unsigned next_;
+        unsigned up_[Probe::MAX_M];
+        // The query-directed sequence: the squared scores of the sorted
+        // order, the changes of the hash value, the components, the heap
+        // of the sets and the hash value of the next probe.
+        float square_[2 * Probe::MAX_M];
+        unsigned move_[2 * Probe::MAX_M];
+        unsigned char comp_[2 * Probe::MAX_M];
+        unsigned size_;
+        std::vector<Shifts> heap_;
+        bool more_;
+
+        void advance ();
+
+    public:
+        ProbeGenerator (): lsh_(0), tmpl_(0), hash_(0), next_(0), size_(0), more_(false) {}
+
+        /// Start the sequence of a query, with scores as scratch memory.
+        void reset (const MultiProbeLsh &lsh, const unsigned *base, const float *delta, ProbeSequence &scores, bool directed = false);
+
+        /// Whether all the probes have been generated.
+        /** There are Probe::MAX_T probes, fewer for a very small M. */
+        bool done () const
+        {
+            if (tmpl_) return next_ >= tmpl_->size();
+            return !more_;
+        }
+
+        /// Number of probes generated.
+        unsigned size () const
+        {
+            return next_;
+        }
+
+        /// The bucket of the next probe.
+        unsigned next ()
+        {
+            if (tmpl_) return lsh_->perturb(hash_, up_, (*tmpl_)[next_++]);
+            unsigned bucket = hash_ % lsh_->H_;
+            ++next_;
+            advance();
+            return bucket;
+        }
+    };
+
+    /// The values of the M component functions.
+    void evaluate (Domain obj, unsigned *base, float *delta) const
+    {
+        for (unsigned i = 0; i < lsh_.size(); ++i) {
+            base[i] = lsh_[i](obj, &delta[i]);
+        }
+    }
+
+    /// Number of component functions (M).
+    unsigned getRepeat () const
+    {
+        return lsh_.size();
+    }
+
+    /// Copy the M component functions to functions [off, off + M) of block.
+    void exportProjections (ProjectionBlock *block, unsigned off) const
+    {
+        std::vector<float> row(block->getDim());
+        for (unsigned i = 0; i < lsh_.size(); ++i) {
+            lsh_[i].expand(&row[0]);
+            block->set(off + i, &row[0], lsh_[i].getB());
+        }
+    }
+
+    /// Copy the M component functions to block, on their shared sample.
+    /**
+      * Only valid if the LSH is created with Parameter::shared.  The block
+      * gathers the sampled dimensions and holds the dense M x subdim
+      * coefficients.
+      */
+    void exportSharedProjections (ProjectionBlock *block) const
+    {
+        const GaussianLsh &first = lsh_[0];
+        block->reset(first.getSubDim(), lsh_.size(), first.getW());
+        block->setGather(first.getSample());
+        for (unsigned i = 0; i < lsh_.size(); ++i) {
+            block->set(i, lsh_[i].getA(), lsh_[i].getB());
+        }
+    }
+
+    /// Hash value from the values of the M component functions.
+    unsigned combine (const unsigned *base) const
+    {
+        unsigned ret = 0;
+        for (unsigned i = 0; i < lsh_.size(); ++i)
+        {
+            ret += base[i] * a_[i];
+        }
+        return ret % H_;
+    }
 };
 
 
@@ -286,15 +539,322 @@ private:
 
     Parameter param_;
     MultiProbeLshRecallTable recall_;
+    std::vector<ProjectionBlock> proj_;
+    unsigned stride_;                   // # hash values of a point
+    std::vector<unsigned> offset_;      // where those of table i start
+    unsigned hadamard_;                 // size of the transform for ACHash, or 0
+    bool sorted_;                       // see setSortedScan
+    bool directed_;                     // see setQueryDirected
+    const SketchFilter<typename Super::Domain> *filter_;    // see setSketchFilter
+    unsigned filterDist_;
+
+    // The kernel depends on the family:
+    //  - MPLSH: all the M x L functions in one block, those of table i
+    //    being [i * M, (i + 1) * M).
+    //  - FastLSH and ACHash: the sampled dimensions of each function with
+    //    SampledDot, through MultiProbeLsh::evaluate.
+    //  - shared samples: one gathering block per table.
+    void initProjection ()
+    {
+        unsigned L = Super::lshs_.size();
+        unsigned M = param_.repeat;
+        offset_.resize(L);
+        hadamard_ = param_.family == FAMILY_ACHASH ? fwht::paddedSize(param_.dim) : 0;
+        if (param_.family != FAMILY_MPLSH && !param_.shared) {
+            proj_.clear();
+            for (unsigned i = 0; i < L; ++i) {
+                offset_[i] = i * M;
+            }
+            stride_ = L * M;
+        }
+        else if (param_.shared) {
+            proj_.resize(L);
+            for (unsigned i = 0; i < L; ++i) {
+                Super::lshs_[i].exportSharedProjections(&proj_[i]);
+                offset_[i] = i * proj_[0].getStride();
+            }
+            stride_ = L * proj_[0].getStride();
+        }
+        else {
+            proj_.resize(1);
+            proj_[0].reset(param_.dim, L * M, param_.W);
+            for (unsigned i = 0; i < L; ++i) {
+                Super::lshs_[i].exportProjections(&proj_[0], i * M);
+                offset_[i] = i * M;
+            }
+            stride_ = proj_[0].getStride();
+        }
+    }
+
+    void evaluate (const float *const *values, unsigned n, unsigned *hash, float *delta) const
+    {
+        if (proj_.empty()) {
+            for (unsigned j = 0; j < n; ++j) {
+                for (unsigned i = 0; i < Super::lshs_.size(); ++i) {
+                    unsigned off = j * stride_ + offset_[i];
+                    Super::lshs_[i].evaluate(values[j], hash + off, delta + off);
+                }
+            }
+            return;
+        }
+        for (unsigned i = 0; i < proj_.size(); ++i) {
+            proj_[i].apply(values, n, hash + offset_[i], delta + offset_[i], stride_);
+        }
+    }
+
+    // Values of all the component functions of n points, row stride stride_.
+    void project (const float *const *values, unsigned n, unsigned *hash, float *delta) const
+    {
+        if (hadamard_ == 0) {
+            evaluate(values, n, hash, delta);
+            return;
+        }
+        // ACHash functions are defined on the Hadamard transform.
+        static thread_local AlignedVector<float> buf;
+        static thread_local std::vector<const float *> rows;
+        buf.resize(std::size_t(n) * hadamard_);
+        rows.resize(n);
+        for (unsigned j = 0; j < n; ++j) {
+            fwht::pad(values[j], param_.dim, &buf[std::size_t(j) * hadamard_], hadamard_);
+            rows[j] = &buf[std::size_t(j) * hadamard_];
+        }
+        fwht::transformRows(&buf[0], n, hadamard_, hadamard_);
+        evaluate(&rows[0], n, hash, delta);
+    }
+
+    // The same for points of bytes, converted to floats.
+    void project (const uint8_t *const *values, unsigned n, unsigned *hash, float *delta) const
+    {
+        static thread_local AlignedVector<float> buf;
+        static thread_local std::vector<const float *> rows;
+        buf.resize(std::size_t(n) * param_.dim);
+        rows.resize(n);
+        for (unsigned j = 0; j < n; ++j) {
+            float *row = &buf[std::size_t(j) * param_.dim];
+            std::copy(values[j], values[j] + param_.dim, row);
+            rows[j] = row;
+        }
+        project(&rows[0], n, hash, delta);
+    }
+
+    void gather (unsigned i, unsigned h, std::vector<KEY> *candidates) const
+    {
+        Super::visitBin(i, h, [candidates](typename Super::BinRange keys) {
+            candidates->insert(candidates->end(), keys.first, keys.second);
+        });
+    }
 
 public: 
+    /// Number of points hashed together by the batched insert.
+    static const unsigned INSERT_BATCH = 64;
+
     typedef typename Super::Domain Domain;
     typedef KEY Key;
 
+    /// Scratch memory of the queries.
+    /**
+      * A query needs a few buffers: the hash values of the query, the probe
+      * generators, the candidates of the sorted scan, the sketch of the
+      * query for the sketch filter, the float values of a query of bytes
+      * and the K-NNs of the recall estimate.  The context keeps them between
+      * queries, so that a thread running many queries with the same context
+      * allocates nothing after the first ones.  A context is used by one
+      * thread at a time.  The queries given no context use one private to
+      * the calling thread.
+      */
+    class QueryContext
+    {
+        friend class MultiProbeLshIndex;
+        std::vector<unsigned> hash_;
+        std::vector<float> delta_;
+        ProbeSequence scores_;
+        std::vector<MultiProbeLsh::ProbeGenerator> gens_;
+        std::vector<Key> candidates_;
+        std::vector<uint64_t> sketch_;
+        std::vector<Key> passed_;
+        std::vector<float> point_;
+        std::vector<float> knn_;        // distances of the last estimate
+        std::vector<int> columns_;      // their columns in the recall table
+        std::vector<float> nextKnn_;
+        std::vector<int> nextColumns_;
+    };
+
+private:
+    static QueryContext &threadContext ()
+    {
+        static thread_local QueryContext ctx;
+        return ctx;
+    }
+
+    // Hash the query and start the probe sequences of the L tables in
+    // ctx.gens_.
+    void probe (Domain obj, QueryContext &ctx) const
+    {
+        unsigned L = Super::lshs_.size();
+        ctx.hash_.resize(stride_);
+        ctx.delta_.resize(stride_);
+        project(&obj, 1, &ctx.hash_[0], &ctx.delta_[0]);
+        if (ctx.gens_.size() < L) ctx.gens_.resize(L);
+        for (unsigned i = 0; i < L; ++i) {
+            ctx.gens_[i].reset(Super::lshs_[i], &ctx.hash_[offset_[i]], &ctx.delta_[offset_[i]], ctx.scores_, directed_);
+        }
+        if (filter_) {
+            ctx.sketch_.resize(filter_->words());
+            filter_->apply(obj, &ctx.sketch_[0]);
+        }
+    }
+
+    // The same for a query of bytes, converted to floats.
+    void probe (const uint8_t *obj, QueryContext &ctx) const
+    {
+        ctx.point_.resize(param_.dim);
+        std::copy(obj, obj + param_.dim, ctx.point_.begin());
+        probe(&ctx.point_[0], ctx);
+    }
+
+    // The recall estimated from the K-NNs of topk after T probes.  topk
+    // is left in heap order: its distances are sorted in a copy.  The
+    // columns of the recall table are kept between the calls of a query,
+    // and only those of the distances not in the K-NNs of the previous
+    // call are computed.  ctx.knn_ is cleared when the query starts.
+    float estimate (const Topk<Key> &topk, unsigned T, QueryContext &ctx) const
+    {
+        unsigned K = topk.size();
+        const std::vector<float> &prev = ctx.knn_;
+        ctx.nextKnn_.resize(K);
+        ctx.nextColumns_.resize(K);
+        for (unsigned k = 0; k < K; ++k) {
+            ctx.nextKnn_[k] = topk[k].dist;
+        }
+        std::sort(ctx.nextKnn_.begin(), ctx.nextKnn_.end());
+        float r = 0.0;
+        unsigned p = 0;
+        for (unsigned k = 0; k < K; ++k) {
+            // Both are sorted, and the K-NNs only lose their farthest
+            // entries and gain nearer ones between two calls.
+            float d = ctx.nextKnn_[k];
+            while (p < prev.size() && prev[p] < d) ++p;
+            int c;
+            if (p < prev.size() && prev[p] == d) c = ctx.columns_[p++];
+            else c = recall_.column(std::sqrt(d) / param_.W);
+            ctx.nextColumns_[k] = c;
+            r += recall_.lookupColumn(c, T);
+        }
+        ctx.knn_.swap(ctx.nextKnn_);
+        ctx.columns_.swap(ctx.nextColumns_);
+        return r / K;
+    }
+
+    // Sort and deduplicate the candidates, drop the removed ones and those
+    // rejected by the sketch filter and score the others in one call.
+    template <typename SCANNER>
+    void scanSorted (std::vector<KEY> *candidates, SCANNER &scanner, QueryContext &ctx) const
+    {
+        std::sort(candidates->begin(), candidates->end());
+        candidates->erase(std::unique(candidates->begin(), candidates->end()), candidates->end());
+        if (Super::tombstones_ != 0 && !candidates->empty()) {
+            Key *keys = &(*candidates)[0];
+            candidates->resize(Super::live(keys, keys + candidates->size(), keys));
+        }
+        if (candidates->empty()) return;
+        if (filter_) {
+            unsigned n = filter_->filter(&ctx.sketch_[0], &(*candidates)[0], candidates->size(), filterDist_, &(*candidates)[0]);
+            candidates->resize(n);
+            if (n == 0) return;
+        }
+        scanner(&(*candidates)[0], unsigned(candidates->size()));
+    }
+
+    // Pass the keys of bin h of table i to the scanner, but the removed
+    // ones and those rejected by the sketch filter.
+    template <typename SCANNER>
+    void scanBin (unsigned i, unsigned h, SCANNER &scanner, QueryContext &ctx) const
+    {
+        Super::visitBin(i, h, [this, &scanner, &ctx](typename Super::BinRange keys) {
+            scanKeys(keys, scanner, ctx);
+        });
+    }
+
+    template <typename SCANNER>
+    void scanKeys (typename Super::BinRange keys, SCANNER &scanner, QueryContext &ctx) const
+    {
+        if (filter_ || Super::tombstones_ != 0) {
+            unsigned n = keys.second - keys.first;
+            if (ctx.passed_.size() < n) ctx.passed_.resize(n);
+            const Key *first = keys.first;
+            if (filter_) {
+                n = filter_->filter(&ctx.sketch_[0], first, n, filterDist_, &ctx.passed_[0]);
+                first = &ctx.passed_[0];
+            }
+            if (Super::tombstones_ != 0) {
+                n = Super::live(first, first + n, &ctx.passed_[0]);
+            }
+            for (unsigned j = 0; j < n; ++j) {
+                scanner(ctx.passed_[j]);
+            }
+            return;
+        }
+        BOOST_FOREACH(Key key, keys) {
+            scanner(key);
+        }
+    }
+
+public:
+
     /// Constructor.
-    MultiProbeLshIndex() {
+    MultiProbeLshIndex(): sorted_(false), directed_(false), filter_(0), filterDist_(0) {
     } 
 
+    /// The parameters of the index.
+    const Parameter &getParam () const
+    {
+        return param_;
+    }
+
+    /// Choose how the candidates of a query are scanned.
+    /**
+      * By default, the keys are passed to scanner(key) as the bins are
+      * walked.  With the sorted scan, the keys of all the probed bins are
+      * collected first (of each probing step for query_recall), sorted,
+      * deduplicated and passed to scanner(keys, n) at once.  The vectors
+      * are then read in increasing key order and can be prefetched, which
+      * pays off when the candidates are many and the data is much larger
+      * than the cache.  The scanner has to support scanner(keys, n), as
+      * TopkScanner does.
+      */
+    void setSortedScan (bool sorted)
+    {
+        sorted_ = sorted;
+    }
+
+    /// Choose how the probes of a query are generated.
+    /**
+      * By default the probe sequences follow the template of expected
+      * scores.  With the query-directed probing, they are generated from
+      * the scores of each query (see MultiProbeLsh::ProbeGenerator), which
+      * reaches the same recall with fewer probes.  The recall table of
+      * query_recall models the template sequence, so an adaptive query
+      * stops after the same number of probes and gets a higher recall.
+      */
+    void setQueryDirected (bool directed)
+    {
+        directed_ = directed;
+    }
+
+    /// Filter the candidates of the queries by their sketches.
+    /**
+      * A candidate is only passed to the scanner when the Hamming distance
+      * between its sketch and the sketch of the query is at most maxDist,
+      * which costs words() words of the filter per candidate instead of a
+      * full vector.  The filter is not owned by the index and must cover
+      * all the keys.  Pass 0 to turn filtering off.
+      */
+    void setSketchFilter (const SketchFilter<Domain> *filter, unsigned maxDist)
+    {
+        filter_ = filter;
+        filterDist_ = maxDist;
+    }
+
     /// Initialize MPLSH.
     /**
       * @param param parameters.
@@ -310,6 +870,7 @@ public:
         // we are going to normalize the distance by window size, so here we pass W = 1.0.
         // We tune adaptive probing for KNN distance range [0.0001W, 20W].
         recall_.reset(MultiProbeLshModel(Super::lshs_.size(), 1.0, param_.repeat, Probe::MAX_T), 200, 0.0001, 20.0);
+        initProjection();
     }
 
     /// Load the index from stream.
@@ -319,6 +880,7 @@ public:
         param_.serialize(ar, 0);
         recall_.load(ar);
         BOOST_VERIFY(ar);
+        initProjection();
     }
 
     /// Save to the index to stream.
@@ -330,62 +892,283 @@ public:
         BOOST_VERIFY(ar);
     }
 
+    /// Save the index as an image, which can be mapped by map().
+    void saveImage (std::ostream &os)
+    {
+        Super::writeImage(os, [this](std::ostream &ms) {
+            param_.serialize(ms, 0);
+            recall_.save(ms);
+        });
+    }
+
+    /// Map an index image saved by saveImage.
+    /**
+      * The hash tables are queried from the mapped file; the hash functions
+      * and the recall table are small and read from it.  verify checks all
+      * the offsets of the tables, see LshIndex::map.
+      */
+    void map (const std::string &path, bool verify = false)
+    {
+        Super::mapImage(path, [this](std::istream &ms) {
+            param_.serialize(ms, 0);
+            recall_.load(ms);
+        }, verify);
+        initProjection();
+    }
+
+    /// Insert a block of items to the index.
+    /**
+      * @param keys the keys of the items.
+      * @param values the values of the items, vectors of float or uint8_t.
+      * @param n number of items.
+      *
+      * The items are hashed INSERT_BATCH at a time with ProjectionBlock,
+      * which is much faster than inserting them one by one.  The items go
+      * to the overflow of a frozen index as one chunk (see
+      * LshIndex::frozen).  Inserting a removed key is the same as updating
+      * it.
+      */
+    template <typename T>
+    void insert (const Key *keys, const T *const *values, unsigned n)
+    {
+        add(keys, values, n, false);
+    }
+
+    /// Insert an item to the index.
+    template <typename T>
+    void insert (Key key, const T *value)
+    {
+        insert(&key, &value, 1);
+    }
+
+    /// Compute the bins of n points in the L tables.
+    /**
+      * @param values the points, vectors of float or uint8_t.
+      * @param bins bins[j * L + i] is set to the bin of values[j] in table i.
+      *
+      * The hash functions never change after init, so the bins can be
+      * computed from any copy of the index.  The points are hashed
+      * INSERT_BATCH at a time.
+      */
+    template <typename T>
+    void hash (const T *const *values, unsigned n, unsigned *bins) const
+    {
+        unsigned L = Super::lshs_.size();
+        std::vector<unsigned> comp(INSERT_BATCH * stride_);
+        std::vector<float> delta(INSERT_BATCH * stride_);
+        for (unsigned b = 0; b < n; b += INSERT_BATCH) {
+            unsigned nb = min(INSERT_BATCH, n - b);
+            project(values + b, nb, &comp[0], &delta[0]);
+            for (unsigned j = 0; j < nb; ++j) {
+                const unsigned *h = &comp[j * stride_];
+                unsigned *out = bins + std::size_t(b + j) * L;
+                for (unsigned i = 0; i < L; ++i) {
+                    out[i] = Super::lshs_[i].combine(h + offset_[i]);
+                }
+            }
+        }
+    }
+
+    /// Change the values of a block of keys.
+    /**
+      * The same as LshIndex::update: the keys are inserted with their new
+      * values, and their entries in the bins of the old values are stale
+      * until the next compaction.  A sketch filter keeps the old sketches
+      * of the keys until it is reset.
+      */
+    template <typename T>
+    void update (const Key *keys, const T *const *values, unsigned n)
+    {
+        add(keys, values, n, true);
+    }
+
+    /// Change the value of a key.
+    template <typename T>
+    void update (Key key, const T *value)
+    {
+        update(&key, &value, 1);
+    }
+
+    /// Insert the items [0, N) in bulk.
+    /**
+      * The same as LshIndex::build, with the items hashed INSERT_BATCH at a
+      * time as in the batched insert.  accessor(key) returns a vector of
+      * float or uint8_t.
+      */
+    template <typename ACCESSOR>
+    void build (ACCESSOR &accessor, unsigned N, unsigned threads = 0)
+    {
+        typedef typename std::decay<decltype(accessor(0))>::type Value;
+        if (threads == 0) threads = defaultThreads();
+        unsigned L = Super::lshs_.size();
+        std::vector<unsigned> buckets(std::size_t(L) * N);
+        parallelRun(threads, [&](unsigned t) {
+            std::vector<Value> values(INSERT_BATCH);
+            std::vector<unsigned> hash(INSERT_BATCH * stride_);
+            std::vector<float> delta(INSERT_BATCH * stride_);
+            unsigned end = partBegin(N, threads, t + 1);
+            for (unsigned b = partBegin(N, threads, t); b < end; b += INSERT_BATCH) {
+                unsigned nb = min(INSERT_BATCH, end - b);
+                for (unsigned j = 0; j < nb; ++j) {
+                    values[j] = accessor(b + j);
+                }
+                project(&values[0], nb, &hash[0], &delta[0]);
+                for (unsigned j = 0; j < nb; ++j) {
+                    const unsigned *h = &hash[j * stride_];
+                    for (unsigned i = 0; i < L; ++i) {
+                        buckets[std::size_t(i) * N + b + j] = Super::lshs_[i].combine(h + offset_[i]);
+                    }
+                }
+            }
+        });
+        Super::fill(&buckets[0], N, threads);
+    }
+
     /// Query for K-NNs.
     /**
-      * @param obj the query object.
+      * @param obj the query object, a vector of float or uint8_t.
       * @param scanner 
       */
-    template <typename SCANNER>
-    void query (Domain obj, unsigned T, SCANNER &scanner)
-    {
-        std::vector<unsigned> seq;
-        for (unsigned i = 0; i < Super::lshs_.size(); ++i) {
-            Super::lshs_[i].genProbeSequence(obj, seq, T);
-            for (unsigned j = 0; j < seq.size(); ++j) {
-                typename Super::Bin &bin = Super::tables_[i][seq[j]];
-                BOOST_FOREACH(Key key, bin) {
-                    scanner(key);
+    template <typename SCANNER, typename POINT>
+    void query (const POINT *obj, unsigned T, SCANNER &scanner) const
+    {
+        query(obj, T, scanner, threadContext());
+    }
+
+    /// Query for K-NNs with the scratch memory of ctx.
+    template <typename SCANNER, typename POINT>
+    void query (const POINT *obj, unsigned T, SCANNER &scanner, QueryContext &ctx) const
+    {
+        unsigned L = Super::lshs_.size();
+        probe(obj, ctx);
+        if (sorted_) {
+            ctx.candidates_.clear();
+            for (unsigned i = 0; i < L; ++i) {
+                MultiProbeLsh::ProbeGenerator &gen = ctx.gens_[i];
+                while (gen.size() < T && !gen.done()) {
+                    gather(i, gen.next(), &ctx.candidates_);
                 }
             }
+            scanSorted(&ctx.candidates_, scanner, ctx);
+            return;
+        }
+        for (unsigned i = 0; i < L; ++i) {
+            MultiProbeLsh::ProbeGenerator &gen = ctx.gens_[i];
+            while (gen.size() < T && !gen.done()) {
+                scanBin(i, gen.next(), scanner, ctx);
+            }
         }
     }
 
     /// Query for K-NNs, try to achieve the given recall by adaptive probing.
     /**
       * There's a special requirement for the scanner type used in adaptive query.
-      * It should support the following method to return the current K-NNs:
+      * It should support the following method to return the current K-NNs,
+      * which are read after every probe and need not be sorted:
       *
-      * const Topk<KEY> &topk () const;
+      * const Topk<KEY> &unsorted () const;
       */
-    template <typename SCANNER>
-    void query_recall (Domain obj, float recall, SCANNER &scanner) const
+    template <typename SCANNER, typename POINT>
+    void query_recall (const POINT *obj, float recall, SCANNER &scanner) const
+    {
+        query_recall(obj, recall, scanner, threadContext());
+    }
+
+    /// Adaptive query with the scratch memory of ctx.
+    template <typename SCANNER, typename POINT>
+    void query_recall (const POINT *obj, float recall, SCANNER &scanner, QueryContext &ctx) const
     {
-        unsigned K = scanner.topk().getK();
+        unsigned K = scanner.unsorted().getK();
         if (K == 0) throw std::logic_error("CANNOT ACCEPT R-NN QUERY");
-        if (scanner.topk().size() < K) throw std::logic_error("ERROR");
+        if (scanner.unsorted().size() < K) throw std::logic_error("ERROR");
         unsigned L = Super::lshs_.size();
-        std::vector<std::vector<unsigned> > seqs(L);
-        for (unsigned i = 0; i < L; ++i) {
-            Super::lshs_[i].genProbeSequence(obj, seqs[i], Probe::MAX_T);
-        }
-        for (unsigned j = 0; j < Probe::MAX_T; ++j) {
-            if (j >= seqs[0].size()) break;
-            for (unsigned i = 0; i < L; ++i) {
-                BOOST_FOREACH(Key key, Super::tables_[i][seqs[i][j]]) {
-                    scanner(key);
+        probe(obj, ctx);
+        ctx.knn_.clear();
+        // The tables have the same number of probes.  They are generated
+        // one step at a time, as most queries stop after a few.
+        for (unsigned j = 0; !ctx.gens_[0].done(); ++j) {
+            if (sorted_) {
+                ctx.candidates_.clear();
+                for (unsigned i = 0; i < L; ++i) {
+                    gather(i, ctx.gens_[i].next(), &ctx.candidates_);
                 }
-                //
+                scanSorted(&ctx.candidates_, scanner, ctx);
             }
-           
-            float r = 0.0;
-            for (unsigned i = 0; i < K; ++i) {
+            else for (unsigned i = 0; i < L; ++i) {
+                scanBin(i, ctx.gens_[i].next(), scanner, ctx);
+            }
+            if (estimate(scanner.unsorted(), j + 1, ctx) >= recall) break;
+        }
+    }
 
-                r += recall_.lookup(std::sqrt(scanner.topk()[i].dist) / param_.W, j + 1);
+    /// Query a batch of points in parallel with T probes.
+    /**
+      * @param queries the Q query objects.
+      * @param scanner the scanner to copy for each thread.
+      * @param threads number of threads, 0 for all the cores.
+      * @param cnt if not 0, set to scanner.cnt() of every query.
+      * @return the K-NNs of every query.
+      *
+      * Every thread queries with its own copy of the scanner, so the
+      * scanner and its accessor should keep their per-query state by value
+      * or per thread, as Matrix::Accessor keeps its marks in the
+      * VisitedSet of the thread.  The scanner should support
+      * reset(query), topk() and cnt(), as TopkScanner does.  The queries
+      * are handed out one at a time, so slow queries do not hold up a
+      * thread's share of the batch.
+      */
+    template <typename SCANNER, typename POINT>
+    std::vector<Topk<Key> > query_batch (const POINT *const *queries, unsigned Q, unsigned T, const SCANNER &scanner, unsigned threads = 0, std::vector<unsigned> *cnt = 0) const
+    {
+        return batch(queries, Q, scanner, threads, cnt, [this, T](const POINT *obj, SCANNER &s, QueryContext &ctx) {
+            query(obj, T, s, ctx);
+        });
+    }
 
+    /// Query a batch of points in parallel by adaptive probing.
+    /**
+      * The same as query_batch, with query_recall instead of query.
+      */
+    template <typename SCANNER, typename POINT>
+    std::vector<Topk<Key> > query_recall_batch (const POINT *const *queries, unsigned Q, float recall, const SCANNER &scanner, unsigned threads = 0, std::vector<unsigned> *cnt = 0) const
+    {
+        return batch(queries, Q, scanner, threads, cnt, [this, recall](const POINT *obj, SCANNER &s, QueryContext &ctx) {
+            query_recall(obj, recall, s, ctx);
+        });
+    }
+
+private:
+    template <typename T>
+    void add (const Key *keys, const T *const *values, unsigned n, bool update)
+    {
+        if (n == 0) return;
+        std::vector<unsigned> bins(std::size_t(n) * Super::lshs_.size());
+        hash(values, n, &bins[0]);
+        std::vector<uint8_t> updates(n, update);
+        Super::append(keys, &bins[0], n, &updates[0]);
+    }
+
+    template <typename SCANNER, typename POINT, typename QUERY>
+    std::vector<Topk<Key> > batch (const POINT *const *queries, unsigned Q, const SCANNER &scanner, unsigned threads, std::vector<unsigned> *cnt, QUERY run) const
+    {
+        if (threads == 0) threads = defaultThreads();
+        if (threads > Q) threads = std::max(Q, 1u);
+        std::vector<Topk<Key> > topks(Q);
+        if (cnt) cnt->resize(Q);
+        std::atomic<unsigned> next(0);
+        parallelRun(threads, [&](unsigned) {
+            SCANNER s(scanner);
+            QueryContext ctx;
+            for (;;) {
+                unsigned i = next++;
+                if (i >= Q) break;
+                s.reset(queries[i]);
+                run(queries[i], s, ctx);
+                topks[i] = s.topk();
+                if (cnt) (*cnt)[i] = s.cnt();
             }
-            r /= K;
-            if (r >= recall) break;
-        }
+        });
+        return topks;
     }
 };
 
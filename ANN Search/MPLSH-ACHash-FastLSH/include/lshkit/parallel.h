@@ -0,0 +1,76 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_PARALLEL__
+#define __LSHKIT_PARALLEL__
+
+/**
+ * \file parallel.h
+ * \brief Minimal thread helpers used by the bulk operations of the indices.
+ */
+
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace lshkit {
+
+/// Number of threads used when 0 is given: the number of cores.
+static inline unsigned defaultThreads ()
+{
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+/// Run f(t) for t = 0, ..., threads - 1, each on its own thread.
+/**
+  * f(0) runs on the calling thread.  The function returns when all of them
+  * are done.
+  */
+template <typename F>
+void parallelRun (unsigned threads, F f)
+{
+    if (threads <= 1) {
+        f(0);
+        return;
+    }
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (unsigned t = 1; t < threads; ++t) {
+        pool.push_back(std::thread(f, t));
+    }
+    f(0);
+    for (unsigned t = 0; t < pool.size(); ++t) {
+        pool[t].join();
+    }
+}
+
+/// Start of part t when [0, n) is split into parts contiguous parts.
+/**
+  * Part t is [partBegin(n, parts, t), partBegin(n, parts, t + 1)).
+  */
+static inline std::size_t partBegin (std::size_t n, unsigned parts, unsigned t)
+{
+    return n * t / parts;
+}
+
+}
+
+#endif
+
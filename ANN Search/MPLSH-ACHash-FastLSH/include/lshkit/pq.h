@@ -0,0 +1,423 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_PQ__
+#define __LSHKIT_PQ__
+
+/**
+ * \file pq.h
+ * \brief Product quantization codes, and a scanner ranking candidates on them.
+ *
+ * ProductQuantizer splits the dim dimensions into M sub-spaces of dim / M
+ * dimensions and quantizes each of them with its own k-means codebook of
+ * 16 (4-bit codes) or 256 (8-bit codes) centroids, so a vector is coded in
+ * M / 2 or M bytes.  PQCodes keeps the codes of a dataset.
+ *
+ * The L2sqr distance between a query and a code is estimated with the
+ * asymmetric distance (ADC), the sum of M lookups into a table of the
+ * distances from the query to every centroid, as WeightedHammingHelper does
+ * for sketches.  For 4-bit codes the tables are quantized to bytes, so that
+ * a table of 16 entries fits in one register, and PQ_BLOCK candidates are
+ * scored at once by shuffle instructions (pshufb), one sub-space at a time,
+ * after their codes are transposed in registers.
+ *
+ * PQTopkScanner ranks the candidates of a query that way, keeps the best
+ * K' and re-ranks them with the exact distance to the fp32 rows, as
+ * QuantizedTopkScanner does.
+ *
+ * \code
+ * ProductQuantizer pq;
+ * pq.reset(data.getDim(), 32, 4);
+ * pq.train(data, rng);
+ * PQCodes codes;
+ * codes.reset(pq, data);
+ * PQTopkScanner<FloatMatrix::Accessor> scanner(pq, codes, accessor, K, 4 * K);
+ * scanner.reset(query);
+ * index.query(query, T, scanner);
+ * scanner.topk();     // exact distances
+ * \endcode
+ *
+ * For more information on product quantization and fast scan, see
+ *
+ *     Herve Jegou, Matthijs Douze, Cordelia Schmid. Product Quantization for
+ *     Nearest Neighbor Search. IEEE Transactions on Pattern Analysis and
+ *     Machine Intelligence, 33(1), 2011.
+ *
+ *     Fabien Andre, Anne-Marie Kermarrec, Nicolas Le Scouarnec. Cache
+ *     locality is not enough: High-Performance Nearest Neighbor Search with
+ *     Product Quantization Fast Scan. VLDB 2015.
+ */
+
+#include <vector>
+#include <limits>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <stdint.h>
+#include <boost/assert.hpp>
+#include <lshkit/common.h>
+#include <lshkit/simd.h>
+#include <lshkit/matrix.h>
+#include <lshkit/topk.h>
+#include <lshkit/visited.h>
+#include <lshkit/distance.h>
+
+namespace lshkit {
+
+/// # candidates scored together by the 4-bit scan kernels.
+static const unsigned PQ_BLOCK = 32;
+
+/// Product quantizer.
+class ProductQuantizer
+{
+    unsigned dim_;
+    unsigned M_;
+    unsigned nbits_;
+    unsigned ksub_;
+    unsigned dsub_;
+    std::vector<float> centroids_;  // M_ x ksub_ x dsub_
+
+    void trainSample (const Matrix<float> &data, const std::vector<unsigned> &sample, unsigned iterations, unsigned threads);
+
+public:
+    ProductQuantizer (): dim_(0), M_(0), nbits_(0), ksub_(0), dsub_(0) {}
+
+    /// Set up an untrained quantizer.
+    /**
+      * @param dim dimension, a multiple of M.
+      * @param M # sub-spaces.
+      * @param nbits bits per sub-space code, 4 or 8.
+      */
+    void reset (unsigned dim, unsigned M, unsigned nbits)
+    {
+        BOOST_VERIFY(M > 0 && dim % M == 0);
+        BOOST_VERIFY(nbits == 4 || nbits == 8);
+        dim_ = dim;
+        M_ = M;
+        nbits_ = nbits;
+        ksub_ = 1U << nbits;
+        dsub_ = dim / M;
+        centroids_.assign(std::size_t(M_) * ksub_ * dsub_, 0);
+    }
+
+    /// Train the codebooks with k-means.
+    /**
+      * @param data training data.
+      * @param rng random number generator, used to sample the data and to
+      * pick the initial centroids.
+      * @param iterations # k-means iterations.
+      * @param samples # training vectors sampled from data, 0 for 256 per
+      * centroid.
+      * @param threads # threads, 0 for all the cores.  The sub-spaces are
+      * trained in parallel.
+      */
+    template <typename RNG>
+    void train (const Matrix<float> &data, RNG &rng, unsigned iterations = 25, unsigned samples = 0, unsigned threads = 0)
+    {
+        BOOST_VERIFY(data.getDim() == dim_);
+        unsigned N = data.getSize();
+        if (samples == 0) samples = 256 * ksub_;
+        if (samples > N) samples = N;
+        BOOST_VERIFY(samples >= ksub_);
+        // Partial Fisher-Yates shuffle, the first ones are the initial centroids.
+        std::vector<unsigned> perm(N);
+        for (unsigned i = 0; i < N; ++i) perm[i] = i;
+        for (unsigned i = 0; i < samples; ++i) {
+            unsigned j = UniformUnsigned(i, N - 1)(rng);
+            std::swap(perm[i], perm[j]);
+        }
+        perm.resize(samples);
+        trainSample(data, perm, iterations, threads);
+    }
+
+    unsigned getDim () const { return dim_; }
+    unsigned getM () const { return M_; }
+    unsigned getBits () const { return nbits_; }
+    /// # centroids per sub-space.
+    unsigned getKsub () const { return ksub_; }
+
+    /// Bytes per code.
+    unsigned codeSize () const { return (M_ * nbits_ + 7) / 8; }
+
+    /// Centroid k of sub-space m.
+    const float *centroid (unsigned m, unsigned k) const
+    {
+        return &centroids_[(std::size_t(m) * ksub_ + k) * dsub_];
+    }
+
+    /// Sub-space code m of code.
+    unsigned subCode (const uint8_t *code, unsigned m) const
+    {
+        if (nbits_ == 8) return code[m];
+        return (code[m / 2] >> ((m & 1) * 4)) & 0xF;
+    }
+
+    /// Code x into codeSize() bytes.
+    void encode (const float *x, uint8_t *code) const;
+
+    /// Decode code into dim floats.
+    void decode (const uint8_t *code, float *x) const;
+
+    /// L2sqr distances from query to every centroid, M x getKsub() floats.
+    void table (const float *query, float *lut) const;
+
+    /// Asymmetric distance of code, given the table of the query.
+    float distance (const float *lut, const uint8_t *code) const
+    {
+        float r = 0;
+        for (unsigned m = 0; m < M_; ++m) {
+            r += lut[m * ksub_ + subCode(code, m)];
+        }
+        return r;
+    }
+
+    void save (std::ostream &os);
+    void load (std::istream &is);
+};
+
+/// PQ codes of a dataset.
+class PQCodes
+{
+    unsigned N_;
+    unsigned bytes_;
+    AlignedVector<uint8_t> codes_;
+
+public:
+    PQCodes (): N_(0), bytes_(0) {}
+
+    /// Code data with pq.
+    /**
+      * @param threads # threads, 0 for all the cores.
+      */
+    void reset (const ProductQuantizer &pq, const Matrix<float> &data, unsigned threads = 0);
+
+    unsigned getSize () const { return N_; }
+
+    /// Bytes per code.
+    unsigned codeSize () const { return bytes_; }
+
+    /// Bytes taken by the codes.
+    std::size_t getBytes () const { return codes_.size(); }
+
+    /// The code of row i.
+    const uint8_t *code (unsigned i) const
+    {
+        return &codes_[std::size_t(i) * bytes_];
+    }
+
+    void save (std::ostream &os);
+    void load (std::istream &is);
+};
+
+/// Kernel scoring PQ_BLOCK candidates with 4-bit codes.
+/**
+  * @param lut M tables of 16 bytes.
+  * @param codes the PQ_BLOCK codes of (M + 1) / 2 bytes.
+  * @param M # sub-spaces.
+  * @param out PQ_BLOCK sums of the M table entries, saturated at 65535.
+  */
+typedef void (*PQScanKernel) (const uint8_t *lut, const uint8_t *const *codes, unsigned M, uint16_t *out);
+
+/// The 4-bit scan kernel of the given instruction set.
+PQScanKernel pqScanKernel (SimdLevel level);
+
+/// The 4-bit scan kernel of simdLevel().
+static inline PQScanKernel pqScanKernel ()
+{
+    static const PQScanKernel kernel = pqScanKernel(simdLevel());
+    return kernel;
+}
+
+/// Quantize the float tables of a query with 4-bit codes to bytes.
+/**
+  * The distance of a code is bias + scale * (sum of the byte entries).
+  *
+  * @param lut M x 16 floats, from ProductQuantizer::table.
+  * @param qlut M x 16 bytes.
+  */
+void quantizeTable (const float *lut, unsigned M, uint8_t *qlut, float *bias, float *scale);
+
+/// Top-K scanner on PQ codes with exact re-ranking.
+/**
+  * The scanner follows the TopkScanner interface, like QuantizedTopkScanner,
+  * and keeps the exact distances of the keys it has re-ranked as it does.
+  * With 4-bit codes the new keys are queued and scored by pqScanKernel()
+  * PQ_BLOCK at a time; topk() scores the keys left in the queue.
+  *
+  * @param ACCESSOR accessor(key) returns the fp32 row of key.  Its marks are
+  * not used; the scanner marks the keys in the VisitedSet of the thread
+  * calling reset().
+  */
+template <typename ACCESSOR>
+class PQTopkScanner
+{
+public:
+    typedef unsigned Key;
+    typedef const float *Value;
+
+    PQTopkScanner (const ProductQuantizer &pq, const PQCodes &codes, const ACCESSOR &accessor, unsigned K, unsigned rerank, float R = std::numeric_limits<float>::max())
+        : pq_(pq), codes_(codes), accessor_(accessor), visited_(&VisitedSet::local(codes.getSize())), query_id_(visited_->query()),
+          lut_(pq.getM() * pq.getKsub()), qlut_(pq.getM() * 16),
+          K_(K), rerank_(rerank < K ? K : rerank), R_(R),
+          l2sqr_(distanceKernels().l2sqr), scan_(pqScanKernel()), dirty_(false) {
+        pending_.reserve(PQ_BLOCK);
+    }
+
+    /// Reset the query.
+    void reset (const float *query) {
+        query_ = query;
+        pq_.table(query, &lut_[0]);
+        if (pq_.getBits() == 4) quantizeTable(&lut_[0], pq_.getM(), &qlut_[0], &bias_, &scale_);
+        visited_ = &VisitedSet::local(codes_.getSize());
+        visited_->reset();
+        query_id_ = visited_->query();
+        candidates_.reset(rerank_, R_);
+        topk_.reset(K_, R_);
+        exact_.clear();
+        pending_.clear();
+        cnt_ = 0;
+        dirty_ = false;
+    }
+
+    /// Number of points scanned for the current query.
+    unsigned cnt () const {
+        return cnt_;
+    }
+
+    /// Count n points scanned elsewhere for the current query.
+    void addCnt (unsigned n) {
+        cnt_ += n;
+    }
+
+    /// Number of nearest neighbors returned.
+    unsigned getK () const {
+        return K_;
+    }
+
+    /// The K-NNs with exact distances, sorted.
+    const Topk<Key> &topk () const {
+        if (dirty_) rerank();
+        topk_.sort();
+        return topk_;
+    }
+
+    /// The K-NNs with exact distances, sorted.
+    Topk<Key> &topk () {
+        if (dirty_) rerank();
+        topk_.sort();
+        return topk_;
+    }
+
+    /// The K-NNs with exact distances, not sorted (see Topk).
+    const Topk<Key> &unsorted () const {
+        if (dirty_) rerank();
+        return topk_;
+    }
+
+    /// The K' best candidates, with their asymmetric distances, sorted.
+    const Topk<Key> &candidates () const {
+        flush();
+        candidates_.sort();
+        return candidates_;
+    }
+
+    /// Update the current query by scanning key.
+    void operator () (unsigned key) {
+        BOOST_ASSERT(visited_->query() == query_id_);
+        if (visited_->mark(key)) {
+            ++cnt_;
+            dirty_ = true;
+            if (pq_.getBits() == 8) {
+                candidates_ << Topk<Key>::Element(key, pq_.distance(&lut_[0], codes_.code(key)));
+                return;
+            }
+            pending_.push_back(key);
+            if (pending_.size() == PQ_BLOCK) flush();
+        }
+    }
+
+    /// Update the current query by scanning n keys.
+    void operator () (const unsigned *keys, unsigned n) {
+        for (unsigned i = 0; i < n; ++i) {
+#ifdef __GNUC__
+            if (i + 4 < n) __builtin_prefetch(codes_.code(keys[i + 4]), 0, 0);
+#endif
+            (*this)(keys[i]);
+        }
+    }
+
+private:
+    // Score the queued keys.
+    void flush () const {
+        unsigned n = pending_.size();
+        if (n == 0) return;
+        // A block that is not full is padded with the first code.
+        const uint8_t *codes[PQ_BLOCK];
+        for (unsigned j = 0; j < PQ_BLOCK; ++j) {
+            codes[j] = codes_.code(pending_[j < n ? j : 0]);
+        }
+        uint16_t sums[PQ_BLOCK];
+        typename Topk<Key>::Element scored[PQ_BLOCK];
+        scan_(&qlut_[0], codes, pq_.getM(), sums);
+        for (unsigned j = 0; j < n; ++j) {
+            scored[j] = typename Topk<Key>::Element(pending_[j], bias_ + scale_ * sums[j]);
+        }
+        candidates_.insert(scored, n);
+        pending_.clear();
+    }
+
+    void rerank () const {
+        flush();
+        topk_.reset(K_, R_);
+        for (unsigned i = 0; i < candidates_.size(); ++i) {
+            Key key = candidates_[i].key;
+            if (candidates_[i].dist == std::numeric_limits<float>::max()) continue;
+            std::pair<typename std::unordered_map<Key, float>::iterator, bool> e = exact_.insert(std::make_pair(key, 0.0f));
+            if (e.second) e.first->second = l2sqr_(query_, accessor_(key), pq_.getDim());
+            topk_ << Topk<Key>::Element(key, e.first->second);
+        }
+        dirty_ = false;
+    }
+
+    const ProductQuantizer &pq_;
+    const PQCodes &codes_;
+    mutable ACCESSOR accessor_;
+    VisitedSet *visited_;
+    unsigned long query_id_;    // visited_->query() at reset()
+    AlignedVector<float> lut_;
+    AlignedVector<uint8_t> qlut_;
+    float bias_;
+    float scale_;
+    unsigned K_;
+    unsigned rerank_;
+    float R_;
+    DistanceKernel l2sqr_;
+    PQScanKernel scan_;
+    mutable std::vector<Key> pending_;
+    mutable Topk<Key> candidates_;
+    mutable Topk<Key> topk_;
+    mutable std::unordered_map<Key, float> exact_;   // of the keys re-ranked
+    mutable bool dirty_;
+    const float *query_;
+    unsigned cnt_;
+};
+
+}
+
+#endif
@@ -0,0 +1,131 @@
+/* 
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+  
+    This file is part of LSHKIT.
+  
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_PROJECTION__
+#define __LSHKIT_PROJECTION__
+
+/**
+ * \file projection.h
+ * \brief Batched evaluation of stable distribution based LSH functions.
+ *
+ * An LSH index with L hash tables of M StableDistLsh functions each evaluates
+ * M x L dot products per inserted or queried point.  Doing them one function
+ * at a time is a long sequence of short dot products.  ProjectionBlock packs
+ * the coefficients of all the functions of an index into a matrix and
+ * evaluates a block of points as one blocked matrix product, with the window
+ * quantization (floor(x/W)) and the delta used by multi-probing done directly
+ * on the accumulators.
+ *
+ * The coefficients are stored in panels of PANEL functions, interleaved so
+ * that the same dimension of PANEL functions is consecutive.  The product is
+ * blocked by KC dimensions so that the panel slice being used stays in L1
+ * while the points of the block are streamed against it.
+ *
+ * When all the functions only look at the same subset of the dimensions (as
+ * FastLSH does with a shared sample), the block can be given the subset with
+ * setGather().  The sampled coordinates of each point are then gathered once
+ * into a contiguous aligned buffer, and the product is done on the dense
+ * (#functions x #samples) coefficient block.
+ *
+ * \code
+ * ProjectionBlock block;
+ * block.reset(dim, F, W);
+ * for (unsigned f = 0; f < F; ++f) block.set(f, coefficients_of_f, b_of_f);
+ *
+ * std::vector<unsigned> hash(n * block.getStride());
+ * std::vector<float> delta(n * block.getStride());
+ * block.apply(points, n, &hash[0], &delta[0]);
+ * // hash[i * block.getStride() + f] is the value of function f on points[i].
+ * \endcode
+ */
+
+#include <lshkit/simd.h>
+
+namespace lshkit {
+
+/// A block of stable distribution LSH functions sharing the window size W.
+class ProjectionBlock
+{
+public:
+    /// Number of functions packed in a panel.
+    static const unsigned PANEL = 16;
+    /// Number of dimensions in a cache block.
+    static const unsigned KC = 256;
+
+    ProjectionBlock (): dim_(0), size_(0), panels_(0), W_(1.0) {}
+
+    /// Reset the block.
+    /**
+      * @param dim dimension of the input.
+      * @param size number of functions.
+      * @param W window size.
+      */
+    void reset (unsigned dim, unsigned size, float W);
+
+    /// Set function f to h(x) = floor((b + coef . x) / W).
+    /**
+      * @param coef dim coefficients, zero for the dimensions not used.
+      */
+    void set (unsigned f, const float *coef, float b);
+
+    /// Only use dimensions dims[0], ..., dims[getDim() - 1] of the input.
+    /**
+      * After this, coefficient k set by set() applies to dimension dims[k]
+      * of the points passed to apply().
+      */
+    void setGather (const unsigned *dims)
+    {
+        gather_.assign(dims, dims + dim_);
+    }
+
+    unsigned getDim () const { return dim_; }
+    unsigned getSize () const { return size_; }
+
+    /// Distance between the outputs of two consecutive points.
+    unsigned getStride () const { return panels_ * PANEL; }
+
+    /// Evaluate all the functions on a block of points.
+    /**
+      * @param points n pointers to the input vectors.
+      * @param n number of points.
+      * @param hash output hash values, n x getStride().
+      * @param delta output, the part rounded off by the floor operation,
+      * n x getStride().  It is also used as the accumulator of the
+      * partial dot products.
+      *
+      * @param ldo row stride of hash and delta, 0 for getStride().
+      *
+      * Outputs beyond getSize() in each row are padding and should be
+      * ignored.
+      */
+    void apply (const float *const *points, unsigned n, unsigned *hash, float *delta, unsigned ldo = 0) const;
+
+private:
+    unsigned dim_;
+    unsigned size_;
+    unsigned panels_;
+    float W_;
+    AlignedVector<float> coef_;     // [panel][dim][PANEL]
+    AlignedVector<float> bias_;     // [panel][PANEL]
+    std::vector<unsigned> gather_;  // empty if the input is used as is
+};
+
+}
+
+#endif
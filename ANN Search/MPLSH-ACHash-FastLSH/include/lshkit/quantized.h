@@ -0,0 +1,271 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_QUANTIZED__
+#define __LSHKIT_QUANTIZED__
+
+/**
+ * \file quantized.h
+ * \brief Scalar quantized vectors, and a scanner ranking candidates on them.
+ *
+ * QuantizedMatrix keeps a compressed copy of a FloatMatrix:
+ *  - QUANT_INT8: every dimension d is quantized to 256 levels between its
+ *    minimum and maximum over the data, x ~= min[d] + step[d] * code, one
+ *    byte per value;
+ *  - QUANT_FP16: every value is an IEEE half precision float, two bytes per
+ *    value.
+ *
+ * QuantizedTopkScanner ranks the candidates of a query by their L2 distance
+ * to the codes, which reads 4 (int8) or 2 (fp16) times less memory than the
+ * floats, keeps the best K' of them and re-ranks those with the exact
+ * distance to the fp32 rows.  The fp32 rows are only read for the K'
+ * candidates, so they can stay on disk (e.g. Matrix::map).
+ *
+ * \code
+ * QuantizedMatrix codes;
+ * codes.reset(data, QuantizedMatrix::QUANT_INT8);
+ * QuantizedTopkScanner<FloatMatrix::Accessor> scanner(codes, accessor, K, 4 * K);
+ * scanner.reset(query);
+ * index.query(query, T, scanner);
+ * scanner.topk();     // exact distances
+ * \endcode
+ */
+
+#include <vector>
+#include <limits>
+#include <iostream>
+#include <unordered_map>
+#include <stdint.h>
+#include <boost/assert.hpp>
+#include <lshkit/simd.h>
+#include <lshkit/matrix.h>
+#include <lshkit/topk.h>
+#include <lshkit/visited.h>
+#include <lshkit/distance.h>
+
+namespace lshkit {
+
+/// Half precision float with the bits of f, rounded to nearest even.
+uint16_t floatToHalf (float f);
+
+/// The float value of half precision h.
+float halfToFloat (uint16_t h);
+
+/// Scalar quantized copy of a matrix of floats.
+class QuantizedMatrix
+{
+public:
+    enum Type {
+        QUANT_INT8 = 1,
+        QUANT_FP16 = 2
+    };
+
+    /// L2sqr kernel between a prepared query and a row of codes.
+    typedef float (*Kernel) (const float *query, const uint8_t *code, const float *step, unsigned dim, float bound);
+
+private:
+    unsigned type_;
+    unsigned dim_;
+    unsigned N_;
+    unsigned rowBytes_;
+    std::vector<float> min_;
+    std::vector<float> step_;
+    AlignedVector<uint8_t> codes_;
+    Kernel kernel_;
+
+    void selectKernel ();
+
+public:
+    QuantizedMatrix (): type_(QUANT_INT8), dim_(0), N_(0), rowBytes_(0), kernel_(0) {}
+
+    /// Quantize data.
+    void reset (const Matrix<float> &data, Type type);
+
+    unsigned getType () const { return type_; }
+    unsigned getDim () const { return dim_; }
+    unsigned getSize () const { return N_; }
+
+    /// Bytes taken by the codes.
+    std::size_t getBytes () const { return codes_.size(); }
+
+    /// The codes of row i.
+    const uint8_t *code (unsigned i) const
+    {
+        return &codes_[std::size_t(i) * rowBytes_];
+    }
+
+    /// Decode row i to dim_ floats.
+    void decode (unsigned i, float *out) const;
+
+    /// Transform a query for distance(); prepared has getDim() values.
+    /**
+      * For int8 the minimum of each dimension is subtracted, so that the
+      * kernel only has to scale the codes.
+      */
+    void prepare (const float *query, float *prepared) const;
+
+    /// L2sqr distance between a prepared query and row i.
+    /**
+      * As the bounded kernels of distance.h, the kernel gives up once the
+      * partial distance exceeds bound.
+      */
+    float distance (const float *prepared, unsigned i, float bound = std::numeric_limits<float>::max()) const
+    {
+        return kernel_(prepared, code(i), &step_[0], dim_, bound);
+    }
+
+    void save (std::ostream &os);
+    void load (std::istream &is);
+};
+
+/// Top-K scanner on quantized codes with exact re-ranking.
+/**
+  * The scanner follows the TopkScanner interface.  The candidates are
+  * ranked on the codes into a heap of K' = rerank entries; topk() re-ranks
+  * them with the exact L2sqr distance when it is called after new keys have
+  * been scanned, and returns the K best.  The exact distances are kept for
+  * the query, so that the repeated calls of unsorted() in query_recall only
+  * read the fp32 rows of the candidates new since the previous call.
+  *
+  * @param ACCESSOR accessor(key) returns the fp32 row of key.  Its marks are
+  * not used; the scanner marks the keys in the VisitedSet of the thread
+  * calling reset().
+  */
+template <typename ACCESSOR>
+class QuantizedTopkScanner
+{
+public:
+    typedef unsigned Key;
+    typedef const float *Value;
+
+    QuantizedTopkScanner (const QuantizedMatrix &codes, const ACCESSOR &accessor, unsigned K, unsigned rerank, float R = std::numeric_limits<float>::max())
+        : codes_(codes), accessor_(accessor), visited_(&VisitedSet::local(codes.getSize())), query_id_(visited_->query()),
+          prepared_(codes.getDim()), K_(K), rerank_(rerank < K ? K : rerank), R_(R),
+          l2sqr_(distanceKernels().l2sqr), dirty_(false) {
+    }
+
+    /// Reset the query.
+    void reset (const float *query) {
+        query_ = query;
+        codes_.prepare(query, &prepared_[0]);
+        visited_ = &VisitedSet::local(codes_.getSize());
+        visited_->reset();
+        query_id_ = visited_->query();
+        candidates_.reset(rerank_, R_);
+        topk_.reset(K_, R_);
+        exact_.clear();
+        cnt_ = 0;
+        dirty_ = false;
+    }
+
+    /// Number of points scanned for the current query.
+    unsigned cnt () const {
+        return cnt_;
+    }
+
+    /// Count n points scanned elsewhere for the current query.
+    void addCnt (unsigned n) {
+        cnt_ += n;
+    }
+
+    /// Number of nearest neighbors returned.
+    unsigned getK () const {
+        return K_;
+    }
+
+    /// The K-NNs with exact distances, sorted.
+    const Topk<Key> &topk () const {
+        if (dirty_) rerank();
+        topk_.sort();
+        return topk_;
+    }
+
+    /// The K-NNs with exact distances, sorted.
+    Topk<Key> &topk () {
+        if (dirty_) rerank();
+        topk_.sort();
+        return topk_;
+    }
+
+    /// The K-NNs with exact distances, not sorted (see Topk).
+    const Topk<Key> &unsorted () const {
+        if (dirty_) rerank();
+        return topk_;
+    }
+
+    /// The K' best candidates, with their distances to the codes, sorted.
+    const Topk<Key> &candidates () const {
+        candidates_.sort();
+        return candidates_;
+    }
+
+    /// Update the current query by scanning key.
+    void operator () (unsigned key) {
+        BOOST_ASSERT(visited_->query() == query_id_);
+        if (visited_->mark(key)) {
+            ++cnt_;
+            float r = codes_.distance(&prepared_[0], key, candidates_.threshold());
+            candidates_ << Topk<Key>::Element(key, r);
+            dirty_ = true;
+        }
+    }
+
+    /// Update the current query by scanning n keys.
+    void operator () (const unsigned *keys, unsigned n) {
+        for (unsigned i = 0; i < n; ++i) {
+#ifdef __GNUC__
+            if (i + 4 < n) __builtin_prefetch(codes_.code(keys[i + 4]), 0, 0);
+#endif
+            (*this)(keys[i]);
+        }
+    }
+
+private:
+    void rerank () const {
+        topk_.reset(K_, R_);
+        for (unsigned i = 0; i < candidates_.size(); ++i) {
+            Key key = candidates_[i].key;
+            if (candidates_[i].dist == std::numeric_limits<float>::max()) continue;
+            std::pair<typename std::unordered_map<Key, float>::iterator, bool> e = exact_.insert(std::make_pair(key, 0.0f));
+            if (e.second) e.first->second = l2sqr_(query_, accessor_(key), codes_.getDim());
+            topk_ << Topk<Key>::Element(key, e.first->second);
+        }
+        dirty_ = false;
+    }
+
+    const QuantizedMatrix &codes_;
+    mutable ACCESSOR accessor_;
+    VisitedSet *visited_;
+    unsigned long query_id_;    // visited_->query() at reset()
+    std::vector<float> prepared_;
+    unsigned K_;
+    unsigned rerank_;
+    float R_;
+    DistanceKernel l2sqr_;
+    mutable Topk<Key> candidates_;
+    mutable Topk<Key> topk_;
+    mutable std::unordered_map<Key, float> exact_;   // of the keys re-ranked
+    mutable bool dirty_;
+    const float *query_;
+    unsigned cnt_;
+};
+
+}
+
+#endif
@@ -0,0 +1,239 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_REMOTE__
+#define __LSHKIT_REMOTE__
+
+/**
+ * \file remote.h
+ * \brief Querying an index served by another process over a Unix socket.
+ *
+ * The protocol carries batches of queries.  A request is a RemoteRequest
+ * followed by Q x dim values of elemSize bytes each (4 for float, 1 for
+ * uint8_t).  The answer is a RemoteResponse followed, when the status is
+ * REMOTE_OK, by the Q x K RemoteEntry of the K-NNs of each query, nearest
+ * first, and the Q numbers of points scanned.  The slots not filled have
+ * the distance std::numeric_limits<float>::max().  The integers are in
+ * the byte order of the machine, as in the index files.
+ *
+ * A connection carries any number of requests, answered in order.
+ * REMOTE_SHUTDOWN stops the server and has no answer.
+ *
+ * \code
+ * // server
+ * int fd = remoteListen("/tmp/shard.sock");
+ * remoteServe(fd, remoteHandler(index, accessor, metric::l2sqr<float>(dim), dim));
+ *
+ * // client
+ * int fd = remoteConnect("/tmp/shard.sock");
+ * RemoteRequest req = remoteRequest(REMOTE_QUERY, Q, dim, sizeof(float), K);
+ * req.T = T;
+ * std::vector<Topk<unsigned> > topks;
+ * remoteQuery(fd, req, queries, &topks, 0);
+ * \endcode
+ */
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include <cstring>
+#include <stdint.h>
+#include <lshkit/topk.h>
+
+namespace lshkit {
+
+static const uint32_t REMOTE_MAGIC = 0x51485354;   // "TSHQ"
+
+/// Operations of the protocol.
+enum RemoteOp {
+    REMOTE_QUERY = 1,       ///< query with T probes
+    REMOTE_RECALL = 2,      ///< adaptive query with the given recall
+    REMOTE_SHUTDOWN = 3     ///< stop the server
+};
+
+/// Status of an answer.
+enum RemoteStatus {
+    REMOTE_OK = 0,
+    REMOTE_BAD_REQUEST = 1, ///< unknown operation, wrong dimension or element size, above the limits
+    REMOTE_FAILED = 2       ///< the query threw an exception
+};
+
+/// Limits of a request.
+/**
+  * Q and K come from the peer and size the answer, so a server answers
+  * REMOTE_BAD_REQUEST to a request above them.  A server may take a lower
+  * limit of K.
+  */
+static const uint32_t REMOTE_MAX_Q = 1 << 16;
+static const uint32_t REMOTE_MAX_K = 1 << 12;
+static const uint64_t REMOTE_MAX_ENTRIES = 1 << 24;    ///< Q x K of an answer
+
+/// Header of a request.
+struct RemoteRequest
+{
+    uint32_t magic;
+    uint32_t op;
+    uint32_t Q;
+    uint32_t dim;
+    uint32_t elemSize;
+    uint32_t K;
+    uint32_t T;
+    float recall;
+};
+
+/// Header of an answer.
+struct RemoteResponse
+{
+    uint32_t magic;
+    uint32_t status;
+    uint32_t Q;
+    uint32_t K;
+};
+
+/// A nearest neighbor in an answer.
+struct RemoteEntry
+{
+    uint32_t key;
+    float dist;
+};
+
+/// A request of Q queries, T and recall left to 0.
+static inline RemoteRequest remoteRequest (RemoteOp op, unsigned Q, unsigned dim, unsigned elemSize, unsigned K)
+{
+    RemoteRequest req;
+    std::memset(&req, 0, sizeof(req));
+    req.magic = REMOTE_MAGIC;
+    req.op = op;
+    req.Q = Q;
+    req.dim = dim;
+    req.elemSize = elemSize;
+    req.K = K;
+    return req;
+}
+
+/// Answer the queries of a request.
+/**
+  * queries points to the Q x dim values.  The handler fills Q Topks and
+  * the Q counts, and returns a RemoteStatus.
+  */
+typedef std::function<unsigned (const RemoteRequest &req, const char *queries,
+                                std::vector<Topk<unsigned> > *topks, std::vector<unsigned> *cnt)> RemoteHandler;
+
+/// Read exactly size bytes, return false at the end of the stream or on error.
+bool readAll (int fd, void *buf, std::size_t size);
+
+/// Write exactly size bytes, return false on error.
+/** SIGPIPE is not raised when the peer has closed a socket. */
+bool writeAll (int fd, const void *buf, std::size_t size);
+
+/// Listen on the Unix socket path, replacing an existing socket file.
+/** Throws std::runtime_error on failure. */
+int remoteListen (const std::string &path);
+
+/// Connect to the Unix socket path.
+/** Throws std::runtime_error on failure. */
+int remoteConnect (const std::string &path);
+
+/// Read a request and its queries, return false at the end of the stream.
+/** Throws std::runtime_error on a malformed request. */
+bool readRequest (int fd, RemoteRequest *req, std::vector<char> *queries);
+
+/// Check a query request, return REMOTE_OK or REMOTE_BAD_REQUEST.
+/**
+  * The request is bad if its operation is not a query, its dimension or
+  * element size are not those given, K is 0 or above maxK, or it is
+  * above the limits of Q and Q x K.
+  */
+unsigned remoteCheck (const RemoteRequest &req, unsigned dim, unsigned elemSize,
+                      unsigned maxK = REMOTE_MAX_K);
+
+/// Write the answer of a request, return false on error.
+bool writeResponse (int fd, unsigned status, const std::vector<Topk<unsigned> > &topks,
+                    const std::vector<unsigned> &cnt, unsigned K);
+
+/// Answer the requests of the connections to the listening socket fd.
+/**
+  * The connections are served one at a time, until a REMOTE_SHUTDOWN
+  * request.  A request above the limits of Q and K is answered
+  * REMOTE_BAD_REQUEST without calling the handler.  The listening socket
+  * is closed on return.
+  */
+void remoteServe (int fd, RemoteHandler handler);
+
+/// Send a request and read the answer.
+/**
+  * @param queries the req.Q x req.dim values.
+  * @param topks set to the K-NNs of every query.
+  * @param cnt if not 0, set to the numbers of points scanned.
+  *
+  * Throws std::runtime_error if the connection fails or the server
+  * rejects the request.
+  */
+void remoteQuery (int fd, const RemoteRequest &req, const void *queries,
+                  std::vector<Topk<unsigned> > *topks, std::vector<unsigned> *cnt);
+
+/// Ask the server to stop.
+void remoteShutdown (int fd);
+
+/// A handler answering the requests with index.
+/**
+  * @param index a MultiProbeLshIndex (or ConcurrentIndex) of points of T.
+  * @param accessor the accessor of the points.
+  * @param metric the metric of TopkScanner, on points of T.
+  * @param dim the dimension of the points.
+  * @param threads number of threads of query_batch, 0 for all the cores.
+  * @param maxK the largest K accepted.
+  *
+  * The queries have to be of T, of the dimension of the index.  The
+  * keys are returned as unsigned.
+  */
+template <typename INDEX, typename ACCESSOR, typename METRIC>
+RemoteHandler remoteHandler (const INDEX &index, const ACCESSOR &accessor, const METRIC &metric, unsigned dim, unsigned threads = 0, unsigned maxK = REMOTE_MAX_K)
+{
+    typedef typename std::remove_const<typename std::remove_pointer<typename ACCESSOR::Value>::type>::type T;
+    return [&index, accessor, metric, dim, threads, maxK] (const RemoteRequest &req, const char *queries,
+                                                     std::vector<Topk<unsigned> > *topks, std::vector<unsigned> *cnt) -> unsigned {
+        unsigned status = remoteCheck(req, dim, sizeof(T), maxK);
+        if (status != REMOTE_OK) return status;
+        std::vector<const T *> rows(req.Q);
+        for (unsigned i = 0; i < req.Q; ++i) {
+            rows[i] = reinterpret_cast<const T *>(queries) + std::size_t(i) * dim;
+        }
+        TopkScanner<ACCESSOR, METRIC> scanner(accessor, metric, req.K);
+        std::vector<Topk<typename ACCESSOR::Key> > found;
+        if (req.Q != 0) {
+            if (req.op == REMOTE_QUERY) found = index.query_batch(&rows[0], req.Q, req.T, scanner, threads, cnt);
+            else found = index.query_recall_batch(&rows[0], req.Q, req.recall, scanner, threads, cnt);
+        }
+        topks->resize(req.Q);
+        for (unsigned i = 0; i < req.Q; ++i) {
+            Topk<unsigned> &t = (*topks)[i];
+            t.reset(req.K);
+            for (unsigned k = 0; k < found[i].size() && k < req.K; ++k) {
+                t[k] = Topk<unsigned>::Element(unsigned(found[i][k].key), found[i][k].dist);
+            }
+        }
+        return REMOTE_OK;
+    };
+}
+
+}
+
+#endif
@@ -0,0 +1,437 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_SHARDED__
+#define __LSHKIT_SHARDED__
+
+/**
+ * \file sharded.h
+ * \brief Multi-Probe LSH index split into shards.
+ *
+ * ShardedIndex splits the keys [0, N) into S contiguous slices, each
+ * indexed by its own MultiProbeLshIndex.  The shards use the same hash
+ * functions, so a point falls into the same bins whatever its shard, and
+ * the shards together return the same candidates as a single index.  A
+ * query is scattered to all the shards and their K-NNs are merged with
+ * Topk::merge.
+ *
+ * The shards can also be served by other processes over Unix sockets
+ * (see remote.h): fork() starts a process per shard on this machine, and
+ * connect() uses shards served elsewhere, e.g. processes started on
+ * different NUMA nodes.  A batch of queries is then sent to all the
+ * shards at once.  The keys are global, so a shard process indexes only
+ * its slice but needs the whole dataset to scan it.
+ *
+ * \code
+ * ShardedIndex<unsigned> index;
+ * index.init(param, rng, L, S);
+ * index.build(accessor, N);
+ * std::vector<Topk<unsigned> > topks = index.query_batch(queries, Q, T, scanner);
+ *
+ * // Serve the shards from S processes.
+ * index.fork("/tmp", accessor, metric::l2sqr<float>(dim));
+ * topks = index.query_batch(queries, Q, T, scanner);
+ * \endcode
+ */
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <lshkit/mplsh.h>
+#include <lshkit/remote.h>
+
+namespace lshkit {
+
+/// Multi-Probe LSH index split into shards.
+/**
+  * @param KEY the key type, an integer.
+  */
+template <typename KEY>
+class ShardedIndex
+{
+public:
+    typedef MultiProbeLshIndex<KEY> Index;
+    typedef typename Index::Parameter Parameter;
+    typedef KEY Key;
+
+private:
+    std::vector<Index> shards_;         // empty when the shards are remote
+    std::vector<unsigned> begin_;       // shard s holds [begin_[s], begin_[s + 1])
+    unsigned S_;
+    unsigned dim_;
+
+    std::vector<int> remote_;           // connections to the remote shards
+    std::vector<pid_t> children_;       // the processes started by fork()
+    std::vector<std::string> paths_;
+    std::mutex remoteMutex_;            // one batch at a time on the sockets
+
+    ShardedIndex (const ShardedIndex &);
+    ShardedIndex &operator = (const ShardedIndex &);
+
+    // Scatter a batch to the remote shards, gather their K-NNs.
+    template <typename POINT>
+    std::vector<Topk<Key> > remoteBatch (const POINT *const *queries, unsigned Q, RemoteRequest req, std::vector<unsigned> *cnt)
+    {
+        std::vector<char> buf(std::size_t(Q) * dim_ * sizeof(POINT));
+        for (unsigned i = 0; i < Q; ++i) {
+            std::memcpy(&buf[std::size_t(i) * dim_ * sizeof(POINT)], queries[i], dim_ * sizeof(POINT));
+        }
+        std::vector<std::vector<Topk<unsigned> > > found(S_);
+        std::vector<std::vector<unsigned> > counts(S_);
+        std::vector<std::string> errors(S_);
+        {
+            std::lock_guard<std::mutex> lock(remoteMutex_);
+            // A thread per shard, waiting for its answer.
+            parallelRun(S_, [&](unsigned s) {
+                try {
+                    remoteQuery(remote_[s], req, buf.empty() ? 0 : &buf[0], &found[s], &counts[s]);
+                }
+                catch (const std::exception &e) {
+                    errors[s] = e.what();
+                }
+            });
+        }
+        for (unsigned s = 0; s < S_; ++s) {
+            if (!errors[s].empty()) throw std::runtime_error("shard " + std::to_string(s) + ": " + errors[s]);
+        }
+        std::vector<Topk<Key> > topks(Q);
+        if (cnt) cnt->assign(Q, 0);
+        for (unsigned i = 0; i < Q; ++i) {
+            Topk<Key> &t = topks[i];
+            t.reset(req.K);
+            for (unsigned s = 0; s < S_; ++s) {
+                Topk<Key> other;
+                other.reset(req.K);
+                for (unsigned k = 0; k < req.K; ++k) {
+                    other[k] = typename Topk<Key>::Element(Key(found[s][i][k].key), found[s][i][k].dist);
+                }
+                t.merge(other);
+                if (cnt) (*cnt)[i] += counts[s][i];
+            }
+        }
+        return topks;
+    }
+
+    // Merge the K-NNs of every shard.
+    template <typename QUERY>
+    std::vector<Topk<Key> > gather (unsigned Q, std::vector<unsigned> *cnt, QUERY run)
+    {
+        std::vector<Topk<Key> > topks;
+        std::vector<unsigned> c;
+        if (cnt) cnt->assign(Q, 0);
+        for (unsigned s = 0; s < S_; ++s) {
+            std::vector<Topk<Key> > found = run(shards_[s], cnt ? &c : 0);
+            if (s == 0) topks.swap(found);
+            else for (unsigned i = 0; i < Q; ++i) topks[i].merge(found[i]);
+            if (cnt) for (unsigned i = 0; i < Q; ++i) (*cnt)[i] += c[i];
+        }
+        return topks;
+    }
+
+public:
+    ShardedIndex (): S_(0), dim_(0) {}
+
+    ~ShardedIndex ()
+    {
+        shutdown();
+    }
+
+    /// Initialize S empty shards with the same L hash tables.
+    template <typename Engine>
+    void init (const Parameter &param, Engine &engine, unsigned L, unsigned S)
+    {
+        BOOST_VERIFY(S > 0 && remote_.empty());
+        shards_.resize(1);
+        shards_[0].init(param, engine, L);
+        shards_.resize(S, shards_[0]);
+        begin_.assign(S + 1, 0);
+        S_ = S;
+        dim_ = param.dim;
+    }
+
+    /// Number of shards.
+    unsigned getS () const
+    {
+        return S_;
+    }
+
+    /// Shard s, in process.
+    const Index &shard (unsigned s) const
+    {
+        return shards_[s];
+    }
+
+    /// Shard s, in process.
+    Index &shard (unsigned s)
+    {
+        return shards_[s];
+    }
+
+    /// The first key of shard s; shard s holds [begin(s), begin(s + 1)).
+    /**
+      * Shards used with connect() have boundaries only if they were given
+      * to it; otherwise this throws std::logic_error.
+      */
+    unsigned begin (unsigned s) const
+    {
+        if (begin_.empty()) throw std::logic_error("UNKNOWN SHARD BOUNDARIES");
+        return begin_[s];
+    }
+
+    /// Insert the items [0, N), split into S slices.
+    /**
+      * The items are hashed in parallel once, and each shard adds its
+      * slice as in MultiProbeLshIndex::build.
+      */
+    template <typename ACCESSOR>
+    void build (ACCESSOR &accessor, unsigned N, unsigned threads = 0)
+    {
+        typedef typename std::decay<decltype(accessor(0))>::type Value;
+        BOOST_VERIFY(remote_.empty());
+        if (threads == 0) threads = defaultThreads();
+        const unsigned BATCH = Index::INSERT_BATCH;
+        unsigned L = shards_[0].getL();
+        std::vector<unsigned> bins(std::size_t(N) * L);
+        parallelRun(threads, [&](unsigned t) {
+            std::vector<Value> values(BATCH);
+            unsigned end = partBegin(N, threads, t + 1);
+            for (unsigned b = partBegin(N, threads, t); b < end; b += BATCH) {
+                unsigned nb = min(BATCH, end - b);
+                for (unsigned j = 0; j < nb; ++j) {
+                    values[j] = accessor(b + j);
+                }
+                shards_[0].hash(&values[0], nb, &bins[std::size_t(b) * L]);
+            }
+        });
+        for (unsigned s = 0; s <= S_; ++s) {
+            begin_[s] = partBegin(N, S_, s);
+        }
+        for (unsigned s = 0; s < S_; ++s) {
+            unsigned n = begin_[s + 1] - begin_[s];
+            std::vector<Key> keys(n);
+            for (unsigned j = 0; j < n; ++j) keys[j] = Key(begin_[s] + j);
+            if (n) shards_[s].append(&keys[0], &bins[std::size_t(begin_[s]) * L], n, 0, threads);
+        }
+    }
+
+    /// Load the shards from a stream.
+    void load (std::istream &ar)
+    {
+        BOOST_VERIFY(remote_.empty());
+        ar & S_;
+        ar & begin_;
+        shards_.resize(S_);
+        for (unsigned s = 0; s < S_; ++s) {
+            shards_[s].load(ar);
+        }
+        dim_ = shards_[0].getParam().dim;
+    }
+
+    /// Save the shards to a stream.
+    void save (std::ostream &ar)
+    {
+        BOOST_VERIFY(remote_.empty());
+        ar & S_;
+        ar & begin_;
+        for (unsigned s = 0; s < S_; ++s) {
+            shards_[s].save(ar);
+        }
+    }
+
+    /// Query all the shards for K-NNs.
+    /**
+      * In process, the shards are queried one after the other with the
+      * same scanner.  Remote shards are queried in a batch of one, whose
+      * K-NNs are merged into scanner.topk() and whose points scanned are
+      * added with scanner.addCnt().
+      */
+    template <typename SCANNER, typename POINT>
+    void query (const POINT *obj, unsigned T, SCANNER &scanner)
+    {
+        if (!remote_.empty()) {
+            RemoteRequest req = remoteRequest(REMOTE_QUERY, 1, dim_, sizeof(POINT), scanner.getK());
+            req.T = T;
+            std::vector<unsigned> cnt;
+            scanner.topk().merge(remoteBatch(&obj, 1, req, &cnt)[0]);
+            scanner.addCnt(cnt[0]);
+            return;
+        }
+        for (unsigned s = 0; s < S_; ++s) {
+            shards_[s].query(obj, T, scanner);
+        }
+    }
+
+    /// Adaptive query of all the shards.
+    /**
+      * In process, the adaptive probing of each shard stops on the K-NNs
+      * found in all the shards so far.  Remote shards are queried as in
+      * query().
+      */
+    template <typename SCANNER, typename POINT>
+    void query_recall (const POINT *obj, float recall, SCANNER &scanner)
+    {
+        if (!remote_.empty()) {
+            RemoteRequest req = remoteRequest(REMOTE_RECALL, 1, dim_, sizeof(POINT), scanner.getK());
+            req.recall = recall;
+            std::vector<unsigned> cnt;
+            scanner.topk().merge(remoteBatch(&obj, 1, req, &cnt)[0]);
+            scanner.addCnt(cnt[0]);
+            return;
+        }
+        for (unsigned s = 0; s < S_; ++s) {
+            shards_[s].query_recall(obj, recall, scanner);
+        }
+    }
+
+    /// Query a batch of points on all the shards, see MultiProbeLshIndex::query_batch.
+    /**
+      * The K-NNs of the shards are merged, and cnt sums the points scanned
+      * by the shards.  Remote shards are sent the K of scanner.getK(); the
+      * scanner is not copied.
+      */
+    template <typename SCANNER, typename POINT>
+    std::vector<Topk<Key> > query_batch (const POINT *const *queries, unsigned Q, unsigned T, const SCANNER &scanner, unsigned threads = 0, std::vector<unsigned> *cnt = 0)
+    {
+        if (!remote_.empty()) {
+            RemoteRequest req = remoteRequest(REMOTE_QUERY, Q, dim_, sizeof(POINT), scanner.getK());
+            req.T = T;
+            return remoteBatch(queries, Q, req, cnt);
+        }
+        return gather(Q, cnt, [&](const Index &shard, std::vector<unsigned> *c) {
+            return shard.query_batch(queries, Q, T, scanner, threads, c);
+        });
+    }
+
+    /// Adaptive query of a batch of points on all the shards.
+    template <typename SCANNER, typename POINT>
+    std::vector<Topk<Key> > query_recall_batch (const POINT *const *queries, unsigned Q, float recall, const SCANNER &scanner, unsigned threads = 0, std::vector<unsigned> *cnt = 0)
+    {
+        if (!remote_.empty()) {
+            RemoteRequest req = remoteRequest(REMOTE_RECALL, Q, dim_, sizeof(POINT), scanner.getK());
+            req.recall = recall;
+            return remoteBatch(queries, Q, req, cnt);
+        }
+        return gather(Q, cnt, [&](const Index &shard, std::vector<unsigned> *c) {
+            return shard.query_recall_batch(queries, Q, recall, scanner, threads, c);
+        });
+    }
+
+    /// Serve every shard from its own process.
+    /**
+      * @param dir directory of the sockets, dir/shard-S.sock.
+      * @param accessor the accessor of the points, as for TopkScanner.
+      * @param metric the metric of TopkScanner.
+      * @param threads number of threads of each process, 0 for all the
+      * cores.
+      *
+      * The processes are forked, so they share the memory of the data
+      * with this process; the shards are released here.  They run until
+      * shutdown().  Fork before starting other threads.
+      */
+    template <typename ACCESSOR, typename METRIC>
+    void fork (const std::string &dir, const ACCESSOR &accessor, const METRIC &metric, unsigned threads = 1)
+    {
+        BOOST_VERIFY(remote_.empty());
+        for (unsigned s = 0; s < S_; ++s) {
+            std::string path = dir + "/shard-" + std::to_string(s) + ".sock";
+            int fd = remoteListen(path);
+            pid_t pid = ::fork();
+            if (pid < 0) {
+                ::close(fd);
+                shutdown();
+                throw std::runtime_error("cannot fork shard " + std::to_string(s));
+            }
+            if (pid == 0) {
+                for (unsigned r = 0; r < remote_.size(); ++r) ::close(remote_[r]);
+                int status = 0;
+                try {
+                    remoteServe(fd, remoteHandler(shards_[s], accessor, metric, dim_, threads));
+                }
+                catch (...) {
+                    status = 1;
+                }
+                ::_exit(status);
+            }
+            ::close(fd);
+            children_.push_back(pid);
+            paths_.push_back(path);
+            remote_.push_back(remoteConnect(path));
+        }
+        std::vector<Index>().swap(shards_);
+    }
+
+    /// Use S shards served at the given socket paths.
+    /**
+      * @param dim dimension of the points.
+      * @param begin the S + 1 boundaries of the shards, as begin(s), or
+      * empty if they are not known here.
+      *
+      * The servers answer the protocol of remote.h, e.g. with remoteServe
+      * and remoteHandler.  They are not stopped by shutdown().
+      *
+      * A shard holds the keys [begin(s), begin(s + 1)) of the whole
+      * dataset, and its server scans them with an accessor of the whole
+      * dataset: there is no per-shard copy of the data.  E.g. each server
+      * is an mplsh-serve mapping the image saved from shard(s) and the
+      * whole dataset, whose pages the processes of a host then share.
+      */
+    void connect (const std::vector<std::string> &paths, unsigned dim, const std::vector<unsigned> &begin = std::vector<unsigned>())
+    {
+        BOOST_VERIFY(remote_.empty());
+        BOOST_VERIFY(begin.empty() || begin.size() == paths.size() + 1);
+        for (unsigned s = 0; s < paths.size(); ++s) {
+            try {
+                remote_.push_back(remoteConnect(paths[s]));
+            }
+            catch (...) {
+                shutdown();
+                throw;
+            }
+        }
+        std::vector<Index>().swap(shards_);
+        begin_ = begin;
+        S_ = paths.size();
+        dim_ = dim;
+    }
+
+    /// Disconnect from the remote shards, and stop the processes of fork().
+    void shutdown ()
+    {
+        for (unsigned s = 0; s < remote_.size(); ++s) {
+            if (!children_.empty()) remoteShutdown(remote_[s]);
+            ::close(remote_[s]);
+        }
+        for (unsigned s = 0; s < children_.size(); ++s) {
+            int status;
+            ::waitpid(children_[s], &status, 0);
+            ::unlink(paths_[s].c_str());
+        }
+        remote_.clear();
+        children_.clear();
+        paths_.clear();
+    }
+};
+
+}
+
+#endif
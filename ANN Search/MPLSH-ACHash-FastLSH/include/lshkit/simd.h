@@ -0,0 +1,100 @@
+/* 
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+  
+    This file is part of LSHKIT.
+  
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_SIMD__
+#define __LSHKIT_SIMD__
+
+/**
+ * \file simd.h
+ * \brief CPU feature detection and aligned storage for the SIMD kernels.
+ *
+ * The SIMD kernels of LSHKIT are compiled for several instruction sets at
+ * once, and the best variant supported by the running CPU is picked when the
+ * kernel is first used.  So the library doesn't have to be rebuilt with
+ * -march=native to make use of AVX2 or AVX-512, and the same binary still
+ * runs on older machines.
+ *
+ * The environment variable LSHKIT_SIMD can be set to "scalar", "sse",
+ * "avx2" or "avx512" to cap the instruction set used, which is handy when
+ * comparing the kernels.
+ */
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace lshkit {
+
+/// Instruction sets the kernels are specialized for.
+enum SimdLevel {
+    SIMD_SCALAR = 0,
+    SIMD_SSE = 1,       // SSE2
+    SIMD_AVX2 = 2,      // AVX2 + FMA
+    SIMD_AVX512 = 3     // AVX-512F
+};
+
+/// The best instruction set supported by the running CPU.
+SimdLevel simdLevel ();
+
+/// Alignment of the buffers used by the kernels (one cache line).
+static const std::size_t SIMD_ALIGN = 64;
+
+/// STL allocator returning memory aligned to SIMD_ALIGN bytes.
+template <typename T>
+class AlignedAllocator
+{
+public:
+    typedef T value_type;
+
+    AlignedAllocator () {}
+    template <typename U> AlignedAllocator (const AlignedAllocator<U> &) {}
+
+    template <typename U> struct rebind { typedef AlignedAllocator<U> other; };
+
+    T *allocate (std::size_t n) {
+        void *p = 0;
+        if (n == 0) return 0;
+        if (posix_memalign(&p, SIMD_ALIGN, n * sizeof(T)) != 0) throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+
+    void deallocate (T *p, std::size_t) {
+        std::free(p);
+    }
+
+    template <typename U>
+    bool operator == (const AlignedAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator != (const AlignedAllocator<U> &) const { return false; }
+};
+
+/// std::vector with SIMD_ALIGN aligned storage.
+template <typename T>
+class AlignedVector: public std::vector<T, AlignedAllocator<T> >
+{
+public:
+    AlignedVector () {}
+    explicit AlignedVector (std::size_t n, const T &v = T())
+        : std::vector<T, AlignedAllocator<T> >(n, v) {}
+};
+
+}
+
+#endif
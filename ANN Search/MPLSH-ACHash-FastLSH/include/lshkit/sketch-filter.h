@@ -0,0 +1,202 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_SKETCH_FILTER__
+#define __LSHKIT_SKETCH_FILTER__
+
+/**
+ * \file sketch-filter.h
+ * \brief Sketches of a dataset, used to filter the candidates of a query.
+ *
+ * SketchFilter keeps the sketch (see sketch.h) of every point in one
+ * contiguous array, padded to 64-bit words.  Given the sketch of a query,
+ * it drops the keys whose sketch is more than a Hamming distance away,
+ * reading only a few bytes per key and counting bits with the popcnt
+ * instruction, or with VPOPCNTDQ on AVX-512 CPUs that have it.
+ *
+ * MultiProbeLshIndex::setSketchFilter makes the filter a stage of the
+ * queries: the candidates are filtered before being passed to the scanner,
+ * so most of them never cost a distance computation on the vectors.
+ *
+ * \code
+ * typedef Sketch<DeltaLSB<GaussianLsh>, uint64_t> MySketch;
+ * MySketch sketch(2, param, rng);             // 128 bits
+ * SketchFilter<const float *> filter;
+ * filter.reset(sketch, accessor, data.getSize());
+ * index.setSketchFilter(&filter, 40);         // drop Hamming distance > 40
+ * index.query(query, T, scanner);
+ * \endcode
+ */
+
+#include <vector>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <lshkit/common.h>
+#include <lshkit/simd.h>
+#include <lshkit/parallel.h>
+
+namespace lshkit {
+
+/// Kernel filtering keys by the Hamming distance of their sketches.
+/**
+  * @param sketches the sketches, words 64-bit words each.
+  * @param query the sketch of the query.
+  * @param keys n keys.
+  * @param out the keys within maxDist of the query, in their order.
+  * @return # keys in out.
+  */
+typedef unsigned (*HammingFilterKernel) (const uint64_t *sketches, unsigned words, const uint64_t *query,
+                                         const unsigned *keys, unsigned n, unsigned maxDist, unsigned *out);
+
+/// The filter kernel of the given instruction set.
+HammingFilterKernel hammingFilterKernel (SimdLevel level);
+
+/// The filter kernel of simdLevel().
+static inline HammingFilterKernel hammingFilterKernel ()
+{
+    static const HammingFilterKernel kernel = hammingFilterKernel(simdLevel());
+    return kernel;
+}
+
+/// Sketches of a dataset.
+/**
+  * @param DOMAIN the domain of the sketcher, as MultiProbeLshIndex::Domain.
+  */
+template <typename DOMAIN>
+class SketchFilter
+{
+public:
+    typedef DOMAIN Domain;
+    /// sketcher(obj, out) writes the sketch of obj in words() words.
+    typedef std::function<void (Domain, uint64_t *)> Sketcher;
+
+private:
+    Sketcher sketcher_;
+    unsigned words_;
+    unsigned N_;
+    AlignedVector<uint64_t> sketches_;
+    HammingFilterKernel filter_;
+
+    template <typename SKETCH>
+    void setSketcher (const SKETCH &sketch)
+    {
+        typedef typename SKETCH::Chunk Chunk;
+        unsigned words = (sketch.getBits() + 63) / 64;
+        words_ = words;
+        sketcher_ = [sketch, words] (Domain obj, uint64_t *out) {
+            std::fill(out, out + words, 0);
+            sketch.apply(obj, reinterpret_cast<Chunk *>(out));
+        };
+    }
+
+public:
+    SketchFilter (): words_(0), N_(0), filter_(hammingFilterKernel()) {}
+
+    /// Sketch the items [0, N).
+    /**
+      * @param sketch a Sketch<>, which is copied to sketch the queries.
+      * @param accessor accessor(key) returns the object of key.
+      * @param threads # threads, 0 for all the cores.
+      */
+    template <typename SKETCH, typename ACCESSOR>
+    void reset (const SKETCH &sketch, ACCESSOR &accessor, unsigned N, unsigned threads = 0)
+    {
+        setSketcher(sketch);
+        N_ = N;
+        sketches_.resize(std::size_t(N) * words_);
+        if (threads == 0) threads = defaultThreads();
+        parallelRun(threads, [&](unsigned t) {
+            unsigned end = partBegin(N, threads, t + 1);
+            for (unsigned i = partBegin(N, threads, t); i < end; ++i) {
+                sketcher_(accessor(i), &sketches_[std::size_t(i) * words_]);
+            }
+        });
+    }
+
+    /// # 64-bit words of a sketch.
+    unsigned words () const { return words_; }
+
+    unsigned getSize () const { return N_; }
+
+    /// Bytes taken by the sketches.
+    std::size_t getBytes () const { return sketches_.size() * sizeof(uint64_t); }
+
+    /// The sketch of key.
+    const uint64_t *sketch (unsigned key) const
+    {
+        return &sketches_[std::size_t(key) * words_];
+    }
+
+    /// Sketch a query into words() words.
+    void apply (Domain obj, uint64_t *out) const
+    {
+        sketcher_(obj, out);
+    }
+
+    /// Copy the keys within maxDist of query to out, return their number.
+    unsigned filter (const uint64_t *query, const unsigned *keys, unsigned n, unsigned maxDist, unsigned *out) const
+    {
+        return filter_(&sketches_[0], words_, query, keys, n, maxDist, out);
+    }
+
+    /// The same for other key types, without the kernels.
+    template <typename KEY>
+    unsigned filter (const uint64_t *query, const KEY *keys, unsigned n, unsigned maxDist, KEY *out) const
+    {
+        unsigned m = 0;
+        for (unsigned i = 0; i < n; ++i) {
+            const uint64_t *s = sketch(keys[i]);
+            unsigned d = 0;
+            for (unsigned w = 0; w < words_; ++w) {
+                for (uint64_t x = s[w] ^ query[w]; x; x &= x - 1) ++d;
+            }
+            out[m] = keys[i];
+            m += d <= maxDist;
+        }
+        return m;
+    }
+
+    /// Save the sketches.  The sketcher has to be saved separately.
+    void save (std::ostream &os)
+    {
+        os & words_;
+        os & N_;
+        os.write((const char *)sketches_.data(), getBytes());
+    }
+
+    /// Load the sketches, made with sketch.
+    template <typename SKETCH>
+    void load (std::istream &is, const SKETCH &sketch)
+    {
+        setSketcher(sketch);
+        unsigned words;
+        is & words;
+        is & N_;
+        if (words != words_) throw std::runtime_error("sketch size mismatch");
+        sketches_.resize(std::size_t(N_) * words_);
+        is.read((char *)sketches_.data(), getBytes());
+    }
+};
+
+}
+
+#endif
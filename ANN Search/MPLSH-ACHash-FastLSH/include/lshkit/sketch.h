@@ -120,6 +120,8 @@ public:
     typedef typename LSH::Parameter Parameter;
     /// Domain of LSH & Sketcheter
     typedef typename LSH::Domain Domain; 
+    /// Chunk type.
+    typedef CHUNK Chunk;
     /// Number of bits in each CHUNK.
     static const unsigned CHUNK_BIT = sizeof(CHUNK) * 8; // #bits in CHUNK
 
@@ -160,7 +162,7 @@ public:
             out[i] = 0;
             for (unsigned j = 0; j < CHUNK_BIT; ++j) {
                 unsigned k = lsh_[l++](in);
-                out[i] = out[i] | (k << j);
+                out[i] = out[i] | (CHUNK(k) << j);
             }
         }
     }
@@ -178,7 +180,7 @@ public:
             out[i] = 0;
             for (unsigned j = 0; j < CHUNK_BIT; ++j) {
                 unsigned k = lsh_[l](in, &asym[l]);
-                out[i] = out[i] | (k << j);
+                out[i] = out[i] | (CHUNK(k) << j);
                 l++;
             }
         }
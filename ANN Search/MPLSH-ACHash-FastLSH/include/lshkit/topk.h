@@ -47,6 +47,7 @@
  *      e.dist = distance(query, data_point);
  *      knn << e;
  * }
+ * knn.sort(); // nearest first
  * 
  * for (unsigned i = 0; i < knn.size(); ++i) {
  *      cout << knn[i].key << ':' << knn[i].dist << endl;
@@ -90,8 +91,22 @@ struct TopkEntry
   * for each candidate key {
   *     topk << key;
   * }
+  * topk.sort();
   *
-  * At this point topk should contain the best k keys.
+  * At this point topk should contain the best k keys, nearest first.
+  *
+  * While keys are inserted the K entries are kept as a max-heap, the
+  * farthest entry first, so an accepted key costs O(log K) instead of the
+  * O(K) of a sorted insert.  sort() puts them in increasing distance, and
+  * the next insertion turns them back into a heap.  The entries can be
+  * read in either state, but only sorted ones are in rank order: call
+  * sort() before reading topk[i] as the i-th nearest.  The scanners return
+  * sorted results.  Slots not filled yet have the distance
+  * std::numeric_limits<float>::max().
+  *
+  * Keys are not checked for duplicates: the scanners skip the keys already
+  * scanned (see the accessor marks), and merge() drops the keys found in
+  * both Topks.
   */
 template <class KEY>
 class Topk: public std::vector<TopkEntry<KEY> >
@@ -99,11 +114,31 @@ class Topk: public std::vector<TopkEntry<KEY> >
     unsigned K;
     float R;
     float th;
+    bool heap;
+
+    // Replace the farthest entry by t and restore the heap.
+    void replaceTop (const TopkEntry<KEY> &t)
+    {
+        TopkEntry<KEY> *h = &(*this)[0];
+        unsigned n = this->size();
+        unsigned i = 0;
+        for (;;) {
+            unsigned c = 2 * i + 1;
+            if (c >= n) break;
+            if (c + 1 < n && h[c] < h[c + 1]) ++c;
+            if (!(t < h[c])) break;
+            h[i] = h[c];
+            i = c;
+        }
+        h[i] = t;
+        th = std::min(R, h[0].dist);
+    }
+
 public:
     typedef TopkEntry<KEY> Element;
     typedef typename std::vector<TopkEntry<KEY> > Base;
 
-    Topk () {}
+    Topk (): K(0), R(std::numeric_limits<float>::max()), th(R), heap(false) {}
 
     ~Topk () {}
 
@@ -112,6 +147,7 @@ public:
         // if (k == 0) throw std::invalid_argument("K MUST BE POSITIVE");
         R = th = r;
         K = k;
+        heap = false;
         this->resize(k);
         for (typename Base::iterator it = this->begin(); it != this->end(); ++it) it->reset();
     }
@@ -120,6 +156,7 @@ public:
         // if (k == 0) throw std::invalid_argument("K MUST BE POSITIVE");
         R = th = r;
         K = k;
+        heap = false;
         this->resize(k); for (typename
             Base::iterator it = this->begin(); it != this->end(); ++it) {
         it->reset(); it->key = key; }
@@ -128,6 +165,7 @@ public:
     void reset (float r) {
         K = 0;
         R = th = r;
+        heap = false;
         this->clear();
     }
 
@@ -138,40 +176,70 @@ public:
     /// Insert a new element, update the heap.
     Topk &operator << (Element t)
     {
-        //cout<<"dist  123123";
-        //是输出的
-        //原始代碼的t.dist=0.88,th=0.89
         if (!(t.dist < th)) return *this;
         if (K == 0) { // R-NN
             this->push_back(t);
             return *this;
         }
         // K-NN
-        //this->size()=K=15,this应该指的是一个TOPK的大小
-        unsigned i = this->size() - 1;
-        unsigned j;
-        for (;;)
-        {
-            if (i == 0) break;
-            j = i - 1;
-            if (this->at(j).match(t)) return *this;
-            if (this->at(j) < t) break;
-            i = j;
+        if (!heap) {
+            std::make_heap(this->begin(), this->end());
+            heap = true;
         }
-        /* i is the place to insert to */
+        replaceTop(t);
+        return *this;
+    }
 
-        j = this->size() - 1;
-        for (;;)
-        {
-            if (j == i) break;
-            this->at(j) = this->at(j-1);
-            --j;
+    /// Insert n elements.
+    /**
+      * The elements not nearer than the current threshold are skipped
+      * without touching the heap, which is most of them once the heap has
+      * filled up.
+      */
+    Topk &insert (const Element *e, unsigned n)
+    {
+        for (unsigned i = 0; i < n; ++i) {
+            if (e[i].dist < th) *this << e[i];
         }
-        this->at(i) = t;
-        th = this->back().dist;
         return *this;
     }
 
+    /// Put the entries in increasing distance.
+    void sort ()
+    {
+        if (heap) std::sort_heap(this->begin(), this->end());
+        else if (K == 0) std::sort(this->begin(), this->end());
+        heap = false;
+    }
+
+    /// Merge the entries of other, e.g. the results of another thread or shard.
+    /**
+      * The result is sorted and keeps the K of this Topk.  A key found in
+      * both is kept once.  Each thread or shard fills a Topk of its own and
+      * they are merged once it is done, so the scans share nothing.
+      */
+    void merge (const Topk<KEY> &other)
+    {
+        Base all;
+        all.reserve(this->size() + other.size());
+        for (unsigned i = 0; i < this->size(); ++i) {
+            if ((*this)[i].dist < R) all.push_back((*this)[i]);
+        }
+        for (unsigned i = 0; i < other.size(); ++i) {
+            if (other[i].dist < R) all.push_back(other[i]);
+        }
+        std::sort(all.begin(), all.end(), [](const Element &a, const Element &b) {
+            return a.dist < b.dist || (a.dist == b.dist && a.key < b.key);
+        });
+        all.erase(std::unique(all.begin(), all.end(), [](const Element &a, const Element &b) {
+            return a.key == b.key;
+        }), all.end());
+        if (K > 0) all.resize(K);
+        this->swap(all);
+        heap = false;
+        th = (K > 0) ? std::min(R, this->back().dist) : R;
+    }
+
     /// Calculate recall.
     /** Recall = size(this /\ topk) / size(this). */
     float recall (const Topk<KEY> &topk /* to be evaluated */) const
@@ -245,13 +313,37 @@ public:
         return cnt_;
     }
 
-    /// TopK results.
+    /// Count n points scanned elsewhere for the current query.
+    /** E.g. by the remote shards of ShardedIndex. */
+    void addCnt (unsigned n) {
+        cnt_ += n;
+    }
+
+    /// Number of nearest neighbors returned, 0 for an R-NN query.
+    unsigned getK () const {
+        return K_;
+    }
+
+    /// Set K for the queries after the next reset().
+    /** A scanner can thus serve queries of any K. */
+    void setK (unsigned K) {
+        K_ = K;
+    }
+
+    /// TopK results, sorted.
     const Topk<Key> &topk () const {
+        topk_.sort();
         return topk_;
     }
 
-    /// TopK results.
+    /// TopK results, sorted.
     Topk<Key> &topk () {
+        topk_.sort();
+        return topk_;
+    }
+
+    /// TopK results found so far, not sorted (see Topk).
+    const Topk<Key> &unsorted () const {
         return topk_;
     }
 
@@ -265,30 +357,45 @@ public:
             topk_ << typename Topk<Key>::Element(key, metric_(query_, accessor_(key)));
         }
     }
+
+    /// Update the current query by scanning n keys.
+    /**
+      * This is invoked by the sorted scan of the LSH index (see
+      * MultiProbeLshIndex::setSortedScan), with the keys in increasing order.
+      */
+    void operator () (const Key *keys, unsigned n) {
+        for (unsigned i = 0; i < n; ++i) {
+            (*this)(keys[i]);
+        }
+    }
 private:
     ACCESSOR accessor_;
     METRIC metric_;
     unsigned K_;
     float R_;
-    Topk<Key> topk_;
+    mutable Topk<Key> topk_;
     Value query_;
     unsigned cnt_;
 };
 
+/// Top-K scanner with a bounded L2sqr kernel, on vectors of T.
 /**
-  * Specialized for l2sqr.
+  * The base of the TopkScanner of metric::l2sqr<float> and
+  * metric::l2sqr<uint8_t>.
   */
-template <typename ACCESSOR>
-class TopkScanner <ACCESSOR, metric::l2sqr<float> >{
+template <typename ACCESSOR, typename T>
+class BoundedL2sqrScanner {
 public:
     typedef typename ACCESSOR::Key Key;
-    typedef const float *Value;
+    typedef const T *Value;
+    /// Bounded kernel, as BoundedDistanceKernel.
+    typedef float (*Kernel) (const T *a, const T *b, unsigned dim, float bound);
 
-    TopkScanner(const ACCESSOR &accessor, const metric::l2sqr<float> &metric, unsigned K, float R = std::numeric_limits<float>::max())
-        : accessor_(accessor), dim_(metric.dim()), K_(K), R_(R) {
+    BoundedL2sqrScanner(const ACCESSOR &accessor, Kernel l2sqr, unsigned dim, unsigned K, float R)
+        : accessor_(accessor), l2sqr_(l2sqr), dim_(dim), K_(K), R_(R) {
     }
 
-    void reset (const float *query) {
+    void reset (const T *query) {
         query_ = query;
         accessor_.reset();
         topk_.reset(K_, R_);
@@ -299,82 +406,103 @@ public:
         return cnt_;
     }
 
+    void addCnt (unsigned n) {
+        cnt_ += n;
+    }
+
+    unsigned getK () const {
+        return K_;
+    }
+
+    void setK (unsigned K) {
+        K_ = K;
+    }
+
     const Topk<Key> &topk () const {
+        topk_.sort();
         return topk_;
     }
 
     Topk<Key> &topk () {
+        topk_.sort();
         return topk_;
     }
-//该类似乎是一种数据结构，支持对浮点数向量进行top-k查询。
-//该函数将一个无符号整数键作为输入，并使用它从访问器中检索向量。
-//然后，它计算输入查询向量和检索到的向量之间的平方欧几里得距离。
-//如果平方距离低于预先计算的阈值，则函数将键值对添加到前k个列表中。
 
+    const Topk<Key> &unsorted () const {
+        return topk_;
+    }
+
+    /// Update the current query by scanning key.
+    /**
+      * The distance is computed by the bounded l2sqr kernel of distance.h,
+      * which gives up as soon as the partial distance exceeds the current
+      * K-th nearest distance.
+      */
     void operator () (unsigned key) {
-        
         if (accessor_.mark(key)) {
             ++cnt_;
-            unsigned d = dim_ & ~unsigned(7);
-            const float *aa = query_, *end_a = aa + d;
-            const float *bb = accessor_(key), *end_b = bb + d;
-#ifdef __GNUC__
-            __builtin_prefetch(aa, 0, 3);
-            __builtin_prefetch(bb, 0, 0);
-#endif
-            double th = topk_.threshold();
-            //topk_.threshold()=1.024e+07
-            float r = 0.0;
-            float r0, r1, r2, r3, r4, r5, r6, r7;
-
-            const float *a = end_a, *b = end_b;
-
-            r0 = r1 = r2 = r3 = r4 = r5 = r6 = r7 = 0.0;
-
-            switch (dim_ & 7) {
-                case 7: r6 = sqr(a[6] - b[6]);
-                case 6: r5 = sqr(a[5] - b[5]);
-                case 5: r4 = sqr(a[4] - b[4]);
-                case 4: r3 = sqr(a[3] - b[3]);
-                case 3: r2 = sqr(a[2] - b[2]);
-                case 2: r1 = sqr(a[1] - b[1]);
-                case 1: r0 = sqr(a[0] - b[0]);
-            }
+            float r = l2sqr_(query_, accessor_(key), dim_, topk_.threshold());
+            topk_ << typename Topk<Key>::Element(key, r);
+        }
+    }
 
-            a = aa; b = bb;
+    /// # keys ahead whose vectors are prefetched by the batch scan.
+    static const unsigned SCAN_PREFETCH = 4;
 
-            for (; a < end_a; a += 8, b += 8) {
+    /// Update the current query by scanning n keys.
+    /**
+      * The vectors of the keys SCAN_PREFETCH positions ahead are prefetched
+      * as a whole, so that they are in cache when they are scored.  The keys
+      * are expected in increasing order, which makes the vector reads
+      * mostly sequential.
+      */
+    void operator () (const unsigned *keys, unsigned n) {
+        for (unsigned i = 0; i < n; ++i) {
 #ifdef __GNUC__
-                __builtin_prefetch(a + 32, 0, 3);
-                __builtin_prefetch(b + 32, 0, 0);
-#endif
-                r += r0 + r1 + r2 + r3 + r4 + r5 + r6 + r7;
-                if (r > th) return;
-                r0 = sqr(a[0] - b[0]);
-                r1 = sqr(a[1] - b[1]);
-                r2 = sqr(a[2] - b[2]);
-                r3 = sqr(a[3] - b[3]);
-                r4 = sqr(a[4] - b[4]);
-                r5 = sqr(a[5] - b[5]);
-                r6 = sqr(a[6] - b[6]);
-                r7 = sqr(a[7] - b[7]);
+            if (i + SCAN_PREFETCH < n) {
+                const char *v = (const char *)accessor_(keys[i + SCAN_PREFETCH]);
+                for (unsigned off = 0; off < dim_ * sizeof(T); off += 64) {
+                    __builtin_prefetch(v + off, 0, 0);
+                }
             }
-
-            r += r0 + r1 + r2 + r3 + r4 + r5 + r6 + r7;
-            topk_ << typename Topk<Key>::Element(key, r);
+#endif
+            (*this)(keys[i]);
         }
     }
 
 private:
     ACCESSOR accessor_;
+    Kernel l2sqr_;
     unsigned dim_;
     unsigned K_;
     float R_;
-    Topk<Key> topk_;
-    const float* query_;
+    mutable Topk<Key> topk_;
+    const T *query_;
     unsigned cnt_;
 };
 
+/**
+  * Specialized for l2sqr.
+  */
+template <typename ACCESSOR>
+class TopkScanner <ACCESSOR, metric::l2sqr<float> >: public BoundedL2sqrScanner<ACCESSOR, float> {
+public:
+    TopkScanner(const ACCESSOR &accessor, const metric::l2sqr<float> &metric, unsigned K, float R = std::numeric_limits<float>::max())
+        : BoundedL2sqrScanner<ACCESSOR, float>(accessor, distanceKernels().l2sqrBounded, metric.dim(), K, R) {
+    }
+};
+
+/**
+  * Specialized for l2sqr on bytes, with the integer kernel.
+  */
+template <typename ACCESSOR>
+class TopkScanner <ACCESSOR, metric::l2sqr<uint8_t> >: public BoundedL2sqrScanner<ACCESSOR, uint8_t> {
+public:
+    TopkScanner(const ACCESSOR &accessor, const metric::l2sqr<uint8_t> &metric, unsigned K, float R = std::numeric_limits<float>::max())
+        : BoundedL2sqrScanner<ACCESSOR, uint8_t>(accessor, l2sqrByteKernel(), metric.dim(), K, R) {
+    }
+};
+
 
 }
 
@@ -0,0 +1,112 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_VISITED__
+#define __LSHKIT_VISITED__
+
+/**
+ * \file visited.h
+ * \brief Set of the keys visited by a query, with constant time reset.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+namespace lshkit {
+
+/// Set of keys in [0, N) with constant time reset.
+/**
+  * Key k is in the set when stamp[k] equals the current epoch, so reset
+  * just starts a new epoch instead of clearing N flags.  The stamps are
+  * cleared once every 65535 resets, when the epoch wraps around.
+  *
+  * A set takes 2N bytes, so the accessors and scanners do not own one:
+  * they borrow the set of the calling thread, local(N), at the start of
+  * each query, or are given one explicitly.  As a consequence the queries
+  * of a thread must not interleave: a borrower keeps the query() number
+  * seen at its reset and asserts that it is still current when it marks a
+  * key, so that a query started on the same set in between is caught in
+  * debug builds instead of silently wiping the marks.
+  */
+class VisitedSet
+{
+    std::vector<uint16_t> stamps_;
+    uint16_t epoch_;
+    unsigned long query_;   // number of resets, does not wrap with epoch_
+
+public:
+    VisitedSet (): epoch_(1), query_(0) {}
+
+    explicit VisitedSet (unsigned N): stamps_(N, 0), epoch_(1), query_(0) {}
+
+    /// Number of keys.
+    unsigned size () const
+    {
+        return stamps_.size();
+    }
+
+    /// Make room for the keys up to N, which are not in the set.
+    void grow (unsigned N)
+    {
+        if (N > stamps_.size()) stamps_.resize(N, 0);
+    }
+
+    /// The set of the calling thread, with room for at least N keys.
+    static VisitedSet &local (unsigned N)
+    {
+        static thread_local VisitedSet set;
+        set.grow(N);
+        return set;
+    }
+
+    /// The query started by the last reset().
+    unsigned long query () const
+    {
+        return query_;
+    }
+
+    /// Remove all the keys.
+    void reset ()
+    {
+        ++query_;
+        if (++epoch_ == 0) {
+            std::fill(stamps_.begin(), stamps_.end(), 0);
+            epoch_ = 1;
+        }
+    }
+
+    /// Add key, return false if it was already in the set.
+    bool mark (unsigned key)
+    {
+        if (stamps_[key] == epoch_) return false;
+        stamps_[key] = epoch_;
+        return true;
+    }
+
+    /// Whether key is in the set.
+    bool contains (unsigned key) const
+    {
+        return stamps_[key] == epoch_;
+    }
+};
+
+}
+
+#endif
@@ -251,92 +251,113 @@ void APostModel::train (const APostLsh &lsh,
     }
 }
 
-struct PrC {
-    unsigned m;
-    const std::vector<PrH> *prh;
-    friend bool operator < (const PrC &c1, const PrC &c2) {
+typedef APostModel::Scratch::Component PrC;
+typedef APostModel::Scratch::Entry ProbeEntry;
+
+struct ByWindow {
+    bool operator () (const PrC &c1, const PrC &c2) const {
         if (c1.prh->size() <= 1) return false;
         if (c2.prh->size() <= 1) return true;
         return c1.prh->at(1).pr > c2.prh->at(1).pr;
     }
 };
 
-struct Probe {
-    std::vector<unsigned> off;
-    unsigned last;
-    float pr;
-    const std::vector<unsigned> *range;
+struct ByPr {
+    bool operator () (const ProbeEntry &p1, const ProbeEntry &p2) const {
+        return p1.pr < p2.pr;
+    }
+};
 
-    Probe () {
-        BOOST_VERIFY(0);
+// A probe takes one window offset per component.  The heap holds the probes
+// by value and their offsets are kept in the pool of the scratch, so once the
+// scratch has grown generating a sequence does not allocate.
+class Probes
+{
+    APostModel::Scratch &s_;
+    unsigned M_;
+public:
+    Probes (APostModel::Scratch &s, unsigned M): s_(s), M_(M) {
+        s_.pool.clear();
     }
 
-    Probe (const std::vector<unsigned> *range_):
-        off(range_->size()),
-        last(0),
-        range(range_)
-    {
-        std::fill(off.begin(), off.end(), 0);
+    unsigned *off (const ProbeEntry &p) {
+        return &s_.pool[p.off];
     }
 
-    bool canShift () const {
-        if (off[last] != 1) return false;
-        if (last + 1 >= off.size()) return false;
-        if (range->at(last + 1) <= 1) return false;
-        return true;
+    ProbeEntry root () {
+        ProbeEntry p;
+        p.pr = 0;
+        p.last = 0;
+        p.off = s_.pool.size();
+        s_.pool.resize(p.off + M_, 0);
+        return p;
     }
 
-    void shift () {
-        off[last] = 0;
-        last++;
-        off[last] = 1;
+    ProbeEntry copy (const ProbeEntry &p) {
+        ProbeEntry q = p;
+        q.off = s_.pool.size();
+        s_.pool.resize(q.off + M_);
+        for (unsigned i = 0; i < M_; ++i) {
+            s_.pool[q.off + i] = s_.pool[p.off + i];
+        }
+        return q;
     }
 
-    bool canExpand () const {
-        if (last + 1 >= off.size()) return false;
-        if (range->at(last + 1) <= 1) return false;
-        return true;
+    bool canShift (const ProbeEntry &p) {
+        if (off(p)[p.last] != 1) return false;
+        return canExpand(p);
     }
 
-    void expand () {
-        last++;
-        off[last] = 1;
+    void shift (ProbeEntry *p) {
+        unsigned *o = off(*p);
+        o[p->last] = 0;
+        p->last++;
+        o[p->last] = 1;
     }
 
-    bool canExtend () const {
-        if (off[last] + 1 >= range->at(last)) return false;
+    bool canExpand (const ProbeEntry &p) const {
+        if (p.last + 1 >= M_) return false;
+        if (s_.range[p.last + 1] <= 1) return false;
         return true;
     }
 
-    void extend () {
-        off[last]++;
+    void expand (ProbeEntry *p) {
+        p->last++;
+        off(*p)[p->last] = 1;
     }
 
-    friend bool operator < (const Probe &p1, const Probe &p2) {
-        return p1.pr < p2.pr;
+    bool canExtend (const ProbeEntry &p) {
+        if (off(p)[p.last] + 1 >= s_.range[p.last]) return false;
+        return true;
+    }
+
+    void extend (ProbeEntry *p) {
+        off(*p)[p->last]++;
     }
 
-    void setPr (const std::vector<PrC> &pl) {
-        pr = 1.0;
-        for (unsigned i = 0; i < off.size(); ++i) {
-            pr *= pl[i].prh->at(off[i]).pr;
+    void setPr (ProbeEntry *p) {
+        const unsigned *o = off(*p);
+        p->pr = 1.0;
+        for (unsigned i = 0; i < M_; ++i) {
+            p->pr *= s_.components[i].prh->at(o[i]).pr;
         }
-//        std::cerr << "PR = " << pr << std::endl;
     }
 
-    unsigned hash (const APostLsh &lsh,
-                    const std::vector<PrC> &pl) {
+    unsigned hash (const APostLsh &lsh, const ProbeEntry &p) {
+        const unsigned *o = off(p);
         unsigned r = 0;
-        for (unsigned i = 0; i < lsh.M; ++i) {
-            r += lsh.c[pl[i].m] * unsigned(pl[i].prh->at(off[i]).h);
+        for (unsigned i = 0; i < M_; ++i) {
+            const PrC &c = s_.components[i];
+            r += lsh.c[c.m] * unsigned(c.prh->at(o[i]).h);
         }
         return r % lsh.H;
     }
 
 #ifdef DEBUGGING
-    unsigned print (const std::vector<PrC> &pl) {
-        BOOST_FOREACH(unsigned v, off) {
-            std::cout << ' ' << v;
+    void print (const ProbeEntry &p) {
+        const unsigned *o = off(p);
+        for (unsigned i = 0; i < M_; ++i) {
+            std::cout << ' ' << o[i];
         }
         std::cout << std::endl;
     }
@@ -347,6 +368,16 @@ void APostModel::genProbeSequence (const APostLsh &lsh,
                                 APostLsh::Domain query,
                                 float recall, unsigned T,
                                 std::vector<unsigned> *seq) const
+{
+    Scratch scratch;
+    genProbeSequence(lsh, query, recall, T, seq, &scratch);
+}
+
+void APostModel::genProbeSequence (const APostLsh &lsh,
+                                APostLsh::Domain query,
+                                float recall, unsigned T,
+                                std::vector<unsigned> *seq,
+                                Scratch *scratch) const
 {
 #ifdef DEBUGGING
     std::cout << "Range of each hash component:" << std::endl;
@@ -355,7 +386,8 @@ void APostModel::genProbeSequence (const APostLsh &lsh,
     }
     std::cout << "Data distribution on each hash component:" << std::endl;
 #endif
-    std::vector<PrC> pl(lsh.M);
+    std::vector<PrC> &pl = scratch->components;
+    pl.resize(lsh.M);
     for (unsigned i = 0; i < lsh.M; ++i) {
         pl[i].m = i;
 
@@ -382,7 +414,7 @@ void APostModel::genProbeSequence (const APostLsh &lsh,
 #endif
     }
 
-    std::sort(pl.begin(), pl.end());
+    std::sort(pl.begin(), pl.end(), ByWindow());
 #ifdef DEBUGGING
     std::cout << "Sorted probability of windows on each component:" << std::endl;
 
@@ -400,60 +432,62 @@ void APostModel::genProbeSequence (const APostLsh &lsh,
     // generate probe sequence
     seq->clear();
 
-    std::vector<unsigned> range(pl.size());
+    std::vector<unsigned> &range = scratch->range;
+    range.resize(pl.size());
     for (unsigned i = 0; i < range.size(); ++i) {
         range[i] = pl[i].prh->size();
     }
 
+    Probes probes(*scratch, pl.size());
+    std::vector<ProbeEntry> &heap = scratch->heap;
+    heap.clear();
+    heap.push_back(probes.root());
 
-    std::vector<Probe> heap;
-    heap.push_back(Probe(&range));
-
-    heap.back().setPr(pl);
+    probes.setPr(&heap.back());
     float pr = heap.back().pr;
-    seq->push_back(heap.back().hash(lsh, pl));
+    seq->push_back(probes.hash(lsh, heap.back()));
 
     if (pr >= recall) return;
     if (seq->size() >= T) return;
 
-    heap.back().off[0] = 1;
-    heap.back().setPr(pl);
+    probes.off(heap.back())[0] = 1;
+    probes.setPr(&heap.back());
 
     for (;;) {
         if (pr >= recall) break;
         if (seq->size() >= T) break;
         if (heap.empty()) break;
 
-        pop_heap(heap.begin(), heap.end());
-        Probe p = heap.back();
+        pop_heap(heap.begin(), heap.end(), ByPr());
+        ProbeEntry p = heap.back();
         heap.pop_back();
 
-        seq->push_back(p.hash(lsh, pl));
+        seq->push_back(probes.hash(lsh, p));
         pr += p.pr;
 #ifdef DEBUGGING
         std::cout << pr << ", " << p.pr << ":";
-        p.print(pl);
+        probes.print(p);
 #endif
 
-        if (p.canShift()) {
-            heap.push_back(p);
-            heap.back().shift();
-            heap.back().setPr(pl);
-            push_heap(heap.begin(), heap.end());
+        if (probes.canShift(p)) {
+            heap.push_back(probes.copy(p));
+            probes.shift(&heap.back());
+            probes.setPr(&heap.back());
+            push_heap(heap.begin(), heap.end(), ByPr());
         }
 
-        if (p.canExpand()) {
-            heap.push_back(p);
-            heap.back().expand();
-            heap.back().setPr(pl);
-            push_heap(heap.begin(), heap.end());
+        if (probes.canExpand(p)) {
+            heap.push_back(probes.copy(p));
+            probes.expand(&heap.back());
+            probes.setPr(&heap.back());
+            push_heap(heap.begin(), heap.end(), ByPr());
         }
 
-        if (p.canExtend()) {
-            heap.push_back(p);
-            heap.back().extend();
-            heap.back().setPr(pl);
-            push_heap(heap.begin(), heap.end());
+        if (probes.canExtend(p)) {
+            heap.push_back(probes.copy(p));
+            probes.extend(&heap.back());
+            probes.setPr(&heap.back());
+            push_heap(heap.begin(), heap.end(), ByPr());
         }
     }
 #ifdef DEBUGGING
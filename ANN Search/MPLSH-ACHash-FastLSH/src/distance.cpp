@@ -0,0 +1,474 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <lshkit/distance.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LSHKIT_X86_KERNELS
+#endif
+
+namespace lshkit
+{
+    /*
+     * Every kernel is one template over the operation.  An operation
+     * accumulates one value per pair of coordinates, by addition (L2SQR,
+     * L1, DOT) or by maximum (MAX); the accumulators start from 0, so the
+     * zero padding of a masked load does not change the result.
+     */
+    enum { L2SQR, L1, MAX, DOT };
+
+    template <int OP>
+    static inline float stepScalar (float acc, float x, float y)
+    {
+        float d = x - y;
+        switch (OP) {
+        case L2SQR: return acc + d * d;
+        case L1: return acc + std::fabs(d);
+        case MAX: return std::fabs(d) > acc ? std::fabs(d) : acc;
+        default: return acc + x * y;
+        }
+    }
+
+    template <int OP, bool BOUNDED>
+    static float kernelScalar (const float *a, const float *b, unsigned dim, float bound)
+    {
+        float r = 0;
+        unsigned i = 0;
+        if (BOUNDED) {
+            for (; i + DISTANCE_BLOCK <= dim; ) {
+                for (unsigned e = i + DISTANCE_BLOCK; i < e; ++i) {
+                    r = stepScalar<OP>(r, a[i], b[i]);
+                }
+                if (r > bound) return r;
+            }
+        }
+        for (; i < dim; ++i) {
+            r = stepScalar<OP>(r, a[i], b[i]);
+        }
+        return r;
+    }
+
+#ifdef LSHKIT_X86_KERNELS
+    // 4 registers of 4 values, 16 dimensions per iteration.
+    template <int OP>
+    __attribute__((target("sse2")))
+    static inline __m128 stepSse (__m128 acc, __m128 x, __m128 y)
+    {
+        const __m128 sign = _mm_set1_ps(-0.0F);
+        __m128 d = _mm_sub_ps(x, y);
+        switch (OP) {
+        case L2SQR: return _mm_add_ps(acc, _mm_mul_ps(d, d));
+        case L1: return _mm_add_ps(acc, _mm_andnot_ps(sign, d));
+        case MAX: return _mm_max_ps(acc, _mm_andnot_ps(sign, d));
+        default: return _mm_add_ps(acc, _mm_mul_ps(x, y));
+        }
+    }
+
+    template <int OP>
+    __attribute__((target("sse2")))
+    static inline float reduceSse (__m128 a0, __m128 a1, __m128 a2, __m128 a3)
+    {
+        __m128 v;
+        if (OP == MAX) {
+            v = _mm_max_ps(_mm_max_ps(a0, a1), _mm_max_ps(a2, a3));
+            v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+            v = _mm_max_ss(v, _mm_shuffle_ps(v, v, 1));
+        }
+        else {
+            v = _mm_add_ps(_mm_add_ps(a0, a1), _mm_add_ps(a2, a3));
+            v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+            v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+        }
+        return _mm_cvtss_f32(v);
+    }
+
+    template <int OP, bool BOUNDED>
+    __attribute__((target("sse2")))
+    static float kernelSse (const float *a, const float *b, unsigned dim, float bound)
+    {
+        __m128 a0 = _mm_setzero_ps(), a1 = a0, a2 = a0, a3 = a0;
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; ) {
+            for (unsigned e = i + DISTANCE_BLOCK; i < e; i += 16) {
+                a0 = stepSse<OP>(a0, _mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+                a1 = stepSse<OP>(a1, _mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+                a2 = stepSse<OP>(a2, _mm_loadu_ps(a + i + 8), _mm_loadu_ps(b + i + 8));
+                a3 = stepSse<OP>(a3, _mm_loadu_ps(a + i + 12), _mm_loadu_ps(b + i + 12));
+            }
+            if (BOUNDED) {
+                float r = reduceSse<OP>(a0, a1, a2, a3);
+                if (r > bound) return r;
+            }
+        }
+        for (; i + 4 <= dim; i += 4) {
+            a0 = stepSse<OP>(a0, _mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        }
+        float r = reduceSse<OP>(a0, a1, a2, a3);
+        for (; i < dim; ++i) {
+            r = stepScalar<OP>(r, a[i], b[i]);
+        }
+        return r;
+    }
+
+    // 2 registers of 8 values, 16 dimensions per iteration.
+    template <int OP>
+    __attribute__((target("avx2,fma")))
+    static inline __m256 stepAvx2 (__m256 acc, __m256 x, __m256 y)
+    {
+        const __m256 sign = _mm256_set1_ps(-0.0F);
+        __m256 d = _mm256_sub_ps(x, y);
+        switch (OP) {
+        case L2SQR: return _mm256_fmadd_ps(d, d, acc);
+        case L1: return _mm256_add_ps(acc, _mm256_andnot_ps(sign, d));
+        case MAX: return _mm256_max_ps(acc, _mm256_andnot_ps(sign, d));
+        default: return _mm256_fmadd_ps(x, y, acc);
+        }
+    }
+
+    template <int OP>
+    __attribute__((target("avx2,fma")))
+    static inline float reduceAvx2 (__m256 a0, __m256 a1)
+    {
+        __m256 v = OP == MAX ? _mm256_max_ps(a0, a1) : _mm256_add_ps(a0, a1);
+        __m128 lo = _mm256_castps256_ps128(v);
+        __m128 hi = _mm256_extractf128_ps(v, 1);
+        __m128 w;
+        if (OP == MAX) {
+            w = _mm_max_ps(lo, hi);
+            w = _mm_max_ps(w, _mm_movehl_ps(w, w));
+            w = _mm_max_ss(w, _mm_movehdup_ps(w));
+        }
+        else {
+            w = _mm_add_ps(lo, hi);
+            w = _mm_add_ps(w, _mm_movehl_ps(w, w));
+            w = _mm_add_ss(w, _mm_movehdup_ps(w));
+        }
+        return _mm_cvtss_f32(w);
+    }
+
+    template <int OP, bool BOUNDED>
+    __attribute__((target("avx2,fma")))
+    static float kernelAvx2 (const float *a, const float *b, unsigned dim, float bound)
+    {
+        __m256 a0 = _mm256_setzero_ps(), a1 = a0;
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; ) {
+            for (unsigned e = i + DISTANCE_BLOCK; i < e; i += 16) {
+                a0 = stepAvx2<OP>(a0, _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+                a1 = stepAvx2<OP>(a1, _mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+            }
+            if (BOUNDED) {
+                float r = reduceAvx2<OP>(a0, a1);
+                if (r > bound) return r;
+            }
+        }
+        for (; i + 8 <= dim; i += 8) {
+            a0 = stepAvx2<OP>(a0, _mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        }
+        float r = reduceAvx2<OP>(a0, a1);
+        for (; i < dim; ++i) {
+            r = stepScalar<OP>(r, a[i], b[i]);
+        }
+        return r;
+    }
+
+    // 2 registers of 16 values, 32 dimensions per iteration; the tail is
+    // done with masked loads.
+    template <int OP>
+    __attribute__((target("avx512f")))
+    static inline __m512 stepAvx512 (__m512 acc, __m512 x, __m512 y)
+    {
+        __m512 d = _mm512_sub_ps(x, y);
+        switch (OP) {
+        case L2SQR: return _mm512_fmadd_ps(d, d, acc);
+        case L1: return _mm512_add_ps(acc, _mm512_abs_ps(d));
+        case MAX: return _mm512_max_ps(acc, _mm512_abs_ps(d));
+        default: return _mm512_fmadd_ps(x, y, acc);
+        }
+    }
+
+    template <int OP>
+    __attribute__((target("avx512f")))
+    static inline float reduceAvx512 (__m512 a0, __m512 a1)
+    {
+        if (OP == MAX) return _mm512_reduce_max_ps(_mm512_max_ps(a0, a1));
+        return _mm512_reduce_add_ps(_mm512_add_ps(a0, a1));
+    }
+
+    template <int OP, bool BOUNDED>
+    __attribute__((target("avx512f")))
+    static float kernelAvx512 (const float *a, const float *b, unsigned dim, float bound)
+    {
+        __m512 a0 = _mm512_setzero_ps(), a1 = a0;
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; i += DISTANCE_BLOCK) {
+            a0 = stepAvx512<OP>(a0, _mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+            a1 = stepAvx512<OP>(a1, _mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+            if (BOUNDED) {
+                float r = reduceAvx512<OP>(a0, a1);
+                if (r > bound) return r;
+            }
+        }
+        for (; i < dim; i += 16) {
+            unsigned n = dim - i < 16 ? dim - i : 16;
+            __mmask16 m = __mmask16((1U << n) - 1);
+            a0 = stepAvx512<OP>(a0, _mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        }
+        return reduceAvx512<OP>(a0, a1);
+    }
+#endif
+
+    template <int OP>
+    static float unboundedScalar (const float *a, const float *b, unsigned dim)
+    {
+        return kernelScalar<OP, false>(a, b, dim, 0);
+    }
+
+    static const DistanceKernels SCALAR_KERNELS = {
+        unboundedScalar<L2SQR>, unboundedScalar<L1>, unboundedScalar<MAX>, unboundedScalar<DOT>,
+        kernelScalar<L2SQR, true>, kernelScalar<L1, true>
+    };
+
+#ifdef LSHKIT_X86_KERNELS
+    template <int OP>
+    __attribute__((target("sse2")))
+    static float unboundedSse (const float *a, const float *b, unsigned dim)
+    {
+        return kernelSse<OP, false>(a, b, dim, 0);
+    }
+
+    template <int OP>
+    __attribute__((target("avx2,fma")))
+    static float unboundedAvx2 (const float *a, const float *b, unsigned dim)
+    {
+        return kernelAvx2<OP, false>(a, b, dim, 0);
+    }
+
+    template <int OP>
+    __attribute__((target("avx512f")))
+    static float unboundedAvx512 (const float *a, const float *b, unsigned dim)
+    {
+        return kernelAvx512<OP, false>(a, b, dim, 0);
+    }
+
+    static const DistanceKernels SSE_KERNELS = {
+        unboundedSse<L2SQR>, unboundedSse<L1>, unboundedSse<MAX>, unboundedSse<DOT>,
+        kernelSse<L2SQR, true>, kernelSse<L1, true>
+    };
+
+    static const DistanceKernels AVX2_KERNELS = {
+        unboundedAvx2<L2SQR>, unboundedAvx2<L1>, unboundedAvx2<MAX>, unboundedAvx2<DOT>,
+        kernelAvx2<L2SQR, true>, kernelAvx2<L1, true>
+    };
+
+    static const DistanceKernels AVX512_KERNELS = {
+        unboundedAvx512<L2SQR>, unboundedAvx512<L1>, unboundedAvx512<MAX>, unboundedAvx512<DOT>,
+        kernelAvx512<L2SQR, true>, kernelAvx512<L1, true>
+    };
+#endif
+
+    /*
+     * The byte kernels square and sum the differences in 32-bit integers,
+     * DISTANCE_BLOCK dimensions per step; at most 65025 is added to a lane
+     * per pair of dimensions, so they cannot overflow.
+     */
+    static float byteScalar (const uint8_t *a, const uint8_t *b, unsigned dim, float bound)
+    {
+        uint32_t r = 0;
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; ) {
+            for (unsigned e = i + DISTANCE_BLOCK; i < e; ++i) {
+                int d = int(a[i]) - int(b[i]);
+                r += d * d;
+            }
+            if (r > bound) return r;
+        }
+        for (; i < dim; ++i) {
+            int d = int(a[i]) - int(b[i]);
+            r += d * d;
+        }
+        return r;
+    }
+
+#ifdef LSHKIT_X86_KERNELS
+    __attribute__((target("sse2")))
+    static inline uint32_t reduceEpi32Sse (__m128i v)
+    {
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+        v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(v);
+    }
+
+    // 16 bytes unpacked to two registers of 16-bit values.
+    __attribute__((target("sse2")))
+    static inline __m128i stepByteSse (__m128i acc, __m128i x, __m128i y)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+        return _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+
+    __attribute__((target("sse2")))
+    static float byteSse (const uint8_t *a, const uint8_t *b, unsigned dim, float bound)
+    {
+        __m128i acc = _mm_setzero_si128();
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; i += DISTANCE_BLOCK) {
+            acc = stepByteSse(acc, _mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+            acc = stepByteSse(acc, _mm_loadu_si128((const __m128i *)(a + i + 16)), _mm_loadu_si128((const __m128i *)(b + i + 16)));
+            uint32_t r = reduceEpi32Sse(acc);
+            if (r > bound) return r;
+        }
+        for (; i + 16 <= dim; i += 16) {
+            acc = stepByteSse(acc, _mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        }
+        uint32_t r = reduceEpi32Sse(acc);
+        for (; i < dim; ++i) {
+            int d = int(a[i]) - int(b[i]);
+            r += d * d;
+        }
+        return r;
+    }
+
+    __attribute__((target("avx2")))
+    static inline uint32_t reduceEpi32Avx2 (__m256i v)
+    {
+        __m128i w = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        w = _mm_add_epi32(w, _mm_shuffle_epi32(w, _MM_SHUFFLE(1, 0, 3, 2)));
+        w = _mm_add_epi32(w, _mm_shuffle_epi32(w, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(w);
+    }
+
+    // 16 bytes widened to one register of 16-bit values.
+    __attribute__((target("avx2")))
+    static inline __m256i stepByteAvx2 (__m256i acc, const uint8_t *a, const uint8_t *b)
+    {
+        __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)a)),
+                                     _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)b)));
+        return _mm256_add_epi32(acc, _mm256_madd_epi16(d, d));
+    }
+
+    __attribute__((target("avx2")))
+    static float byteAvx2 (const uint8_t *a, const uint8_t *b, unsigned dim, float bound)
+    {
+        __m256i acc = _mm256_setzero_si256();
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; i += DISTANCE_BLOCK) {
+            acc = stepByteAvx2(acc, a + i, b + i);
+            acc = stepByteAvx2(acc, a + i + 16, b + i + 16);
+            uint32_t r = reduceEpi32Avx2(acc);
+            if (r > bound) return r;
+        }
+        for (; i + 16 <= dim; i += 16) {
+            acc = stepByteAvx2(acc, a + i, b + i);
+        }
+        uint32_t r = reduceEpi32Avx2(acc);
+        for (; i < dim; ++i) {
+            int d = int(a[i]) - int(b[i]);
+            r += d * d;
+        }
+        return r;
+    }
+
+    // 32 bytes widened to one register of 16-bit values; the tail is read
+    // with a masked load.
+    __attribute__((target("avx512f,avx512bw,avx512vl")))
+    static inline __m512i stepByteAvx512 (__m512i acc, __m256i x, __m256i y)
+    {
+        __m512i d = _mm512_sub_epi16(_mm512_cvtepu8_epi16(x), _mm512_cvtepu8_epi16(y));
+        return _mm512_add_epi32(acc, _mm512_madd_epi16(d, d));
+    }
+
+    __attribute__((target("avx512f,avx512bw,avx512vl")))
+    static float byteAvx512 (const uint8_t *a, const uint8_t *b, unsigned dim, float bound)
+    {
+        __m512i acc = _mm512_setzero_si512();
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; i += DISTANCE_BLOCK) {
+            acc = stepByteAvx512(acc, _mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+            uint32_t r = _mm512_reduce_add_epi32(acc);
+            if (r > bound) return r;
+        }
+        if (i < dim) {
+            __mmask32 m = __mmask32((1ULL << (dim - i)) - 1);
+            acc = stepByteAvx512(acc, _mm256_maskz_loadu_epi8(m, a + i), _mm256_maskz_loadu_epi8(m, b + i));
+        }
+        return uint32_t(_mm512_reduce_add_epi32(acc));
+    }
+
+    // The same with VNNI, which fuses the multiply and the add.
+    __attribute__((target("avx512f,avx512bw,avx512vl,avx512vnni")))
+    static inline __m512i stepByteVnni (__m512i acc, __m256i x, __m256i y)
+    {
+        __m512i d = _mm512_sub_epi16(_mm512_cvtepu8_epi16(x), _mm512_cvtepu8_epi16(y));
+        return _mm512_dpwssd_epi32(acc, d, d);
+    }
+
+    __attribute__((target("avx512f,avx512bw,avx512vl,avx512vnni")))
+    static float byteVnni (const uint8_t *a, const uint8_t *b, unsigned dim, float bound)
+    {
+        __m512i acc = _mm512_setzero_si512();
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; i += DISTANCE_BLOCK) {
+            acc = stepByteVnni(acc, _mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+            uint32_t r = _mm512_reduce_add_epi32(acc);
+            if (r > bound) return r;
+        }
+        if (i < dim) {
+            __mmask32 m = __mmask32((1ULL << (dim - i)) - 1);
+            acc = stepByteVnni(acc, _mm256_maskz_loadu_epi8(m, a + i), _mm256_maskz_loadu_epi8(m, b + i));
+        }
+        return uint32_t(_mm512_reduce_add_epi32(acc));
+    }
+#endif
+
+    ByteDistanceKernel l2sqrByteKernel (SimdLevel level)
+    {
+#ifdef LSHKIT_X86_KERNELS
+        switch (level) {
+        case SIMD_AVX512:
+            if (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) {
+                if (__builtin_cpu_supports("avx512vnni")) return byteVnni;
+                return byteAvx512;
+            }
+            return byteAvx2;
+        case SIMD_AVX2: return byteAvx2;
+        case SIMD_SSE: return byteSse;
+        default: break;
+        }
+#endif
+        return byteScalar;
+    }
+
+    const DistanceKernels &distanceKernels (SimdLevel level)
+    {
+        switch (level) {
+#ifdef LSHKIT_X86_KERNELS
+        case SIMD_AVX512: return AVX512_KERNELS;
+        case SIMD_AVX2: return AVX2_KERNELS;
+        case SIMD_SSE: return SSE_KERNELS;
+#endif
+        default: return SCALAR_KERNELS;
+        }
+    }
+}
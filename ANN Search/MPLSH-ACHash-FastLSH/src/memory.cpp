@@ -0,0 +1,200 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <mutex>
+#include <stdexcept>
+#include <lshkit/simd.h>
+#include <lshkit/memory.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define LSHKIT_LINUX_MEMORY
+#endif
+
+namespace lshkit {
+
+HugePages parseHugePages (const std::string &s)
+{
+    if (s == "none") return HUGEPAGES_NONE;
+    if (s == "thp") return HUGEPAGES_TRANSPARENT;
+    if (s == "explicit") return HUGEPAGES_EXPLICIT;
+    throw std::runtime_error("unknown huge page setting " + s);
+}
+
+void parseNuma (const std::string &s, MemoryPolicy *policy)
+{
+    if (s == "default") {
+        policy->numa = NUMA_DEFAULT;
+    }
+    else if (s == "interleave") {
+        policy->numa = NUMA_INTERLEAVE;
+    }
+    else if (s.compare(0, 5, "bind:") == 0 && s.size() > 5
+            && s.find_first_not_of("0123456789", 5) == std::string::npos) {
+        policy->numa = NUMA_BIND;
+        policy->node = std::atoi(s.c_str() + 5);
+    }
+    else {
+        throw std::runtime_error("unknown NUMA policy " + s);
+    }
+}
+
+static MemoryPolicy envMemoryPolicy ()
+{
+    MemoryPolicy policy;
+    const char *huge = std::getenv("LSHKIT_HUGEPAGES");
+    if (huge != 0) policy.hugePages = parseHugePages(huge);
+    const char *numa = std::getenv("LSHKIT_NUMA");
+    if (numa != 0) parseNuma(numa, &policy);
+    return policy;
+}
+
+static std::mutex policyMutex;
+
+static MemoryPolicy &currentPolicy ()
+{
+    static MemoryPolicy policy = envMemoryPolicy();
+    return policy;
+}
+
+MemoryPolicy memoryPolicy ()
+{
+    std::lock_guard<std::mutex> lock(policyMutex);
+    return currentPolicy();
+}
+
+void setMemoryPolicy (const MemoryPolicy &policy)
+{
+    std::lock_guard<std::mutex> lock(policyMutex);
+    currentPolicy() = policy;
+}
+
+#ifdef LSHKIT_LINUX_MEMORY
+
+// From <numaif.h>, so that libnuma is not needed.
+static const int LSHKIT_MPOL_BIND = 2;
+static const int LSHKIT_MPOL_INTERLEAVE = 3;
+static const unsigned long LSHKIT_MPOL_F_MEMS_ALLOWED = 1 << 2;
+static const unsigned MAX_NODES = 1024;
+
+static inline std::size_t roundLarge (std::size_t bytes)
+{
+    return (bytes + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+}
+
+// Map len bytes aligned to LARGE_PAGE_SIZE, trimming an over-sized mapping.
+static void *mapAligned (std::size_t len)
+{
+    std::size_t span = len + LARGE_PAGE_SIZE;
+    void *p = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+    char *start = static_cast<char *>(p);
+    char *aligned = reinterpret_cast<char *>(roundLarge(reinterpret_cast<std::size_t>(start)));
+    if (aligned > start) munmap(start, aligned - start);
+    char *end = start + span;
+    if (end > aligned + len) munmap(aligned + len, end - (aligned + len));
+    return aligned;
+}
+
+/*
+ * The policy has to be set before the pages are touched, so a buffer
+ * loaded by a single thread still ends up spread over the nodes.
+ */
+static bool bindNuma (void *p, std::size_t len, const MemoryPolicy &policy)
+{
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+    std::memset(mask, 0, sizeof mask);
+    int mode;
+    if (policy.numa == NUMA_BIND) {
+        if (policy.node >= MAX_NODES) return false;
+        mask[policy.node / (8 * sizeof(unsigned long))] |= 1UL << (policy.node % (8 * sizeof(unsigned long)));
+        mode = LSHKIT_MPOL_BIND;
+    }
+    else {
+        if (syscall(SYS_get_mempolicy, NULL, mask, MAX_NODES, NULL, LSHKIT_MPOL_F_MEMS_ALLOWED) != 0) return false;
+        mode = LSHKIT_MPOL_INTERLEAVE;
+    }
+    return syscall(SYS_mbind, p, len, mode, mask, MAX_NODES + 1, 0) == 0;
+}
+
+void *allocLarge (std::size_t bytes)
+{
+    if (bytes == 0) return NULL;
+    if (bytes < LARGE_PAGE_SIZE) {
+        void *p = 0;
+        if (posix_memalign(&p, SIMD_ALIGN, bytes) != 0) throw std::bad_alloc();
+        return p;
+    }
+    MemoryPolicy policy = memoryPolicy();
+    std::size_t len = roundLarge(bytes);
+    void *p = NULL;
+    if (policy.hugePages == HUGEPAGES_EXPLICIT) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED) {
+            p = NULL;
+            policy.hugePages = HUGEPAGES_TRANSPARENT;
+        }
+    }
+    if (p == NULL) {
+        p = mapAligned(len);
+        if (p == NULL) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+        if (policy.hugePages == HUGEPAGES_TRANSPARENT) madvise(p, len, MADV_HUGEPAGE);
+        else if (policy.hugePages == HUGEPAGES_NONE) madvise(p, len, MADV_NOHUGEPAGE);
+#endif
+    }
+    // A failed interleave leaves the default placement, as on a
+    // single-node machine; a failed binding is an error.
+    if (policy.numa != NUMA_DEFAULT && !bindNuma(p, len, policy) && policy.numa == NUMA_BIND) {
+        munmap(p, len);
+        throw std::runtime_error("cannot bind memory to the NUMA node");
+    }
+    return p;
+}
+
+void freeLarge (void *p, std::size_t bytes)
+{
+    if (p == NULL) return;
+    if (bytes < LARGE_PAGE_SIZE) std::free(p);
+    else munmap(p, roundLarge(bytes));
+}
+
+#else
+
+void *allocLarge (std::size_t bytes)
+{
+    if (bytes == 0) return NULL;
+    void *p = 0;
+    if (posix_memalign(&p, SIMD_ALIGN, bytes) != 0) throw std::bad_alloc();
+    return p;
+}
+
+void freeLarge (void *p, std::size_t)
+{
+    std::free(p);
+}
+
+#endif
+
+}
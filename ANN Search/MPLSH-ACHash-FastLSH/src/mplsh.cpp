@@ -88,15 +88,38 @@ namespace lshkit
 
     void MultiProbeLsh::genProbeSequence (Domain obj, std::vector<unsigned>
             &seq, unsigned T) const
+    {
+        std::vector<unsigned> base(lsh_.size());
+        std::vector<float> delta(lsh_.size());
+        if (lsh_[0].getFamily() == FAMILY_ACHASH) {
+            // The functions are applied to the Hadamard transform of the
+            // point, as in MultiProbeLshIndex.
+            unsigned dim = lsh_[0].getDim();
+            AlignedVector<float> buf(fwht::paddedSize(dim));
+            fwht::pad(obj, dim, &buf[0], buf.size());
+            fwht::transform(&buf[0], buf.size());
+            evaluate(&buf[0], &base[0], &delta[0]);
+        }
+        else {
+            evaluate(obj, &base[0], &delta[0]);
+        }
+        genProbeSequence(&base[0], &delta[0], seq, T);
+    }
+
+    void MultiProbeLsh::genProbeSequence (const unsigned *base, const float *deltas,
+            std::vector<unsigned> &seq, unsigned T) const
     {
         ProbeSequence scores;
-        std::vector<unsigned> base;
+        genProbeSequence(base, deltas, seq, T, scores);
+    }
+
+    unsigned MultiProbeLsh::sortScores (const unsigned *base, const float *deltas,
+            ProbeSequence &scores, unsigned *up) const
+    {
         scores.resize(2 * lsh_.size());
-        base.resize(lsh_.size());
         for (unsigned i = 0; i < lsh_.size(); ++i)
         {
-            float delta;
-            base[i] = Super::lsh_[i](obj, &delta);
+            float delta = deltas[i];
             scores[2*i].mask = i;
             scores[2*i].reserve = 1;    // direction
             scores[2*i].score = delta;
@@ -106,6 +129,25 @@ namespace lshkit
         }
         std::sort(scores.begin(), scores.end());
 
+        // The template probes shift the first M components of the order,
+        // so the hash value of a probe differs from that of the query by
+        // +/- up[i] for each component i it shifts.
+        unsigned hash = 0;
+        for (unsigned i = 0; i < lsh_.size(); ++i)
+        {
+            unsigned c = scores[i].mask;
+            hash += base[c] * a_[c];
+            up[i] = scores[i].reserve * a_[c];
+        }
+        return hash;
+    }
+
+    void MultiProbeLsh::genProbeSequence (const unsigned *base, const float *deltas,
+            std::vector<unsigned> &seq, unsigned T, ProbeSequence &scores) const
+    {
+        unsigned up[Probe::MAX_M];
+        unsigned hash = sortScores(base, deltas, scores, up);
+
         ProbeSequence &tmpl = __probeSequenceTemplates[lsh_.size()];
 
         seq.clear();
@@ -113,26 +155,113 @@ namespace lshkit
                 it != tmpl.end(); ++it)
         {
             if (seq.size() == T) break;
-            const Probe &probe = *it;
-            unsigned hash = 0;
-            for (unsigned i = 0; i < lsh_.size(); ++i)
+            seq.push_back(perturb(hash, up, *it));
+        }
+    }
+
+    void MultiProbeLsh::ProbeGenerator::reset (const MultiProbeLsh &lsh,
+            const unsigned *base, const float *delta, ProbeSequence &scores,
+            bool directed)
+    {
+        lsh_ = &lsh;
+        next_ = 0;
+        hash_ = lsh.sortScores(base, delta, scores, up_);
+        if (!directed)
+        {
+            tmpl_ = &__probeSequenceTemplates[lsh.getRepeat()];
+            return;
+        }
+        tmpl_ = 0;
+
+        // The score of shifting a component is its distance to the
+        // boundary in that direction, and that of a set is the sum of
+        // their squares.  The sorted order is the same for the squares.
+        unsigned M = lsh.getRepeat();
+        size_ = 2 * M;
+        hash_ = 0;
+        for (unsigned i = 0; i < M; ++i)
+        {
+            hash_ += base[i] * lsh.a_[i];
+        }
+        for (unsigned j = 0; j < size_; ++j)
+        {
+            const Probe &s = scores[j];
+            square_[j] = s.score * s.score;
+            // reserve is 1 for the distance to the lower boundary.
+            move_[j] = (0u - s.reserve) * lsh.a_[s.mask];
+            comp_[j] = s.mask;
+        }
+        heap_.clear();
+        Shifts first;
+        first.score = square_[0];
+        first.hash = hash_ + move_[0];
+        first.last = 0;
+        first.once = leftshift(comp_[0]);
+        first.twice = 0;
+        heap_.push_back(first);
+        more_ = true;
+    }
+
+    // Pop the sets until a valid one, whose hash value becomes that of the
+    // next probe.  Each set popped pushes its two successors: the last
+    // component replaced by the next one in the order (shift), and the
+    // next one added (expand).  Every set is reached once, and in
+    // increasing score.  The successors only change the last component,
+    // so a set shifting a component in both directions other than its
+    // last one has no valid successor and is not pushed, which keeps the
+    // heap within a few entries of the number of probes.
+    void MultiProbeLsh::ProbeGenerator::advance ()
+    {
+        if (next_ >= Probe::MAX_T)
+        {
+            more_ = false;
+            return;
+        }
+        while (!heap_.empty())
+        {
+            std::pop_heap(heap_.begin(), heap_.end());
+            Shifts s = heap_.back();
+            heap_.pop_back();
+            unsigned a = s.last;
+            if (a + 1 < size_)
             {
-                unsigned h = base[scores[i].mask];
-                if (probe.mask & leftshift(i))
+                unsigned long long prev = leftshift(comp_[a]);
+                unsigned long long next = leftshift(comp_[a + 1]);
+
+                Shifts e = s;
+                e.score += square_[a + 1];
+                e.hash += move_[a + 1];
+                e.last = a + 1;
+                if (e.once & next) e.twice |= next;
+                else e.once |= next;
+
+                Shifts t = s;
+                t.score += square_[a + 1] - square_[a];
+                t.hash += move_[a + 1] - move_[a];
+                t.last = a + 1;
+                if (t.twice & prev) t.twice &= ~prev;
+                else t.once &= ~prev;
+                if (t.once & next) t.twice |= next;
+                else t.once |= next;
+
+                if ((e.twice & ~next) == 0)
                 {
-                    if (probe.shift & leftshift(i))
-                    {
-                        h += scores[i].reserve;
-                    }
-                    else
-                    {
-                        h += unsigned(-1) * scores[i].reserve;
-                    }
+                    heap_.push_back(e);
+                    std::push_heap(heap_.begin(), heap_.end());
                 }
-                hash += h * a_[scores[i].mask];
+                if ((t.twice & ~next) == 0)
+                {
+                    heap_.push_back(t);
+                    std::push_heap(heap_.begin(), heap_.end());
+                }
+            }
+            if (s.twice == 0)
+            {
+                hash_ = s.hash;
+                return;
             }
-            seq.push_back(hash % H_);
         }
+        more_ = false;
     }
 }
 
@@ -0,0 +1,353 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <atomic>
+#include <stdexcept>
+#include <lshkit/common.h>
+#include <lshkit/parallel.h>
+#include <lshkit/pq.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LSHKIT_X86_KERNELS
+#endif
+
+namespace lshkit
+{
+    static inline float l2sqr (const float *a, const float *b, unsigned dim)
+    {
+        float r = 0;
+        for (unsigned i = 0; i < dim; ++i) {
+            float d = a[i] - b[i];
+            r += d * d;
+        }
+        return r;
+    }
+
+    // Index of the nearest of the K centroids of dim dimensions to x.
+    static inline unsigned nearest (const float *x, const float *centroids, unsigned K, unsigned dim)
+    {
+        unsigned best = 0;
+        float bestDist = std::numeric_limits<float>::max();
+        for (unsigned k = 0; k < K; ++k) {
+            float d = l2sqr(x, centroids + std::size_t(k) * dim, dim);
+            if (d < bestDist) {
+                bestDist = d;
+                best = k;
+            }
+        }
+        return best;
+    }
+
+    /*
+     * Lloyd's k-means on the sub-vectors of sub-space m of the sample, the
+     * first ksub_ of which are the initial centroids.  An empty cluster
+     * takes over half of the largest one: it gets a copy of its centroid
+     * moved a little apart.
+     */
+    void ProductQuantizer::trainSample (const Matrix<float> &data, const std::vector<unsigned> &sample, unsigned iterations, unsigned threads)
+    {
+        if (threads == 0) threads = defaultThreads();
+        if (threads > M_) threads = M_;
+        std::atomic<unsigned> next(0);
+        parallelRun(threads, [&](unsigned) {
+            std::vector<float> sums(std::size_t(ksub_) * dsub_);
+            std::vector<unsigned> counts(ksub_);
+            for (;;) {
+                unsigned m = next++;
+                if (m >= M_) break;
+                float *cent = &centroids_[std::size_t(m) * ksub_ * dsub_];
+                unsigned off = m * dsub_;
+                for (unsigned k = 0; k < ksub_; ++k) {
+                    std::copy(data[sample[k]] + off, data[sample[k]] + off + dsub_, cent + k * dsub_);
+                }
+                for (unsigned it = 0; it < iterations; ++it) {
+                    std::fill(sums.begin(), sums.end(), 0);
+                    std::fill(counts.begin(), counts.end(), 0);
+                    for (unsigned i = 0; i < sample.size(); ++i) {
+                        const float *x = data[sample[i]] + off;
+                        unsigned k = nearest(x, cent, ksub_, dsub_);
+                        ++counts[k];
+                        for (unsigned d = 0; d < dsub_; ++d) sums[k * dsub_ + d] += x[d];
+                    }
+                    for (unsigned k = 0; k < ksub_; ++k) {
+                        if (counts[k] == 0) continue;
+                        for (unsigned d = 0; d < dsub_; ++d) {
+                            cent[k * dsub_ + d] = sums[k * dsub_ + d] / counts[k];
+                        }
+                    }
+                    for (unsigned k = 0; k < ksub_; ++k) {
+                        if (counts[k] != 0) continue;
+                        unsigned big = std::max_element(counts.begin(), counts.end()) - counts.begin();
+                        for (unsigned d = 0; d < dsub_; ++d) {
+                            float c = cent[big * dsub_ + d];
+                            float eps = (d % 2 ? 1.0F : -1.0F) * (std::fabs(c) + 1e-6F) * 1e-3F;
+                            cent[k * dsub_ + d] = c + eps;
+                            cent[big * dsub_ + d] = c - eps;
+                        }
+                        counts[k] = counts[big] / 2;
+                        counts[big] -= counts[k];
+                    }
+                }
+            }
+        });
+    }
+
+    void ProductQuantizer::encode (const float *x, uint8_t *code) const
+    {
+        std::fill(code, code + codeSize(), 0);
+        for (unsigned m = 0; m < M_; ++m) {
+            unsigned k = nearest(x + m * dsub_, centroid(m, 0), ksub_, dsub_);
+            if (nbits_ == 8) code[m] = k;
+            else code[m / 2] |= k << ((m & 1) * 4);
+        }
+    }
+
+    void ProductQuantizer::decode (const uint8_t *code, float *x) const
+    {
+        for (unsigned m = 0; m < M_; ++m) {
+            const float *c = centroid(m, subCode(code, m));
+            std::copy(c, c + dsub_, x + m * dsub_);
+        }
+    }
+
+    void ProductQuantizer::table (const float *query, float *lut) const
+    {
+        for (unsigned m = 0; m < M_; ++m) {
+            for (unsigned k = 0; k < ksub_; ++k) {
+                lut[m * ksub_ + k] = l2sqr(query + m * dsub_, centroid(m, k), dsub_);
+            }
+        }
+    }
+
+    void ProductQuantizer::save (std::ostream &os)
+    {
+        os & dim_;
+        os & M_;
+        os & nbits_;
+        os & centroids_;
+    }
+
+    void ProductQuantizer::load (std::istream &is)
+    {
+        is & dim_;
+        is & M_;
+        is & nbits_;
+        if ((nbits_ != 4 && nbits_ != 8) || M_ == 0 || dim_ % M_ != 0) {
+            throw std::runtime_error("invalid product quantizer");
+        }
+        ksub_ = 1U << nbits_;
+        dsub_ = dim_ / M_;
+        is & centroids_;
+    }
+
+    void PQCodes::reset (const ProductQuantizer &pq, const Matrix<float> &data, unsigned threads)
+    {
+        BOOST_VERIFY(data.getDim() == pq.getDim());
+        N_ = data.getSize();
+        bytes_ = pq.codeSize();
+        codes_.resize(std::size_t(N_) * bytes_);
+        if (threads == 0) threads = defaultThreads();
+        parallelRun(threads, [&](unsigned t) {
+            unsigned end = partBegin(N_, threads, t + 1);
+            for (unsigned i = partBegin(N_, threads, t); i < end; ++i) {
+                pq.encode(data[i], &codes_[std::size_t(i) * bytes_]);
+            }
+        });
+    }
+
+    void PQCodes::save (std::ostream &os)
+    {
+        os & N_;
+        os & bytes_;
+        os.write((const char *)codes_.data(), codes_.size());
+    }
+
+    void PQCodes::load (std::istream &is)
+    {
+        is & N_;
+        is & bytes_;
+        codes_.resize(std::size_t(N_) * bytes_);
+        is.read((char *)codes_.data(), codes_.size());
+    }
+
+    void quantizeTable (const float *lut, unsigned M, uint8_t *qlut, float *bias, float *scale)
+    {
+        float b = 0, range = 0;
+        for (unsigned m = 0; m < M; ++m) {
+            const float *t = lut + m * 16;
+            float lo = *std::min_element(t, t + 16);
+            float hi = *std::max_element(t, t + 16);
+            b += lo;
+            range = std::max(range, hi - lo);
+        }
+        float s = range > 0 ? range / 255 : 1;
+        for (unsigned m = 0; m < M; ++m) {
+            const float *t = lut + m * 16;
+            float lo = *std::min_element(t, t + 16);
+            for (unsigned k = 0; k < 16; ++k) {
+                float q = std::floor((t[k] - lo) / s + 0.5F);
+                qlut[m * 16 + k] = uint8_t(std::min(255.0F, q));
+            }
+        }
+        *bias = b;
+        *scale = s;
+    }
+
+    /*
+     * The scan kernels add up the table entries with unsigned saturation,
+     * so that every variant returns the same sums.
+     */
+    static void scanScalar (const uint8_t *lut, const uint8_t *const *codes, unsigned M, uint16_t *out)
+    {
+        for (unsigned j = 0; j < PQ_BLOCK; ++j) {
+            unsigned s = 0;
+            for (unsigned m = 0; m < M; ++m) {
+                unsigned c = (codes[j][m / 2] >> ((m & 1) * 4)) & 0xF;
+                s = std::min(65535U, s + lut[m * 16 + c]);
+            }
+            out[j] = s;
+        }
+    }
+
+#ifdef LSHKIT_X86_KERNELS
+    // w <= 16 bytes of a code, without reading past them.
+    __attribute__((target("ssse3")))
+    static inline __m128i loadCode (const uint8_t *p, unsigned w)
+    {
+        if (w == 16) return _mm_loadu_si128((const __m128i *)p);
+        if (w == 8) return _mm_loadl_epi64((const __m128i *)p);
+        uint8_t buf[16] = {0};
+        std::copy(p, p + w, buf);
+        return _mm_loadu_si128((const __m128i *)buf);
+    }
+
+    // Bytes [b, b + w) of 16 codes, transposed: x[k] holds byte b + k of
+    // every code.  Four rounds of unpacks, of 8, 16, 32 and 64 bits.
+    __attribute__((target("ssse3")))
+    static inline void transposeCodes (const uint8_t *const *codes, unsigned b, unsigned w, __m128i *x)
+    {
+        __m128i t[16], u[16];
+        for (unsigned i = 0; i < 16; ++i) u[i] = loadCode(codes[i] + b, w);
+        for (unsigned i = 0; i < 8; ++i) {
+            t[i] = _mm_unpacklo_epi8(u[2 * i], u[2 * i + 1]);
+            t[i + 8] = _mm_unpackhi_epi8(u[2 * i], u[2 * i + 1]);
+        }
+        for (unsigned h = 0; h < 16; h += 8) {
+            for (unsigned i = 0; i < 4; ++i) {
+                u[h + i] = _mm_unpacklo_epi16(t[h + 2 * i], t[h + 2 * i + 1]);
+                u[h + 4 + i] = _mm_unpackhi_epi16(t[h + 2 * i], t[h + 2 * i + 1]);
+            }
+        }
+        for (unsigned g = 0; g < 16; g += 4) {
+            for (unsigned i = 0; i < 2; ++i) {
+                t[g + i] = _mm_unpacklo_epi32(u[g + 2 * i], u[g + 2 * i + 1]);
+                t[g + 2 + i] = _mm_unpackhi_epi32(u[g + 2 * i], u[g + 2 * i + 1]);
+            }
+        }
+        for (unsigned c = 0; c < 16; c += 2) {
+            x[c] = _mm_unpacklo_epi64(t[c], t[c + 1]);
+            x[c + 1] = _mm_unpackhi_epi64(t[c], t[c + 1]);
+        }
+    }
+
+    // Two halves of 16 candidates, one pshufb per sub-space and half.  The
+    // codes are transposed 16 bytes (32 sub-spaces) at a time.
+    __attribute__((target("ssse3")))
+    static void scanSsse3 (const uint8_t *lut, const uint8_t *const *codes, unsigned M, uint16_t *out)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i nibble = _mm_set1_epi8(0xF);
+        unsigned bytes = (M + 1) / 2;
+        for (unsigned h = 0; h < PQ_BLOCK; h += 16) {
+            __m128i lo = zero, hi = zero;
+            for (unsigned b = 0; b < bytes; b += 16) {
+                unsigned w = std::min(16U, bytes - b);
+                __m128i x[16];
+                transposeCodes(codes + h, b, w, x);
+                for (unsigned k = 0; k < w; ++k) {
+                    unsigned m = 2 * (b + k);
+                    __m128i t = _mm_loadu_si128((const __m128i *)(lut + m * 16));
+                    __m128i r = _mm_shuffle_epi8(t, _mm_and_si128(x[k], nibble));
+                    lo = _mm_adds_epu16(lo, _mm_unpacklo_epi8(r, zero));
+                    hi = _mm_adds_epu16(hi, _mm_unpackhi_epi8(r, zero));
+                    if (m + 1 == M) break;
+                    t = _mm_loadu_si128((const __m128i *)(lut + (m + 1) * 16));
+                    r = _mm_shuffle_epi8(t, _mm_and_si128(_mm_srli_epi16(x[k], 4), nibble));
+                    lo = _mm_adds_epu16(lo, _mm_unpacklo_epi8(r, zero));
+                    hi = _mm_adds_epu16(hi, _mm_unpackhi_epi8(r, zero));
+                }
+            }
+            _mm_storeu_si128((__m128i *)(out + h), lo);
+            _mm_storeu_si128((__m128i *)(out + h + 8), hi);
+        }
+    }
+
+    // The table is repeated in both 128-bit lanes, which hold candidates
+    // 0-15 and 16-31; one pshufb per sub-space.
+    __attribute__((target("avx2")))
+    static void scanAvx2 (const uint8_t *lut, const uint8_t *const *codes, unsigned M, uint16_t *out)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i nibble = _mm256_set1_epi8(0xF);
+        unsigned bytes = (M + 1) / 2;
+        __m256i lo = zero, hi = zero;
+        for (unsigned b = 0; b < bytes; b += 16) {
+            unsigned w = std::min(16U, bytes - b);
+            __m128i x0[16], x1[16];
+            transposeCodes(codes, b, w, x0);
+            transposeCodes(codes + 16, b, w, x1);
+            for (unsigned k = 0; k < w; ++k) {
+                unsigned m = 2 * (b + k);
+                __m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(x0[k]), x1[k], 1);
+                __m256i t = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(lut + m * 16)));
+                __m256i r = _mm256_shuffle_epi8(t, _mm256_and_si256(c, nibble));
+                lo = _mm256_adds_epu16(lo, _mm256_unpacklo_epi8(r, zero));
+                hi = _mm256_adds_epu16(hi, _mm256_unpackhi_epi8(r, zero));
+                if (m + 1 == M) break;
+                t = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(lut + (m + 1) * 16)));
+                r = _mm256_shuffle_epi8(t, _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble));
+                lo = _mm256_adds_epu16(lo, _mm256_unpacklo_epi8(r, zero));
+                hi = _mm256_adds_epu16(hi, _mm256_unpackhi_epi8(r, zero));
+            }
+        }
+        // lo holds candidates 0-7 and 16-23, hi 8-15 and 24-31.
+        _mm256_storeu_si256((__m256i *)out, _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(out + 16), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+#endif
+
+    PQScanKernel pqScanKernel (SimdLevel level)
+    {
+#ifdef LSHKIT_X86_KERNELS
+        switch (level) {
+        case SIMD_AVX512:
+        case SIMD_AVX2:
+            return scanAvx2;
+        case SIMD_SSE:
+            if (__builtin_cpu_supports("ssse3")) return scanSsse3;
+            break;
+        default:
+            break;
+        }
+#endif
+        return scanScalar;
+    }
+}
@@ -0,0 +1,273 @@
+/* 
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+  
+    This file is part of LSHKIT.
+  
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cassert>
+#include <cmath>
+#include <lshkit/common.h>
+#include <lshkit/projection.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LSHKIT_X86_KERNELS
+#endif
+
+namespace lshkit
+{
+    static const unsigned PANEL = ProjectionBlock::PANEL;
+    static const unsigned KC = ProjectionBlock::KC;
+
+    void ProjectionBlock::reset (unsigned dim, unsigned size, float W)
+    {
+        dim_ = dim;
+        size_ = size;
+        W_ = W;
+        panels_ = (size + PANEL - 1) / PANEL;
+        coef_.assign(std::size_t(panels_) * dim_ * PANEL, 0);
+        bias_.assign(std::size_t(panels_) * PANEL, 0);
+        gather_.clear();
+    }
+
+    void ProjectionBlock::set (unsigned f, const float *coef, float b)
+    {
+        assert(f < size_);
+        float *panel = &coef_[std::size_t(f / PANEL) * dim_ * PANEL + f % PANEL];
+        for (unsigned k = 0; k < dim_; ++k) {
+            panel[std::size_t(k) * PANEL] = coef[k];
+        }
+        bias_[f] = b;
+    }
+
+    /*
+     * A micro kernel multiplies ROWS points with kn rows of a panel.  x[r] points
+     * to the current cache block of the rth point, points beyond "rows" are
+     * padding and their results are not stored.  C holds the partial sums of
+     * the panel, with row stride ldc.  On the first cache block the sums start
+     * from bias (which is non-NULL), otherwise from C.  On the last cache block
+     * (H non-NULL) the sums are quantized: C receives the deltas and H the
+     * hash values.
+     */
+    typedef void (*MicroKernel) (const float *A, unsigned kn,
+            const float *const *x, unsigned rows, const float *bias,
+            float *C, unsigned *H, unsigned ldc, float W);
+
+    static const unsigned SCALAR_ROWS = 4;
+
+    static void microScalar (const float *A, unsigned kn,
+            const float *const *x, unsigned rows, const float *bias,
+            float *C, unsigned *H, unsigned ldc, float W)
+    {
+        float acc[SCALAR_ROWS][PANEL];
+        for (unsigned r = 0; r < SCALAR_ROWS; ++r) {
+            const float *init = bias ? bias : C + (r < rows ? r : 0) * ldc;
+            for (unsigned l = 0; l < PANEL; ++l) acc[r][l] = init[l];
+        }
+        for (unsigned k = 0; k < kn; ++k) {
+            const float *a = A + k * PANEL;
+            for (unsigned r = 0; r < SCALAR_ROWS; ++r) {
+                float v = x[r][k];
+                for (unsigned l = 0; l < PANEL; ++l) acc[r][l] += v * a[l];
+            }
+        }
+        for (unsigned r = 0; r < rows; ++r) {
+            float *c = C + r * ldc;
+            if (H == 0) {
+                for (unsigned l = 0; l < PANEL; ++l) c[l] = acc[r][l];
+                continue;
+            }
+            unsigned *h = H + r * ldc;
+            for (unsigned l = 0; l < PANEL; ++l) {
+                float ret = acc[r][l] / W;
+                float flr = std::floor(ret);
+                c[l] = ret - flr;
+                h[l] = unsigned(int(flr));
+            }
+        }
+    }
+
+#ifdef LSHKIT_X86_KERNELS
+    static const unsigned AVX2_ROWS = 4;
+
+    __attribute__((target("avx2,fma")))
+    static inline void storeAvx2 (__m256 acc, float *c, unsigned *h, __m256 w)
+    {
+        if (h == 0) {
+            _mm256_storeu_ps(c, acc);
+            return;
+        }
+        __m256 ret = _mm256_div_ps(acc, w);
+        __m256 flr = _mm256_floor_ps(ret);
+        _mm256_storeu_ps(c, _mm256_sub_ps(ret, flr));
+        _mm256_storeu_si256((__m256i *)h, _mm256_cvttps_epi32(flr));
+    }
+
+    // 4 points x 16 functions, two registers per point.
+    __attribute__((target("avx2,fma")))
+    static void microAvx2 (const float *A, unsigned kn,
+            const float *const *x, unsigned rows, const float *bias,
+            float *C, unsigned *H, unsigned ldc, float W)
+    {
+        __m256 c00, c01, c10, c11, c20, c21, c30, c31;
+        if (bias) {
+            c00 = c10 = c20 = c30 = _mm256_load_ps(bias);
+            c01 = c11 = c21 = c31 = _mm256_load_ps(bias + 8);
+        }
+        else {
+            const float *p0 = C;
+            const float *p1 = C + (rows > 1 ? ldc : 0);
+            const float *p2 = C + (rows > 2 ? 2 * ldc : 0);
+            const float *p3 = C + (rows > 3 ? 3 * ldc : 0);
+            c00 = _mm256_loadu_ps(p0); c01 = _mm256_loadu_ps(p0 + 8);
+            c10 = _mm256_loadu_ps(p1); c11 = _mm256_loadu_ps(p1 + 8);
+            c20 = _mm256_loadu_ps(p2); c21 = _mm256_loadu_ps(p2 + 8);
+            c30 = _mm256_loadu_ps(p3); c31 = _mm256_loadu_ps(p3 + 8);
+        }
+        const float *x0 = x[0], *x1 = x[1], *x2 = x[2], *x3 = x[3];
+        for (unsigned k = 0; k < kn; ++k) {
+            __m256 a0 = _mm256_load_ps(A + k * PANEL);
+            __m256 a1 = _mm256_load_ps(A + k * PANEL + 8);
+            __m256 v;
+            v = _mm256_broadcast_ss(x0 + k);
+            c00 = _mm256_fmadd_ps(v, a0, c00); c01 = _mm256_fmadd_ps(v, a1, c01);
+            v = _mm256_broadcast_ss(x1 + k);
+            c10 = _mm256_fmadd_ps(v, a0, c10); c11 = _mm256_fmadd_ps(v, a1, c11);
+            v = _mm256_broadcast_ss(x2 + k);
+            c20 = _mm256_fmadd_ps(v, a0, c20); c21 = _mm256_fmadd_ps(v, a1, c21);
+            v = _mm256_broadcast_ss(x3 + k);
+            c30 = _mm256_fmadd_ps(v, a0, c30); c31 = _mm256_fmadd_ps(v, a1, c31);
+        }
+        __m256 w = _mm256_set1_ps(W);
+        storeAvx2(c00, C, H, w);
+        storeAvx2(c01, C + 8, H ? H + 8 : 0, w);
+        if (rows < 2) return;
+        storeAvx2(c10, C + ldc, H ? H + ldc : 0, w);
+        storeAvx2(c11, C + ldc + 8, H ? H + ldc + 8 : 0, w);
+        if (rows < 3) return;
+        storeAvx2(c20, C + 2 * ldc, H ? H + 2 * ldc : 0, w);
+        storeAvx2(c21, C + 2 * ldc + 8, H ? H + 2 * ldc + 8 : 0, w);
+        if (rows < 4) return;
+        storeAvx2(c30, C + 3 * ldc, H ? H + 3 * ldc : 0, w);
+        storeAvx2(c31, C + 3 * ldc + 8, H ? H + 3 * ldc + 8 : 0, w);
+    }
+
+    static const unsigned AVX512_ROWS = 8;
+
+    // 8 points x 16 functions, one register per point.
+    __attribute__((target("avx512f")))
+    static void microAvx512 (const float *A, unsigned kn,
+            const float *const *x, unsigned rows, const float *bias,
+            float *C, unsigned *H, unsigned ldc, float W)
+    {
+        __m512 c[AVX512_ROWS];
+        for (unsigned r = 0; r < AVX512_ROWS; ++r) {
+            c[r] = bias ? _mm512_load_ps(bias) : _mm512_loadu_ps(C + (r < rows ? r : 0) * ldc);
+        }
+        for (unsigned k = 0; k < kn; ++k) {
+            __m512 a = _mm512_load_ps(A + k * PANEL);
+            for (unsigned r = 0; r < AVX512_ROWS; ++r) {
+                c[r] = _mm512_fmadd_ps(_mm512_set1_ps(x[r][k]), a, c[r]);
+            }
+        }
+        __m512 w = _mm512_set1_ps(W);
+        for (unsigned r = 0; r < rows; ++r) {
+            if (H == 0) {
+                _mm512_storeu_ps(C + r * ldc, c[r]);
+                continue;
+            }
+            __m512 ret = _mm512_div_ps(c[r], w);
+            __m512 flr = _mm512_roundscale_ps(ret, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+            _mm512_storeu_ps(C + r * ldc, _mm512_sub_ps(ret, flr));
+            _mm512_storeu_si512(H + r * ldc, _mm512_cvttps_epi32(flr));
+        }
+    }
+#endif
+
+    template <unsigned ROWS, MicroKernel MICRO>
+    static void drive (const float *coef, const float *bias, unsigned dim,
+            unsigned panels, float W, const float *const *points, unsigned n,
+            unsigned *hash, float *delta, unsigned ldc)
+    {
+        const float *x[ROWS];
+        for (unsigned k0 = 0; k0 < dim; k0 += KC) {
+            unsigned kn = min(KC, dim - k0);
+            bool first = k0 == 0;
+            bool last = k0 + kn == dim;
+            for (unsigned p = 0; p < panels; ++p) {
+                const float *A = coef + (std::size_t(p) * dim + k0) * PANEL;
+                for (unsigned r0 = 0; r0 < n; r0 += ROWS) {
+                    unsigned rows = min(ROWS, n - r0);
+                    for (unsigned r = 0; r < ROWS; ++r) {
+                        x[r] = points[r0 + (r < rows ? r : 0)] + k0;
+                    }
+                    std::size_t off = std::size_t(r0) * ldc + p * PANEL;
+                    MICRO(A, kn, x, rows, first ? bias + p * PANEL : 0,
+                            delta + off, last ? hash + off : 0, ldc, W);
+                }
+            }
+        }
+    }
+
+    static void dispatch (const float *coef, const float *bias, unsigned dim,
+            unsigned panels, float W, const float *const *points, unsigned n,
+            unsigned *hash, float *delta, unsigned ldc)
+    {
+        switch (simdLevel()) {
+#ifdef LSHKIT_X86_KERNELS
+        case SIMD_AVX512:
+            drive<AVX512_ROWS, microAvx512>(coef, bias, dim, panels, W, points, n, hash, delta, ldc);
+            break;
+        case SIMD_AVX2:
+            drive<AVX2_ROWS, microAvx2>(coef, bias, dim, panels, W, points, n, hash, delta, ldc);
+            break;
+#endif
+        default:
+            drive<SCALAR_ROWS, microScalar>(coef, bias, dim, panels, W, points, n, hash, delta, ldc);
+        }
+    }
+
+    // Number of points gathered at a time.
+    static const unsigned GATHER_ROWS = 64;
+
+    void ProjectionBlock::apply (const float *const *points, unsigned n, unsigned *hash, float *delta, unsigned ldo) const
+    {
+        assert(dim_ > 0);
+        if (ldo == 0) ldo = getStride();
+        assert(ldo >= getStride());
+        if (gather_.empty()) {
+            dispatch(&coef_[0], &bias_[0], dim_, panels_, W_, points, n, hash, delta, ldo);
+            return;
+        }
+        // Gather the sampled coordinates into rows padded to a cache line.
+        static thread_local AlignedVector<float> buf;
+        const unsigned *dims = &gather_[0];
+        unsigned ld = (dim_ + PANEL - 1) / PANEL * PANEL;
+        if (buf.size() < std::size_t(GATHER_ROWS) * ld) buf.resize(std::size_t(GATHER_ROWS) * ld);
+        const float *rows[GATHER_ROWS];
+        for (unsigned b = 0; b < n; b += GATHER_ROWS) {
+            unsigned nb = std::min(GATHER_ROWS, n - b);
+            for (unsigned j = 0; j < nb; ++j) {
+                const float *in = points[b + j];
+                float *out = &buf[std::size_t(j) * ld];
+                for (unsigned k = 0; k < dim_; ++k) out[k] = in[dims[k]];
+                rows[j] = out;
+            }
+            dispatch(&coef_[0], &bias_[0], dim_, panels_, W_, rows, nb,
+                    hash + std::size_t(b) * ldo, delta + std::size_t(b) * ldo, ldo);
+        }
+    }
+}
@@ -0,0 +1,292 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <lshkit/common.h>
+#include <lshkit/quantized.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LSHKIT_X86_KERNELS
+#endif
+
+namespace lshkit
+{
+    uint16_t floatToHalf (float f)
+    {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        uint16_t sign = (x >> 16) & 0x8000;
+        x &= 0x7fffffff;
+        if (x >= 0x7f800000) {          // inf and nan
+            return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+        }
+        if (x >= 0x477ff000) {          // rounds to inf
+            return sign | 0x7c00;
+        }
+        if (x < 0x38800000) {           // subnormal, in units of 2^-24
+            float a;
+            std::memcpy(&a, &x, sizeof(a));
+            return sign | uint16_t(std::nearbyint(a * 16777216.0F));
+        }
+        x -= 0x38000000;                // rebias the exponent from 127 to 15
+        x += 0xfff + ((x >> 13) & 1);   // round to nearest even
+        return sign | uint16_t(x >> 13);
+    }
+
+    float halfToFloat (uint16_t h)
+    {
+        uint32_t sign = uint32_t(h & 0x8000) << 16;
+        uint32_t exp = (h >> 10) & 0x1f;
+        uint32_t mant = h & 0x3ff;
+        uint32_t x;
+        if (exp == 0) {
+            float a = std::ldexp(float(mant), -24);
+            return sign ? -a : a;
+        }
+        if (exp == 31) x = sign | 0x7f800000 | (mant << 13);
+        else x = sign | ((exp + 112) << 23) | (mant << 13);
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+
+    /*
+     * The kernels compute sum (q[d] - x[d])^2, x[d] being step[d] * code[d]
+     * for int8 (q being prepared) and the half float code[d] for fp16.  As
+     * in distance.cpp, the partial sum is compared with bound every
+     * DISTANCE_BLOCK dimensions.
+     */
+    static float int8Scalar (const float *q, const uint8_t *code, const float *step, unsigned dim, float bound)
+    {
+        float r = 0;
+        for (unsigned i = 0; i < dim; ++i) {
+            float d = q[i] - step[i] * code[i];
+            r += d * d;
+            if ((i + 1) % DISTANCE_BLOCK == 0 && r > bound) return r;
+        }
+        return r;
+    }
+
+    static float fp16Scalar (const float *q, const uint8_t *code, const float *, unsigned dim, float bound)
+    {
+        const uint16_t *h = (const uint16_t *)code;
+        float r = 0;
+        for (unsigned i = 0; i < dim; ++i) {
+            float d = q[i] - halfToFloat(h[i]);
+            r += d * d;
+            if ((i + 1) % DISTANCE_BLOCK == 0 && r > bound) return r;
+        }
+        return r;
+    }
+
+#ifdef LSHKIT_X86_KERNELS
+    __attribute__((target("avx2,fma")))
+    static inline float sumAvx2 (__m256 a0, __m256 a1)
+    {
+        __m256 v = _mm256_add_ps(a0, a1);
+        __m128 w = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        w = _mm_add_ps(w, _mm_movehl_ps(w, w));
+        w = _mm_add_ss(w, _mm_movehdup_ps(w));
+        return _mm_cvtss_f32(w);
+    }
+
+    __attribute__((target("avx2,fma")))
+    static inline __m256 int8Avx2 (const uint8_t *code, const float *step)
+    {
+        __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)code));
+        return _mm256_mul_ps(_mm256_loadu_ps(step), _mm256_cvtepi32_ps(c));
+    }
+
+    __attribute__((target("avx2,fma,f16c")))
+    static inline __m256 fp16Avx2 (const uint8_t *code, const float *)
+    {
+        return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)code));
+    }
+
+    // 2 registers of 8 dimensions.  DECODE(code, step) decodes 8 values.
+    template <__m256 (*DECODE) (const uint8_t *, const float *), unsigned BYTES, float (*TAIL) (const float *, const uint8_t *, const float *, unsigned, float)>
+    __attribute__((target("avx2,fma,f16c")))
+    static float kernelAvx2 (const float *q, const uint8_t *code, const float *step, unsigned dim, float bound)
+    {
+        __m256 a0 = _mm256_setzero_ps(), a1 = a0;
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; ) {
+            for (unsigned e = i + DISTANCE_BLOCK; i < e; i += 16) {
+                __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q + i), DECODE(code + i * BYTES, step + i));
+                __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(q + i + 8), DECODE(code + (i + 8) * BYTES, step + i + 8));
+                a0 = _mm256_fmadd_ps(d0, d0, a0);
+                a1 = _mm256_fmadd_ps(d1, d1, a1);
+            }
+            float r = sumAvx2(a0, a1);
+            if (r > bound) return r;
+        }
+        for (; i + 8 <= dim; i += 8) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(q + i), DECODE(code + i * BYTES, step + i));
+            a0 = _mm256_fmadd_ps(d0, d0, a0);
+        }
+        return sumAvx2(a0, a1) + TAIL(q + i, code + i * BYTES, step + i, dim - i, std::numeric_limits<float>::max());
+    }
+
+    __attribute__((target("avx512f")))
+    static inline __m512 int8Avx512 (const uint8_t *code, const float *step)
+    {
+        __m512i c = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)code));
+        return _mm512_mul_ps(_mm512_loadu_ps(step), _mm512_cvtepi32_ps(c));
+    }
+
+    __attribute__((target("avx512f")))
+    static inline __m512 fp16Avx512 (const uint8_t *code, const float *)
+    {
+        return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)code));
+    }
+
+    // 2 registers of 16 dimensions.
+    template <__m512 (*DECODE) (const uint8_t *, const float *), unsigned BYTES, float (*TAIL) (const float *, const uint8_t *, const float *, unsigned, float)>
+    __attribute__((target("avx512f")))
+    static float kernelAvx512 (const float *q, const uint8_t *code, const float *step, unsigned dim, float bound)
+    {
+        __m512 a0 = _mm512_setzero_ps(), a1 = a0;
+        unsigned i = 0;
+        for (; i + DISTANCE_BLOCK <= dim; i += DISTANCE_BLOCK) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q + i), DECODE(code + i * BYTES, step + i));
+            __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(q + i + 16), DECODE(code + (i + 16) * BYTES, step + i + 16));
+            a0 = _mm512_fmadd_ps(d0, d0, a0);
+            a1 = _mm512_fmadd_ps(d1, d1, a1);
+            float r = _mm512_reduce_add_ps(_mm512_add_ps(a0, a1));
+            if (r > bound) return r;
+        }
+        for (; i + 16 <= dim; i += 16) {
+            __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(q + i), DECODE(code + i * BYTES, step + i));
+            a0 = _mm512_fmadd_ps(d0, d0, a0);
+        }
+        return _mm512_reduce_add_ps(_mm512_add_ps(a0, a1)) + TAIL(q + i, code + i * BYTES, step + i, dim - i, std::numeric_limits<float>::max());
+    }
+#endif
+
+    void QuantizedMatrix::selectKernel ()
+    {
+        bool int8 = type_ == QUANT_INT8;
+        kernel_ = int8 ? int8Scalar : fp16Scalar;
+#ifdef LSHKIT_X86_KERNELS
+        switch (simdLevel()) {
+        case SIMD_AVX512:
+            kernel_ = int8 ? kernelAvx512<int8Avx512, 1, int8Scalar> : kernelAvx512<fp16Avx512, 2, fp16Scalar>;
+            break;
+        case SIMD_AVX2:
+            if (int8 || __builtin_cpu_supports("f16c")) {
+                kernel_ = int8 ? kernelAvx2<int8Avx2, 1, int8Scalar> : kernelAvx2<fp16Avx2, 2, fp16Scalar>;
+            }
+            break;
+        default:
+            break;
+        }
+#endif
+    }
+
+    void QuantizedMatrix::reset (const Matrix<float> &data, Type type)
+    {
+        type_ = type;
+        dim_ = data.getDim();
+        N_ = data.getSize();
+        rowBytes_ = type == QUANT_INT8 ? dim_ : 2 * dim_;
+        min_.assign(dim_, 0);
+        step_.assign(dim_, 1);
+        codes_.resize(std::size_t(N_) * rowBytes_);
+        if (type == QUANT_INT8) {
+            std::vector<float> max(dim_, 0);
+            for (unsigned d = 0; d < dim_; ++d) {
+                min_[d] = N_ ? data[0][d] : 0;
+                max[d] = min_[d];
+            }
+            for (unsigned i = 0; i < N_; ++i) {
+                const float *row = data[i];
+                for (unsigned d = 0; d < dim_; ++d) {
+                    min_[d] = std::min(min_[d], row[d]);
+                    max[d] = std::max(max[d], row[d]);
+                }
+            }
+            for (unsigned d = 0; d < dim_; ++d) {
+                if (max[d] > min_[d]) step_[d] = (max[d] - min_[d]) / 255;
+            }
+            for (unsigned i = 0; i < N_; ++i) {
+                const float *row = data[i];
+                uint8_t *code = &codes_[std::size_t(i) * rowBytes_];
+                for (unsigned d = 0; d < dim_; ++d) {
+                    float c = std::floor((row[d] - min_[d]) / step_[d] + 0.5F);
+                    code[d] = uint8_t(std::min(255.0F, std::max(0.0F, c)));
+                }
+            }
+        }
+        else {
+            for (unsigned i = 0; i < N_; ++i) {
+                const float *row = data[i];
+                uint16_t *code = (uint16_t *)&codes_[std::size_t(i) * rowBytes_];
+                for (unsigned d = 0; d < dim_; ++d) {
+                    code[d] = floatToHalf(row[d]);
+                }
+            }
+        }
+        selectKernel();
+    }
+
+    void QuantizedMatrix::decode (unsigned i, float *out) const
+    {
+        const uint8_t *c = code(i);
+        for (unsigned d = 0; d < dim_; ++d) {
+            if (type_ == QUANT_INT8) out[d] = min_[d] + step_[d] * c[d];
+            else out[d] = halfToFloat(((const uint16_t *)c)[d]);
+        }
+    }
+
+    void QuantizedMatrix::prepare (const float *query, float *prepared) const
+    {
+        for (unsigned d = 0; d < dim_; ++d) {
+            prepared[d] = type_ == QUANT_INT8 ? query[d] - min_[d] : query[d];
+        }
+    }
+
+    void QuantizedMatrix::save (std::ostream &os)
+    {
+        os & type_;
+        os & dim_;
+        os & N_;
+        os & min_;
+        os & step_;
+        os.write((const char *)codes_.data(), codes_.size());
+    }
+
+    void QuantizedMatrix::load (std::istream &is)
+    {
+        is & type_;
+        is & dim_;
+        is & N_;
+        is & min_;
+        is & step_;
+        if (type_ != QUANT_INT8 && type_ != QUANT_FP16) {
+            throw std::runtime_error("unknown quantization type");
+        }
+        rowBytes_ = type_ == QUANT_INT8 ? dim_ : 2 * dim_;
+        codes_.resize(std::size_t(N_) * rowBytes_);
+        is.read((char *)codes_.data(), codes_.size());
+        selectKernel();
+    }
+}
@@ -0,0 +1,238 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <lshkit/remote.h>
+
+namespace lshkit {
+
+// Largest request, so that a bad header cannot make us allocate
+// gigabytes.
+static const std::size_t MAX_REQUEST_BYTES = std::size_t(1) << 30;
+
+bool readAll (int fd, void *buf, std::size_t size)
+{
+    char *p = static_cast<char *>(buf);
+    while (size > 0) {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool writeAll (int fd, const void *buf, std::size_t size)
+{
+    const char *p = static_cast<const char *>(buf);
+    while (size > 0) {
+        ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) n = ::write(fd, p, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static sockaddr_un socketAddress (const std::string &path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("socket path too long: " + path);
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+    return addr;
+}
+
+int remoteListen (const std::string &path)
+{
+    sockaddr_un addr = socketAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw std::runtime_error("cannot create socket " + path);
+    ::unlink(path.c_str());
+    if (::bind(fd, (const sockaddr *)&addr, sizeof(addr)) != 0 || ::listen(fd, 16) != 0) {
+        ::close(fd);
+        throw std::runtime_error("cannot listen on " + path);
+    }
+    return fd;
+}
+
+int remoteConnect (const std::string &path)
+{
+    sockaddr_un addr = socketAddress(path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) throw std::runtime_error("cannot create socket " + path);
+    if (::connect(fd, (const sockaddr *)&addr, sizeof(addr)) != 0) {
+        ::close(fd);
+        throw std::runtime_error("cannot connect to " + path);
+    }
+    return fd;
+}
+
+bool readRequest (int fd, RemoteRequest *req, std::vector<char> *queries)
+{
+    if (!readAll(fd, req, sizeof(*req))) return false;
+    if (req->magic != REMOTE_MAGIC) throw std::runtime_error("bad request");
+    // Checked before multiplying, as the product of the three can wrap.
+    std::size_t row = std::size_t(req->dim) * req->elemSize;
+    if (row != 0 && req->Q > MAX_REQUEST_BYTES / row) throw std::runtime_error("request too large");
+    std::size_t bytes = req->Q * row;
+    queries->resize(bytes);
+    if (bytes != 0 && !readAll(fd, &(*queries)[0], bytes)) {
+        throw std::runtime_error("truncated request");
+    }
+    return true;
+}
+
+// Whether Q and K are within the limits, with K at most maxK.
+static bool withinLimits (const RemoteRequest &req, unsigned maxK)
+{
+    return req.Q <= REMOTE_MAX_Q && req.K <= std::min<unsigned>(maxK, REMOTE_MAX_K)
+        && uint64_t(req.Q) * req.K <= REMOTE_MAX_ENTRIES;
+}
+
+unsigned remoteCheck (const RemoteRequest &req, unsigned dim, unsigned elemSize, unsigned maxK)
+{
+    if (req.op != REMOTE_QUERY && req.op != REMOTE_RECALL) return REMOTE_BAD_REQUEST;
+    if (req.dim != dim || req.elemSize != elemSize || req.K == 0) return REMOTE_BAD_REQUEST;
+    if (!withinLimits(req, maxK)) return REMOTE_BAD_REQUEST;
+    return REMOTE_OK;
+}
+
+bool writeResponse (int fd, unsigned status, const std::vector<Topk<unsigned> > &topks,
+                    const std::vector<unsigned> &cnt, unsigned K)
+{
+    RemoteResponse res;
+    res.magic = REMOTE_MAGIC;
+    res.status = status;
+    res.Q = status == REMOTE_OK ? topks.size() : 0;
+    res.K = K;
+    if (!writeAll(fd, &res, sizeof(res))) return false;
+    if (status != REMOTE_OK) return true;
+    std::vector<RemoteEntry> entries(std::size_t(res.Q) * K);
+    for (unsigned i = 0; i < res.Q; ++i) {
+        for (unsigned k = 0; k < K; ++k) {
+            RemoteEntry &e = entries[std::size_t(i) * K + k];
+            if (k < topks[i].size()) {
+                e.key = topks[i][k].key;
+                e.dist = topks[i][k].dist;
+            }
+            else {
+                e.key = 0;
+                e.dist = std::numeric_limits<float>::max();
+            }
+        }
+    }
+    std::vector<uint32_t> counts(res.Q, 0);
+    for (unsigned i = 0; i < res.Q && i < cnt.size(); ++i) counts[i] = cnt[i];
+    return (entries.empty() || writeAll(fd, &entries[0], entries.size() * sizeof(RemoteEntry)))
+        && (counts.empty() || writeAll(fd, &counts[0], counts.size() * sizeof(uint32_t)));
+}
+
+void remoteServe (int fd, RemoteHandler handler)
+{
+    RemoteRequest req;
+    std::vector<char> queries;
+    std::vector<Topk<unsigned> > topks;
+    std::vector<unsigned> cnt;
+    for (;;) {
+        int conn = ::accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        bool shutdown = false;
+        try {
+            while (readRequest(conn, &req, &queries)) {
+                if (req.op == REMOTE_SHUTDOWN) {
+                    shutdown = true;
+                    break;
+                }
+                topks.clear();
+                cnt.clear();
+                unsigned status = REMOTE_BAD_REQUEST;
+                try {
+                    if (withinLimits(req, REMOTE_MAX_K)) {
+                        status = handler(req, queries.empty() ? 0 : &queries[0], &topks, &cnt);
+                    }
+                }
+                catch (const std::exception &) {
+                    status = REMOTE_FAILED;
+                }
+                if (!writeResponse(conn, status, topks, cnt, req.K)) break;
+            }
+        }
+        catch (const std::runtime_error &) {
+            // A malformed request drops the connection.
+        }
+        ::close(conn);
+        if (shutdown) break;
+    }
+    ::close(fd);
+}
+
+void remoteQuery (int fd, const RemoteRequest &req, const void *queries,
+                  std::vector<Topk<unsigned> > *topks, std::vector<unsigned> *cnt)
+{
+    std::size_t bytes = std::size_t(req.Q) * req.dim * req.elemSize;
+    if (!writeAll(fd, &req, sizeof(req)) || (bytes != 0 && !writeAll(fd, queries, bytes))) {
+        throw std::runtime_error("cannot send request");
+    }
+    RemoteResponse res;
+    if (!readAll(fd, &res, sizeof(res)) || res.magic != REMOTE_MAGIC) {
+        throw std::runtime_error("cannot read response");
+    }
+    if (res.status != REMOTE_OK) throw std::runtime_error("request rejected by the server");
+    if (res.Q != req.Q || res.K != req.K) throw std::runtime_error("bad response");
+    std::vector<RemoteEntry> entries(std::size_t(res.Q) * res.K);
+    std::vector<uint32_t> counts(res.Q);
+    if ((!entries.empty() && !readAll(fd, &entries[0], entries.size() * sizeof(RemoteEntry)))
+            || (!counts.empty() && !readAll(fd, &counts[0], counts.size() * sizeof(uint32_t)))) {
+        throw std::runtime_error("cannot read response");
+    }
+    topks->resize(res.Q);
+    for (unsigned i = 0; i < res.Q; ++i) {
+        Topk<unsigned> &t = (*topks)[i];
+        t.reset(res.K);
+        for (unsigned k = 0; k < res.K; ++k) {
+            const RemoteEntry &e = entries[std::size_t(i) * res.K + k];
+            t[k] = Topk<unsigned>::Element(e.key, e.dist);
+        }
+    }
+    if (cnt) cnt->assign(counts.begin(), counts.end());
+}
+
+void remoteShutdown (int fd)
+{
+    RemoteRequest req = remoteRequest(REMOTE_SHUTDOWN, 0, 0, 0, 0);
+    writeAll(fd, &req, sizeof(req));
+}
+
+}
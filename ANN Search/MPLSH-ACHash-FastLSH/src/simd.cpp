@@ -0,0 +1,51 @@
+/* 
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+  
+    This file is part of LSHKIT.
+  
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <cstring>
+#include <lshkit/simd.h>
+
+namespace lshkit {
+
+static SimdLevel detectSimdLevel ()
+{
+    SimdLevel level = SIMD_SCALAR;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) level = SIMD_SSE;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        level = SIMD_AVX2;
+        if (__builtin_cpu_supports("avx512f")) level = SIMD_AVX512;
+    }
+#endif
+    const char *cap = std::getenv("LSHKIT_SIMD");
+    if (cap != 0) {
+        if (std::strcmp(cap, "scalar") == 0) level = SIMD_SCALAR;
+        else if (std::strcmp(cap, "sse") == 0 && level > SIMD_SSE) level = SIMD_SSE;
+        else if (std::strcmp(cap, "avx2") == 0 && level > SIMD_AVX2) level = SIMD_AVX2;
+    }
+    return level;
+}
+
+SimdLevel simdLevel ()
+{
+    static SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+}
@@ -0,0 +1,102 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <lshkit/sketch-filter.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LSHKIT_X86_KERNELS
+#endif
+
+namespace lshkit
+{
+    /// # keys ahead whose sketches are prefetched.
+    static const unsigned FILTER_PREFETCH = 8;
+
+    /*
+     * Without the popcnt instruction __builtin_popcountll is a call to
+     * libgcc; in the popcnt variant it compiles to the instruction.  The
+     * loop over the words stops once the distance exceeds maxDist.
+     */
+    static inline unsigned filterLoop (const uint64_t *sketches, unsigned words, const uint64_t *query,
+                                       const unsigned *keys, unsigned n, unsigned maxDist, unsigned *out)
+    {
+        unsigned m = 0;
+        for (unsigned i = 0; i < n; ++i) {
+#ifdef __GNUC__
+            if (i + FILTER_PREFETCH < n) __builtin_prefetch(sketches + std::size_t(keys[i + FILTER_PREFETCH]) * words, 0, 0);
+#endif
+            const uint64_t *s = sketches + std::size_t(keys[i]) * words;
+            unsigned d = 0;
+            for (unsigned w = 0; w < words && d <= maxDist; ++w) {
+                d += __builtin_popcountll(s[w] ^ query[w]);
+            }
+            out[m] = keys[i];
+            m += d <= maxDist;
+        }
+        return m;
+    }
+
+    static unsigned filterScalar (const uint64_t *sketches, unsigned words, const uint64_t *query,
+                                  const unsigned *keys, unsigned n, unsigned maxDist, unsigned *out)
+    {
+        return filterLoop(sketches, words, query, keys, n, maxDist, out);
+    }
+
+#ifdef LSHKIT_X86_KERNELS
+    __attribute__((target("popcnt")))
+    static unsigned filterPopcnt (const uint64_t *sketches, unsigned words, const uint64_t *query,
+                                  const unsigned *keys, unsigned n, unsigned maxDist, unsigned *out)
+    {
+        return filterLoop(sketches, words, query, keys, n, maxDist, out);
+    }
+
+    // 8 words at a time; the last, partial, group is read with a mask.
+    __attribute__((target("avx512f,avx512vpopcntdq")))
+    static unsigned filterAvx512 (const uint64_t *sketches, unsigned words, const uint64_t *query,
+                                  const unsigned *keys, unsigned n, unsigned maxDist, unsigned *out)
+    {
+        unsigned m = 0;
+        for (unsigned i = 0; i < n; ++i) {
+            if (i + FILTER_PREFETCH < n) __builtin_prefetch(sketches + std::size_t(keys[i + FILTER_PREFETCH]) * words, 0, 0);
+            const uint64_t *s = sketches + std::size_t(keys[i]) * words;
+            __m512i acc = _mm512_setzero_si512();
+            for (unsigned w = 0; w < words; w += 8) {
+                __mmask8 k = words - w >= 8 ? 0xFF : __mmask8((1U << (words - w)) - 1);
+                __m512i a = _mm512_maskz_loadu_epi64(k, s + w);
+                __m512i b = _mm512_maskz_loadu_epi64(k, query + w);
+                acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(_mm512_xor_si512(a, b)));
+            }
+            unsigned d = _mm512_reduce_add_epi64(acc);
+            out[m] = keys[i];
+            m += d <= maxDist;
+        }
+        return m;
+    }
+#endif
+
+    HammingFilterKernel hammingFilterKernel (SimdLevel level)
+    {
+#ifdef LSHKIT_X86_KERNELS
+        if (level == SIMD_AVX512 && __builtin_cpu_supports("avx512vpopcntdq")) return filterAvx512;
+        if (level > SIMD_SCALAR && __builtin_cpu_supports("popcnt")) return filterPopcnt;
+#endif
+        return filterScalar;
+    }
+}
@@ -0,0 +1,79 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LSHKIT_TEST_COMMON__
+#define __LSHKIT_TEST_COMMON__
+
+/*
+ * Helpers shared by the tests comparing the candidates of indexes: random
+ * data, the parameters of an index and a scanner keeping all the keys.
+ */
+
+#include <algorithm>
+#include <vector>
+#include <lshkit.h>
+
+namespace lshkit {
+
+/// A scanner keeping all the candidates.
+class Collector
+{
+    std::vector<unsigned> *keys_;
+public:
+    Collector (std::vector<unsigned> *keys): keys_(keys) {}
+    void operator () (unsigned key) { keys_->push_back(key); }
+    void operator () (const unsigned *keys, unsigned n) { keys_->insert(keys_->end(), keys, keys + n); }
+};
+
+/// The sorted candidates of a query with T probes.
+template <typename INDEX>
+static inline std::vector<unsigned> candidates (const INDEX &index, const float *query, unsigned T)
+{
+    std::vector<unsigned> r;
+    Collector collect(&r);
+    index.query(query, T, collect);
+    std::sort(r.begin(), r.end());
+    return r;
+}
+
+/// Fill data with standard Gaussian values.
+static inline void gaussian (FloatMatrix &data, DefaultRng &rng)
+{
+    boost::normal_distribution<float> normal;
+    boost::variate_generator<DefaultRng &, boost::normal_distribution<float> > gen(rng, normal);
+    for (unsigned j = 0; j < data.getSize(); ++j) {
+        for (unsigned k = 0; k < data.getDim(); ++k) data[j][k] = gen();
+    }
+}
+
+/// The parameters of an index of INDEX.
+template <typename INDEX>
+static inline typename INDEX::Parameter parameter (float W, unsigned H, unsigned M, unsigned D)
+{
+    typename INDEX::Parameter param;
+    param.W = W;
+    param.range = H;
+    param.repeat = M;
+    param.dim = D;
+    return param;
+}
+
+}
+
+#endif
@@ -0,0 +1,164 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Inserts into a ConcurrentIndex while other threads query it.  The
+ * readers check that a snapshot does not change under them, and that the
+ * removed keys and those never inserted are not returned.  Once all the
+ * keys are published, the index must return the candidates of an index
+ * built statically with the same functions.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <boost/program_options.hpp>
+#include <lshkit.h>
+#include "common.h"
+
+using namespace std;
+using namespace lshkit;
+namespace po = boost::program_options;
+
+typedef MultiProbeLshIndex<unsigned> Index;
+
+static const unsigned T = 20;
+
+// Keys [0, N0) are built, and every fifth of them removed.
+static bool removed (unsigned key, unsigned N0)
+{
+    return key < N0 && key % 5 == 0;
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned N, D, L, M, H, B, R;
+    float W;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help,h", "produce help message.")
+		(",W", po::value<float>(&W)->default_value(4.0), "")
+		(",M", po::value<unsigned>(&M)->default_value(8), "")
+		(",L", po::value<unsigned>(&L)->default_value(4), "")
+		(",H", po::value<unsigned>(&H)->default_value(10007), "")
+		(",N", po::value<unsigned>(&N)->default_value(20000), "number of points")
+		(",D", po::value<unsigned>(&D)->default_value(32), "dimension")
+		(",B", po::value<unsigned>(&B)->default_value(200), "keys inserted at a time")
+		(",R", po::value<unsigned>(&R)->default_value(2), "number of reader threads")
+		;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+        cout << "This program checks inserting into an index being queried." << endl;
+		cout << desc;
+		return 0;
+	}
+
+    DefaultRng rng;
+    FloatMatrix data(D, N);
+    gaussian(data, rng);
+    FloatMatrix::Accessor accessor(data);
+    unsigned N0 = N / 2;
+
+    std::shared_ptr<Index> index = std::make_shared<Index>();
+    index->init(parameter<Index>(W, H, M, D), rng, L);
+    stringstream functions;
+    index->save(functions);
+    index->build(accessor, N0, 1);
+
+    ConcurrentIndex<Index> live;
+    live.reset(index);
+    for (unsigned key = 0; key < N0; ++key) {
+        if (removed(key, N0)) live.remove(key);
+    }
+    live.publish(1);
+    live.start(5, 1);
+
+    atomic<bool> done(false);
+    atomic<unsigned> queries(0), errors(0);
+    vector<thread> readers;
+    for (unsigned r = 0; r < R; ++r) {
+        readers.push_back(thread([&, r]() {
+            unsigned j = r;
+            while (!done) {
+                const float *query = data[j % N];
+                ConcurrentIndex<Index>::Snapshot s = live.snapshot();
+                vector<unsigned> c = candidates(*s, query, T);
+                for (unsigned i = 0; i < c.size(); ++i) {
+                    if (c[i] >= N || removed(c[i], N0)) ++errors;
+                }
+                if (candidates(*s, query, T) != c) ++errors;
+                ++queries;
+                j += 7;
+            }
+        }));
+    }
+
+    for (unsigned b = N0; b < N; b += B) {
+        vector<unsigned> keys;
+        vector<const float *> values;
+        for (unsigned key = b; key < std::min(N, b + B); ++key) {
+            keys.push_back(key);
+            values.push_back(data[key]);
+        }
+        live.insert(&keys[0], &values[0], keys.size());
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    live.stop();
+    live.publish(1);
+    done = true;
+    for (unsigned r = 0; r < R; ++r) readers[r].join();
+    cout << "queries during the inserts " << queries << ", errors " << errors << endl;
+
+    // The same functions, built with all the keys.
+    Index reference;
+    reference.load(functions);
+    reference.build(accessor, N, 1);
+    for (unsigned key = 0; key < N0; ++key) {
+        if (removed(key, N0)) reference.remove(key);
+    }
+    reference.compact(1);
+
+    unsigned diff = 0;
+    ConcurrentIndex<Index>::Snapshot s = live.snapshot();
+    for (unsigned j = 0; j < N; j += N / 100) {
+        if (candidates(*s, data[j], T) != candidates(reference, data[j], T)) ++diff;
+    }
+    live.compact(1);
+    s = live.snapshot();
+    for (unsigned j = 0; j < N; j += N / 100) {
+        if (candidates(*s, data[j], T) != candidates(reference, data[j], T)) ++diff;
+    }
+    cout << "queries different from a static index " << diff
+         << ", tombstones " << s->tombstones() << endl;
+
+    if (errors || diff || s->tombstones() || live.queued()) {
+        cout << "FAILED" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
@@ -0,0 +1,209 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Checks that the tables of MultiProbeLshIndex hold the same keys whichever
+ * way they are built: in bulk, one key at a time into thawed tables then
+ * frozen, through the overflow of a frozen index, after a save / load, and
+ * mapped from an image.  The mapped index must also answer the queries as
+ * the one it was saved from, and a verified map must refuse an image whose
+ * offsets are out of order.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include <boost/program_options.hpp>
+#include <lshkit.h>
+#include "common.h"
+
+using namespace std;
+using namespace lshkit;
+namespace po = boost::program_options;
+
+typedef MultiProbeLshIndex<unsigned> Index;
+
+// The sorted keys of every bin.
+static vector<vector<unsigned> > dump (const Index &index, unsigned H)
+{
+    vector<vector<unsigned> > r;
+    for (unsigned i = 0; i < index.getL(); ++i) {
+        for (unsigned h = 0; h < H; ++h) {
+            Index::BinRange b = index.bin(i, h);
+            r.push_back(vector<unsigned>(b.first, b.second));
+            sort(r.back().begin(), r.back().end());
+        }
+    }
+    return r;
+}
+
+static unsigned failed = 0;
+
+static void expect (bool ok, unsigned family, const char *what)
+{
+    if (ok) return;
+    cout << "family " << family << ": " << what << " FAILED" << endl;
+    ++failed;
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned N, D, L, M, H;
+    float W;
+    string image;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help,h", "produce help message.")
+		(",W", po::value<float>(&W)->default_value(4.0), "")
+		(",M", po::value<unsigned>(&M)->default_value(8), "")
+		(",L", po::value<unsigned>(&L)->default_value(4), "")
+		(",H", po::value<unsigned>(&H)->default_value(10007), "")
+		(",N", po::value<unsigned>(&N)->default_value(5000), "number of points")
+		(",D", po::value<unsigned>(&D)->default_value(64), "dimension")
+		("image,I", po::value<string>(&image)->default_value("frozen-index.img"), "temporary image file")
+		;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+        cout << "This program checks the frozen tables of MultiProbeLshIndex." << endl;
+		cout << desc;
+		return 0;
+	}
+
+    DefaultRng rng;
+    FloatMatrix data(D, N);
+    gaussian(data, rng);
+    FloatMatrix::Accessor accessor(data);
+
+    static const unsigned families[] = {FAMILY_MPLSH, FAMILY_FASTLSH, FAMILY_ACHASH};
+    for (unsigned f = 0; f < sizeof(families) / sizeof(families[0]); ++f)
+    {
+        Index::Parameter param = parameter<Index>(W, H, M, D);
+        param.family = families[f];
+
+        // The same functions for all the copies.
+        Index bulk;
+        bulk.init(param, rng, L);
+        stringstream empty;
+        bulk.save(empty);
+
+        bulk.build(accessor, N, 2);
+        expect(bulk.frozen(), f, "frozen after build");
+        vector<vector<unsigned> > ref = dump(bulk, H);
+
+        Index single;
+        empty.seekg(0);
+        single.load(empty);
+        single.thaw();
+        for (unsigned j = 0; j < N; ++j) single.insert(j, data[j]);
+        expect(dump(single, H) == ref, f, "thawed insert");
+        single.freeze(2);
+        expect(single.frozen() && dump(single, H) == ref, f, "freeze");
+        single.thaw();
+        expect(!single.frozen() && dump(single, H) == ref, f, "thaw");
+
+        Index overflow;
+        empty.seekg(0);
+        overflow.load(empty);
+        overflow.build(accessor, N / 2, 1);
+        for (unsigned j = N / 2; j < N; ++j) overflow.insert(j, data[j]);
+        expect(overflow.frozen(), f, "insert keeps the index frozen");
+        overflow.freeze();
+        expect(overflow.overflow() == 0 && dump(overflow, H) == ref, f, "overflow flush");
+
+        stringstream saved;
+        bulk.save(saved);
+        Index loaded;
+        loaded.load(saved);
+        expect(loaded.frozen() && dump(loaded, H) == ref, f, "save / load");
+
+        {
+            ofstream os(image.c_str(), ios::binary);
+            bulk.saveImage(os);
+        }
+        expect(isIndexImage(image), f, "image magic");
+        Index mapped;
+        mapped.map(image);
+        expect(mapped.frozen() && dump(mapped, H) == ref, f, "map");
+        bool same = true;
+        for (unsigned j = 0; j < 100; ++j) {
+            same = same && candidates(mapped, data[j], 20) == candidates(bulk, data[j], 20);
+        }
+        expect(same, f, "mapped queries");
+        // Inserted into the overflow, beside the mapped tables.
+        mapped.insert(N, data[1]);
+        vector<unsigned> c = candidates(mapped, data[1], 1);
+        expect(unsigned(count(c.begin(), c.end(), N)) == L, f, "insert into a mapped index");
+
+        // Offsets out of order, found only by a verified map.
+        {
+            fstream fs(image.c_str(), ios::in | ios::out | ios::binary);
+            IndexImageTable table;
+            fs.seekg(sizeof(IndexImageHeader));
+            fs.read((char *)&table, sizeof(table));
+            unsigned last = table.size;
+            fs.seekp(table.offsets + sizeof(unsigned));
+            fs.write((const char *)&last, sizeof(last));
+        }
+        Index unverified;
+        unverified.map(image);
+        bool refused = false;
+        try {
+            Index verified;
+            verified.map(image, true);
+        }
+        catch (const exception &) {
+            refused = true;
+        }
+        expect(refused, f, "verify a corrupted image");
+
+        cout << "family " << param.family << " done" << endl;
+    }
+
+    {
+        // The save format is not an image.
+        Index index;
+        index.init(parameter<Index>(W, H, M, D), rng, 1);
+        ofstream os(image.c_str(), ios::binary);
+        index.save(os);
+    }
+    bool refused = false;
+    try {
+        Index index;
+        index.map(image);
+    }
+    catch (const exception &) {
+        refused = true;
+    }
+    expect(!isIndexImage(image) && refused, 0, "map a saved index");
+    remove(image.c_str());
+
+    if (failed) {
+        cout << "FAILED" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
@@ -0,0 +1,164 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Checks MultiProbeLsh::ProbeGenerator on random hash values: generated
+ * one probe at a time, the template sequence must be the one of
+ * genProbeSequence, in the same order.  For small M, the query-directed
+ * sequence is checked against all the 3^M perturbations sorted by score:
+ * it must have them all (up to Probe::MAX_T), in the same order but for
+ * the ties.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <lshkit.h>
+
+using namespace std;
+using namespace lshkit;
+namespace po = boost::program_options;
+
+// Scores closer than this are ties.
+static const float EPSILON = 1e-5;
+
+typedef pair<float, unsigned> Perturbation;     // score, bucket
+
+static bool byScore (const Perturbation &a, const Perturbation &b)
+{
+    return a.first < b.first;
+}
+
+// Every perturbation of base by -1, 0 or +1 per component, sorted by the
+// sum of the squared distances to the boundaries crossed.
+static vector<Perturbation> enumerate (const MultiProbeLsh &lsh, const unsigned *base, const float *delta)
+{
+    unsigned M = lsh.getRepeat();
+    unsigned n = 1;
+    for (unsigned i = 0; i < M; ++i) n *= 3;
+    vector<Perturbation> all;
+    vector<unsigned> b(M);
+    for (unsigned c = 0; c < n; ++c) {
+        float score = 0;
+        unsigned x = c;
+        for (unsigned i = 0; i < M; ++i) {
+            int shift = int(x % 3) - 1;
+            x /= 3;
+            b[i] = base[i] + shift;
+            if (shift < 0) score += delta[i] * delta[i];
+            if (shift > 0) score += (1 - delta[i]) * (1 - delta[i]);
+        }
+        all.push_back(Perturbation(score, lsh.combine(&b[0])));
+    }
+    stable_sort(all.begin(), all.end(), byScore);
+    return all;
+}
+
+// Whether seq is all the perturbations, up to MAX_T, in order of score.
+static bool directed (const vector<unsigned> &seq, const vector<Perturbation> &all)
+{
+    if (seq.size() != std::min<std::size_t>(all.size(), Probe::MAX_T)) return false;
+    for (unsigned k = 0; k < seq.size(); ++k) {
+        if (all[k].second == seq[k]) continue;
+        bool tie = false;
+        for (unsigned t = 0; t < all.size(); ++t) {
+            if (all[t].second == seq[k] && fabs(all[t].first - all[k].first) < EPSILON) tie = true;
+        }
+        if (!tie) return false;
+    }
+    vector<unsigned> sorted(seq);
+    sort(sorted.begin(), sorted.end());
+    return unique(sorted.begin(), sorted.end()) == sorted.end();
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned N;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help,h", "produce help message.")
+		(",N", po::value<unsigned>(&N)->default_value(200), "number of random queries per M")
+		;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+        cout << "This program checks the incremental probe generator." << endl;
+		cout << desc;
+		return 0;
+	}
+
+    DefaultRng rng;
+    boost::uniform_real<float> unit(0, 1);
+    boost::variate_generator<DefaultRng &, boost::uniform_real<float> > uniform(rng, unit);
+    unsigned failed = 0;
+
+    static const unsigned Ms[] = {1, 2, 3, 5, 10, 20};
+    for (unsigned m = 0; m < sizeof(Ms) / sizeof(Ms[0]); ++m)
+    {
+        unsigned M = Ms[m];
+        MultiProbeLsh::Parameter param;
+        param.W = 1;
+        param.range = 1000003;
+        param.repeat = M;
+        param.dim = 16;
+        param.family = FAMILY_MPLSH;
+        MultiProbeLsh lsh(param, rng);
+
+        vector<unsigned> base(M);
+        vector<float> delta(M);
+        ProbeSequence scores;
+        MultiProbeLsh::ProbeGenerator gen;
+        unsigned diff = 0, directedDiff = 0;
+        for (unsigned n = 0; n < N; ++n) {
+            for (unsigned i = 0; i < M; ++i) {
+                base[i] = 1000 + n * 7 + i;
+                delta[i] = uniform();
+            }
+            vector<unsigned> seq;
+            lsh.genProbeSequence(&base[0], &delta[0], seq, Probe::MAX_T);
+
+            vector<unsigned> lazy;
+            gen.reset(lsh, &base[0], &delta[0], scores);
+            while (!gen.done()) lazy.push_back(gen.next());
+            if (lazy != seq || gen.size() != seq.size()) ++diff;
+
+            if (M > 5) continue;
+            vector<unsigned> query;
+            gen.reset(lsh, &base[0], &delta[0], scores, true);
+            while (!gen.done()) query.push_back(gen.next());
+            if (!directed(query, enumerate(lsh, &base[0], &delta[0]))) ++directedDiff;
+        }
+        cout << "M " << M << ": template sequences different " << diff
+             << ", directed sequences wrong " << directedDiff << endl;
+        failed += diff + directedDiff;
+    }
+
+    if (failed) {
+        cout << "FAILED" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Checks that ProjectionBlock hashes random points to the same values as
+ * the MultiProbeLsh functions evaluated one at a time.  The kernel used is
+ * that of simdLevel(); run it again with LSHKIT_SIMD=scalar (or sse, avx2)
+ * to check the others.  FastLSH is also checked with the sample shared by
+ * the functions of a table, where the block gathers the sampled dimensions.
+ *
+ * The block adds the products in another order, so a value may differ when
+ * the projection falls on a window boundary.  Only the differences away
+ * from the boundaries are counted as errors.
+ */
+
+#include <cmath>
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <lshkit.h>
+
+using namespace std;
+using namespace lshkit;
+namespace po = boost::program_options;
+
+// Values differing this close to a window boundary are rounding.
+static const float EPSILON = 1e-4;
+
+// Compare the outputs off, ..., off + M - 1 of block on points with the
+// functions of lsh.
+static unsigned check (const MultiProbeLsh &lsh, const ProjectionBlock &block, unsigned off,
+        const vector<const float *> &points, unsigned *boundary)
+{
+    unsigned M = lsh.getRepeat();
+    unsigned N = points.size();
+    unsigned errors = 0;
+    vector<unsigned> base(M);
+    vector<float> delta(M);
+    vector<unsigned> hash(N * block.getStride());
+    vector<float> bd(N * block.getStride());
+    block.apply(&points[0], N, &hash[0], &bd[0]);
+
+    for (unsigned j = 0; j < N; ++j) {
+        const unsigned *h = &hash[j * block.getStride() + off];
+        lsh.evaluate(points[j], &base[0], &delta[0]);
+        bool same = true;
+        for (unsigned i = 0; i < M; ++i) {
+            if (h[i] == base[i]) continue;
+            same = false;
+            if (delta[i] < EPSILON || delta[i] > 1 - EPSILON) ++*boundary;
+            else ++errors;
+        }
+        if (same && lsh.combine(h) != lsh(points[j])) ++errors;
+    }
+    return errors;
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned M, L, N;
+    float W;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help,h", "produce help message.")
+		(",W", po::value<float>(&W)->default_value(4.0), "")
+		(",M", po::value<unsigned>(&M)->default_value(10), "")
+		(",L", po::value<unsigned>(&L)->default_value(5), "")
+		(",N", po::value<unsigned>(&N)->default_value(1000), "number of points")
+		;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+        cout << "This program checks the batched projection kernel." << endl;
+		cout << desc;
+		return 0;
+	}
+
+    cout << "SIMD level " << simdLevel() << endl;
+
+    static const unsigned dims[] = {7, 128, 300, 960};
+    // The last family is FastLSH with a sample shared by the M functions,
+    // hashed with a gathering block per table.
+    static const unsigned families[] = {FAMILY_MPLSH, FAMILY_FASTLSH, FAMILY_FASTLSH};
+    static const unsigned shared[] = {0, 0, 1};
+    unsigned failed = 0;
+
+    for (unsigned f = 0; f < sizeof(families) / sizeof(families[0]); ++f)
+    for (unsigned d = 0; d < sizeof(dims) / sizeof(dims[0]); ++d)
+    {
+        unsigned dim = dims[d];
+        MultiProbeLsh::Parameter param;
+        param.range = 1017881;
+        param.repeat = M;
+        param.dim = dim;
+        param.W = W;
+        param.family = families[f];
+        param.shared = shared[f];
+        DefaultRng rng;
+
+        vector<MultiProbeLsh> lshs(L);
+        for (unsigned t = 0; t < L; ++t) lshs[t].reset(param, rng);
+
+        vector<ProjectionBlock> blocks(param.shared ? L : 1);
+        if (param.shared) {
+            for (unsigned t = 0; t < L; ++t) lshs[t].exportSharedProjections(&blocks[t]);
+        }
+        else {
+            blocks[0].reset(dim, L * M, W);
+            for (unsigned t = 0; t < L; ++t) lshs[t].exportProjections(&blocks[0], t * M);
+        }
+
+        vector<float> data(std::size_t(N) * dim);
+        vector<const float *> points(N);
+        boost::normal_distribution<float> gaussian;
+        boost::variate_generator<DefaultRng &, boost::normal_distribution<float> > gen(rng, gaussian);
+        for (unsigned j = 0; j < N; ++j) {
+            for (unsigned k = 0; k < dim; ++k) data[j * dim + k] = gen() * W;
+            points[j] = &data[j * dim];
+        }
+
+        unsigned boundary = 0;
+        unsigned errors = 0;
+        for (unsigned t = 0; t < L; ++t) {
+            if (param.shared) errors += check(lshs[t], blocks[t], 0, points, &boundary);
+            else errors += check(lshs[t], blocks[0], t * M, points, &boundary);
+        }
+        cout << "family " << param.family << (param.shared ? " shared" : "") << " dim " << dim
+             << ": errors " << errors << ", at boundaries " << boundary << endl;
+        failed += errors;
+    }
+
+    if (failed) {
+        cout << "FAILED" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
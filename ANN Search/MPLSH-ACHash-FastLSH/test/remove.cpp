@@ -0,0 +1,194 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Checks the tombstones of MultiProbeLshIndex and APostLshIndex: after
+ * every third key is removed, a query must return the candidates it
+ * returned before but the removed keys, before and after a compaction.
+ * A removed key inserted again is found again, and an updated key is found
+ * from its new value.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <boost/program_options.hpp>
+#include <lshkit.h>
+#include <lshkit/apost.h>
+#include "common.h"
+
+using namespace std;
+using namespace lshkit;
+namespace po = boost::program_options;
+
+static const unsigned T = 20;
+
+static bool dead (unsigned key, unsigned revived)
+{
+    return key % 3 == 0 && key != revived;
+}
+
+// Candidates of queries [0, Q) but the removed keys.
+static vector<vector<unsigned> > expected (const vector<vector<unsigned> > &before, unsigned revived)
+{
+    vector<vector<unsigned> > r(before.size());
+    for (unsigned j = 0; j < before.size(); ++j) {
+        for (unsigned i = 0; i < before[j].size(); ++i) {
+            if (!dead(before[j][i], revived)) r[j].push_back(before[j][i]);
+        }
+    }
+    return r;
+}
+
+template <typename INDEX>
+static vector<vector<unsigned> > run (const INDEX &index, const FloatMatrix &queries)
+{
+    vector<vector<unsigned> > r(queries.getSize());
+    for (unsigned j = 0; j < r.size(); ++j) r[j] = candidates(index, queries[j], T);
+    return r;
+}
+
+template <typename INDEX>
+static unsigned check (INDEX &index, const FloatMatrix &data, const FloatMatrix &queries, const char *name)
+{
+    unsigned N = data.getSize();
+    unsigned errors = 0;
+    vector<vector<unsigned> > before = run(index, queries);
+    std::size_t total = 0;
+    for (unsigned j = 0; j < before.size(); ++j) total += before[j].size();
+    if (total == 0) {
+        cout << name << ": no candidates" << endl;
+        ++errors;
+    }
+
+    unsigned none = N;
+    for (unsigned key = 0; key < N; key += 3) index.remove(key);
+    if (index.tombstones() != (N + 2) / 3) ++errors;
+    if (run(index, queries) != expected(before, none)) {
+        cout << name << ": removed keys returned" << endl;
+        ++errors;
+    }
+
+    index.compact(1);
+    if (index.tombstones() != 0) ++errors;
+    if (run(index, queries) != expected(before, none)) {
+        cout << name << ": compaction changed the candidates" << endl;
+        ++errors;
+    }
+
+    index.insert(0, data[0]);
+    if (run(index, queries) != expected(before, 0)) {
+        cout << name << ": removed key not revived" << endl;
+        ++errors;
+    }
+
+    // Key 1 takes the value of a candidate of the first query, and is now
+    // in the same bins.
+    vector<unsigned> c = candidates(index, queries[0], T);
+    unsigned other = 0;
+    for (unsigned i = 0; i < c.size(); ++i) {
+        if (!dead(c[i], 0) && c[i] != 1) other = c[i];
+    }
+    index.update(1, data[other]);
+    c = candidates(index, queries[0], T);
+    if (other == 0 || count(c.begin(), c.end(), 1u) < count(c.begin(), c.end(), other)) {
+        cout << name << ": updated key not found" << endl;
+        ++errors;
+    }
+
+    cout << name << ": " << total << " candidates, errors " << errors << endl;
+    return errors;
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned N, D, L, M, H, Q, K;
+    float W;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help,h", "produce help message.")
+		(",W", po::value<float>(&W)->default_value(4.0), "")
+		(",M", po::value<unsigned>(&M)->default_value(8), "")
+		(",L", po::value<unsigned>(&L)->default_value(4), "")
+		(",H", po::value<unsigned>(&H)->default_value(10007), "")
+		(",N", po::value<unsigned>(&N)->default_value(5000), "number of points")
+		(",D", po::value<unsigned>(&D)->default_value(32), "dimension")
+		(",Q", po::value<unsigned>(&Q)->default_value(100), "number of queries")
+		(",K", po::value<unsigned>(&K)->default_value(10), "# nearest neighbors to train APost")
+		;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+        cout << "This program checks removing keys from an index." << endl;
+		cout << desc;
+		return 0;
+	}
+
+    DefaultRng rng;
+    FloatMatrix data(D, N);
+    gaussian(data, rng);
+    // Close to the first Q points.
+    FloatMatrix queries(D, Q);
+    gaussian(queries, rng);
+    for (unsigned j = 0; j < Q; ++j) {
+        for (unsigned k = 0; k < D; ++k) queries[j][k] = data[j][k] + queries[j][k] * 0.2;
+    }
+    FloatMatrix::Accessor accessor(data);
+    unsigned failed = 0;
+
+    {
+        typedef MultiProbeLshIndex<unsigned> Index;
+        Index index;
+        index.init(parameter<Index>(W, H, M, D), rng, L);
+        index.build(accessor, N, 1);
+        failed += check(index, data, queries, "MultiProbeLshIndex");
+    }
+
+    {
+        typedef APostLshIndex<unsigned> Index;
+        Index index;
+        index.init(parameter<Index>(W, H, M, D), rng, L);
+        for (unsigned j = 0; j < N; ++j) index.insert(j, data[j]);
+
+        // The K-NNs of the queries, by brute force.
+        metric::l2sqr<float> l2sqr(D);
+        vector<APostExample> examples(Q);
+        for (unsigned j = 0; j < Q; ++j) {
+            Topk<unsigned> topk;
+            topk.reset(K);
+            for (unsigned k = 0; k < N; ++k) topk << Topk<unsigned>::Element(k, l2sqr(queries[j], data[k]));
+            topk.sort();
+            examples[j].query = queries[j];
+            for (unsigned k = 0; k < topk.size(); ++k) examples[j].results.push_back(data[topk[k].key]);
+        }
+        index.train(examples, 2500, 1.0, 0.1);
+        failed += check(index, data, queries, "APostLshIndex");
+    }
+
+    if (failed) {
+        cout << "FAILED" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
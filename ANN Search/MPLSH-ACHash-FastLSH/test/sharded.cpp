@@ -0,0 +1,173 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Checks that a ShardedIndex answers as a single MultiProbeLshIndex with
+ * the same functions: the shards together return the same candidates, and
+ * the merged K-NNs are at the same distances.  The shards are then forked
+ * into processes, which must return the K-NNs of the shards in process.
+ * Other clients connected to the processes have the boundaries of the
+ * shards only if they are given them.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <boost/program_options.hpp>
+#include <lshkit.h>
+#include "common.h"
+
+using namespace std;
+using namespace lshkit;
+namespace po = boost::program_options;
+
+typedef MultiProbeLshIndex<unsigned> Index;
+typedef TopkScanner<FloatMatrix::Accessor, metric::l2sqr<float> > Scanner;
+
+// Number of queries whose K-NNs are at different distances.
+static unsigned compare (const vector<Topk<unsigned> > &a, const vector<Topk<unsigned> > &b)
+{
+    unsigned diff = 0;
+    for (unsigned j = 0; j < a.size(); ++j) {
+        bool same = a[j].size() == b[j].size();
+        for (unsigned k = 0; same && k < a[j].size(); ++k) {
+            same = a[j][k].dist == b[j][k].dist;
+        }
+        if (!same) ++diff;
+    }
+    return diff;
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned N, D, L, M, H, S, Q, K, T;
+    float W;
+    string dir;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help,h", "produce help message.")
+		(",W", po::value<float>(&W)->default_value(4.0), "")
+		(",M", po::value<unsigned>(&M)->default_value(8), "")
+		(",L", po::value<unsigned>(&L)->default_value(4), "")
+		(",H", po::value<unsigned>(&H)->default_value(10007), "")
+		(",T", po::value<unsigned>(&T)->default_value(20), "# probes")
+		(",S", po::value<unsigned>(&S)->default_value(4), "# shards")
+		(",N", po::value<unsigned>(&N)->default_value(10000), "number of points")
+		(",D", po::value<unsigned>(&D)->default_value(32), "dimension")
+		(",Q", po::value<unsigned>(&Q)->default_value(100), "number of queries")
+		(",K", po::value<unsigned>(&K)->default_value(10), "# nearest neighbors")
+		("dir", po::value<string>(&dir)->default_value("/tmp"), "directory of the sockets")
+		;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help"))
+	{
+        cout << "This program checks a sharded index against a single one." << endl;
+		cout << desc;
+		return 0;
+	}
+
+    DefaultRng rng;
+    FloatMatrix data(D, N);
+    gaussian(data, rng);
+    FloatMatrix::Accessor accessor(data);
+    vector<const float *> queries(Q);
+    for (unsigned j = 0; j < Q; ++j) queries[j] = data[j * (N / Q)];
+
+    ShardedIndex<unsigned> sharded;
+    sharded.init(parameter<Index>(W, H, M, D), rng, L, S);
+
+    // The functions of the shards, built with all the keys.
+    Index single;
+    {
+        stringstream functions;
+        sharded.shard(0).save(functions);
+        single.load(functions);
+    }
+    single.build(accessor, N, 1);
+    sharded.build(accessor, N, 1);
+
+    unsigned diff = 0;
+    for (unsigned j = 0; j < Q; ++j) {
+        vector<unsigned> a, b;
+        Collector ca(&a), cb(&b);
+        for (unsigned s = 0; s < S; ++s) sharded.shard(s).query(queries[j], T, ca);
+        single.query(queries[j], T, cb);
+        sort(a.begin(), a.end());
+        sort(b.begin(), b.end());
+        if (a != b) ++diff;
+    }
+    cout << "queries with different candidates " << diff << endl;
+    unsigned failed = diff;
+
+    Scanner scanner(accessor, metric::l2sqr<float>(D), K);
+    vector<unsigned> cnt, remoteCnt;
+    vector<Topk<unsigned> > knn = sharded.query_batch(&queries[0], Q, T, scanner, 1, &cnt);
+    diff = compare(knn, single.query_batch(&queries[0], Q, T, scanner, 1));
+    cout << "queries with different K-NNs " << diff << endl;
+    failed += diff;
+
+    vector<Topk<unsigned> > recall = sharded.query_recall_batch(&queries[0], Q, 0.9, scanner, 1);
+
+    sharded.fork(dir, accessor, metric::l2sqr<float>(D), 1);
+    diff = compare(knn, sharded.query_batch(&queries[0], Q, T, scanner, 1, &remoteCnt));
+    diff += compare(recall, sharded.query_recall_batch(&queries[0], Q, 0.9, scanner, 1));
+    if (cnt != remoteCnt) ++diff;
+    for (unsigned j = 0; j < Q; ++j) {
+        scanner.reset(queries[j]);
+        sharded.query(queries[j], T, scanner);
+        vector<Topk<unsigned> > one(1, scanner.topk());
+        diff += compare(one, vector<Topk<unsigned> >(1, knn[j]));
+        if (scanner.cnt() != cnt[j]) ++diff;
+    }
+    // Clients of the same processes know the boundaries only if given.
+    vector<string> paths;
+    vector<unsigned> begins;
+    for (unsigned s = 0; s < S; ++s) paths.push_back(dir + "/shard-" + to_string(s) + ".sock");
+    for (unsigned s = 0; s <= S; ++s) begins.push_back(sharded.begin(s));
+    {
+        ShardedIndex<unsigned> client, blind;
+        client.connect(paths, D, begins);
+        blind.connect(paths, D);
+        if (client.getS() != S || client.begin(S) != N) ++diff;
+        bool thrown = false;
+        try {
+            blind.begin(0);
+        }
+        catch (const logic_error &) {
+            thrown = true;
+        }
+        if (!thrown) ++diff;
+    }
+    sharded.shutdown();
+    cout << "remote shards different from those in process " << diff << endl;
+    failed += diff;
+
+    if (failed) {
+        cout << "FAILED" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
@@ -171,6 +171,7 @@ int main (int argc, char *argv[])
 
         for (unsigned i = 0; i < Q; i++)
         {
+            topks[i].sort();
             for (unsigned k = 0; k < K; k++)
             {
                 M[k] += topks[i][k].dist;
@@ -18,9 +18,8 @@
 */
 
 #include <boost/program_options.hpp>
-#include <boost/progress.hpp>
 #include <boost/format.hpp>
-#include <boost/timer.hpp>
+#include <chrono>
 #include <lshkit.h>
 
 /**
@@ -35,6 +34,9 @@
   * will try to load the previously saved index.  When a saved index is
   * used, you need to make sure that the dataset and other parameters match
   * the previous run.  However, the benchmark file, Q and K can be different.
+  * The index is saved as an image (see LshIndex::map), which is mapped
+  * into memory the next time instead of being read; index files saved by
+  * LshIndex::save are still loaded.
   *
 \verbatim
 Allowed options:
@@ -51,6 +53,33 @@ Allowed options:
   -B [ --benchmark ] arg          benchmark file
   --index arg                     index file
   -H [ -- ] arg (=1017881)        hash table size, use the default value.
+  --shared                        the M functions of a table sample the same
+                                  dimensions
+  --family arg (=fastlsh)         mplsh, fastlsh or achash
+  --subdim arg (=0)               # dimensions sampled, 0 for the default of
+                                  the family
+  --threads arg (=0)              # threads for construction and queries, 0
+                                  for all the cores
+  --sorted                        collect, sort and deduplicate the
+                                  candidates of a query before scanning them
+  --directed                      generate the probes from the scores of each
+                                  query instead of the template sequence
+  --quantize arg                  int8 or fp16, rank the candidates on
+                                  quantized vectors and re-rank with fp32
+  --rerank arg (=0)               # candidates re-ranked with fp32, 0 for 4K
+  --pq arg (=0)                   # sub-spaces of product quantization codes
+                                  to rank the candidates on, 0 for none
+  --pq-bits arg (=4)              bits per sub-space code, 4 or 8
+  --sketch arg (=0)               # 64-bit words of the sketches filtering the
+                                  candidates, 0 for no filtering
+  --sketch-W arg (=1)             window size of the sketch bits
+  --sketch-dist arg (=0)          maximal Hamming distance of a candidate
+  --hugepages arg                 none, thp or explicit, huge pages of the
+                                  dataset (see memory.h)
+  --numa arg                      default, interleave or bind:N, NUMA
+                                  placement of the dataset
+  --mmap                          map the data and query files instead of
+                                  reading them
 \endverbatim
   */
 
@@ -116,45 +145,24 @@ public:
 };
 */
 
-bool is_power_of_two(int n){
-    return (n > 0) && ((n & (n-1)) == 0);
-}
-
-void hadamard_transform(float* work, int N, float* output) 
+// Wall clock timer.  boost::timer counts the CPU time of the process, which
+// grows with the number of threads.
+class WallTimer
 {
-	int i, j, k, stage, L, J, M;
-	float *tmp;
-	for (i = 0; i < N-1; i += 2)
-	{
-		work[i] = (work[i] + work[i+1]);
-		work[i+1] = (work[i] - 2*work[i+1]);
-	}
-	L = 1;
-	for (stage = 2; stage <= ceil(log2(N)); ++stage)
-	{
-		M = (int) pow((float)2, L);
-		J = 0;
-		k = 0;
-
-		while (k < N-1)
-		{
-			for (j = J; j < J+M-1; j = j+2)
-			{
-				output[k] = work[j] + work[j+M];
-				output[k+1] = work[j] - work[j+M];
-				output[k+2] = work[j+1] - work[j+M+1];
-				output[k+3] = work[j+1] + work[j+M+1];
-				k += 4;
-			}
-			J += 2*M;
-		}
-		tmp = work;
-		work = output;
-		output = tmp;
-		L += 1;
-	}
-}
+    std::chrono::steady_clock::time_point start_;
+public:
+    WallTimer (): start_(std::chrono::steady_clock::now()) {}
 
+    void restart ()
+    {
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    double elapsed () const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+};
 
 int main (int argc, char *argv[])
 {
@@ -162,16 +170,25 @@ int main (int argc, char *argv[])
     string benchmark;
     string index_file;
     string querymark_file;
+    string family;
+    string quantize;
+    string hugepages, numa;
 
     float W, R, desired_recall = 1.0;
-    unsigned M, L, H;
+    unsigned M, L, H, subdim;
+    unsigned threads;
+    unsigned rerank;
+    unsigned pqM, pqBits;
+    unsigned sketchWords, sketchDist;
+    float sketchW;
     unsigned Q, K, T;
     unsigned Z;
     bool do_recall = false;
     bool do_benchmark = true;
     bool use_index = false; // load the index from a file
+    bool shared = false;
 
-    boost::timer timer;
+    WallTimer timer;
 
     po::options_description desc("Allowed options");
     desc.add_options()
@@ -193,6 +210,22 @@ int main (int argc, char *argv[])
         (",M", po::value<unsigned>(&M)->default_value(1), "")
         (",L", po::value<unsigned>(&L)->default_value(1), "# hash tables")
         (",W", po::value<float>(&W)->default_value(1.0), "")
+        ("shared", "the M functions of a table sample the same dimensions")
+        ("family", po::value<string>(&family)->default_value("fastlsh"), "mplsh, fastlsh or achash")
+        ("subdim", po::value<unsigned>(&subdim)->default_value(0), "# dimensions sampled, 0 for the default of the family")
+        ("threads", po::value<unsigned>(&threads)->default_value(0), "# threads for construction and queries, 0 for all the cores")
+        ("sorted", "collect, sort and deduplicate the candidates of a query before scanning them")
+        ("directed", "generate the probes from the scores of each query instead of the template sequence")
+        ("quantize", po::value<string>(&quantize), "int8 or fp16, rank the candidates on quantized vectors and re-rank with fp32")
+        ("rerank", po::value<unsigned>(&rerank)->default_value(0), "# candidates re-ranked with fp32, 0 for 4K")
+        ("pq", po::value<unsigned>(&pqM)->default_value(0), "# sub-spaces of product quantization codes to rank the candidates on, 0 for none")
+        ("pq-bits", po::value<unsigned>(&pqBits)->default_value(4), "bits per sub-space code, 4 or 8")
+        ("sketch", po::value<unsigned>(&sketchWords)->default_value(0), "# 64-bit words of the sketches filtering the candidates, 0 for no filtering")
+        ("sketch-W", po::value<float>(&sketchW)->default_value(1.0), "window size of the sketch bits")
+        ("sketch-dist", po::value<unsigned>(&sketchDist)->default_value(0), "maximal Hamming distance of a candidate")
+        ("hugepages", po::value<string>(&hugepages), "none, thp or explicit, huge pages of the dataset (see memory.h)")
+        ("numa", po::value<string>(&numa), "default, interleave or bind:N, NUMA placement of the dataset")
+        ("mmap", "map the data and query files instead of reading them")
         ;
 
     po::variables_map vm;
@@ -225,12 +258,48 @@ int main (int argc, char *argv[])
         use_index = true;
     }
 
+    if (vm.count("shared") >= 1) {
+        shared = true;
+    }
+
+    if (pqM > 0 && (pqBits != 4 && pqBits != 8)) {
+        cerr << "PQ codes have 4 or 8 bits." << endl;
+        return 1;
+    }
+
+    if (!quantize.empty() && quantize != "int8" && quantize != "fp16") {
+        cerr << "Unknown quantization " << quantize << "." << endl;
+        return 1;
+    }
+
+    try {
+        MemoryPolicy policy = memoryPolicy();
+        if (vm.count("hugepages")) policy.hugePages = parseHugePages(hugepages);
+        if (vm.count("numa")) parseNuma(numa, &policy);
+        setMemoryPolicy(policy);
+    }
+    catch (const std::runtime_error &e) {
+        cerr << e.what() << "." << endl;
+        return 1;
+    }
+
     // cout << "LOADING DATA..." << endl;
     timer.restart();
-    FloatMatrix data(data_file);
-   // FloatMatrix data(data_file,querymark_file);
-    FloatMatrix queryRow(querymark_file);
+    FloatMatrix data;
+    FloatMatrix queryRow;
+    if (vm.count("mmap") >= 1) {
+        data.mapVecs(data_file);
+        queryRow.mapVecs(querymark_file);
+    }
+    else {
+        data.loadFvecs(data_file);
+        queryRow.loadFvecs(querymark_file);
+    }
 
+    if (pqM > 0 && data.getDim() % pqM != 0) {
+        cerr << "The dimension " << data.getDim() << " is not a multiple of --pq " << pqM << "." << endl;
+        return 1;
+    }
 
 
     // cout << boost::format("LOAD TIME: %1%s.") % timer.elapsed() << endl;
@@ -246,7 +315,12 @@ int main (int argc, char *argv[])
 
 
 
-    if (use_index) {
+    if (use_index && isIndexImage(index_file)) {
+        timer.restart();
+        index.map(index_file);
+        index_loaded = true;
+    }
+    else if (use_index) {
         ifstream is(index_file.c_str(), ios_base::binary);
         if (is) {
             is.exceptions(ios_base::eofbit | ios_base::failbit | ios_base::badbit);
@@ -268,6 +342,15 @@ int main (int argc, char *argv[])
         param.range = H; // See H in the program parameters.  You can just use the default value.
         param.repeat = M;
         param.dim = data.getDim();
+        param.shared = shared;
+        param.subdim = subdim;
+        if (family == "mplsh") param.family = FAMILY_MPLSH;
+        else if (family == "fastlsh") param.family = FAMILY_FASTLSH;
+        else if (family == "achash") param.family = FAMILY_ACHASH;
+        else {
+            cerr << "Unknown family " << family << "." << endl;
+            return 1;
+        }
         DefaultRng rng;
 
         cout<<endl;
@@ -281,38 +364,7 @@ int main (int argc, char *argv[])
         cout << "CONSTRUCTING INDEX..." << endl;
 
         timer.restart();
-        {
-            boost::progress_display progress(data.getSize());
-            for (unsigned i = 0; i < data.getSize(); ++i)
-            {   
-                
-                // Insert an item to the hash table.
-                // Note that only the key is passed in here.
-                // MPLSH will get the feature from the accessor.
-
-                // return to lsh.h file to use MPLSH, FastLSH and ACHash
-
-                //**************MPLSH and FastLSH
-                index.insert(i, data[i]);
-
-                //**************ACHash
-                // if(is_power_of_two(param.dim)){
-                //     float firHT[param.dim];
-                //     float *tmp = data[i]; 
-                //     hadamard_transform(tmp, param.dim, firHT);
-                //     index.insert(i, tmp);
-                // }else{
-                //     int dimension = pow(2, ceil(log2(param.dim)));
-                //     float firHT[dimension];
-                //     float tmp[dimension] = {0}; 
-                //     for (int d = 0; d < param.dim; ++d){tmp[d] = data[i][d];}
-                //     hadamard_transform(tmp, dimension, firHT);
-                //     index.insert(i, tmp);
-                // }
-                ++progress;
-            }
-
-        }
+        index.build(accessor, data.getSize(), threads);
         cout << boost::format("CONSTRUCTION TIME: %1%s.") % timer.elapsed() << endl;
 
         if (use_index) {
@@ -321,7 +373,7 @@ int main (int argc, char *argv[])
             {
                 ofstream os(index_file.c_str(), ios_base::binary);
                 os.exceptions(ios_base::eofbit | ios_base::failbit | ios_base::badbit);
-                index.save(os);
+                index.saveImage(os);
             }
             cout << boost::format("SAVING TIME: %1%s") % timer.elapsed() << endl;
         }
@@ -345,77 +397,89 @@ int main (int argc, char *argv[])
 
         cout << "RUNNING QUERIES..." << endl;
 
+        index.setSortedScan(vm.count("sorted") >= 1);
+        index.setQueryDirected(vm.count("directed") >= 1);
+
+        SketchFilter<const float *> filter;
+        if (sketchWords > 0) {
+            typedef Sketch<DeltaLSB<GaussianLsh>, uint64_t> MySketch;
+            MySketch::Parameter sparam;
+            sparam.W = sketchW;
+            sparam.dim = data.getDim();
+            DefaultRng srng;
+            MySketch sketch(sketchWords, sparam, srng);
+            timer.restart();
+            filter.reset(sketch, accessor, data.getSize(), threads);
+            cout << boost::format("SKETCH TIME: %1%s.") % timer.elapsed() << endl;
+            index.setSketchFilter(&filter, sketchDist);
+        }
+
         Stat recall;
         Stat cost;
 
         metric::l2sqr<float> l2sqr(data.getDim());
         TopkScanner<FloatMatrix::Accessor, metric::l2sqr<float>> query(accessor, l2sqr, K, R);
-        vector<Topk<unsigned> > topks(Q);
-        unsigned dim = data.getDim();
-        timer.restart();
-        if (do_recall)
+        vector<const float *> queries(Q);
+        for (unsigned i = 0; i < Q; ++i) {
+            queries[i] = queryRow[bench.getQuery(i)];
+        }
+        vector<Topk<unsigned> > topks;
+        vector<unsigned> cnts;
+        if (pqM > 0)
+        {
+            ProductQuantizer pq;
+            pq.reset(data.getDim(), pqM, pqBits);
+            DefaultRng pqRng;
+            timer.restart();
+            pq.train(data, pqRng, 25, 0, threads);
+            PQCodes codes;
+            codes.reset(pq, data, threads);
+            cout << boost::format("PQ TRAINING TIME: %1%s.") % timer.elapsed() << endl;
+            cout << boost::format("CODES: %1% bytes.") % codes.getBytes() << endl;
+            PQTopkScanner<FloatMatrix::Accessor> pquery(pq, codes, accessor, K, rerank ? rerank : 4 * K, R);
+            timer.restart();
+            if (do_recall)
+            {
+                topks = index.query_recall_batch(&queries[0], Q, desired_recall, pquery, threads, &cnts);
+            }
+            else
+            {
+                topks = index.query_batch(&queries[0], Q, T, pquery, threads, &cnts);
+            }
+        }
+        else if (!quantize.empty())
         {
-            boost::progress_display progress(Q);
-            
-            for (unsigned i = 0; i < Q; ++i)
+            QuantizedMatrix codes;
+            codes.reset(data, quantize == "int8" ? QuantizedMatrix::QUANT_INT8 : QuantizedMatrix::QUANT_FP16);
+            cout << boost::format("CODES: %1% bytes.") % codes.getBytes() << endl;
+            QuantizedTopkScanner<FloatMatrix::Accessor> qquery(codes, accessor, K, rerank ? rerank : 4 * K, R);
+            timer.restart();
+            if (do_recall)
+            {
+                topks = index.query_recall_batch(&queries[0], Q, desired_recall, qquery, threads, &cnts);
+            }
+            else
             {
-                query.reset(queryRow[bench.getQuery(i)]);
-
-                //********** MPLSH and FastLSH
-                index.query_recall(queryRow[bench.getQuery(i)], desired_recall, query);
-
-                //**********ACHash 
-            //    if(is_power_of_two(dim)){
-            //         float firHT[dim];
-            //         float *tmp = queryRow[bench.getQuery(i)]; 
-            //         hadamard_transform(tmp, dim, firHT);
-            //         index.query_recall(tmp, desired_recall, query);
-            //     }else{
-            //         int dimension = pow(2, ceil(log2(dim)));
-            //         float firHT[dimension];
-            //         float tmp[dimension] = {0}; 
-            //         for (int d = 0; d < dim; ++d){tmp[d] = queryRow[bench.getQuery(i)][d];}
-            //         hadamard_transform(tmp, dimension, firHT);
-            //         index.query_recall(tmp, desired_recall, query);
-            //     }
-
-
-                cost << double(query.cnt())/double(data.getSize());
-                topks[i].swap(query.topk());
-                ++progress;
+                topks = index.query_batch(&queries[0], Q, T, qquery, threads, &cnts);
             }
         }
         else
         {
-            boost::progress_display progress(Q);
-            for (unsigned i = 0; i < Q; ++i)
+            timer.restart();
+            if (do_recall)
+            {
+                topks = index.query_recall_batch(&queries[0], Q, desired_recall, query, threads, &cnts);
+            }
+            else
             {
-                query.reset(queryRow[bench.getQuery(i)]);
-
-                //********** MPLSH and FastLSH
-                index.query(queryRow[bench.getQuery(i)], T, query);
-                
-                //**********ACHash
-                // if(is_power_of_two(dim)){
-                //     float firHT[dim];
-                //     float *tmp = queryRow[bench.getQuery(i)]; 
-                //     hadamard_transform(tmp, dim, firHT);
-                //     index.query(tmp, T, query);
-                // }else{
-                //     int dimension = pow(2, ceil(log2(dim)));
-                //     float firHT[dimension];
-                //     float tmp[dimension] = {0}; 
-                //     for (int d = 0; d < dim; ++d){tmp[d] = queryRow[bench.getQuery(i)][d];}
-                //     hadamard_transform(tmp, dimension, firHT);
-                //     index.query(tmp, T, query);
-                // }
-                
-                cost << double(query.cnt())/double(data.getSize());
-                topks[i].swap(query.topk());
-                ++progress;
+                topks = index.query_batch(&queries[0], Q, T, query, threads, &cnts);
             }
         }
 
+        for (unsigned i = 0; i < Q; ++i) {
+            cost << double(cnts[i])/double(data.getSize());
+        }
+
         for (unsigned i = 0; i < Q; ++i) {
             recall << bench.getAnswer(i).recall(topks[i]);
         }
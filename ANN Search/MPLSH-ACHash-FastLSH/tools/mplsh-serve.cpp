@@ -0,0 +1,435 @@
+/*
+    Copyright (C) 2008 Wei Dong <wdong@princeton.edu>. All Rights Reserved.
+
+    This file is part of LSHKIT.
+
+    LSHKIT is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    LSHKIT is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with LSHKIT.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <lshkit.h>
+#include <lshkit/latency.h>
+
+/**
+  * \file mplsh-serve.cpp
+  * \brief Serve an MPLSH index over a Unix socket.
+  *
+  * The program maps an index image saved by mplsh-run --index and the
+  * dataset, and answers the query batches of the protocol of remote.h on
+  * a Unix socket until it receives REMOTE_SHUTDOWN, SIGINT or SIGTERM.
+  * The queries are vectors of float for an fvecs dataset and of bytes for
+  * a bvecs one.  A ShardedIndex can use such servers as its shards with
+  * ShardedIndex::connect.
+  *
+  * Each connection is read by its own thread, and a connection has one
+  * request in flight.  The requests of all the connections are cut into
+  * slices of at most --batch queries and queued.  A worker takes the
+  * slices at the head of the queue which have the same parameters, up to
+  * --batch queries, waiting at most --wait microseconds after the oldest
+  * one arrived for the batch to fill up, and runs them with its own
+  * scanner and query context.  Small concurrent requests are thus served
+  * together, and a large one is spread over the workers.  A worker has a
+  * single scanner, set to the K of each batch; requests of K above --max-k
+  * are answered REMOTE_BAD_REQUEST.
+  *
+  * Every --interval seconds, the program prints the QPS and the p50, p99
+  * and p999 latencies of the requests of the interval, from their arrival
+  * to their answer, and rewrites the --stats file with the histograms of
+  * the latencies and of the QPS of the intervals since the start.
+  *
+\verbatim
+Allowed options:
+  -h [ --help ]                produce help message.
+  -D [ --data ] arg            data file, fvecs or bvecs
+  --index arg                  index image
+  --socket arg (=/tmp/mplsh.sock)
+                               Unix socket to listen on
+  --threads arg (=0)           # worker threads, 0 for all the cores
+  --batch arg (=64)            maximal # queries of a micro-batch
+  --max-k arg (=1000)          maximal K of a request
+  --wait arg (=100)            microseconds to wait for a micro-batch to
+                               fill up
+  --sorted                     collect, sort and deduplicate the candidates
+                               of a query before scanning them
+  --directed                   generate the probes from the scores of each
+                               query instead of the template sequence
+  --populate                   read the whole dataset at start
+  --interval arg (=10)         seconds between the statistics, 0 for none
+  --stats arg                  file of the latency and QPS histograms
+\endverbatim
+  */
+
+using namespace std;
+using namespace lshkit;
+namespace po = boost::program_options;
+
+typedef MultiProbeLshIndex<unsigned> Index;
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<bool> stopping(false);
+
+static void onSignal (int)
+{
+    stopping = true;
+}
+
+// A request being served.
+struct Request
+{
+    RemoteRequest header;
+    std::vector<char> queries;
+    std::vector<Topk<unsigned> > topks;
+    std::vector<unsigned> cnt;
+    Clock::time_point arrival;
+    unsigned pending;           // slices not answered yet
+};
+
+// Queries [begin, end) of a request.
+struct Slice
+{
+    Request *req;
+    unsigned begin, end;
+};
+
+static bool sameBatch (const RemoteRequest &a, const RemoteRequest &b)
+{
+    return a.op == b.op && a.K == b.K && (a.op == REMOTE_QUERY ? a.T == b.T : a.recall == b.recall);
+}
+
+struct Stats
+{
+    std::mutex mutex;
+    LatencyHistogram interval;  // latencies of the current interval, us
+    LatencyHistogram latency;   // since the start
+    LatencyHistogram qps;       // QPS of the intervals
+    uint64_t requests = 0;
+    uint64_t queries = 0;
+    uint64_t intervalQueries = 0;
+};
+
+template <typename T>
+class Server
+{
+    typedef typename Matrix<T>::Accessor Accessor;
+    typedef metric::l2sqr<T> Metric;
+    typedef TopkScanner<Accessor, Metric> Scanner;
+
+    const Index &index_;
+    const Matrix<T> &data_;
+    unsigned batch_;
+    unsigned maxK_;
+    Clock::duration wait_;
+
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    std::condition_variable answered_;
+    std::deque<Slice> queue_;
+    unsigned queuedQueries_;
+    bool stop_;
+
+    std::mutex connMutex_;
+    std::condition_variable connClosed_;
+    std::map<int, bool> conns_;             // open connections
+
+public:
+    Stats stats;
+
+    Server (const Index &index, const Matrix<T> &data, unsigned batch, unsigned maxK, unsigned wait)
+        : index_(index), data_(data), batch_(batch), maxK_(maxK), wait_(std::chrono::microseconds(wait)),
+          queuedQueries_(0), stop_(false) {}
+
+    // Run micro-batches until stop() and the queue is empty.
+    void work ()
+    {
+        Accessor accessor(data_);
+        Scanner scanner(accessor, Metric(data_.getDim()), 1);
+        Index::QueryContext ctx;
+        std::vector<Slice> taken;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queued_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) break;
+                Clock::time_point deadline = queue_.front().req->arrival + wait_;
+                while (!stop_ && queuedQueries_ < batch_ && Clock::now() < deadline && !queue_.empty()) {
+                    queued_.wait_until(lock, deadline);
+                }
+                // Another worker may have emptied the queue meanwhile.
+                if (queue_.empty()) continue;
+                const RemoteRequest &head = queue_.front().req->header;
+                unsigned n = 0;
+                taken.clear();
+                while (!queue_.empty() && sameBatch(queue_.front().req->header, head)) {
+                    const Slice &s = queue_.front();
+                    if (n > 0 && n + (s.end - s.begin) > batch_) break;
+                    n += s.end - s.begin;
+                    taken.push_back(s);
+                    queue_.pop_front();
+                }
+                queuedQueries_ -= n;
+            }
+            const RemoteRequest &head = taken[0].req->header;
+            scanner.setK(head.K);
+            for (unsigned t = 0; t < taken.size(); ++t) {
+                Request &req = *taken[t].req;
+                for (unsigned i = taken[t].begin; i < taken[t].end; ++i) {
+                    const T *q = reinterpret_cast<const T *>(&req.queries[0]) + std::size_t(i) * data_.getDim();
+                    scanner.reset(q);
+                    if (head.op == REMOTE_QUERY) index_.query(q, head.T, scanner, ctx);
+                    else index_.query_recall(q, head.recall, scanner, ctx);
+                    req.topks[i] = scanner.topk();
+                    req.cnt[i] = scanner.cnt();
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (unsigned t = 0; t < taken.size(); ++t) {
+                --taken[t].req->pending;
+            }
+            answered_.notify_all();
+        }
+    }
+
+    void stop ()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        queued_.notify_all();
+    }
+
+    // Queue the queries of req and wait for their answers.
+    void run (Request &req)
+    {
+        unsigned Q = req.header.Q;
+        req.topks.resize(Q);
+        req.cnt.resize(Q);
+        req.arrival = Clock::now();
+        std::unique_lock<std::mutex> lock(mutex_);
+        req.pending = 0;
+        for (unsigned b = 0; b < Q; b += batch_) {
+            Slice s;
+            s.req = &req;
+            s.begin = b;
+            s.end = std::min(Q, b + batch_);
+            queue_.push_back(s);
+            ++req.pending;
+        }
+        queuedQueries_ += Q;
+        queued_.notify_all();
+        answered_.wait(lock, [&req] { return req.pending == 0; });
+    }
+
+    // Serve a connection until it is closed or asks for a shutdown.
+    void serve (int fd)
+    {
+        Request req;
+        try {
+            while (readRequest(fd, &req.header, &req.queries)) {
+                const RemoteRequest &h = req.header;
+                if (h.op == REMOTE_SHUTDOWN) {
+                    stopping = true;
+                    break;
+                }
+                if (remoteCheck(h, data_.getDim(), sizeof(T), maxK_) != REMOTE_OK) {
+                    req.topks.clear();
+                    if (!writeResponse(fd, REMOTE_BAD_REQUEST, req.topks, req.cnt, h.K)) break;
+                    continue;
+                }
+                run(req);
+                uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - req.arrival).count();
+                {
+                    std::lock_guard<std::mutex> lock(stats.mutex);
+                    stats.interval.record(us);
+                    stats.latency.record(us);
+                    ++stats.requests;
+                    stats.queries += h.Q;
+                    stats.intervalQueries += h.Q;
+                }
+                if (!writeResponse(fd, REMOTE_OK, req.topks, req.cnt, h.K)) break;
+            }
+        }
+        catch (const std::runtime_error &) {
+            // A malformed request drops the connection.
+        }
+        ::close(fd);
+        std::lock_guard<std::mutex> lock(connMutex_);
+        conns_.erase(fd);
+        connClosed_.notify_all();
+    }
+
+    void accept (int fd)
+    {
+        std::lock_guard<std::mutex> lock(connMutex_);
+        conns_[fd] = true;
+        std::thread(&Server::serve, this, fd).detach();
+    }
+
+    // Unblock the readers and wait for the connections to close.
+    void closeAll ()
+    {
+        std::unique_lock<std::mutex> lock(connMutex_);
+        for (std::map<int, bool>::iterator it = conns_.begin(); it != conns_.end(); ++it) {
+            ::shutdown(it->first, SHUT_RD);
+        }
+        connClosed_.wait(lock, [this] { return conns_.empty(); });
+    }
+};
+
+static void printStats (Stats &stats, double seconds, const Clock::time_point &start, const string &file)
+{
+    std::lock_guard<std::mutex> lock(stats.mutex);
+    double qps = stats.intervalQueries / seconds;
+    stats.qps.record(uint64_t(qps + 0.5));
+    cout << boost::format("[STATS] QPS: %1%  REQUESTS: %2%  P50: %3%us  P99: %4%us  P999: %5%us  MAX: %6%us")
+            % qps % stats.interval.count() % stats.interval.percentile(0.5) % stats.interval.percentile(0.99)
+            % stats.interval.percentile(0.999) % stats.interval.max() << endl;
+    stats.interval.reset();
+    stats.intervalQueries = 0;
+    if (file.empty()) return;
+    string tmp = file + ".tmp";
+    {
+        ofstream os(tmp.c_str());
+        os << "uptime_s " << std::chrono::duration<double>(Clock::now() - start).count() << '\n';
+        os << "requests " << stats.requests << '\n';
+        os << "queries " << stats.queries << '\n';
+        os << "latency_us_p50 " << stats.latency.percentile(0.5) << '\n';
+        os << "latency_us_p99 " << stats.latency.percentile(0.99) << '\n';
+        os << "latency_us_p999 " << stats.latency.percentile(0.999) << '\n';
+        os << "latency_us_max " << stats.latency.max() << '\n';
+        os << "latency_us_mean " << stats.latency.mean() << '\n';
+        os << "# latency_us histogram: lower upper count\n";
+        stats.latency.dump(os);
+        os << "# qps histogram of the intervals: lower upper count\n";
+        stats.qps.dump(os);
+    }
+    std::rename(tmp.c_str(), file.c_str());
+}
+
+template <typename T>
+static int serve (const Index &index, const Matrix<T> &data, int listenFd, unsigned threads,
+                  unsigned batch, unsigned maxK, unsigned wait, unsigned interval, const string &statsFile)
+{
+    Server<T> server(index, data, batch, maxK, wait);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.push_back(std::thread(&Server<T>::work, &server));
+    }
+    Clock::time_point start = Clock::now(), last = start;
+    while (!stopping) {
+        pollfd p;
+        p.fd = listenFd;
+        p.events = POLLIN;
+        if (::poll(&p, 1, 200) > 0) {
+            int fd = ::accept(listenFd, NULL, NULL);
+            if (fd >= 0) server.accept(fd);
+        }
+        Clock::time_point now = Clock::now();
+        if (interval > 0 && now - last >= std::chrono::seconds(interval)) {
+            printStats(server.stats, std::chrono::duration<double>(now - last).count(), start, statsFile);
+            last = now;
+        }
+    }
+    ::close(listenFd);
+    server.closeAll();
+    server.stop();
+    for (unsigned t = 0; t < workers.size(); ++t) workers[t].join();
+    if (interval > 0) {
+        printStats(server.stats, std::chrono::duration<double>(Clock::now() - last).count(), start, statsFile);
+    }
+    const LatencyHistogram &h = server.stats.latency;
+    cout << boost::format("[TOTAL] REQUESTS: %1%  QUERIES: %2%  P50: %3%us  P99: %4%us  P999: %5%us  MAX: %6%us")
+            % server.stats.requests % server.stats.queries % h.percentile(0.5) % h.percentile(0.99)
+            % h.percentile(0.999) % h.max() << endl;
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    string data_file, index_file, socket_path, stats_file;
+    unsigned threads, batch, maxK, wait, interval;
+
+    po::options_description desc("Allowed options");
+    desc.add_options()
+        ("help,h", "produce help message.")
+        ("data,D", po::value<string>(&data_file), "data file, fvecs or bvecs")
+        ("index", po::value<string>(&index_file), "index image")
+        ("socket", po::value<string>(&socket_path)->default_value("/tmp/mplsh.sock"), "Unix socket to listen on")
+        ("threads", po::value<unsigned>(&threads)->default_value(0), "# worker threads, 0 for all the cores")
+        ("batch", po::value<unsigned>(&batch)->default_value(64), "maximal # queries of a micro-batch")
+        ("max-k", po::value<unsigned>(&maxK)->default_value(1000), "maximal K of a request")
+        ("wait", po::value<unsigned>(&wait)->default_value(100), "microseconds to wait for a micro-batch to fill up")
+        ("sorted", "collect, sort and deduplicate the candidates of a query before scanning them")
+        ("directed", "generate the probes from the scores of each query instead of the template sequence")
+        ("populate", "read the whole dataset at start")
+        ("interval", po::value<unsigned>(&interval)->default_value(10), "seconds between the statistics, 0 for none")
+        ("stats", po::value<string>(&stats_file), "file of the latency and QPS histograms")
+        ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || vm.count("data") < 1 || vm.count("index") < 1) {
+        cout << desc;
+        return 0;
+    }
+    if (threads == 0) threads = defaultThreads();
+    if (batch == 0) batch = 1;
+
+    bool bytes = data_file.size() >= 6 && data_file.compare(data_file.size() - 6, 6, ".bvecs") == 0;
+    bool populate = vm.count("populate") >= 1;
+    Matrix<float> floats;
+    Matrix<uint8_t> u8;
+    Index index;
+    int fd;
+    try {
+        if (bytes) u8.mapVecs(data_file, populate);
+        else floats.mapVecs(data_file, populate);
+        index.map(index_file);
+        fd = remoteListen(socket_path);
+    }
+    catch (const std::runtime_error &e) {
+        cerr << e.what() << "." << endl;
+        return 1;
+    }
+    index.setSortedScan(vm.count("sorted") >= 1);
+    index.setQueryDirected(vm.count("directed") >= 1);
+    unsigned dim = bytes ? u8.getDim() : floats.getDim();
+    if (index.getParam().dim != dim) {
+        cerr << "The index is not of the dimension of the data." << endl;
+        return 1;
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    std::signal(SIGPIPE, SIG_IGN);
+    cout << boost::format("SERVING %1% POINTS OF DIMENSION %2% ON %3%") % (bytes ? u8.getSize() : floats.getSize()) % dim % socket_path << endl;
+
+    int ret = bytes ? serve(index, u8, fd, threads, batch, maxK, wait, interval, stats_file)
+                    : serve(index, floats, fd, threads, batch, maxK, wait, interval, stats_file);
+    ::unlink(socket_path.c_str());
+    return ret;
+}
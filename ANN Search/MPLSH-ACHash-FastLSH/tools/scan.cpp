@@ -37,6 +37,7 @@ Allowed options:
   -Q [ -- ] arg (=1)     number of queries to sample.
   -K [ -- ] arg (=1)     number of nearest neighbors.
   --metric arg (=2)      1: L1; 2: L2
+  --threads arg (=0)     # threads scanning each query, 0 for all the cores
   -D [ --data ] arg      dataset path
   -B [ --benchmark ] arg output benchmark file path
 \endverbatim
@@ -54,13 +55,35 @@ using namespace std;
 using namespace lshkit;
 namespace po = boost::program_options; 
 
+// Scan the data for the K-NNs of row q, each thread scanning a part of the
+// rows into its own Topk; the Topks are merged at the end.
+template <typename METRIC>
+void scan (const Matrix<float> &data, unsigned q, const METRIC &metric, unsigned K, float R, unsigned threads, Topk<unsigned> *topk)
+{
+    vector<Topk<unsigned> > parts(threads);
+    parallelRun(threads, [&](unsigned t) {
+        Topk<unsigned> &part = parts[t];
+        part.reset(K, R);
+        unsigned end = partBegin(data.getSize(), threads, t + 1);
+        for (unsigned j = partBegin(data.getSize(), threads, t); j < end; ++j)
+        {
+            if (q == j) continue;
+            part << Topk<unsigned>::Element(j, metric(data[q], data[j]));
+        }
+    });
+    topk->reset(K, R);
+    for (unsigned t = 0; t < threads; ++t) {
+        topk->merge(parts[t]);
+    }
+}
+
 
 int main (int argc, char *argv[])
 {
     string data_file;
     string query_file;
 
-    unsigned K, Q, metric, seed;
+    unsigned K, Q, metric, seed, threads;
     float R;
 
     po::options_description desc("Allowed options");
@@ -71,6 +94,7 @@ int main (int argc, char *argv[])
         (",R", po::value<float>(&R)->default_value(numeric_limits<float>::max()), "distance range to search for")
         ("seed", po::value<unsigned>(&seed)->default_value(0), "random number seed, 0 to use default.")
         ("metric", po::value<unsigned>(&metric)->default_value(2), "1: L1; 2: L2")
+        ("threads", po::value<unsigned>(&threads)->default_value(0), "# threads scanning each query, 0 for all the cores")
         ("data,D", po::value<string>(&data_file), "dataset path")
         ("benchmark,B", po::value<string>(&query_file), "output benchmark file path")
         ;
@@ -88,6 +112,8 @@ int main (int argc, char *argv[])
 
     Matrix<float> data(data_file);
 
+    if (threads == 0) threads = defaultThreads();
+
     Benchmark<unsigned> bench;
     bench.init(Q, data.getSize(), seed);
     boost::timer timer;
@@ -100,15 +126,7 @@ int main (int argc, char *argv[])
         boost::progress_display progress(Q);
         for (unsigned i = 0; i < Q; ++i)
         {
-            unsigned q = bench.getQuery(i);
-            Topk<unsigned> &topk = bench.getAnswer(i);
-            topk.reset(K, R);
-            for (unsigned j = 0; j < data.getSize(); ++j)
-            {
-                if (q == j) continue;
-                topk << Topk<unsigned>::Element(j, l1(data[q],
-                                        data[j]));
-            }
+            scan(data, bench.getQuery(i), l1, K, R, threads, &bench.getAnswer(i));
             ++progress;
         }
     }
@@ -119,15 +137,7 @@ int main (int argc, char *argv[])
         boost::progress_display progress(Q);
         for (unsigned i = 0; i < Q; ++i)
         {
-            unsigned q = bench.getQuery(i);
-            Topk<unsigned> &topk = bench.getAnswer(i);
-            topk.reset(K, R);
-            for (unsigned j = 0; j < data.getSize(); ++j)
-            {
-                if (q == j) continue;
-                topk << Topk<unsigned>::Element(j, l2(data[q],
-                                        data[j]));
-            }
+            scan(data, bench.getQuery(i), l2, K, R, threads, &bench.getAnswer(i));
             ++progress;
         }
     }
@@ -0,0 +1,231 @@
+/*
+ * Fast Walsh-Hadamard transform shared by the ACHash variants of MPLSH,
+ * E2LSH and ACE.
+ *
+ * The transform is unnormalized and in place:
+ *
+ *     fwht::transform(x, n);                  // n a power of two
+ *     fwht::transformRows(x, rows, n, ld);    // rows x n, row stride ld
+ *
+ * A point whose dimension is not a power of two is copied to a zero padded
+ * buffer of fwht::paddedSize(dim) values first, with fwht::pad.
+ *
+ * The butterflies of strides smaller than BLOCK are done one L1-sized block
+ * at a time, the others one stage at a time over the whole vector.  On x86
+ * the AVX kernels are picked at runtime; they do exactly the same additions
+ * as the scalar code, so the results do not depend on the CPU.
+ *
+ * The header has no dependencies and compiles as C++11.
+ */
+
+#ifndef __FWHT_FWHT_H__
+#define __FWHT_FWHT_H__
+
+#include <cstddef>
+#include <cassert>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FWHT_X86_KERNELS
+#endif
+
+namespace fwht {
+
+/// Number of values transformed together before the large strides.
+static const std::size_t BLOCK = 2048;
+
+inline bool isPowerOfTwo (std::size_t n)
+{
+    return (n > 0) && ((n & (n - 1)) == 0);
+}
+
+/// The smallest power of two >= n.
+inline std::size_t paddedSize (std::size_t n)
+{
+    std::size_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+/// Copy dim values of in to out and fill out up to n with zeros.
+template <typename T, typename S>
+void pad (const S *in, std::size_t dim, T *out, std::size_t n)
+{
+    assert(dim <= n);
+    for (std::size_t i = 0; i < dim; ++i) out[i] = in[i];
+    for (std::size_t i = dim; i < n; ++i) out[i] = 0;
+}
+
+namespace detail {
+
+// a[j], b[j] = a[j] + b[j], a[j] - b[j] for j in [0, h).
+template <typename T>
+void butterflyScalar (T *a, T *b, std::size_t h)
+{
+    for (std::size_t j = 0; j < h; ++j) {
+        T u = a[j];
+        T v = b[j];
+        a[j] = u + v;
+        b[j] = u - v;
+    }
+}
+
+#ifdef FWHT_X86_KERNELS
+
+inline bool hasAvx ()
+{
+    static const bool avx = __builtin_cpu_supports("avx");
+    return avx;
+}
+
+// Values in one vector.
+template <typename T>
+struct Lanes
+{
+    static const std::size_t value = 32 / sizeof(T);
+};
+
+// h is a multiple of Lanes.
+__attribute__((target("avx")))
+inline void butterflyAvx (float *a, float *b, std::size_t h)
+{
+    for (std::size_t j = 0; j < h; j += 8) {
+        __m256 u = _mm256_loadu_ps(a + j);
+        __m256 v = _mm256_loadu_ps(b + j);
+        _mm256_storeu_ps(a + j, _mm256_add_ps(u, v));
+        _mm256_storeu_ps(b + j, _mm256_sub_ps(u, v));
+    }
+}
+
+__attribute__((target("avx")))
+inline void butterflyAvx (double *a, double *b, std::size_t h)
+{
+    for (std::size_t j = 0; j < h; j += 4) {
+        __m256d u = _mm256_loadu_pd(a + j);
+        __m256d v = _mm256_loadu_pd(b + j);
+        _mm256_storeu_pd(a + j, _mm256_add_pd(u, v));
+        _mm256_storeu_pd(b + j, _mm256_sub_pd(u, v));
+    }
+}
+
+// partner + v in the lanes of sign 0, partner - v in the others.  The
+// partner of the upper lane of a pair is the lower one, so this is u + v
+// and u - v as in butterflyScalar; adding -v is exactly subtracting v.
+__attribute__((target("avx")))
+inline __m256 lanes (__m256 v, __m256 partner, __m256 sign)
+{
+    return _mm256_add_ps(partner, _mm256_xor_ps(v, sign));
+}
+
+__attribute__((target("avx")))
+inline __m256d lanes (__m256d v, __m256d partner, __m256d sign)
+{
+    return _mm256_add_pd(partner, _mm256_xor_pd(v, sign));
+}
+
+// The strides smaller than a vector, on x[0, n).
+__attribute__((target("avx")))
+inline void inVectorAvx (float *x, std::size_t n)
+{
+    const float m = -0.0F;
+    const __m256 s1 = _mm256_setr_ps(0, m, 0, m, 0, m, 0, m);
+    const __m256 s2 = _mm256_setr_ps(0, 0, m, m, 0, 0, m, m);
+    const __m256 s4 = _mm256_setr_ps(0, 0, 0, 0, m, m, m, m);
+    for (std::size_t i = 0; i < n; i += 8) {
+        __m256 v = _mm256_loadu_ps(x + i);
+        v = lanes(v, _mm256_permute_ps(v, 0xB1), s1);
+        v = lanes(v, _mm256_permute_ps(v, 0x4E), s2);
+        v = lanes(v, _mm256_permute2f128_ps(v, v, 1), s4);
+        _mm256_storeu_ps(x + i, v);
+    }
+}
+
+__attribute__((target("avx")))
+inline void inVectorAvx (double *x, std::size_t n)
+{
+    const double m = -0.0;
+    const __m256d s1 = _mm256_setr_pd(0, m, 0, m);
+    const __m256d s2 = _mm256_setr_pd(0, 0, m, m);
+    for (std::size_t i = 0; i < n; i += 4) {
+        __m256d v = _mm256_loadu_pd(x + i);
+        v = lanes(v, _mm256_permute_pd(v, 0x5), s1);
+        v = lanes(v, _mm256_permute2f128_pd(v, v, 1), s2);
+        _mm256_storeu_pd(x + i, v);
+    }
+}
+
+#endif
+
+// The butterflies of strides h = lo, 2 lo, ..., < hi on x[0, n), n being a
+// multiple of hi.  lo is 1 or a multiple of the vector size.
+template <typename T>
+void stages (T *x, std::size_t n, std::size_t lo, std::size_t hi)
+{
+    std::size_t h = lo;
+#ifdef FWHT_X86_KERNELS
+    if (hi >= Lanes<T>::value && hasAvx()) {
+        assert(lo == 1 || lo % Lanes<T>::value == 0);
+        if (h < Lanes<T>::value) {
+            inVectorAvx(x, n);
+            h = Lanes<T>::value;
+        }
+        for (; h < hi; h <<= 1) {
+            for (std::size_t i = 0; i < n; i += 2 * h) {
+                butterflyAvx(x + i, x + i + h, h);
+            }
+        }
+        return;
+    }
+#endif
+    for (; h < hi; h <<= 1) {
+        for (std::size_t i = 0; i < n; i += 2 * h) {
+            butterflyScalar(x + i, x + i + h, h);
+        }
+    }
+}
+
+} // namespace detail
+
+/// Transform x[0, n) in place, n being a power of two.
+template <typename T>
+void transform (T *x, std::size_t n)
+{
+    assert(isPowerOfTwo(n));
+    if (n <= BLOCK) {
+        detail::stages(x, n, 1, n);
+        return;
+    }
+    for (std::size_t i = 0; i < n; i += BLOCK) {
+        detail::stages(x + i, BLOCK, 1, BLOCK);
+    }
+    detail::stages(x, n, BLOCK, n);
+}
+
+/// Transform each of the rows x[r * ld, r * ld + n) in place.
+/**
+ * Small rows are processed BLOCK values at a time across rows, so that the
+ * dispatch and loop setup is paid once per block instead of once per row.
+ */
+template <typename T>
+void transformRows (T *x, std::size_t rows, std::size_t n, std::size_t ld)
+{
+    assert(isPowerOfTwo(n));
+    assert(ld >= n);
+    if (ld == n && n < BLOCK) {
+        // Contiguous rows: the small stages of consecutive rows form one
+        // contiguous range, as rows are aligned to multiples of n.
+        std::size_t per = BLOCK / n;
+        for (std::size_t r = 0; r < rows; r += per) {
+            std::size_t nr = rows - r < per ? rows - r : per;
+            detail::stages(x + r * n, nr * n, 1, n);
+        }
+        return;
+    }
+    for (std::size_t r = 0; r < rows; ++r) {
+        transform(x + r * ld, n);
+    }
+}
+
+} // namespace fwht
+
+#endif
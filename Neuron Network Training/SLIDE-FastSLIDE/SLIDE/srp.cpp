@@ -6,6 +6,56 @@
 
 using namespace std;
 
+// The terms are added in the order of j, as in the loop of sampledDot, so
+// the unrolled kernels give the same hashes.
+template <size_t N>
+struct SampledDot
+{
+    static double apply(double s, const float *vector, const int *indices, const float *bits)
+    {
+        float v = vector[indices[0]];
+        return SampledDot<N - 1>::apply(s + v * bits[0], vector, indices + 1, bits + 1);
+    }
+};
+
+template <>
+struct SampledDot<0>
+{
+    static double apply(double s, const float *, const int *, const float *)
+    {
+        return s;
+    }
+};
+
+template <size_t N>
+static double sampledDotFixed(const float *vector, const int *indices, const float *bits, size_t)
+{
+    return SampledDot<N>::apply(0, vector, indices, bits);
+}
+
+static double sampledDot(const float *vector, const int *indices, const float *bits, size_t n)
+{
+    double s = 0;
+    for (size_t j = 0; j < n; j++) {
+        float v = vector[indices[j]];
+        s += v * bits[j];
+    }
+    return s;
+}
+
+// _samSize is only known at runtime: pick the unrolled kernel if there's one.
+static SampledDotFunc selectSampledDot(size_t n)
+{
+    switch (n) {
+        case 16: return &sampledDotFixed<16>;
+        case 30: return &sampledDotFixed<30>;
+        case 32: return &sampledDotFixed<32>;
+        case 64: return &sampledDotFixed<64>;
+        case 128: return &sampledDotFixed<128>;
+        default: return &sampledDot;
+    }
+}
+
 SparseRandomProjection::SparseRandomProjection(size_t dimension, size_t numOfHashes, int ratio) {
     _dim = dimension;
     _numhashes = numOfHashes;
@@ -35,6 +85,7 @@ SparseRandomProjection::SparseRandomProjection(size_t dimension, size_t numOfHas
         std::sort(_indices[i], _indices[i]+_samSize);
     }
     delete [] a;
+    _dot = selectSampledDot(_samSize);
 }
 
 
@@ -43,11 +94,7 @@ int *SparseRandomProjection::getHash(float *vector, int length) {
 
 //  #pragma omp parallel for
     for (size_t i = 0; i < _numhashes; i++) {
-        double s = 0;
-        for (size_t j = 0; j < _samSize; j++) {
-            float v = vector[_indices[i][j]];
-            s += v * _randBits[i][j];
-        }
+        double s = _dot(vector, _indices[i], _randBits[i], _samSize);
         hashes[i] = (s >= 0 ? 0 : 1);
     }
     return hashes;
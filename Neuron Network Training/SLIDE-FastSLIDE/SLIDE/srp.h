@@ -2,6 +2,9 @@
 #pragma once
 using namespace std;
 
+// Sum of vector[indices[j]] * bits[j] over the n sampled dimensions.
+typedef double (*SampledDotFunc)(const float *vector, const int *indices, const float *bits, size_t n);
+
 class SparseRandomProjection 
 {
 private:
@@ -10,6 +13,7 @@ private:
 	// short ** _randBits;
 	float ** _randBits;
 	int ** _indices;
+	SampledDotFunc _dot; // unrolled for the common _samSize, see srp.cpp
 public:
 	SparseRandomProjection(size_t dimention, size_t numOfHashes, int ratio);
 	int * getHash(float * vector, int length);